@@ -0,0 +1,190 @@
+/*
+
+ checkpoint.cc - This file is part of MUSIC -
+ a code to generate multi-scale initial conditions
+ for cosmological simulations
+
+ Copyright (C) 2010  Oliver Hahn
+
+*/
+
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "checkpoint.hh"
+
+//! configuration sections whose values determine the computed fields
+static const char* checkpoint_sections[] = { "setup/", "cosmology/", "random/", "poisson/" };
+
+//! 64bit FNV-1a hash of all parameters that determine the fields, as hex string
+static std::string checkpoint_fingerprint( config_file& cf )
+{
+	std::stringstream ss;
+	cf.dump( ss );
+
+	unsigned long long h = 14695981039346656037ull;
+	std::string line;
+
+	while( std::getline( ss, line ) )
+	{
+		std::string key = line.substr( 0, line.find(' ') );
+		bool relevant = false;
+
+		for( size_t i=0; i<sizeof(checkpoint_sections)/sizeof(checkpoint_sections[0]); ++i )
+			relevant |= key.compare( 0, strlen(checkpoint_sections[i]), checkpoint_sections[i] ) == 0;
+
+		//... the memory plan may switch on disk caching, which does not change the fields
+		if( !relevant || key == "random/disk_cached" )
+			continue;
+
+		for( size_t i=0; i<line.size(); ++i )
+		{
+			h ^= (unsigned char)line[i];
+			h *= 1099511628211ull;
+		}
+	}
+
+	char buf[32];
+	sprintf( buf, "%016llx", h );
+	return std::string( buf );
+}
+
+checkpoint::checkpoint( config_file& cf, const std::string& paramfile )
+: enabled_( cf.getValueSafe<bool>( "checkpoint", "enabled", false ) ),
+  keep_( cf.getValueSafe<bool>( "checkpoint", "keep", false ) )
+{
+	if( !enabled_ )
+		return;
+
+	dir_ = cf.getValueSafe<std::string>( "checkpoint", "directory", paramfile+"_checkpoint" );
+	fingerprint_ = checkpoint_fingerprint( cf );
+
+	if( mkdir( dir_.c_str(), 0755 ) != 0 && errno != EEXIST )
+	{
+		LOGERR("Could not create checkpoint directory \'%s\'.",dir_.c_str());
+		throw std::runtime_error("Could not create checkpoint directory");
+	}
+
+	//... pick up the stages of a previous run
+	std::ifstream ifs( manifest_file().c_str() );
+	std::string tag, value, old_fingerprint;
+
+	while( ifs >> tag >> value )
+	{
+		if( tag == "fingerprint" )
+			old_fingerprint = value;
+		else if( tag == "stage" )
+			completed_.insert( value );
+	}
+	ifs.close();
+
+	if( completed_.size() > 0 && old_fingerprint != fingerprint_ )
+	{
+		LOGWARN("Checkpoints in \'%s\' were written with different parameters, discarding them.",dir_.c_str());
+		clear();
+	}
+
+	//... a stage only counts as completed if its file still exists
+	for( std::set<std::string>::iterator it=completed_.begin(); it!=completed_.end(); )
+	{
+		if( access( stage_file(*it).c_str(), R_OK ) != 0 )
+			completed_.erase( it++ );
+		else
+			++it;
+	}
+
+	if( completed_.size() > 0 )
+	{
+		std::cout << " - Resuming from " << completed_.size() << " checkpointed stages in \'" << dir_ << "\'\n";
+		LOGUSER("Resuming from %d checkpointed stages in \'%s\'.",(int)completed_.size(),dir_.c_str());
+	}
+	else
+		LOGINFO("Writing checkpoints to \'%s\'.",dir_.c_str());
+
+	write_manifest();
+}
+
+std::string checkpoint::stage_file( const std::string& stage ) const
+{
+	return dir_ + "/" + stage + ".bin";
+}
+
+std::string checkpoint::manifest_file( void ) const
+{
+	return dir_ + "/manifest.txt";
+}
+
+void checkpoint::write_manifest( void ) const
+{
+	//... write under a temporary name so that an interrupted run keeps the previous manifest
+	std::string ftmp = manifest_file() + ".tmp";
+	std::ofstream ofs( ftmp.c_str() );
+
+	ofs << "fingerprint " << fingerprint_ << "\n";
+	for( std::set<std::string>::const_iterator it=completed_.begin(); it!=completed_.end(); ++it )
+		ofs << "stage " << *it << "\n";
+	ofs.close();
+
+	if( !ofs.good() || rename( ftmp.c_str(), manifest_file().c_str() ) != 0 )
+	{
+		LOGERR("Could not write checkpoint manifest \'%s\'.",manifest_file().c_str());
+		throw std::runtime_error("Could not write checkpoint manifest");
+	}
+}
+
+void checkpoint::clear( void )
+{
+	for( std::set<std::string>::iterator it=completed_.begin(); it!=completed_.end(); ++it )
+		remove( stage_file(*it).c_str() );
+
+	completed_.clear();
+	remove( manifest_file().c_str() );
+}
+
+bool checkpoint::load( const std::string& stage, grid_hierarchy& g )
+{
+	if( !enabled_ || !has( stage ) )
+		return false;
+
+	g.load( stage_file( stage ) );
+
+	std::cout << " - Restored stage \'" << stage << "\' from checkpoint\n";
+	LOGINFO("Restored stage \'%s\' from checkpoint.",stage.c_str());
+	return true;
+}
+
+void checkpoint::save( const std::string& stage, const grid_hierarchy& g )
+{
+	if( !enabled_ )
+		return;
+
+	g.save( stage_file( stage ) );
+
+	std::lock_guard<std::mutex> lock( mutex_ );
+	completed_.insert( stage );
+	write_manifest();
+
+	LOGINFO("Checkpointed stage \'%s\'.",stage.c_str());
+}
+
+void checkpoint::finalize( void )
+{
+	if( !enabled_ )
+		return;
+
+	if( keep_ )
+	{
+		LOGINFO("Keeping %d checkpointed stages in \'%s\'.",(int)completed_.size(),dir_.c_str());
+		return;
+	}
+
+	clear();
+	rmdir( dir_.c_str() );
+}
@@ -0,0 +1,101 @@
+/*
+
+ checkpoint.hh - This file is part of MUSIC -
+ a code to generate multi-scale initial conditions
+ for cosmological simulations
+
+ Copyright (C) 2010  Oliver Hahn
+
+*/
+
+#ifndef __CHECKPOINT_HH
+#define __CHECKPOINT_HH
+
+#include <string>
+#include <set>
+#include <mutex>
+
+#include "general.hh"
+#include "config_file.hh"
+#include "mesh.hh"
+
+/*!
+ * @class checkpoint
+ * @brief stage-level checkpoints of the main driver
+ *
+ * After each expensive stage (density hierarchies, potentials, 2LPT
+ * potentials, displacement and velocity components) the driver saves the
+ * resulting grid hierarchy under the name of the stage. A manifest lists the
+ * completed stages together with a fingerprint of all parameters that
+ * determine the fields. A rerun with identical parameters restores every
+ * completed stage instead of recomputing it; checkpoints written with
+ * different parameters are discarded.
+ *
+ * [checkpoint]
+ * enabled   = yes                                (default no)
+ * directory = <parameter file>_checkpoint
+ * keep      = no                                 (remove them after a successful run)
+ */
+class checkpoint
+{
+protected:
+	bool enabled_;						//!< whether stages are checkpointed at all
+	bool keep_;							//!< keep the checkpoints after a successful run
+	std::string dir_;					//!< directory holding the checkpoint files
+	std::string fingerprint_;			//!< hash of the parameters that determine the fields
+	std::set<std::string> completed_;	//!< stages with a valid checkpoint
+	mutable std::mutex mutex_;			//!< stages may complete concurrently, see task_graph
+
+	//! name of the file holding a stage
+	std::string stage_file( const std::string& stage ) const;
+
+	//! name of the manifest file
+	std::string manifest_file( void ) const;
+
+	//! rewrite the manifest from the list of completed stages
+	void write_manifest( void ) const;
+
+	//! remove all checkpoint files and the manifest
+	void clear( void );
+
+public:
+
+	//! set up checkpointing and pick up the stages completed by a previous run
+	/*! @param cf the configuration, all values that affect the fields must already be set
+	 *  @param paramfile name of the parameter file, used for the default directory
+	 */
+	checkpoint( config_file& cf, const std::string& paramfile );
+
+	//! whether checkpointing is switched on
+	bool enabled( void ) const
+	{	return enabled_;	}
+
+	//! whether a stage has been completed by a previous run
+	bool has( const std::string& stage ) const
+	{
+		std::lock_guard<std::mutex> lock( mutex_ );
+		return completed_.count( stage ) > 0;
+	}
+
+	//! restore the result of a stage if it has been completed before
+	/*! @param stage the name of the stage
+	 *  @param g the hierarchy to be replaced by the checkpointed one
+	 *  @return true if the stage was restored, false if it needs to be computed
+	 */
+	bool load( const std::string& stage, grid_hierarchy& g );
+
+	//! save the result of a completed stage
+	/*! @param stage the name of the stage
+	 *  @param g the hierarchy holding the result of the stage
+	 */
+	void save( const std::string& stage, const grid_hierarchy& g );
+
+	//! the run finished successfully, remove the checkpoints unless they are to be kept
+	void finalize( void );
+
+	//! name of the stage holding one component of a vector field, e.g. dm_displacement_x
+	static std::string component( const std::string& stage, int icoord )
+	{	return stage + "_" + (char)('x'+icoord);	}
+};
+
+#endif //__CHECKPOINT_HH
@@ -83,6 +83,11 @@ public:
 		}
   }
 
+  //! constructor of an empty configuration, to be filled with insertValue
+  config_file( void )
+	: m_iLine(0), m_Items()
+  { }
+
   //! constructor of class config_file
   /*! @param FileName the path/name of the configuration file to be parsed
    */
@@ -210,7 +210,7 @@ public:
 		{
 			//... we are operating on the periodic coarse grid
 			size_t nx = lx[0], ny = lx[1], nz = lx[2], nzp = nz+2;
-			fftw_real * w = new fftw_real[nx*ny*nzp];
+			fftw_real * w = mem_allocate<fftw_real>( nx*ny*nzp );
 			
 			
 #ifdef FFTW3
@@ -287,7 +287,7 @@ public:
 			LOGINFO("Applied constraints to level %d.",ilevel);
 			
 						
-			delete[] w;
+			mem_deallocate( w );
 			
 			
 #ifdef FFTW3
@@ -304,7 +304,7 @@ public:
 			//... we are operating on a refinement grid, not necessarily the finest
 			
 			size_t nx = lx[0], ny = lx[1], nz = lx[2], nzp = nz+2;
-			fftw_real * w = new fftw_real[nx*ny*nzp];
+			fftw_real * w = mem_allocate<fftw_real>( nx*ny*nzp );
 			
 			
 #ifdef FFTW3
@@ -399,7 +399,7 @@ public:
 
 			LOGINFO("Applied constraints to level %d.",ilevel);	
 			
-			delete[] w;
+			mem_deallocate( w );
 			
 			
 #ifdef FFTW3
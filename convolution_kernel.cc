@@ -11,6 +11,7 @@
 #include "general.hh"
 #include "densities.hh"
 #include "convolution_kernel.hh"
+#include "trace.hh"
 
 #if defined(FFTW3) && defined( SINGLE_PRECISION)
 //#define fftw_complex fftwf_complex
@@ -43,7 +44,8 @@ namespace convolution{
 		cdata		= reinterpret_cast<fftw_complex*>(data);
 		ckernel		= reinterpret_cast<fftw_complex*>( pk->get_ptr() );
 		
-		
+		MUSIC::trace_scope trace("convolution");
+		trace.fft( cparam_.nx, cparam_.ny, cparam_.nz );
 		
 		std::cout << "   - Performing density convolution... (" 
 			<< cparam_.nx <<  ", " << cparam_.ny << ", " << cparam_.nz << ")\n";
@@ -360,8 +362,9 @@ namespace convolution{
 	template< typename real_t >
 	kernel* kernel_real_cached<real_t>::fetch_kernel( int ilevel, bool isolated )
 	{
+		MUSIC::trace_scope trace("kernel fetch level %d",ilevel);
 		char cachefname[128];
-		sprintf(cachefname,"temp_kernel_level%03d.tmp",ilevel);
+		sprintf(cachefname,"temp_kernel_%d_level%03d.tmp",(int)type_,ilevel);
 		FILE *fp = fopen(cachefname,"r");
 		
 		
@@ -520,6 +523,7 @@ namespace convolution{
 			levelmax	= refh.levelmax(),
 			levelmin	= refh.levelmin();
 		
+		MUSIC::trace_scope trace("kernel precompute");
 		LOGUSER("Precomputing transfer function kernels...");
 			
 		nx = refh.size(refh.levelmax(),0);
@@ -558,7 +562,7 @@ namespace convolution{
 		TransferFunction_real *tfr = new TransferFunction_real( boxlength, 1<<levelmax, type, ptf,nspec,pnorm,
 									0.25*dx,2.0*boxlength,kny, (int)pow(2,levelmax+2));		
 		
-		fftw_real *rkernel = new fftw_real[(size_t)nx*(size_t)ny*((size_t)nz+2)], *rkernel_coarse;
+		fftw_real *rkernel = mem_allocate<fftw_real>( (size_t)nx*(size_t)ny*((size_t)nz+2) ), *rkernel_coarse;
 		
 		#pragma omp parallel for
 		for( int i=0; i<nx; ++i )
@@ -954,7 +958,7 @@ namespace convolution{
 		
 		
 		char cachefname[128];
-		sprintf(cachefname,"temp_kernel_level%03d.tmp",levelmax);
+		sprintf(cachefname,"temp_kernel_%d_level%03d.tmp",(int)type,levelmax);
 		LOGUSER("Storing kernel in temp file \'%s\'.",cachefname);
 
 		FILE *fp = fopen(cachefname,"w+");
@@ -1003,7 +1007,7 @@ namespace convolution{
 			lyc = dxc * nyc;
 			lzc = dxc * nzc;
 			
-			rkernel_coarse = new fftw_real[(size_t)nxc*(size_t)nyc*2*((size_t)nzc/2+1)];
+			rkernel_coarse = mem_allocate<fftw_real>( (size_t)nxc*(size_t)nyc*2*((size_t)nzc/2+1) );
 			fac = lxc*lyc*lzc/pow(2.0*M_PI,3)/((double)nxc*(double)nyc*(double)nzc);
 			
 			if( bperiodic  )
@@ -1146,7 +1150,7 @@ namespace convolution{
 					}
 
 #endif // #OLD_KERNEL_SAMPLING
-			sprintf(cachefname,"temp_kernel_level%03d.tmp",ilevel);
+			sprintf(cachefname,"temp_kernel_%d_level%03d.tmp",(int)type,ilevel);
 			LOGUSER("Storing kernel in temp file \'%s\'.",cachefname);
 			fp = fopen(cachefname,"w+");
 			q = nxc;
@@ -1165,7 +1169,7 @@ namespace convolution{
 			
 			fclose(fp);
 			
-			delete[] rkernel;
+			mem_deallocate( rkernel );
 			
 			//... prepare for next iteration
 			nx = nxc;
@@ -1179,7 +1183,7 @@ namespace convolution{
 		}
 		
 		//... clean up
-		delete[] rkernel;
+		mem_deallocate( rkernel );
 	}
 	
 }
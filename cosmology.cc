@@ -12,6 +12,7 @@
 #include "mesh.hh"
 #include "mg_operators.hh"
 #include "general.hh"
+#include "trace.hh"
 
 #define ACC(i,j,k) ((*u.get_grid((ilevel)))((i),(j),(k)))
 #define SQR(x)	((x)*(x))
@@ -24,6 +25,7 @@
 void compute_LLA_density( const grid_hierarchy& u, grid_hierarchy& fnew, unsigned order )
 {
 	fnew = u;
+	fnew.detach();
 	
 	for( unsigned ilevel=u.levelmin(); ilevel<=u.levelmax(); ++ilevel )
 	{
@@ -151,6 +153,7 @@ void compute_LLA_density( const grid_hierarchy& u, grid_hierarchy& fnew, unsigne
 void compute_Lu_density( const grid_hierarchy& u, grid_hierarchy& fnew, unsigned order )
 {
 	fnew = u;
+	fnew.detach();
 	
 	for( unsigned ilevel=u.levelmin(); ilevel<=u.levelmax(); ++ilevel )
 	{
@@ -183,26 +186,29 @@ void compute_2LPT_source_FFT( config_file& cf_, const grid_hierarchy& u, grid_hi
 	if( u.levelmin() != u.levelmax() )
 		throw std::runtime_error("FFT 2LPT can only be run in Unigrid mode!");
 	
+	MUSIC::trace_scope trace("2LPT source");
+	
 	fnew = u;
 	size_t nx,ny,nz,nzp;
 	nx = u.get_grid(u.levelmax())->size(0);
 	ny = u.get_grid(u.levelmax())->size(1);
 	nz = u.get_grid(u.levelmax())->size(2);
 	nzp = 2*(nz/2+1);
+	trace.fft( nx, ny, nz );
 	
 	//... copy data ..................................................
-	fftw_real *data = new fftw_real[nx*ny*nzp];
+	fftw_real *data = mem_allocate<fftw_real>( nx*ny*nzp );
 	fftw_complex *cdata = reinterpret_cast<fftw_complex*> (data);
 	
 	fftw_complex	*cdata_11, *cdata_12, *cdata_13, *cdata_22, *cdata_23, *cdata_33;
 	fftw_real		*data_11, *data_12, *data_13, *data_22, *data_23, *data_33;
 	
-	data_11 = new fftw_real[nx*ny*nzp]; cdata_11 = reinterpret_cast<fftw_complex*> (data_11);
-	data_12 = new fftw_real[nx*ny*nzp]; cdata_12 = reinterpret_cast<fftw_complex*> (data_12);
-	data_13 = new fftw_real[nx*ny*nzp]; cdata_13 = reinterpret_cast<fftw_complex*> (data_13);
-	data_22 = new fftw_real[nx*ny*nzp]; cdata_22 = reinterpret_cast<fftw_complex*> (data_22);
-	data_23 = new fftw_real[nx*ny*nzp]; cdata_23 = reinterpret_cast<fftw_complex*> (data_23);
-	data_33 = new fftw_real[nx*ny*nzp]; cdata_33 = reinterpret_cast<fftw_complex*> (data_33);
+	data_11 = mem_allocate<fftw_real>( nx*ny*nzp ); cdata_11 = reinterpret_cast<fftw_complex*> (data_11);
+	data_12 = mem_allocate<fftw_real>( nx*ny*nzp ); cdata_12 = reinterpret_cast<fftw_complex*> (data_12);
+	data_13 = mem_allocate<fftw_real>( nx*ny*nzp ); cdata_13 = reinterpret_cast<fftw_complex*> (data_13);
+	data_22 = mem_allocate<fftw_real>( nx*ny*nzp ); cdata_22 = reinterpret_cast<fftw_complex*> (data_22);
+	data_23 = mem_allocate<fftw_real>( nx*ny*nzp ); cdata_23 = reinterpret_cast<fftw_complex*> (data_23);
+	data_33 = mem_allocate<fftw_real>( nx*ny*nzp ); cdata_33 = reinterpret_cast<fftw_complex*> (data_33);
 	
 	#pragma omp parallel for
 	for( int i=0; i<(int)nx; ++i )
@@ -310,7 +316,7 @@ void compute_2LPT_source_FFT( config_file& cf_, const grid_hierarchy& u, grid_hi
 				
 			}
 	
-	delete[] data;
+	mem_deallocate( data );
 	/*cdata_11[0][0]	= 0.0; cdata_11[0][1]	= 0.0;
 	 cdata_12[0][0]	= 0.0; cdata_12[0][1]	= 0.0;
 	 cdata_13[0][0]	= 0.0; cdata_13[0][1]	= 0.0;
@@ -436,7 +442,7 @@ void compute_2LPT_source_FFT( config_file& cf_, const grid_hierarchy& u, grid_hi
 				
 			}
 	
-	delete[] data;
+	mem_deallocate( data );
 	/*cdata_11[0].re	= 0.0; cdata_11[0].im	= 0.0;
 	cdata_12[0].re	= 0.0; cdata_12[0].im	= 0.0;
 	cdata_13[0].re	= 0.0; cdata_13[0].im	= 0.0;
@@ -471,31 +477,35 @@ void compute_2LPT_source_FFT( config_file& cf_, const grid_hierarchy& u, grid_hi
 
 
 	//... copy data ..........................................
+	meshvar_bnd *pvar = fnew.writable(u.levelmax());
+	
 	#pragma omp parallel for
 	for( int i=0; i<(int)nx; ++i )
 		for( size_t j=0; j<ny; ++j )	
 			for( size_t k=0; k<nz; ++k )
 			{
 				size_t ii = ((size_t)i*ny+j)*nzp+k;
-				(*fnew.get_grid(u.levelmax()))(i,j,k) = (( data_11[ii]*data_22[ii]-data_12[ii]*data_12[ii] ) +
-														 ( data_11[ii]*data_33[ii]-data_13[ii]*data_13[ii] ) +
-														 ( data_22[ii]*data_33[ii]-data_23[ii]*data_23[ii] ) );
+				(*pvar)(i,j,k) = (( data_11[ii]*data_22[ii]-data_12[ii]*data_12[ii] ) +
+								  ( data_11[ii]*data_33[ii]-data_13[ii]*data_13[ii] ) +
+								  ( data_22[ii]*data_33[ii]-data_23[ii]*data_23[ii] ) );
 				
 				//(*fnew.get_grid(u.levelmax()))(i,j,k) = 
 				
 			}
 	
 	//delete[] data;
-	delete[] data_11;
-	delete[] data_12;
-	delete[] data_13;
-	delete[] data_23;
-	delete[] data_22;
-	delete[] data_33;
+	mem_deallocate( data_11 );
+	mem_deallocate( data_12 );
+	mem_deallocate( data_13 );
+	mem_deallocate( data_23 );
+	mem_deallocate( data_22 );
+	mem_deallocate( data_33 );
 }
 
 void compute_2LPT_source( const grid_hierarchy& u, grid_hierarchy& fnew, unsigned order )
 {
+	MUSIC::trace_scope trace("2LPT source");
+	
 	fnew = u;
     fnew.zero();
 	
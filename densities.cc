@@ -9,9 +9,11 @@
  */
 
 #include <cstring>
+#include <map>
 
 #include "densities.hh"
 #include "convolution_kernel.hh"
+#include "trace.hh"
 
 
 //TODO: this should be a larger number by default, just to maintain consistency with old default
@@ -19,6 +21,51 @@
 
 double blend_sharpness = 0.5;
 
+//! whether transfer function kernels are kept between density computations
+static bool tf_kernel_keep = false;
+
+//! the kept kernels, by kernel class and transfer function type
+static std::map< std::pair<const convolution::kernel_creator*,int>, convolution::kernel* > tf_kernel_cache;
+
+void keep_tf_kernels( bool keep )
+{
+	tf_kernel_keep = keep;
+	
+	if( !keep )
+	{
+		for( std::map< std::pair<const convolution::kernel_creator*,int>, convolution::kernel* >::iterator it=tf_kernel_cache.begin();
+			it!=tf_kernel_cache.end(); ++it )
+			delete it->second;
+		tf_kernel_cache.clear();
+	}
+}
+
+//! create a transfer function kernel, or reuse the kept one
+static convolution::kernel *acquire_tf_kernel( const convolution::kernel_creator *pcreator, config_file& cf, transfer_function *ptf,
+											   refinement_hierarchy& refh, tf_type type )
+{
+	if( !tf_kernel_keep )
+		return pcreator->create( cf, ptf, refh, type );
+	
+	std::pair<const convolution::kernel_creator*,int> key( pcreator, (int)type );
+	
+	if( tf_kernel_cache.count( key ) == 0 )
+		tf_kernel_cache[key] = pcreator->create( cf, ptf, refh, type );
+	else
+		LOGUSER("Reusing transfer function kernel of type %d.",(int)type);
+	
+	return tf_kernel_cache[key];
+}
+
+//! release a kernel obtained by acquire_tf_kernel, a kept kernel only frees its memory
+static void release_tf_kernel( convolution::kernel *pk )
+{
+	if( tf_kernel_keep )
+		pk->deallocate();
+	else
+		delete pk;
+}
+
 double Blend_Function( double k, double kmax )
 {
 #if 0
@@ -43,10 +90,10 @@ void fft_coarsen( m1& v, m2& V )
     size_t nxf = v.size(0), nyf = v.size(1), nzf = v.size(2), nzfp = nzf+2;
     size_t nxF = V.size(0), nyF = V.size(1), nzF = V.size(2), nzFp = nzF+2;
     
-    fftw_real *rcoarse = new fftw_real[ nxF * nyF * nzFp ];
+    fftw_real *rcoarse = mem_allocate<fftw_real>( nxF * nyF * nzFp );
     fftw_complex *ccoarse = reinterpret_cast<fftw_complex*> (rcoarse);
     
-    fftw_real *rfine = new fftw_real[ nxf * nyf * nzfp];
+    fftw_real *rfine = mem_allocate<fftw_real>( nxf * nyf * nzfp );
     fftw_complex *cfine = reinterpret_cast<fftw_complex*> (rfine);
     
 #ifdef FFTW3
@@ -122,7 +169,7 @@ void fft_coarsen( m1& v, m2& V )
                 IM(ccoarse[qc]) = val_fine.imag();
             }
     
-    delete[] rfine;
+    mem_deallocate( rfine );
     
 #ifdef FFTW3
 #ifdef SINGLE_PRECISION
@@ -147,7 +194,7 @@ void fft_coarsen( m1& v, m2& V )
                 V(i,j,k) = rcoarse[q];
             }
     
-    delete[] rcoarse;
+    mem_deallocate( rcoarse );
     
 #ifdef FFTW3
 #ifdef SINGLE_PRECISION
@@ -167,7 +214,7 @@ void fft_coarsen( m1& v, m2& V )
 //#define NO_COARSE_OVERLAP
 
 template< typename m1, typename m2 >
-void fft_interpolate( m1& V, m2& v, bool from_basegrid=false ) 
+void fft_interpolate( m1& V, m2& v, bool from_basegrid ) 
 {
   int oxf = v.offset(0), oyf = v.offset(1), ozf = v.offset(2);
   size_t nxf = v.size(0), nyf = v.size(1), nzf = v.size(2), nzfp = nzf+2;
@@ -199,10 +246,10 @@ void fft_interpolate( m1& V, m2& v, bool from_basegrid=false )
   
   size_t nxc = nxf/2, nyc = nyf/2, nzc = nzf/2, nzcp = nzf/2+2;
   
-  fftw_real *rcoarse = new fftw_real[ nxc * nyc * nzcp ];
+  fftw_real *rcoarse = mem_allocate<fftw_real>( nxc * nyc * nzcp );
   fftw_complex *ccoarse = reinterpret_cast<fftw_complex*> (rcoarse);
   
-  fftw_real *rfine = new fftw_real[ nxf * nyf * nzfp];
+  fftw_real *rfine = mem_allocate<fftw_real>( nxf * nyf * nzfp );
   fftw_complex *cfine = reinterpret_cast<fftw_complex*> (rfine);
   
   // copy coarse data to rcoarse[.]
@@ -420,7 +467,7 @@ void fft_interpolate( m1& V, m2& v, bool from_basegrid=false )
 	  }
 #endif
         
-    delete[] rcoarse;
+    mem_deallocate( rcoarse );
 
      /*************************************************/    
 
@@ -457,9 +504,12 @@ void fft_interpolate( m1& V, m2& v, bool from_basegrid=false )
 	    v(i,j,k) = rfine[q] * fftnorm;
 	  }
 
-    delete[] rfine;
+    mem_deallocate( rfine );
 }
 
+template void fft_interpolate< DensityGrid<real_t>, PaddedDensitySubGrid<real_t> >( DensityGrid<real_t>& V, PaddedDensitySubGrid<real_t>& v, bool from_basegrid );
+template void fft_interpolate< PaddedDensitySubGrid<real_t>, PaddedDensitySubGrid<real_t> >( PaddedDensitySubGrid<real_t>& V, PaddedDensitySubGrid<real_t>& v, bool from_basegrid );
+
 
 
 /*******************************************************************************************/
@@ -510,7 +560,7 @@ void GenerateDensityUnigrid( config_file& cf, transfer_function *ptf, tf_type ty
 		
 	
 	//... initialize convolution kernel
-	convolution::kernel *the_tf_kernel = the_kernel_creator->create( cf, ptf, refh, type );
+	convolution::kernel *the_tf_kernel = acquire_tf_kernel( the_kernel_creator, cf, ptf, refh, type );
 
 	//...
 	std::cout << " - Performing noise convolution on level " << std::setw(2) << levelmax << " ..." << std::endl;
@@ -529,7 +579,7 @@ void GenerateDensityUnigrid( config_file& cf, transfer_function *ptf, tf_type ty
 	convolution::perform<real_t>( the_tf_kernel, reinterpret_cast<void*>( top->get_data_ptr() ), shift );
 	
 	//... clean up kernel
-	delete the_tf_kernel;
+	release_tf_kernel( the_tf_kernel );
 	
 	//... create multi-grid hierarchy
 	delta.create_base_hierarchy(levelmin);
@@ -563,6 +613,8 @@ void GenerateDensityHierarchy(	config_file& cf, transfer_function *ptf, tf_type
   tstart = (double)clock() / CLOCKS_PER_SEC;
 #endif
   
+  MUSIC::trace_scope trace("density convolution");
+  
   levelminPoisson = cf.getValue<unsigned>("setup","levelmin");
   levelmin = cf.getValueSafe<unsigned>("setup","levelmin_TF",levelminPoisson);
   levelmax = cf.getValue<unsigned>("setup","levelmax");
@@ -596,7 +648,7 @@ void GenerateDensityHierarchy(	config_file& cf, transfer_function *ptf, tf_type
 #endif
     }	
 	
-  convolution::kernel *the_tf_kernel = the_kernel_creator->create( cf, ptf, refh, type );
+  convolution::kernel *the_tf_kernel = acquire_tf_kernel( the_kernel_creator, cf, ptf, refh, type );
 	
   /***** PERFORM CONVOLUTIONS *****/
   if( kspaceTF ){
@@ -607,6 +659,7 @@ void GenerateDensityHierarchy(	config_file& cf, transfer_function *ptf, tf_type
     int nlevels = (int)levelmax-(int)levelmin+1;
     
     // do coarse level
+    MUSIC::trace_scope trace_level("convolution level %d",levelmin);
     top = new DensityGrid<real_t>( nbase, nbase, nbase );
     LOGINFO("Performing noise convolution on level %3d",levelmin);
     rand.load(*top,levelmin);
@@ -617,6 +670,7 @@ void GenerateDensityHierarchy(	config_file& cf, transfer_function *ptf, tf_type
     
     for( int i=1; i<nlevels; ++i )
       {
+	trace_level.next("convolution level %d",levelmin+i);
 	LOGINFO("Performing noise convolution on level %3d...",levelmin+i);
 	/////////////////////////////////////////////////////////////////////////
 	//... add new refinement patch
@@ -667,6 +721,7 @@ void GenerateDensityHierarchy(	config_file& cf, transfer_function *ptf, tf_type
         //... create and initialize density grids with white noise	
 	PaddedDensitySubGrid<real_t>* coarse(NULL), *fine(NULL);
 	DensityGrid<real_t>* top(NULL);
+	MUSIC::trace_scope trace_level("convolution level %d",levelmin);
 
 	if( levelmax == levelmin )
 	{
@@ -696,6 +751,8 @@ void GenerateDensityHierarchy(	config_file& cf, transfer_function *ptf, tf_type
 		//... GENERATE/FILL WITH RANDOM NUMBERS .................................................................//
 		//.......................................................................................................//
 		
+		if( i>0 )
+			trace_level.next("convolution level %d",levelmin+i);
 		
 		if( i==0 )
 		{
@@ -839,6 +896,7 @@ void GenerateDensityHierarchy(	config_file& cf, transfer_function *ptf, tf_type
 		/**********************************************************************************************************\
 		 *	multi-grid: finest sub-grid .....
 		 \**********************************************************************************************************/ 
+		trace_level.next("convolution level %d",levelmax);
 		std::cout << " - Performing noise convolution on level " << std::setw(2) << levelmax << " ..." << std::endl;
 		LOGUSER("Performing noise convolution on level %3d",levelmax);
 				
@@ -881,7 +939,7 @@ void GenerateDensityHierarchy(	config_file& cf, transfer_function *ptf, tf_type
 
   }
 	
-	delete the_tf_kernel;
+	release_tf_kernel( the_tf_kernel );
 			
 #ifndef SINGLETHREAD_FFTW
 	tend = omp_get_wtime();
@@ -908,6 +966,8 @@ void normalize_density( grid_hierarchy& delta )
 	long double sum = 0.0;
 	unsigned levelmin = delta.levelmin(), levelmax = delta.levelmax();
 	
+	delta.detach();
+	
 	{
 		size_t nx,ny,nz;
 		
@@ -945,6 +1005,8 @@ void normalize_density( grid_hierarchy& delta )
 void coarsen_density( const refinement_hierarchy& rh, GridHierarchy<real_t>& u, bool kspace )
 {
   unsigned levelmin_TF = u.levelmin();
+
+  u.detach();
     
     /*for( int i=rh.levelmax(); i>0; --i )
         mg_straight().restrict( *(u.get_grid(i)), *(u.get_grid(i-1)) );*/
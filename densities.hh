@@ -14,6 +14,7 @@
 #include <assert.h>
 
 #include "general.hh"
+#include "mem_alloc.hh"
 #include "config_file.hh"
 #include "random.hh"
 #include "cosmology.hh"
@@ -28,6 +29,13 @@ void GenerateDensityUnigrid( config_file& cf, transfer_function *ptf, tf_type ty
 
 void normalize_density( grid_hierarchy& delta );
 
+//! keep the transfer function kernels between density computations
+/*! a kernel only depends on the transfer function type and the refinement
+ *  hierarchy, so an ensemble of realizations computes each one only once.
+ *  Switching it off deletes the kept kernels.
+ */
+void keep_tf_kernels( bool keep );
+
 
 /*!
  * @class DensityGrid
@@ -55,8 +63,11 @@ public:
 
         size_t ov_[3];
 
+	//! type of the data container, aligned and first-touched in parallel
+	typedef std::vector< real_t, mem_allocator<real_t> > data_vector;
+
 	//! the actual data container in the form of a 1D array
-	std::vector< real_t > data_;
+	data_vector data_;
 	
 	//! constructor
 	/*! constructs an instance given the dimensions of the density field
@@ -67,7 +78,8 @@ public:
 	DensityGrid( unsigned nx, unsigned ny, unsigned nz )
 	  : nx_(nx), ny_(ny), nz_(nz), nzp_( 2*(nz_/2+1) ), ox_(0), oy_(0), oz_(0)
 	{
-		data_.assign((size_t)nx_*(size_t)ny_*(size_t)nzp_,0.0);
+		data_.resize((size_t)nx_*(size_t)ny_*(size_t)nzp_);
+		parallel_zero( data_.data(), data_.size() );
 		nv_[0] = nx_; nv_[1] = ny_; nv_[2] = nz_;
 		ov_[0] = ox_; ov_[1] = oy_; ov_[2] = oz_;
 	}
@@ -75,7 +87,8 @@ public:
         DensityGrid( unsigned nx, unsigned ny, unsigned nz, int ox, int oy, int oz )
 	  : nx_(nx), ny_(ny), nz_(nz), nzp_( 2*(nz_/2+1) ), ox_(ox), oy_(oy), oz_(oz)
 	{
-		data_.assign((size_t)nx_*(size_t)ny_*(size_t)nzp_,0.0);
+		data_.resize((size_t)nx_*(size_t)ny_*(size_t)nzp_);
+		parallel_zero( data_.data(), data_.size() );
 		nv_[0] = nx_; nv_[1] = ny_; nv_[2] = nz_;
 		ov_[0] = ox_; ov_[1] = oy_; ov_[2] = oz_;
 	}
@@ -85,7 +98,8 @@ public:
 	  : nx_(g.nx_), ny_(g.ny_), nz_(g.nz_), nzp_(g.nzp_), 
 	    ox_(g.ox_), oy_(g.oy_), oz_(g.oz_)
 	{
-		data_ = g.data_;
+		data_.resize( g.data_.size() );
+		parallel_copy( data_.data(), g.data_.data(), data_.size() );
 		nv_[0] = nx_; nv_[1] = ny_; nv_[2] = nz_;
 		ov_[0] = ox_; ov_[1] = oy_; ov_[2] = oz_;
 	}
@@ -105,7 +119,7 @@ public:
 		ov_[0] = ov_[1] = ov_[2] = 0;
 
 		data_.clear();
-		std::vector<real_t>().swap(data_);
+		data_vector().swap(data_);
 	}
 	
 	//! query the 3D array sizes of the density object
@@ -127,7 +141,7 @@ public:
 	 */
 	void zero( void )
 	{
-		data_.assign(data_.size(),0.0);
+		parallel_zero( data_.data(), data_.size() );
 	}
 	
 	//! assigns the contents of another DensityGrid to this
@@ -140,7 +154,13 @@ public:
 		ox_ = g.ox_;
 		oy_ = g.oy_;
 		oz_ = g.oz_;
-		data_ = g.data_;
+		
+		if( data_.size() != g.data_.size() )
+		{
+			data_vector().swap(data_);
+			data_.resize( g.data_.size() );
+		}
+		parallel_copy( data_.data(), g.data_.data(), data_.size() );
 		
 		return *this;
 	}
@@ -1077,6 +1097,15 @@ inline void enforce_mean( M& v, M& V )
 
 
 
+//! Fourier interpolate a coarse grid onto the padded fine grid nested in it
+/*! instantiated for DensityGrid and PaddedDensitySubGrid coarse grids
+ * @param V the coarse grid
+ * @param v the padded fine grid, the interpolated long waves are added to it
+ * @param from_basegrid whether V is the periodic top grid
+ */
+template< typename m1, typename m2 >
+void fft_interpolate( m1& V, m2& v, bool from_basegrid=false );
+
 void coarsen_density( const refinement_hierarchy& rh, GridHierarchy<real_t>& u, bool kspace );
 
 
@@ -15,10 +15,10 @@ struct fft_interp{
 
     size_t nxc = nxf/2, nyc = nyf/2, nzc = nzf/2, nzcp = nzf/2+2;
 
-    fftw_real *rcoarse = new fftw_real[ nxc * nyc * nzcp ];
+    fftw_real *rcoarse = mem_allocate<fftw_real>( nxc * nyc * nzcp );
     fftw_complex *ccoarse = reinterpret_cast<fftw_complex*> (rcoarse);
 
-    fftw_real *rfine = new fftw_real[ nxf * nyf * nzfp];
+    fftw_real *rfine = mem_allocate<fftw_real>( nxf * nyf * nzfp );
     fftw_complex *cfine = reinterpret_cast<fftw_complex*> (rfine);
 
     #pragma omp parallel for
@@ -154,7 +154,7 @@ struct fft_interp{
 	    IM(cfine[qf]) = sqrt8*IM(ccoarse[qc]);
 	  }
         
-    delete[] rcoarse;
+    mem_deallocate( rcoarse );
 
     /*************************************************/    
 
@@ -191,8 +191,7 @@ struct fft_interp{
 	    v(i,j,k) = rfine[q] * fftnorm;
 	  }
 
-    delete[] rcoarse;
-    delete[] rfine;
+    mem_deallocate( rfine );
 
   }
 
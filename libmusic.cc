@@ -0,0 +1,280 @@
+/*
+
+ libmusic.cc - This file is part of MUSIC -
+ a code to generate multi-scale initial conditions
+ for cosmological simulations
+
+ Copyright (C) 2010  Oliver Hahn
+
+*/
+
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#include "libmusic.hh"
+
+/*!
+ * @class callback_output_plugin
+ * @brief output plug-in handing the fields and particles to callbacks
+ *
+ * Fields are passed on as they arrive. For particles the plug-in keeps the
+ * position and velocity components of a species until all six have arrived.
+ * The kept hierarchies share their data with the driver until it overwrites
+ * them, so at most five components are held in addition to the driver's.
+ * The particles are then handed over level by level in batches of
+ * [output] callback_batch particles (default 1048576), finest level first.
+ */
+class callback_output_plugin : public output_plugin
+{
+protected:
+
+	typedef std::shared_ptr<const grid_hierarchy> snapshot;
+
+	const MUSIC::output_callbacks& cb_;
+	double omegam_, omegab_;
+	bool bbaryons_;
+	size_t batch_size_;
+
+	//! kept components, [dm/gas][position/velocity][coordinate]
+	snapshot comp_[2][2][3];
+
+	std::vector<double> pos_[3], vel_[3];
+
+	void grid( MUSIC::field_type field, int coord, const grid_hierarchy& gh )
+	{
+		if( cb_.grid )
+			cb_.grid( field, coord, gh );
+	}
+
+	void keep( int species, int quantity, int coord, const grid_hierarchy& gh )
+	{
+		if( !cb_.particles )
+			return;
+
+		comp_[species][quantity][coord] = snapshot( new grid_hierarchy( gh ) );
+
+		for( int q=0; q<2; ++q )
+			for( int i=0; i<3; ++i )
+				if( !comp_[species][q][i] )
+					return;
+
+		emit_particles( species );
+
+		for( int q=0; q<2; ++q )
+			for( int i=0; i<3; ++i )
+				comp_[species][q][i].reset();
+	}
+
+	void flush( MUSIC::particle_batch& batch )
+	{
+		if( pos_[0].size() == 0 )
+			return;
+
+		batch.count = pos_[0].size();
+		for( int i=0; i<3; ++i )
+		{
+			batch.pos[i] = &pos_[i][0];
+			batch.vel[i] = &vel_[i][0];
+		}
+
+		cb_.particles( batch );
+
+		batch.id_offset += batch.count;
+		for( int i=0; i<3; ++i )
+		{
+			pos_[i].clear();
+			vel_[i].clear();
+		}
+	}
+
+	void emit_particles( int species )
+	{
+		const grid_hierarchy& gh = *comp_[species][0][0];
+
+		MUSIC::particle_batch batch;
+		batch.baryons = (species == 1);
+		batch.id_offset = batch.baryons? gh.count_leaf_cells() : 0;
+
+		for( int i=0; i<3; ++i )
+		{
+			pos_[i].reserve( batch_size_ );
+			vel_[i].reserve( batch_size_ );
+		}
+
+		for( int ilevel=gh.levelmax(); ilevel>=(int)gh.levelmin(); --ilevel )
+		{
+			batch.level = ilevel;
+			batch.mass = omegam_/(double)(1ul<<(3*ilevel));
+
+			if( bbaryons_ )
+				batch.mass *= batch.baryons? omegab_/omegam_ : (omegam_-omegab_)/omegam_;
+
+			const MeshvarBnd<real_t> *pp[3], *pv[3];
+			for( int i=0; i<3; ++i )
+			{
+				pp[i] = comp_[species][0][i]->get_grid( ilevel );
+				pv[i] = comp_[species][1][i]->get_grid( ilevel );
+			}
+
+			for( unsigned i=0; i<pp[0]->size(0); ++i )
+				for( unsigned j=0; j<pp[0]->size(1); ++j )
+					for( unsigned k=0; k<pp[0]->size(2); ++k )
+						if( gh.is_in_mask(ilevel,i,j,k) && !gh.is_refined(ilevel,i,j,k) )
+						{
+							double xx[3];
+							gh.cell_pos( ilevel, i, j, k, xx );
+
+							for( int c=0; c<3; ++c )
+							{
+								pos_[c].push_back( fmod( xx[c]+(double)(*pp[c])(i,j,k)+1.0, 1.0 ) );
+								vel_[c].push_back( (double)(*pv[c])(i,j,k) );
+							}
+
+							if( pos_[0].size() == batch_size_ )
+								flush( batch );
+						}
+
+			flush( batch );
+		}
+
+		for( int i=0; i<3; ++i )
+		{
+			std::vector<double>().swap( pos_[i] );
+			std::vector<double>().swap( vel_[i] );
+		}
+	}
+
+public:
+
+	callback_output_plugin( config_file& cf, const MUSIC::output_callbacks& cb )
+	: output_plugin( cf ), cb_( cb )
+	{
+		omegam_		= cf.getValue<double>( "cosmology", "Omega_m" );
+		omegab_		= cf.getValue<double>( "cosmology", "Omega_b" );
+		bbaryons_	= cf.getValue<bool>( "setup", "baryons" );
+		batch_size_	= cf.getValueSafe<size_t>( "output", "callback_batch", 1048576 );
+
+		if( batch_size_ == 0 )
+			batch_size_ = 1;
+	}
+
+	void write_dm_mass( const grid_hierarchy& gh )
+	{	grid( MUSIC::dm_mass, -1, gh );	}
+
+	void write_dm_density( const grid_hierarchy& gh )
+	{	grid( MUSIC::dm_density, -1, gh );	}
+
+	void write_dm_potential( const grid_hierarchy& gh )
+	{	grid( MUSIC::dm_potential, -1, gh );	}
+
+	void write_dm_velocity( int coord, const grid_hierarchy& gh )
+	{
+		grid( MUSIC::dm_velocity, coord, gh );
+		keep( 0, 1, coord, gh );
+	}
+
+	void write_dm_position( int coord, const grid_hierarchy& gh )
+	{
+		grid( MUSIC::dm_position, coord, gh );
+		keep( 0, 0, coord, gh );
+	}
+
+	void write_gas_velocity( int coord, const grid_hierarchy& gh )
+	{
+		grid( MUSIC::gas_velocity, coord, gh );
+		keep( 1, 1, coord, gh );
+	}
+
+	void write_gas_position( int coord, const grid_hierarchy& gh )
+	{
+		grid( MUSIC::gas_position, coord, gh );
+		keep( 1, 0, coord, gh );
+	}
+
+	void write_gas_density( const grid_hierarchy& gh )
+	{	grid( MUSIC::gas_density, -1, gh );	}
+
+	void write_gas_potential( const grid_hierarchy& gh )
+	{	grid( MUSIC::gas_potential, -1, gh );	}
+
+	void finalize( void )
+	{
+		//... gas positions are only written for SPH, drop incomplete species
+		for( int s=0; s<2; ++s )
+			for( int q=0; q<2; ++q )
+				for( int i=0; i<3; ++i )
+					comp_[s][q][i].reset();
+
+		if( cb_.finalize )
+			cb_.finalize();
+	}
+};
+
+//! creates the callback plug-in of a single run, it is not registered by name
+struct callback_output_plugin_creator : public output_plugin_creator
+{
+	const MUSIC::output_callbacks& cb_;
+
+	explicit callback_output_plugin_creator( const MUSIC::output_callbacks& cb )
+	: cb_( cb )
+	{ }
+
+	output_plugin * create( config_file& cf ) const
+	{
+		return new callback_output_plugin( cf, cb_ );
+	}
+};
+
+
+void MUSIC::parameters::to_config( config_file& cf ) const
+{
+	char tmpstr[128];
+
+	sprintf( tmpstr, "%.12g", boxlength );		cf.insertValue( "setup", "boxlength", tmpstr );
+	sprintf( tmpstr, "%.12g", zstart );			cf.insertValue( "setup", "zstart", tmpstr );
+	sprintf( tmpstr, "%u", levelmin );			cf.insertValue( "setup", "levelmin", tmpstr );
+	sprintf( tmpstr, "%u", levelmin_TF );		cf.insertValue( "setup", "levelmin_TF", tmpstr );
+	sprintf( tmpstr, "%u", levelmax );			cf.insertValue( "setup", "levelmax", tmpstr );
+	sprintf( tmpstr, "%u", padding );			cf.insertValue( "setup", "padding", tmpstr );
+	sprintf( tmpstr, "%u", overlap );			cf.insertValue( "setup", "overlap", tmpstr );
+	cf.insertValue( "setup", "baryons", baryons? "yes" : "no" );
+	cf.insertValue( "setup", "use_2LPT", use_2LPT? "yes" : "no" );
+
+	sprintf( tmpstr, "%.12g", Omega_m );		cf.insertValue( "cosmology", "Omega_m", tmpstr );
+	sprintf( tmpstr, "%.12g", Omega_L );		cf.insertValue( "cosmology", "Omega_L", tmpstr );
+	sprintf( tmpstr, "%.12g", Omega_b );		cf.insertValue( "cosmology", "Omega_b", tmpstr );
+	sprintf( tmpstr, "%.12g", H0 );				cf.insertValue( "cosmology", "H0", tmpstr );
+	sprintf( tmpstr, "%.12g", sigma_8 );		cf.insertValue( "cosmology", "sigma_8", tmpstr );
+	sprintf( tmpstr, "%.12g", nspec );			cf.insertValue( "cosmology", "nspec", tmpstr );
+	cf.insertValue( "cosmology", "transfer", transfer );
+
+	char seedkey[32];
+	sprintf( seedkey, "seed[%u]", levelmin );
+	sprintf( tmpstr, "%ld", seed );
+	cf.insertValue( "random", seedkey, tmpstr );
+
+	for( std::map<std::string,std::string>::const_iterator it=extra.begin(); it!=extra.end(); ++it )
+		cf.insertValue( it->first, it->second );
+}
+
+int MUSIC::generate( config_file& cf, const output_callbacks& cb, const std::string& name )
+{
+	cf.insertValue( "output", "format", "callback" );
+	if( !cf.containsKey( "output", "filename" ) )
+		cf.insertValue( "output", "filename", name );
+
+	open_log( name );
+
+	callback_output_plugin_creator creator( cb );
+	return run( cf, name, false, &creator );
+}
+
+int MUSIC::generate( const parameters& par, const output_callbacks& cb, const std::string& name )
+{
+	config_file cf;
+	par.to_config( cf );
+
+	return generate( cf, cb, name );
+}
@@ -0,0 +1,134 @@
+/*
+
+ libmusic.hh - This file is part of MUSIC -
+ a code to generate multi-scale initial conditions
+ for cosmological simulations
+
+ Copyright (C) 2010  Oliver Hahn
+
+*/
+
+#ifndef __LIBMUSIC_HH
+#define __LIBMUSIC_HH
+
+#include <string>
+#include <map>
+#include <functional>
+
+#include "general.hh"
+#include "config_file.hh"
+#include "mesh.hh"
+#include "output.hh"
+
+/*!
+ * libmusic runs the MUSIC driver inside another code. The fields and
+ * particles are handed to callbacks instead of being written to disk.
+ *
+ * Build with 'make lib'. The plug-ins register themselves from static
+ * constructors, so link with
+ *   -Wl,--whole-archive -lmusic -Wl,--no-whole-archive
+ * and the FFTW, GSL (and HDF5) libraries MUSIC was built with.
+ *
+ * A minimal use:
+ *
+ *   MUSIC::parameters par;
+ *   par.boxlength = 100.0; par.levelmin = par.levelmax = 7;
+ *
+ *   MUSIC::output_callbacks cb;
+ *   cb.particles = []( const MUSIC::particle_batch& b ){ ... };
+ *
+ *   MUSIC::generate( par, cb );
+ */
+namespace MUSIC
+{
+	//! the fields the driver hands to the output
+	enum field_type
+	{
+		dm_mass, dm_density, dm_potential, dm_velocity, dm_position,
+		gas_velocity, gas_position, gas_density, gas_potential
+	};
+
+	//! particles of one species on one refinement level
+	/*! The arrays are owned by libmusic and are only valid during the callback.
+	 *  Positions are in units of the box length in [0,1), velocities in units of
+	 *  the box length as well, so that multiplying by the box length in Mpc/h
+	 *  gives peculiar velocities in km/s. Masses are in units of rho_crit times
+	 *  the box volume.
+	 */
+	struct particle_batch
+	{
+		bool baryons;			//!< gas particles rather than dark matter
+		unsigned level;			//!< refinement level the particles belong to
+		size_t count;			//!< number of particles in the batch
+		size_t id_offset;		//!< id of the first particle, ids are consecutive
+		const double *pos[3];	//!< positions, one array per coordinate
+		const double *vel[3];	//!< velocities, one array per coordinate
+		double mass;			//!< mass of every particle of the batch
+	};
+
+	//! callbacks receiving the output of a run, unset ones are skipped
+	struct output_callbacks
+	{
+		//! every field as the driver hands it to the output plug-ins, coord is -1 for scalars
+		/*! the hierarchy is the driver's own, it is not copied and only valid during the call */
+		std::function<void( field_type field, int coord, const grid_hierarchy& gh )> grid;
+
+		//! particle batches, handed over once positions and velocities of a species are complete
+		std::function<void( const particle_batch& batch )> particles;
+
+		//! called at the very end of the run
+		std::function<void( void )> finalize;
+	};
+
+	//! the most common parameters of a run, to set up a run without a parameter file
+	/*! every other parameter can be given in 'extra' as "section/key" = value,
+	 *  e.g. extra["setup/ref_center"] = "0.5,0.5,0.5"
+	 */
+	struct parameters
+	{
+		double boxlength, zstart;
+		unsigned levelmin, levelmin_TF, levelmax, padding, overlap;
+		bool baryons, use_2LPT;
+		double Omega_m, Omega_L, Omega_b, H0, sigma_8, nspec;
+		std::string transfer;
+		long seed;				//!< seed of levelmin
+		std::map<std::string,std::string> extra;
+
+		parameters( void )
+		: boxlength( 100.0 ), zstart( 50.0 ),
+		  levelmin( 7 ), levelmin_TF( 7 ), levelmax( 7 ), padding( 8 ), overlap( 4 ),
+		  baryons( false ), use_2LPT( false ),
+		  Omega_m( 0.276 ), Omega_L( 0.724 ), Omega_b( 0.045 ), H0( 70.3 ), sigma_8( 0.811 ), nspec( 0.961 ),
+		  transfer( "eisenstein" ), seed( 12345 )
+		{ }
+
+		//! fill an empty configuration with the parameters
+		void to_config( config_file& cf ) const;
+	};
+
+	//! open the log file <name>_log.txt and write the build configuration to it
+	void open_log( const std::string& name );
+
+	//! run the driver on a configuration
+	/*! @param cf the configuration of the run
+	 *  @param paramfile name of the run, default prefix of the trace, checkpoint and staging files
+	 *  @param bdry_run only estimate the resources of the run
+	 *  @param pcreator creates the output plug-in, NULL selects it from [output] format
+	 *  @return 0 on success, 1 if the run failed
+	 */
+	int run( config_file& cf, const std::string& paramfile, bool bdry_run = false,
+			 const output_plugin_creator *pcreator = NULL );
+
+	//! generate initial conditions in-process, handing the output to callbacks
+	/*! @param cf the configuration of the run, [output] format and filename are not needed
+	 *  @param cb the callbacks receiving fields and particles
+	 *  @param name name of the run, prefix of the log file and temporary files
+	 *  @return 0 on success, 1 if the run failed
+	 */
+	int generate( config_file& cf, const output_callbacks& cb, const std::string& name = "libmusic" );
+
+	//! generate initial conditions in-process from a parameter struct
+	int generate( const parameters& par, const output_callbacks& cb, const std::string& name = "libmusic" );
+}
+
+#endif //__LIBMUSIC_HH
@@ -38,60 +38,65 @@ std::string RemoveMultipleWhiteSpaces( std::string s )
 void MUSIC::log::send(messageType type, const std::string& text_)
 //void MUSIC::log::send(messageType type, std::stringstream& textstr)
 {
-	std::string text(text_);// = textstr.str();
 	// Skip logging if minimum level is higher
     if (logLevel_)
 		if (type < logLevel_) return;
-	// log message
-	MUSIC::log::message m;
-	m.type = type;
-	m.text = text;
-	time_t t = time(NULL);
-	m.when = localtime(&t);
-	messages_.push_back(m);
 	
-	if( type==Info||type==Warning||type==Error||type==FatalError )
-	{	
-		std::cout << " - "; 
-		if(type==Warning)
-			std::cout << "WARNING: ";
-		if(type==Error)
-			std::cout << "ERROR: ";
-		if(type==FatalError)
-			std::cout << "FATAL: ";
-		std::cout << text << std::endl;
-	}
+	// messages may come from several threads, e.g. concurrent output plug-ins
+	#pragma omp critical(log)
+	{
+		std::string text(text_);// = textstr.str();
+		// log message
+		MUSIC::log::message m;
+		m.type = type;
+		m.text = text;
+		time_t t = time(NULL);
+		m.when = localtime(&t);
+		messages_.push_back(m);
 	
-	std::replace(text.begin(),text.end(),'\n',' ');
-	RemoveMultipleWhiteSpaces(text);
+		if( type==Info||type==Warning||type==Error||type==FatalError )
+		{	
+			std::cout << " - "; 
+			if(type==Warning)
+				std::cout << "WARNING: ";
+			if(type==Error)
+				std::cout << "ERROR: ";
+			if(type==FatalError)
+				std::cout << "FATAL: ";
+			std::cout << text << std::endl;
+		}
 	
-	// if enabled logging to file
-	if(outputStream_.is_open())
-	{
-		// print time
-		char buffer[9];
-		strftime(buffer, 9, "%X", m.when);
-		outputStream_ << buffer;
-		
-		// print type
-		switch(type)
+		std::replace(text.begin(),text.end(),'\n',' ');
+		RemoveMultipleWhiteSpaces(text);
+	
+		// if enabled logging to file
+		if(outputStream_.is_open())
 		{
-			case Info:		outputStream_ << " | info    | "; break;
-			case DebugInfo: outputStream_ << " | debug   | "; break;
-			case Warning:	outputStream_ << " | warning | "; break;
-			case Error:		outputStream_ << " | ERROR   | "; break;
-			case FatalError:outputStream_ << " | FATAL   | "; break;
-			case User:		outputStream_ << " | info    | "; break;
-			default:		outputStream_ << " | ";
-		}
+			// print time
+			char buffer[9];
+			strftime(buffer, 9, "%X", m.when);
+			outputStream_ << buffer;
 		
-		// print description
-		outputStream_ << text << std::endl;
-	}
+			// print type
+			switch(type)
+			{
+				case Info:		outputStream_ << " | info    | "; break;
+				case DebugInfo: outputStream_ << " | debug   | "; break;
+				case Warning:	outputStream_ << " | warning | "; break;
+				case Error:		outputStream_ << " | ERROR   | "; break;
+				case FatalError:outputStream_ << " | FATAL   | "; break;
+				case User:		outputStream_ << " | info    | "; break;
+				default:		outputStream_ << " | ";
+			}
+		
+			// print description
+			outputStream_ << text << std::endl;
+		}
 	
-	// if user wants to catch messages, send it to him
-	if(receiver)
-		receiver(m);
+		// if user wants to catch messages, send it to him
+		if(receiver)
+			receiver(m);
+	}
 }
 
 
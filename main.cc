@@ -21,6 +21,12 @@
 
 
 #include "general.hh"
+#include "mem_alloc.hh"
+#include "mem_plan.hh"
+#include "checkpoint.hh"
+#include "task_graph.hh"
+#include "libmusic.hh"
+#include "trace.hh"
 #include "defaults.hh"
 #include "output.hh"
 
@@ -53,13 +59,6 @@ namespace music
 	
 }
  
-//... declare static class members here
-transfer_function *TransferFunction_real::ptf_ = NULL;
-transfer_function *TransferFunction_k::ptf_ = NULL;
-tf_type TransferFunction_k::type_;
-tf_type TransferFunction_real::type_;
-real_t TransferFunction_real::nspec_ = -1.0;
-real_t TransferFunction_k::nspec_ = -1.0;
 
 
 //... prototypes for routines used in main driver routine
@@ -278,45 +277,676 @@ double compute_finest_max( grid_hierarchy& u )
 	return valmax;
 }
 
+//! how the 2LPT terms of the velocity stage are reused for the displacements in DM-only runs
+enum lpt_reuse_mode
+{
+	lpt_reuse_memory,		//!< keep the 2LPT terms in memory while writing the velocities
+	lpt_reuse_recompute		//!< release them and recompute the displacements from scratch
+};
 
+//! the switches of the main driver that determine its stages and their live sets
+struct driver_options
+{
+	bool do_baryons, do_2LPT, do_LLA, bdefd, bsph, kspace, kspace2LPT, kspace_TF;
+	bool tf_has_velocities, tf_is_distinct, wnoise_in_memory;
+	lpt_reuse_mode lpt_reuse;
+	bool grad_reuse;				//!< derive the 1LPT velocities from the kept displacements
+	size_t output_buffer_bytes;		//!< buffer the output plug-in needs when writing a component
+};
 
-/*****************************************************************************************************/
-/*****************************************************************************************************/
-/*****************************************************************************************************/
+//! name of the file used to stage a buffer to disk
+std::string staging_file( config_file& cf, const std::string& name )
+{
+	std::string dir = cf.getValueSafe<std::string>( "memory", "staging_dir", "." );
+	return dir + "/music_stage_" + name + ".bin";
+}
 
-region_generator_plugin *the_region_generator;
-RNG_plugin *the_random_number_generator;
+//! parse the seeds of an ensemble, given as comma separated seeds and ranges first-last
+std::vector<long> parse_ensemble_seeds( const std::string& list )
+{
+	std::vector<long> seeds;
+	std::stringstream ss( list );
+	std::string item;
 
-int main (int argc, const char * argv[]) 
+	while( std::getline( ss, item, ',' ) )
+	{
+		long first, last;
+		char dash;
+		std::stringstream is( item );
+
+		if( !(is >> first) )
+			continue;
+		if( !(is >> dash) )
+			last = first;
+		else if( dash != '-' || !(is >> last) || last < first )
+		{
+			LOGERR("Invalid entry \'%s\' in [random] ensemble_seeds.",item.c_str());
+			throw std::runtime_error("Invalid ensemble seed list");
+		}
+
+		for( long s=first; s<=last; ++s )
+		{
+			if( s <= 0 )
+			{
+				LOGERR("Ensemble seeds need to be numbers >0, got %ld.",s);
+				throw std::runtime_error("Seed values need to be >0");
+			}
+			seeds.push_back( s );
+		}
+	}
+
+	return seeds;
+}
+
+//! the seed key varied by an ensemble, that of the coarsest level with a numeric seed
+std::string ensemble_seed_key( config_file& cf )
 {
-	const unsigned nbnd = 4;
+	for( int i=0; i<=100; ++i )
+	{
+		char seedstr[128];
+		sprintf( seedstr, "seed[%d]", i );
+
+		if( cf.containsKey( "random", seedstr ) )
+		{
+			long seed;
+			std::stringstream is( cf.getValue<std::string>( "random", seedstr ) );
+			if( is >> seed )
+				return std::string( seedstr );
+		}
+	}
+
+	LOGERR("An ensemble needs a numeric [random] seed[level] entry to vary.");
+	throw std::runtime_error("No seed to vary in ensemble");
+}
+
+//! the output file names of an ensemble member
+/*! {seed} in a file name is replaced by the seed, otherwise _<seed> is appended.
+ *  For several output formats, every name of the list is treated this way.
+ */
+std::string ensemble_filename( const std::string& fnames, long seed )
+{
+	char seedstr[32];
+	sprintf( seedstr, "%ld", seed );
+
+	std::stringstream ss( fnames );
+	std::string item, out;
+
+	while( std::getline( ss, item, ',' ) )
+	{
+		size_t pos = item.find( "{seed}" );
+
+		if( pos == std::string::npos )
+		{
+			size_t end = item.find_last_not_of( " \t" );
+			item.insert( (end==std::string::npos)? item.size() : end+1, std::string("_")+seedstr );
+		}
+		else
+			while( pos != std::string::npos )
+			{
+				item.replace( pos, 6, seedstr );
+				pos = item.find( "{seed}", pos );
+			}
+
+		out += (out.size()? "," : "") + item;
+	}
+
+	return out;
+}
+
+//! compute the normalized density of a stage on the Poisson grid, or restore it from a checkpoint
+void compute_density( checkpoint& ckpt, const std::string& stage, config_file& cf, transfer_function *ptf, tf_type type,
+					  refinement_hierarchy& rh_TF, const refinement_hierarchy& rh_Poisson, rand_gen& rand,
+					  grid_hierarchy& f, bool smooth, bool shift, bool kspace_TF )
+{
+	if( ckpt.load( stage, f ) )
+		return;
+
+	GenerateDensityHierarchy( cf, ptf, type, rh_TF, rand, f, smooth, shift );
+	coarsen_density( rh_Poisson, f, kspace_TF );
+	f.add_refinement_mask( rh_Poisson.get_coord_shift() );
+	normalize_density( f );
+
+	ckpt.save( stage, f );
+}
+
+//! solve for the potential of a stage, or restore it from a checkpoint
+/*! @return the error reported by the solver, zero if the potential was restored
+ */
+double solve_potential( checkpoint& ckpt, const std::string& stage, poisson_plugin *solver,
+						grid_hierarchy& f, grid_hierarchy& u )
+{
+	if( ckpt.load( stage, u ) )
+		return 0.0;
+
+	u = f;	u.zero();
+	double err = solver->solve( f, u );
+
+	ckpt.save( stage, u );
+	return err;
+}
+
+//! compute the 2LPT source of a stage and solve for its potential, or restore them from a checkpoint
+/*! the source is only checkpointed if it is needed later on, i.e. for the hybrid step
+ *  @return the error reported by the solver, zero if the potential was restored
+ */
+double solve_2LPT_potential( checkpoint& ckpt, const std::string& stage, config_file& cf, poisson_plugin *solver,
+							 grid_hierarchy& u1, grid_hierarchy& f2LPT, grid_hierarchy& u2LPT,
+							 bool with_source, bool kspace2LPT, unsigned grad_order )
+{
+	if( ckpt.load( stage+"_potential", u2LPT ) && (!with_source || ckpt.load( stage+"_source", f2LPT )) )
+		return 0.0;
+
+	LOGINFO("Computing 2LPT term....");
+	if( !kspace2LPT )
+		compute_2LPT_source( u1, f2LPT, grad_order );
+	else
+	{
+		LOGUSER("computing term using FFT");
+		compute_2LPT_source_FFT( cf, u1, f2LPT );
+	}
+
+	LOGINFO("Solving 2LPT Poisson equation");
+	u2LPT = u1;	u2LPT.zero();
+	double err = solver->solve( f2LPT, u2LPT );
+
+	if( with_source )
+		ckpt.save( stage+"_source", f2LPT );
+	ckpt.save( stage+"_potential", u2LPT );
+	return err;
+}
+
+//! compute one component of the gradient of a potential, or restore it from a checkpoint
+/*! @param f the density for the hybrid scheme, which takes the finest level from it, NULL otherwise
+ *  @param vfact factor converting to velocities, 0 for displacements
+ *  @param what the particles named in the log message, NULL for none
+ */
+void compute_gradient( checkpoint& ckpt, const std::string& stage, int icoord, poisson_plugin *solver,
+					   const refinement_hierarchy& rh_Poisson, grid_hierarchy *f, grid_hierarchy& u,
+					   grid_hierarchy& data_forIO, unsigned grad_order, bool decic, double vfact, const char *what )
+{
+	data_forIO = u;
 	
-	unsigned lbase, lmax, lbaseTF;
-	double   err = 1.0;
+	if( ckpt.load( checkpoint::component(stage,icoord), data_forIO ) )
+		return;
 	
-	//------------------------------------------------------------------------------
-	//... parse command line options
-	//------------------------------------------------------------------------------
+	if( f != NULL )
+	{
+		data_forIO.zero();
+		*data_forIO.writable(data_forIO.levelmax()) = *f->get_grid(f->levelmax());
+		poisson_hybrid(*data_forIO.get_grid(data_forIO.levelmax()), icoord, grad_order,
+					   data_forIO.levelmin()==data_forIO.levelmax(), decic );
+		*data_forIO.get_grid(data_forIO.levelmax()) /= 1<<f->levelmax();
+		solver->gradient_add(icoord, u, data_forIO );
+	}
+	else
+		solver->gradient(icoord, u, data_forIO );
 	
-	splash();
-	if( argc != 2 ){
-		std::cout << " This version is compiled with the following plug-ins:\n";
+	if( vfact > 0.0 )
+	{
+		//... multiply to get velocity
+		data_forIO *= vfact;
 		
-		print_region_generator_plugins();
-		print_transfer_function_plugins();
-		print_RNG_plugins();
-		print_output_plugins();
+		if( what != NULL )
+		{
+			double sigv = compute_finest_sigma( data_forIO );
+			LOGINFO("sigma of %c-velocity of %s is %f",'x'+icoord, what, sigv);
+		}
+	}
+	else if( what != NULL )
+	{
+		double dispmax = compute_finest_max( data_forIO );
+		LOGINFO("max. %c-displacement of %s is %f [mean dx]",'x'+icoord, what, dispmax*(double)(1ll<<data_forIO.levelmax()));
+	}
+	
+	coarsen_density( rh_Poisson, data_forIO, false );
+	ckpt.save( checkpoint::component(stage,icoord), data_forIO );
+}
+
+//! turn a displacement component into a velocity component in place, or restore it from a checkpoint
+/*! the velocities of a potential are its displacements times vfact, this
+ *  saves a second gradient of the same potential
+ *  @param what the particles named in the log message
+ */
+void derive_velocity( checkpoint& ckpt, const std::string& stage, int icoord, grid_hierarchy& data_forIO,
+					  double vfact, const char *what )
+{
+	if( ckpt.load( checkpoint::component(stage,icoord), data_forIO ) )
+		return;
+	
+	data_forIO *= vfact;
+	
+	double sigv = compute_finest_sigma( data_forIO );
+	LOGINFO("sigma of %c-velocity of %s is %f",'x'+icoord, what, sigv);
+	
+	ckpt.save( checkpoint::component(stage,icoord), data_forIO );
+}
+
+//! total of a list of scratch parts
+size_t scratch_bytes( const memory_plan::scratch_list& s )
+{
+	size_t n = 0;
+	for( size_t i=0; i<s.size(); ++i )
+		n += s[i].second;
+	return n;
+}
+
+//! build the memory plan of the main driver branching tree
+/*! this mirrors the stages of the driver in main() and needs to be kept
+ *  in sync with it. Scratch sizes are upper bounds of the temporaries
+ *  allocated inside the density convolution, the Poisson solvers, the
+ *  2LPT source term and the output plug-in.
+ */
+memory_plan plan_driver_memory( const refinement_hierarchy& rh_Poisson, const refinement_hierarchy& rh_TF,
+								unsigned nbnd, const driver_options& opt )
+{
+	typedef std::vector<std::string> names;
+	typedef memory_plan::scratch_list scratch_list;
+	memory_plan plan;
+	
+	size_t nhier = grid_hierarchy_bytes( rh_Poisson, nbnd );
+	unsigned lmin = rh_Poisson.levelmin(), lmax = rh_Poisson.levelmax();
+	
+	//... density convolution: top grid, coarse and fine padded subgrids, FFT interpolation
+	unsigned lminTF = rh_TF.levelmin();
+	size_t nbase = (size_t)1<<lminTF;
+	size_t ntop = fft_array_bytes( nbase, nbase, nbase );
+	size_t nconv = ntop, nkern = opt.kspace_TF? 0 : ntop, nprev = ntop;
+	
+	for( unsigned ilevel=lminTF+1; ilevel<=rh_TF.levelmax(); ++ilevel )
+	{
+		size_t nx = rh_TF.size(ilevel,0), ny = rh_TF.size(ilevel,1), nz = rh_TF.size(ilevel,2);
+		size_t nfine = fft_array_bytes( 2*nx, 2*ny, 2*nz );
+		size_t ngrids = nprev + 2*nfine + fft_array_bytes( nx, ny, nz );
+		size_t nk = opt.kspace_TF? 0 : nfine;
+		if( ngrids+nk > nconv+nkern )
+		{
+			nconv = ngrids;
+			nkern = nk;
+		}
+		nprev = nfine;
+	}
+	
+	scratch_list sdens;
+	sdens.push_back( std::make_pair( std::string("convolution grids"), nconv ) );
+	sdens.push_back( std::make_pair( std::string("convolution kernel"), nkern ) );
+	
+	//... white noise memory cache, released level by level during the first convolution
+	size_t nwnoise = 0;
+	if( opt.wnoise_in_memory )
+	{
+		nwnoise = nbase*nbase*nbase*sizeof(real_t);
+		for( unsigned ilevel=lminTF+1; ilevel<=rh_TF.levelmax(); ++ilevel )
+			nwnoise += 8*rh_TF.size(ilevel,0)*rh_TF.size(ilevel,1)*rh_TF.size(ilevel,2)*sizeof(real_t);
+	}
+	
+	//... Poisson solver: the FFT solver needs one array, the multigrid V-cycle keeps a
+	//... copy of every coarser level plus two temporaries on the next coarser level
+	scratch_list ssolve;
+	size_t ntopP = (size_t)1<<lmin;
+	size_t nsolve = 0;
+	if( opt.kspace )
+	{
+		nsolve = fft_array_bytes( ntopP, ntopP, ntopP );
+		ssolve.push_back( std::make_pair( std::string("Poisson FFT"), nsolve ) );
+	}
+	else if( lmax > 0 )
+	{
+		size_t nmg = 2*grid_level_bytes( rh_Poisson, lmax-1, nbnd );
+		for( unsigned ilevel=0; ilevel<lmax; ++ilevel )
+			nmg += grid_level_bytes( rh_Poisson, ilevel, nbnd );
+		ssolve.push_back( std::make_pair( std::string("multigrid V-cycle"), nmg ) );
+	}
+	
+	//... gradient: the hybrid solver pads the finest level unless it is periodic
+	scratch_list sgrad;
+	if( opt.bdefd )
+	{
+		size_t nmax = std::max( rh_Poisson.size(lmax,0), std::max( rh_Poisson.size(lmax,1), rh_Poisson.size(lmax,2) ) );
+		size_t np = (lmin==lmax)? nmax : 2*nmax;
+		sgrad.push_back( std::make_pair( std::string("hybrid gradient FFT"), np*np*(np+2)*sizeof(fftw_real) ) );
+	}
+	else if( opt.kspace )
+		sgrad.push_back( std::make_pair( std::string("gradient FFT"), nsolve ) );
+	sgrad.push_back( std::make_pair( std::string("output buffer"), opt.output_buffer_bytes ) );
+	
+	//... 2LPT source term in Fourier space: six tensor components plus the transform
+	scratch_list s2LPT;
+	if( opt.kspace2LPT )
+		s2LPT.push_back( std::make_pair( std::string("2LPT source FFTs"),
+			7*fft_array_bytes( rh_Poisson.size(lmax,0), rh_Poisson.size(lmax,1), rh_Poisson.size(lmax,2) ) ) );
+	
+	names none, fb;
+	if( opt.bdefd )
+		fb.push_back("f");
+	
+	//... concatenate two lists of buffer names
+	struct cat {
+		static names of( names a, const names& b )
+		{	a.insert( a.end(), b.begin(), b.end() ); return a;	}
+	};
+	
+	bool bwnoise = (nwnoise > 0);
+	if( bwnoise )
+		plan.add_buffer( "white noise", nwnoise );
+	
+	names first_density = bwnoise? names{"f","white noise"} : names{"f"};
+	
+	if( !opt.do_2LPT )
+	{
+		plan.add_buffer( "f", nhier );
+		plan.add_buffer( "u", nhier );
+		plan.add_buffer( "data_forIO", nhier );
 		
-		std::cerr << "\n In order to run, you need to specify a parameter file!\n\n";
-		exit(0);
+		plan.add_stage( "DM density", first_density, none, sdens );
+		plan.add_stage( "DM potential", {"f","u"}, none, ssolve );
+		
+		//... the displacement components are kept to derive the velocities from them
+		if( opt.grad_reuse )
+		{
+			plan.add_buffer( "displacements", 3*nhier );
+			plan.add_stage( "DM displacements", cat::of({"u","displacements"},fb), none, sgrad );
+			
+			scratch_list sout;
+			sout.push_back( std::make_pair( std::string("output buffer"), opt.output_buffer_bytes ) );
+			plan.add_stage( "velocities", {"displacements"}, none, sout );
+			return plan;
+		}
+		
+		plan.add_stage( "DM displacements", cat::of({"u","data_forIO"},fb), none, sgrad );
+		
+		if( opt.do_baryons )
+		{
+			plan.add_stage( "baryon density", {"f"}, none, sdens );
+			if( opt.bsph )
+			{
+				plan.add_stage( "baryon potential", {"f","u"}, none, ssolve );
+				plan.add_stage( "baryon displacements", cat::of({"u","data_forIO"},fb), none, sgrad );
+			}
+			else if( opt.do_LLA )
+				plan.add_stage( "baryon LLA density", {"f","u"}, none, ssolve );
+		}
+		
+		if( (!opt.tf_has_velocities || !opt.do_baryons) && !opt.bsph )
+		{
+			if( opt.do_baryons || opt.tf_has_velocities )
+			{
+				plan.add_stage( "velocity density", {"f"}, none, sdens );
+				plan.add_stage( "velocity potential", {"f","u"}, none, ssolve );
+			}
+			plan.add_stage( "velocities", cat::of({"u","data_forIO"},fb), none, sgrad );
+		}
+		else
+		{
+			plan.add_stage( "DM velocity density", {"f"}, none, sdens );
+			plan.add_stage( "DM velocity potential", {"f","u"}, none, ssolve );
+			plan.add_stage( "DM velocities", cat::of({"u","data_forIO"},fb), none, sgrad );
+			plan.add_stage( "baryon velocity density", {"f"}, none, sdens );
+			plan.add_stage( "baryon velocity potential", {"f","u"}, none, ssolve );
+			plan.add_stage( "baryon velocities", cat::of({"u","data_forIO"},fb), none, sgrad );
+		}
+		
+		return plan;
 	}
 	
-	//------------------------------------------------------------------------------
-	//... open log file
-	//------------------------------------------------------------------------------
+	bool dm_only = !opt.do_baryons;
+	bool reuse = dm_only && opt.lpt_reuse == lpt_reuse_memory;
+	
+	plan.add_buffer( "f", nhier );
+	plan.add_buffer( "u1", nhier );
+	plan.add_buffer( "u2LPT", nhier, true );
+	plan.add_buffer( "f2LPT", nhier, true );
+	plan.add_buffer( "data_forIO", nhier );
+	
+	//... the 1LPT and 2LPT potentials for one component
+	struct lpt {
+		static void stages( memory_plan& plan, const std::string& what, const names& density, const names& fb,
+						   const scratch_list& sdens, const scratch_list& ssolve, const scratch_list& s2LPT )
+		{
+			plan.add_stage( what+" density", density, names(), sdens );
+			plan.add_stage( what+" 1LPT potential", {"f","u1"}, names(), ssolve );
+			plan.add_stage( what+" 2LPT source", {"u1","f2LPT"}, fb, s2LPT );
+			plan.add_stage( what+" 2LPT potential", {"f2LPT","u2LPT"}, cat::of({"u1"},fb), ssolve );
+		}
+	};
+	
+	names held;
+	if( reuse )
+	{
+		held.push_back("u2LPT");
+		if( opt.bdefd )
+			held.push_back("f2LPT");
+	}
+	
+	lpt::stages( plan, "velocity", first_density, fb, sdens, ssolve, s2LPT );
+	plan.add_stage( "velocities", cat::of({"u1","data_forIO"},fb), held, sgrad );
+	
+	if( opt.do_baryons && (opt.tf_has_velocities || opt.bsph) )
+	{
+		lpt::stages( plan, "baryon velocity", {"f"}, fb, sdens, ssolve, s2LPT );
+		plan.add_stage( "baryon velocities", cat::of({"u1","data_forIO"},fb), none, sgrad );
+	}
+	
+	if( reuse )
+		plan.add_stage( "DM displacement 2LPT reuse", cat::of({"u1"},held), fb );
+	else
+		lpt::stages( plan, "DM displacement", {"f"}, fb, sdens, ssolve, s2LPT );
+	plan.add_stage( "DM displacements", cat::of({"u1","data_forIO"},fb), none, sgrad );
+	
+	if( opt.do_baryons && !opt.bsph )
+	{
+		plan.add_stage( "baryon density", {"f"}, none, sdens );
+		if( opt.do_LLA )
+			plan.add_stage( "baryon LLA density", {"f","u1","f2LPT","u2LPT"}, none,
+							(scratch_bytes(ssolve) > scratch_bytes(s2LPT))? ssolve : s2LPT );
+	}
+	else if( opt.do_baryons && opt.bsph )
+	{
+		lpt::stages( plan, "baryon displacement", {"f"}, fb, sdens, ssolve, s2LPT );
+		plan.add_stage( "baryon displacements", cat::of({"u1","data_forIO"},fb), none, sgrad );
+	}
+	
+	return plan;
+}
+
+//! choose a driver configuration whose memory plan fits the memory cap
+/*! the candidates are tried in order: the configuration as given, recomputing
+ *  instead of keeping the 2LPT terms, and then staging to disk (white noise
+ *  cache and held 2LPT terms). Throws if nothing fits, so that the run stops
+ *  before any work is done.
+ */
+memory_plan select_memory_plan( const refinement_hierarchy& rh_Poisson, const refinement_hierarchy& rh_TF,
+								unsigned nbnd, driver_options& opt, size_t max_bytes )
+{
+	memory_plan plan = plan_driver_memory( rh_Poisson, rh_TF, nbnd, opt );
+	
+	if( max_bytes == 0 || plan.peak_bytes() <= max_bytes )
+		return plan;
+	
+	LOGINFO("Estimated peak memory of %.2f GB exceeds the cap of %.2f GB, trying to reorder...",
+			(double)plan.peak_bytes()/1024.0/1024.0/1024.0, (double)max_bytes/1024.0/1024.0/1024.0 );
+	
+	driver_options optc = opt;
+	
+	//... computing the velocity gradients again needs less memory than keeping the displacements
+	if( optc.grad_reuse )
+	{
+		optc.grad_reuse = false;
+		plan = plan_driver_memory( rh_Poisson, rh_TF, nbnd, optc );
+		
+		if( plan.peak_bytes() <= max_bytes )
+		{
+			opt = optc;
+			return plan;
+		}
+	}
+	
+	for( int istaging=0; istaging<2; ++istaging )
+	{
+		for( int imode=0; imode<2; ++imode )
+		{
+			optc.lpt_reuse = (imode==0)? lpt_reuse_memory : lpt_reuse_recompute;
+			if( istaging )
+				optc.wnoise_in_memory = false;
+			
+			plan = plan_driver_memory( rh_Poisson, rh_TF, nbnd, optc );
+			
+			if( (istaging && plan.stage_to_fit( max_bytes )) || plan.peak_bytes() <= max_bytes )
+			{
+				opt = optc;
+				return plan;
+			}
+		}
+	}
+	
+	plan.log();
+	LOGERR("Estimated peak memory of %.2f GB exceeds the memory cap of %.2f GB.",
+		   (double)plan.peak_bytes()/1024.0/1024.0/1024.0, (double)max_bytes/1024.0/1024.0/1024.0 );
+	throw std::runtime_error("Estimated peak memory exceeds the memory cap");
+}
+
+//! number of particles contributed by a level, i.e. its cells that are not refined further
+size_t level_particle_count( const refinement_hierarchy& rh, unsigned ilevel )
+{
+	size_t n = rh.size(ilevel,0)*rh.size(ilevel,1)*rh.size(ilevel,2);
+	
+	if( ilevel < rh.levelmax() )
+		n -= (rh.size(ilevel+1,0)/2)*(rh.size(ilevel+1,1)/2)*(rh.size(ilevel+1,2)/2);
+	
+	return n;
+}
+
+//! number of particles of all levels
+size_t total_particle_count( const refinement_hierarchy& rh )
+{
+	size_t n = 0;
+	for( unsigned ilevel=rh.levelmin(); ilevel<=rh.levelmax(); ++ilevel )
+		n += level_particle_count( rh, ilevel );
+	return n;
+}
+
+//! number of files the output plug-ins split the particles into, the largest of all formats
+unsigned output_file_count( config_file& cf )
+{
+	std::vector<std::string> formats = get_output_formats( cf );
+	unsigned nfiles = 1;
+	
+	for( size_t i=0; i<formats.size(); ++i )
+	{
+		if( formats[i] == "arepo" )
+			nfiles = std::max( nfiles, cf.getValueSafe<unsigned>( "output", "arepo_num_files", 1 ) );
+		if( formats[i].compare( 0, 6, "gadget" ) == 0 )
+			nfiles = std::max( nfiles, cf.getValueSafe<unsigned>( "output", "gadget_num_files", 1 ) );
+	}
+	
+	return nfiles;
+}
+
+//! estimate of the buffer the output plug-ins need to write one particle component
+/*! the gadget plug-ins stream in blocks of gadget_blksize particles through
+ *  three buffers, the others convert one component of all particles at once.
+ *  When several formats are written, their plug-ins run concurrently.
+ */
+size_t output_buffer_estimate( config_file& cf, size_t npart )
+{
+	std::vector<std::string> formats = get_output_formats( cf );
+	size_t nbytes = 0;
+	
+	for( size_t i=0; i<formats.size(); ++i )
+	{
+		if( formats[i].compare( 0, 6, "gadget" ) == 0 )
+		{
+			size_t nblk = cf.getValueSafe<unsigned>( "output", "gadget_blksize", 1048576 );
+			nbytes += 3*std::min( nblk, npart )*sizeof(float);
+		}
+		else
+			nbytes += npart*sizeof(float);
+	}
+	
+	return nbytes;
+}
+
+//! print the resources a run needs without allocating any of them
+/*! lists the FFT sizes, the particle counts per level and per output file,
+ *  and the memory of every stage of the plan broken down into its buffers
+ *  and temporaries
+ */
+void print_resource_estimate( config_file& cf, const refinement_hierarchy& rh_Poisson, const refinement_hierarchy& rh_TF,
+							  const driver_options& opt, const memory_plan& plan )
+{
+	unsigned lmin = rh_Poisson.levelmin(), lmax = rh_Poisson.levelmax();
+	
+	std::cout << "=============================================================\n";
+	std::cout << "   RESOURCE ESTIMATE (DRY RUN)\n";
+	std::cout << "-------------------------------------------------------------\n";
+	
+	//... FFT sizes
+	std::cout << " - FFT sizes:\n";
+	
+	size_t nbase = (size_t)1<<rh_TF.levelmin();
+	std::cout << "     convolution level " << std::setw(3) << rh_TF.levelmin() << "   : "
+			  << std::setw(6) << nbase << " x " << std::setw(6) << nbase << " x " << std::setw(6) << nbase << "\n";
+	for( unsigned ilevel=rh_TF.levelmin()+1; ilevel<=rh_TF.levelmax(); ++ilevel )
+		std::cout << "     convolution level " << std::setw(3) << ilevel << "   : "
+				  << std::setw(6) << 2*rh_TF.size(ilevel,0) << " x " << std::setw(6) << 2*rh_TF.size(ilevel,1)
+				  << " x " << std::setw(6) << 2*rh_TF.size(ilevel,2) << "  (padded)\n";
+	
+	if( opt.kspace )
+		std::cout << "     Poisson solver          : "
+				  << std::setw(6) << (1<<lmin) << " x " << std::setw(6) << (1<<lmin) << " x " << std::setw(6) << (1<<lmin) << "\n";
+	
+	if( opt.bdefd )
+	{
+		size_t nmax = std::max( rh_Poisson.size(lmax,0), std::max( rh_Poisson.size(lmax,1), rh_Poisson.size(lmax,2) ) );
+		size_t np = (lmin==lmax)? nmax : 2*nmax;
+		std::cout << "     hybrid gradient         : "
+				  << std::setw(6) << np << " x " << std::setw(6) << np << " x " << std::setw(6) << np << "  (padded)\n";
+	}
+	
+	if( opt.do_2LPT && opt.kspace2LPT )
+		std::cout << "     2LPT source (7 arrays)  : "
+				  << std::setw(6) << rh_Poisson.size(lmax,0) << " x " << std::setw(6) << rh_Poisson.size(lmax,1)
+				  << " x " << std::setw(6) << rh_Poisson.size(lmax,2) << "\n";
+	
+	//... particle counts
+	size_t npart = total_particle_count( rh_Poisson );
+	size_t ngas = opt.bsph? rh_Poisson.size(lmax,0)*rh_Poisson.size(lmax,1)*rh_Poisson.size(lmax,2) : 0;
+	unsigned nfiles = output_file_count( cf );
+	
+	std::cout << " - Particles:\n";
+	for( unsigned ilevel=lmin; ilevel<=lmax; ++ilevel )
+		std::cout << "     Level " << std::setw(3) << ilevel << " :   " << std::setw(14) << level_particle_count( rh_Poisson, ilevel ) << "\n";
+	if( ngas > 0 )
+		std::cout << "     gas       :   " << std::setw(14) << ngas << "\n";
+	std::cout << "     total     :   " << std::setw(14) << npart+ngas << "  in " << nfiles << " file(s), "
+			  << (npart+ngas+nfiles-1)/nfiles << " per file\n";
+	std::streamsize prec = std::cout.precision();
+	std::cout << " - Output buffer : " << std::fixed << std::setprecision(2)
+			  << (double)opt.output_buffer_bytes/1024.0/1024.0 << " MB\n";
+	std::cout.unsetf( std::ios::floatfield );
+	std::cout.precision( prec );
+	
+	//... memory of every stage
+	plan.print( true );
+	
+	LOGUSER("Dry run: %ld particles in %d file(s), peak memory estimate %.2f GB",
+			(long)(npart+ngas), nfiles, (double)plan.peak_bytes()/1024.0/1024.0/1024.0 );
+}
+
+
+
+
+/*****************************************************************************************************/
+/*****************************************************************************************************/
+/*****************************************************************************************************/
+
+region_generator_plugin *the_region_generator;
+RNG_plugin *the_random_number_generator;
 
+//! open the log file <name>_log.txt and write the build configuration to it
+void MUSIC::open_log( const std::string& name )
+{
 	char logfname[128];
-	sprintf(logfname,"%s_log.txt",argv[1]);
+	sprintf(logfname,"%s_log.txt",name.c_str());
 	MUSIC::log::setOutput(logfname);
 	time_t ltime=time(NULL);
 	LOGINFO("Opening log file \'%s\'.",logfname);
@@ -341,13 +971,38 @@ int main (int argc, const char * argv[])
 #else
 	LOGUSER("Code was compiled for double precision.");
 #endif
+}
+
+//! deletes the region and random number generator plug-ins when run() returns
+//! or throws, so that repeated calls through libmusic do not leak them
+struct global_plugin_guard
+{
+	~global_plugin_guard()
+	{
+		delete the_random_number_generator;
+		the_random_number_generator = NULL;
+		delete the_region_generator;
+		the_region_generator = NULL;
+	}
+};
+
+//! run the driver on a configuration, see libmusic.hh
+int MUSIC::run( config_file& cf, const std::string& paramfile, bool bdry_run, const output_plugin_creator *pcreator )
+{
+	const unsigned nbnd = 4;
+	
+	unsigned lbase, lmax, lbaseTF;
+	double   err = 1.0;
 	
+	std::string tfname,randfname,temp;
 	
 	//------------------------------------------------------------------------------
-	//... read and interpret config file
+	//... start tracing the phases of the run
 	//------------------------------------------------------------------------------
-	config_file cf(argv[1]);
-	std::string tfname,randfname,temp;
+	
+	MUSIC::trace::enable( cf.getValueSafe<bool>( "trace", "enabled", false ) );
+	std::string tracefname = cf.getValueSafe<std::string>( "trace", "filename", std::string(paramfile)+"_trace.json" );
+	MUSIC::trace_scope phase("setup");
 	bool force_shift(false);
 	double boxlength;
 	
@@ -385,6 +1040,12 @@ int main (int argc, const char * argv[])
 	else
 	  LOGINFO("Using real space sampled transfer functions...");
 		
+	//------------------------------------------------------------------------------
+	//... initialize field memory allocation (before any grid is allocated)
+	//------------------------------------------------------------------------------
+	
+	mem_alloc_init( cf );
+	
 	//------------------------------------------------------------------------------
 	//... initialize multithread FFTW
 	//------------------------------------------------------------------------------
@@ -394,9 +1055,11 @@ int main (int argc, const char * argv[])
 	#ifdef SINGLE_PRECISION
 	fftwf_init_threads();
 	fftwf_plan_with_nthreads(omp_get_max_threads());
+	fftwf_make_planner_thread_safe();
 	#else
 	fftw_init_threads();
 	fftw_plan_with_nthreads(omp_get_max_threads());
+	fftw_make_planner_thread_safe();
 	#endif
 #else
 	fftw_threads_init();
@@ -451,6 +1114,7 @@ int main (int argc, const char * argv[])
 		
 	}
 	
+    global_plugin_guard plugin_guard;
     the_region_generator = select_region_generator_plugin( cf );
   
     the_random_number_generator = select_RNG_plugin( cf );
@@ -484,23 +1148,6 @@ int main (int argc, const char * argv[])
 	LOGUSER("Grid structure for density convolution:");
 	rh_TF.output_log();
 	
-	//------------------------------------------------------------------------------
-	//... initialize the output plug-in
-	//------------------------------------------------------------------------------
-	std::string outformat, outfname;
-	outformat			= cf.getValue<std::string>( "output", "format" );
-	outfname			= cf.getValue<std::string>( "output", "filename" );
-	output_plugin *the_output_plugin = select_output_plugin( cf );
-	
-	//------------------------------------------------------------------------------
-	//... initialize the random numbers
-	//------------------------------------------------------------------------------
-	std::cout << "=============================================================\n";
-	std::cout << "   GENERATING WHITE NOISE\n";
-	std::cout << "-------------------------------------------------------------\n";
-	LOGUSER("Computing white noise...");
-	rand_gen rand( cf, rh_TF, the_transfer_function_plugin );
-	
 	//------------------------------------------------------------------------------
 	//... initialize the Poisson solver
 	//------------------------------------------------------------------------------
@@ -540,743 +1187,780 @@ int main (int argc, const char * argv[])
 	poisson_plugin_creator *the_poisson_plugin_creator = get_poisson_plugin_map()[ poisson_solver_name ];
 	poisson_plugin *the_poisson_solver = the_poisson_plugin_creator->create( cf );
 	
-	//---------------------------------------------------------------------------------
-	//... THIS IS THE MAIN DRIVER BRANCHING TREE RUNNING THE VARIOUS PARTS OF THE CODE
-	//---------------------------------------------------------------------------------
+	//------------------------------------------------------------------------------
+	//... plan the memory usage of the run
+	//------------------------------------------------------------------------------
+	driver_options dopt;
+	dopt.do_baryons = do_baryons;
+	dopt.do_2LPT = do_2LPT;
+	dopt.do_LLA = do_LLA;
+	dopt.bdefd = bdefd;
+	dopt.bsph = bsph;
+	dopt.kspace = kspace;
+	dopt.kspace2LPT = kspace2LPT;
+	dopt.kspace_TF = bspectral_sampling;
+	dopt.tf_has_velocities = the_transfer_function_plugin->tf_has_velocities();
+	dopt.tf_is_distinct = the_transfer_function_plugin->tf_is_distinct();
+	dopt.wnoise_in_memory = !cf.getValueSafe<bool>("random","disk_cached",true);
+	dopt.lpt_reuse = lpt_reuse_memory;
+	//... without baryons or velocity transfer functions, 1LPT velocities and displacements
+	//... are gradients of the same potential. The hybrid scheme deconvolves them alike only
+	//... without glass CIC deconvolution
+	dopt.grad_reuse = !do_2LPT && !do_baryons && !dopt.tf_has_velocities && (!bdefd || decic_DM == decic_baryons);
+	dopt.output_buffer_bytes = output_buffer_estimate( cf, total_particle_count( rh_Poisson ) );
+	
+	memory_plan mplan = select_memory_plan( rh_Poisson, rh_TF, nbnd, dopt, mem_alloc_get_settings().max_bytes );
+	if( !bdry_run )
+		mplan.print();
+	mplan.log();
+	
+	if( !dopt.wnoise_in_memory && !cf.getValueSafe<bool>("random","disk_cached",true) )
+	{
+		LOGINFO("Memory plan: caching white noise on disk to fit the memory cap");
+		cf.insertValue("random","disk_cached","yes");
+	}
+	if( dopt.lpt_reuse == lpt_reuse_recompute )
+		LOGINFO("Memory plan: recomputing 2LPT displacements instead of keeping them in memory");
+	if( dopt.grad_reuse )
+		LOGINFO("Memory plan: deriving the velocities from the displacements");
+	
+	//------------------------------------------------------------------------------
+	//... number of driver tasks running at the same time, see task_graph.hh.
+	//... Concurrent FFT planning needs the thread-safe planner of FFTW 3.3.5+
+	//------------------------------------------------------------------------------
+#if defined(FFTW3) and not defined(SINGLETHREAD_FFTW)
+	unsigned max_tasks = cf.getValueSafe<unsigned>( "scheduler", "max_tasks", 2 );
+#else
+	unsigned max_tasks = 1;
+#endif
+	LOGINFO("Running up to %d driver tasks at the same time",max_tasks);
+	
+	//------------------------------------------------------------------------------
+	//... in a dry run, report the estimate and stop before anything is allocated
+	//------------------------------------------------------------------------------
+	if( bdry_run )
+	{
+		print_resource_estimate( cf, rh_Poisson, rh_TF, dopt, mplan );
+		std::cout << "=============================================================\n";
+		std::cout << " - Dry run, no output written." << std::endl << std::endl;
+		LOGUSER("Dry run finished, no output written.");
+		
+		delete the_transfer_function_plugin;
+		delete the_poisson_solver;
+		
+#if defined(FFTW3) and not defined(SINGLETHREAD_FFTW)
+	#ifdef SINGLE_PRECISION
+		fftwf_cleanup_threads();
+	#else
+		fftw_cleanup_threads();
+	#endif
+#endif
+		
+		cf.log_dump();
+		return 0;
+	}
+	
+	//------------------------------------------------------------------------------
+	//... an ensemble varies the seed of the coarsest seeded level, everything
+	//... computed up to here does not depend on it and is shared by all members
+	//------------------------------------------------------------------------------
+	std::vector<long> ensemble_seeds;
+	std::string ensemble_seedkey, ensemble_fnames, ensemble_ckptdir;
+	
+	if( cf.containsKey( "random", "ensemble_seeds" ) )
+	{
+		ensemble_seeds = parse_ensemble_seeds( cf.getValue<std::string>( "random", "ensemble_seeds" ) );
+		ensemble_seedkey = ensemble_seed_key( cf );
+		ensemble_fnames = cf.getValue<std::string>( "output", "filename" );
+		ensemble_ckptdir = cf.getValueSafe<std::string>( "checkpoint", "directory", std::string(paramfile)+"_checkpoint" );
+		keep_tf_kernels( true );
+		
+		std::cout << " - Ensemble of " << ensemble_seeds.size() << " realizations varying [random] " << ensemble_seedkey << std::endl;
+		LOGUSER("Ensemble of %d realizations varying [random] %s.",(int)ensemble_seeds.size(),ensemble_seedkey.c_str());
+	}
+	
 	bool bfatal = false;
-	try{
-		if( ! do_2LPT )
+	size_t nmembers = std::max( (size_t)1, ensemble_seeds.size() );
+	
+	for( size_t imember=0; imember<nmembers && !bfatal; ++imember )
+	{
+		if( ensemble_seeds.size() > 0 )
 		{
-			LOGUSER("Entering 1LPT branch");
+			char seedstr[32];
+			sprintf( seedstr, "%ld", ensemble_seeds[imember] );
+			cf.insertValue( "random", ensemble_seedkey, seedstr );
+			cf.insertValue( "output", "filename", ensemble_filename( ensemble_fnames, ensemble_seeds[imember] ) );
+			cf.insertValue( "checkpoint", "directory", ensemble_ckptdir+"_"+seedstr );
 			
-			//------------------------------------------------------------------------------
-			//... cdm density and displacements
-			//------------------------------------------------------------------------------
 			std::cout << "=============================================================\n";
-			std::cout << "   COMPUTING DARK MATTER DISPLACEMENTS\n";
-			std::cout << "-------------------------------------------------------------\n";
-			LOGUSER("Computing dark matter displacements...");
-			
-			grid_hierarchy f( nbnd );//, u(nbnd);
-			tf_type my_tf_type = cdm;
-			if( !do_baryons || !the_transfer_function_plugin->tf_is_distinct() )
-				my_tf_type = total;
-			
-			
-			GenerateDensityHierarchy(	cf, the_transfer_function_plugin, my_tf_type , rh_TF, rand, f, false, false );
-			coarsen_density(rh_Poisson, f, bspectral_sampling);
-            f.add_refinement_mask( rh_Poisson.get_coord_shift() );
-            
-			normalize_density(f);
-			
-			LOGUSER("Writing CDM data");
-			the_output_plugin->write_dm_mass(f);
-			the_output_plugin->write_dm_density(f);
-			
-			grid_hierarchy u( f );	u.zero();
-			err = the_poisson_solver->solve(f, u);
-			
-			if(!bdefd)
-				f.deallocate();	
-			
-			LOGUSER("Writing CDM potential");
-			the_output_plugin->write_dm_potential(u);
-			
-			
-			//------------------------------------------------------------------------------
-			//... DM displacements
-			//------------------------------------------------------------------------------
+			std::cout << "   ENSEMBLE MEMBER " << imember+1 << " OF " << nmembers << " (SEED " << seedstr << ")\n";
+			LOGUSER("Ensemble member %d of %d with seed %s",(int)imember+1,(int)nmembers,seedstr);
+		}
+		
+		//------------------------------------------------------------------------------
+		//... initialize the output plug-in
+		//------------------------------------------------------------------------------
+		std::string outformat, outfname;
+		outformat			= cf.getValue<std::string>( "output", "format" );
+		outfname			= cf.getValue<std::string>( "output", "filename" );
+		output_plugin *the_output_plugin = pcreator? pcreator->create( cf ) : select_output_plugin( cf );
+	
+		//------------------------------------------------------------------------------
+		//... pick up the stages completed by a previous run
+		//------------------------------------------------------------------------------
+		checkpoint ckpt( cf, paramfile );
+	
+		//------------------------------------------------------------------------------
+		//... initialize the random numbers
+		//------------------------------------------------------------------------------
+		std::cout << "=============================================================\n";
+		std::cout << "   GENERATING WHITE NOISE\n";
+		std::cout << "-------------------------------------------------------------\n";
+		LOGUSER("Computing white noise...");
+		phase.next("white noise");
+		rand_gen rand( cf, rh_TF, the_transfer_function_plugin );
+	
+		//---------------------------------------------------------------------------------
+		//... THIS IS THE MAIN DRIVER BRANCHING TREE RUNNING THE VARIOUS PARTS OF THE CODE
+		//---------------------------------------------------------------------------------
+		try{
+			if( ! do_2LPT )
 			{
-				grid_hierarchy data_forIO(u);
-				for( int icoord = 0; icoord < 3; ++icoord )
-				{
-					if( bdefd )
-					{
-						data_forIO.zero();
-						*data_forIO.get_grid(data_forIO.levelmax()) = *f.get_grid(f.levelmax());
-						poisson_hybrid(*data_forIO.get_grid(data_forIO.levelmax()), icoord, grad_order,
-							       data_forIO.levelmin()==data_forIO.levelmax(), decic_DM );					
-						*data_forIO.get_grid(data_forIO.levelmax()) /= 1<<f.levelmax();
-						the_poisson_solver->gradient_add(icoord, u, data_forIO );
-						
-					}
-					else
-						//... displacement
-					        the_poisson_solver->gradient(icoord, u, data_forIO );
-					double dispmax = compute_finest_max( data_forIO );
-					LOGINFO("max. %c-displacement of HR particles is %f [mean dx]",'x'+icoord, dispmax*(double)(1ll<<data_forIO.levelmax()));
-					coarsen_density( rh_Poisson, data_forIO, false );
-					LOGUSER("Writing CDM displacements");
-					the_output_plugin->write_dm_position(icoord, data_forIO );
-				}
-				if( do_baryons )
-					u.deallocate();
-				data_forIO.deallocate();
-			}
+				LOGUSER("Entering 1LPT branch");
+				phase.next("1LPT task graph");
 			
-			
-			//------------------------------------------------------------------------------
-			//... gas density
-			//------------------------------------------------------------------------------
-			if( do_baryons )
-			{
-				std::cout << "=============================================================\n";
-				std::cout << "   COMPUTING BARYON DENSITY\n";
-				std::cout << "-------------------------------------------------------------\n";
-				LOGUSER("Computing baryon density...");
-				GenerateDensityHierarchy(	cf, the_transfer_function_plugin, baryon , rh_TF, rand, f, false, bbshift );
-				coarsen_density(rh_Poisson, f, bspectral_sampling);
-                f.add_refinement_mask( rh_Poisson.get_coord_shift() );
-				normalize_density(f);
+				//------------------------------------------------------------------------------
+				//... the stages of the 1LPT branch as a task graph. A field is computed as
+				//... soon as its inputs are ready, the output plug-in is called in the order
+				//... of the sequential driver. A task that modifies a hierarchy, even just
+				//... by copy-on-write detaching a shared level, waits for the tasks that
+				//... read it before. The three components of a gradient are computed one
+				//... after the other since they detach levels of the same potential.
+				//------------------------------------------------------------------------------
+				typedef std::shared_ptr<grid_hierarchy> field;
+				typedef std::vector<task_graph::task_id> deps;
 				
-				if( !do_LLA )
-				{	
-					LOGUSER("Writing baryon density");
-					the_output_plugin->write_gas_density(f);
-				}
+				task_graph graph( max_tasks, mem_alloc_get_settings().max_bytes );
+				deps out;
 				
-				if( bsph )
+				//... output tasks form a chain, so the plug-in sees the calls in order
+				auto write = [&]( const std::string& name, deps d, const std::function<void(void)>& work )
 				{
-					u = f;	u.zero();
-					err = the_poisson_solver->solve(f, u);					
-					
-					if(!bdefd)
-						f.deallocate();
-					
-					grid_hierarchy data_forIO(u);
-					for( int icoord = 0; icoord < 3; ++icoord )
-					{
-						if( bdefd )
-						{
-							data_forIO.zero();
-							*data_forIO.get_grid(data_forIO.levelmax()) = *f.get_grid(f.levelmax());
-							poisson_hybrid(*data_forIO.get_grid(data_forIO.levelmax()), icoord, grad_order, 
-								       data_forIO.levelmin()==data_forIO.levelmax(), decic_baryons);					
-							*data_forIO.get_grid(data_forIO.levelmax()) /= 1<<f.levelmax();
-							the_poisson_solver->gradient_add(icoord, u, data_forIO );
-							
-						}
-						else
-							//... displacement
-							the_poisson_solver->gradient(icoord, u, data_forIO );
-						
-						coarsen_density( rh_Poisson, data_forIO, false );
-                        LOGUSER("Writing baryon displacements");
-						the_output_plugin->write_gas_position(icoord, data_forIO );
-						
-					}	
-					u.deallocate();
-					data_forIO.deallocate();
-					if( bdefd )
-						f.deallocate();
-				}
-				else if( do_LLA )
-				{
-					u = f;	u.zero();
-					err = the_poisson_solver->solve(f, u);
-					compute_LLA_density( u, f,grad_order );
-					u.deallocate();
-					normalize_density(f);
-					LOGUSER("Writing baryon density");
-					the_output_plugin->write_gas_density(f);
-				}
+					d.insert( d.end(), out.begin(), out.end() );
+					out = deps{ graph.add( name, d, work ) };
+					return out[0];
+				};
 				
-				f.deallocate();
-			}
-			
-			
-			
-			//------------------------------------------------------------------------------
-			//... velocities
-			//------------------------------------------------------------------------------
-			if( (!the_transfer_function_plugin->tf_has_velocities() || !do_baryons) && !bsph )
-			{	
-				std::cout << "=============================================================\n";
-				std::cout << "   COMPUTING VELOCITIES\n";
-				std::cout << "-------------------------------------------------------------\n";
-				LOGUSER("Computing velocitites...");
+				auto density = [&]( const std::string& name, const std::string& stage, tf_type type, bool shift, field f )
+				{
+					return graph.add( name, deps(), [&,stage,type,shift,f]{
+						compute_density( ckpt, stage, cf, the_transfer_function_plugin, type, rh_TF, rh_Poisson, rand, *f, false, shift, bspectral_sampling );
+					}, mplan.stage_bytes( name ), "transfer function" );
+				};
 				
-				if( do_baryons || the_transfer_function_plugin->tf_has_velocities() )
+				auto potential = [&]( const std::string& name, const std::string& stage, deps d, field f, field u )
 				{
-				  LOGUSER("Generating velocity perturbations...");
-				  GenerateDensityHierarchy( cf, the_transfer_function_plugin, vtotal , rh_TF, rand, f, false, false );
-				  coarsen_density(rh_Poisson, f, bspectral_sampling);
-				  f.add_refinement_mask( rh_Poisson.get_coord_shift() );
-				  normalize_density(f);					
-				  u = f;
-				  u.zero();
-				  err = the_poisson_solver->solve(f, u);
-				  
-				  if(!bdefd)
-				    f.deallocate();
-				}
-				grid_hierarchy data_forIO(u);
-				for( int icoord = 0; icoord < 3; ++icoord )
+					return graph.add( name, d, [&,stage,f,u]{
+						solve_potential( ckpt, stage, the_poisson_solver, *f, *u );
+					}, mplan.stage_bytes( name ) );
+				};
+				
+				//... returns the task computing the last component. If kept is given, the
+				//... components and the tasks writing them are appended to it
+				typedef std::vector< std::pair<field,task_graph::task_id> > component_list;
+				
+				auto gradient = [&]( const std::string& name, const std::string& stage, deps d, field f, field u,
+									 bool decic, double vfact, const char *what, const std::function<void(int,const grid_hierarchy&)>& writer,
+									 component_list *kept = NULL )
 				{
-					//... displacement
-					if(bdefd)
+					//... the density is only needed for the hybrid scheme
+					field fhybrid = bdefd? f : field();
+					
+					for( int icoord=0; icoord<3; ++icoord )
 					{
-						data_forIO.zero();
-						*data_forIO.get_grid(data_forIO.levelmax()) = *f.get_grid(f.levelmax());
-						poisson_hybrid(*data_forIO.get_grid(data_forIO.levelmax()), icoord, grad_order, 
-							       data_forIO.levelmin()==data_forIO.levelmax(), decic_baryons );					
-						*data_forIO.get_grid(data_forIO.levelmax()) /= 1<<f.levelmax();
-						the_poisson_solver->gradient_add(icoord, u, data_forIO );
+						field data_forIO = std::make_shared<grid_hierarchy>( nbnd );
+						std::string cname = name + " " + (char)('x'+icoord);
+						
+						d = deps{ graph.add( cname, d, [&,stage,icoord,fhybrid,u,data_forIO,decic,vfact,what]{
+							compute_gradient( ckpt, stage, icoord, the_poisson_solver, rh_Poisson, fhybrid.get(), *u, *data_forIO,
+											  grad_order, decic, vfact, what );
+						}, mplan.stage_bytes( name ) ) };
+						
+						task_graph::task_id tw = write( "write "+cname, d, [icoord,data_forIO,writer]{ writer( icoord, *data_forIO ); } );
+						
+						if( kept != NULL )
+							kept->push_back( std::make_pair( data_forIO, tw ) );
 					}
-					else 
-						the_poisson_solver->gradient(icoord, u, data_forIO );
 					
+					return d[0];
+				};
+				
+				{
+					//------------------------------------------------------------------------------
+					//... cdm density and displacements
+					//------------------------------------------------------------------------------
+					tf_type my_tf_type = cdm;
+					if( !do_baryons || !the_transfer_function_plugin->tf_is_distinct() )
+						my_tf_type = total;
 					
+					field fdm = std::make_shared<grid_hierarchy>( nbnd ), udm = std::make_shared<grid_hierarchy>( nbnd );
 					
-					//... multiply to get velocity
-					data_forIO *= cosmo.vfact;
+					task_graph::task_id tfdm = density( "DM density", "dm_density", my_tf_type, false, fdm );
+					task_graph::task_id ofdm = write( "write DM density", deps{tfdm}, [&,fdm]{
+						LOGUSER("Writing CDM data");
+						the_output_plugin->write_dm_mass(*fdm);
+						the_output_plugin->write_dm_density(*fdm);
+					});
 					
-					//... velocity kick to keep refined region centered?
+					task_graph::task_id tudm = potential( "DM potential", "dm_potential", deps{tfdm,ofdm}, fdm, udm );
+					task_graph::task_id oudm = write( "write DM potential", deps{tudm}, [&,udm]{
+						LOGUSER("Writing CDM potential");
+						the_output_plugin->write_dm_potential(*udm);
+					});
 					
-					double sigv = compute_finest_sigma( data_forIO );
-					LOGINFO("sigma of %c-velocity of high-res particles is %f",'x'+icoord, sigv);
-
-					coarsen_density( rh_Poisson, data_forIO, false );
-					LOGUSER("Writing CDM velocities");
-					the_output_plugin->write_dm_velocity(icoord, data_forIO);
-
+					component_list ddm;
+					task_graph::task_id tddm = gradient( "DM displacements", "dm_displacement", deps{tudm,oudm}, fdm, udm, decic_DM, 0.0, "HR particles",
+						[&]( int icoord, const grid_hierarchy& g ){
+							LOGUSER("Writing CDM displacements");
+							the_output_plugin->write_dm_position( icoord, g );
+						}, dopt.grad_reuse? &ddm : NULL );
+					
+					//------------------------------------------------------------------------------
+					//... gas density
+					//------------------------------------------------------------------------------
 					if( do_baryons )
-					{	
-						LOGUSER("Writing baryon velocities");
-						the_output_plugin->write_gas_velocity(icoord, data_forIO);
-					}
-				
-				}
-				
-				u.deallocate();
-				data_forIO.deallocate();
-				
-			}
-			else
-			{
-				LOGINFO("Computing separate velocities for CDM and baryons:");
-				std::cout << "=============================================================\n";
-				std::cout << "   COMPUTING DARK MATTER VELOCITIES\n";
-				std::cout << "-------------------------------------------------------------\n";
-				LOGUSER("Computing dark matter velocitites...");
-				
-				//... we do baryons and have velocity transfer functions, or we do SPH and not to shift
-				//... do DM first
-				GenerateDensityHierarchy(	cf, the_transfer_function_plugin, vcdm , rh_TF, rand, f, false, false );
-				coarsen_density(rh_Poisson, f, bspectral_sampling);
-				f.add_refinement_mask( rh_Poisson.get_coord_shift() );
-				normalize_density(f);
-				
-				u = f;	u.zero();
-				
-				err = the_poisson_solver->solve(f, u);
-				
-				if(!bdefd)
-				  f.deallocate();
-								
-				grid_hierarchy data_forIO(u);
-				for( int icoord = 0; icoord < 3; ++icoord )
-				{
-					//... displacement
-					if(bdefd)
 					{
-						data_forIO.zero();
-						*data_forIO.get_grid(data_forIO.levelmax()) = *f.get_grid(f.levelmax());
-						poisson_hybrid(*data_forIO.get_grid(data_forIO.levelmax()), icoord, grad_order, 
-							       data_forIO.levelmin()==data_forIO.levelmax(), decic_DM );					
-						*data_forIO.get_grid(data_forIO.levelmax()) /= 1<<f.levelmax();
-						the_poisson_solver->gradient_add(icoord, u, data_forIO );
+						field fgas = std::make_shared<grid_hierarchy>( nbnd ), ugas = std::make_shared<grid_hierarchy>( nbnd );
+						
+						task_graph::task_id tfgas = density( "baryon density", "gas_density", baryon, bbshift, fgas );
+						deps dfgas{ tfgas };
+						
+						if( !do_LLA )
+							dfgas.push_back( write( "write baryon density", deps{tfgas}, [&,fgas]{
+								LOGUSER("Writing baryon density");
+								the_output_plugin->write_gas_density(*fgas);
+							}) );
+						
+						if( bsph )
+						{
+							task_graph::task_id tugas = potential( "baryon potential", "gas_potential", dfgas, fgas, ugas );
+							
+							gradient( "baryon displacements", "gas_displacement", deps{tugas}, fgas, ugas, decic_baryons, 0.0, NULL,
+								[&]( int icoord, const grid_hierarchy& g ){
+									LOGUSER("Writing baryon displacements");
+									the_output_plugin->write_gas_position( icoord, g );
+								});
+						}
+						else if( do_LLA )
+						{
+							task_graph::task_id tlla = graph.add( "baryon LLA density", dfgas, [&,fgas,ugas]{
+								solve_potential( ckpt, "gas_potential", the_poisson_solver, *fgas, *ugas );
+								compute_LLA_density( *ugas, *fgas, grad_order );
+								ugas->deallocate();
+								normalize_density( *fgas );
+							}, mplan.stage_bytes( "baryon LLA density" ) );
+							
+							write( "write baryon density", deps{tlla}, [&,fgas]{
+								LOGUSER("Writing baryon density");
+								the_output_plugin->write_gas_density(*fgas);
+							});
+						}
 					}
-					else 
-						the_poisson_solver->gradient(icoord, u, data_forIO );
 					
-					//... multiply to get velocity
-					data_forIO *= cosmo.vfact;
-				
-					double sigv = compute_finest_sigma( data_forIO );
-					LOGINFO("sigma of %c-velocity of high-res DM is %f",'x'+icoord, sigv);
-
-					coarsen_density( rh_Poisson, data_forIO, false );
-					LOGUSER("Writing CDM velocities");
-					the_output_plugin->write_dm_velocity(icoord, data_forIO);
-				}
-				u.deallocate();
-				data_forIO.deallocate();
-				f.deallocate();
-				
-				
-				std::cout << "=============================================================\n";
-				std::cout << "   COMPUTING BARYON VELOCITIES\n";
-				std::cout << "-------------------------------------------------------------\n";
-				LOGUSER("Computing baryon velocitites...");
-				//... do baryons
-				GenerateDensityHierarchy(	cf, the_transfer_function_plugin, vbaryon , rh_TF, rand, f, false, bbshift );
-				coarsen_density(rh_Poisson, f, bspectral_sampling);
-				f.add_refinement_mask( rh_Poisson.get_coord_shift() );
-                normalize_density(f);
-				
-				u = f;	u.zero();
-				
-				err = the_poisson_solver->solve(f, u);
-				
-				if(!bdefd)
-					f.deallocate();
-				
-				data_forIO = u;
-				for( int icoord = 0; icoord < 3; ++icoord )
-				{
-					//... displacement
-					if(bdefd)
+					//------------------------------------------------------------------------------
+					//... velocities
+					//------------------------------------------------------------------------------
+					if( dopt.grad_reuse )
 					{
-						data_forIO.zero();
-						*data_forIO.get_grid(data_forIO.levelmax()) = *f.get_grid(f.levelmax());
-						poisson_hybrid(*data_forIO.get_grid(data_forIO.levelmax()), icoord, grad_order, 
-							       data_forIO.levelmin()==data_forIO.levelmax(), decic_baryons );					
-						*data_forIO.get_grid(data_forIO.levelmax()) /= 1<<f.levelmax();
-						the_poisson_solver->gradient_add(icoord, u, data_forIO );
+						//... each velocity component replaces its displacement component once that is written
+						for( int icoord=0; icoord<3; ++icoord )
+						{
+							field data_forIO = ddm[icoord].first;
+							std::string cname = std::string("velocities ") + (char)('x'+icoord);
+							
+							task_graph::task_id tv = graph.add( cname, deps{tddm,ddm[icoord].second}, [&,icoord,data_forIO]{
+								derive_velocity( ckpt, "velocity", icoord, *data_forIO, cosmo.vfact, "high-res particles" );
+							}, mplan.stage_bytes( "velocities" ) );
+							
+							write( "write "+cname, deps{tv}, [&,icoord,data_forIO]{
+								LOGUSER("Writing CDM velocities");
+								the_output_plugin->write_dm_velocity( icoord, *data_forIO );
+							});
+						}
+						
+						ddm.clear();
+					}
+					else if( (!the_transfer_function_plugin->tf_has_velocities() || !do_baryons) && !bsph )
+					{
+						field fv = fdm, uv = udm;
+						deps dv{ tddm };
+						
+						//... without distinct velocities the DM potential is reused
+						if( do_baryons || the_transfer_function_plugin->tf_has_velocities() )
+						{
+							fv = std::make_shared<grid_hierarchy>( nbnd );
+							uv = std::make_shared<grid_hierarchy>( nbnd );
+							
+							task_graph::task_id tfv = density( "velocity density", "velocity_density", vtotal, false, fv );
+							dv = deps{ potential( "velocity potential", "velocity_potential", deps{tfv}, fv, uv ) };
+						}
+						
+						gradient( "velocities", "velocity", dv, fv, uv, decic_baryons, cosmo.vfact, "high-res particles",
+							[&]( int icoord, const grid_hierarchy& g ){
+								LOGUSER("Writing CDM velocities");
+								the_output_plugin->write_dm_velocity( icoord, g );
+								
+								if( do_baryons )
+								{
+									LOGUSER("Writing baryon velocities");
+									the_output_plugin->write_gas_velocity( icoord, g );
+								}
+							});
+					}
+					else
+					{
+						LOGINFO("Computing separate velocities for CDM and baryons:");
+						
+						//... we do baryons and have velocity transfer functions, or we do SPH and not to shift
+						field fvdm = std::make_shared<grid_hierarchy>( nbnd ), uvdm = std::make_shared<grid_hierarchy>( nbnd );
+						
+						task_graph::task_id tfvdm = density( "DM velocity density", "dm_velocity_density", vcdm, false, fvdm );
+						task_graph::task_id tuvdm = potential( "DM velocity potential", "dm_velocity_potential", deps{tfvdm}, fvdm, uvdm );
+						
+						gradient( "DM velocities", "dm_velocity", deps{tuvdm}, fvdm, uvdm, decic_DM, cosmo.vfact, "high-res DM",
+							[&]( int icoord, const grid_hierarchy& g ){
+								LOGUSER("Writing CDM velocities");
+								the_output_plugin->write_dm_velocity( icoord, g );
+							});
+						
+						field fvgas = std::make_shared<grid_hierarchy>( nbnd ), uvgas = std::make_shared<grid_hierarchy>( nbnd );
+						
+						task_graph::task_id tfvgas = density( "baryon velocity density", "gas_velocity_density", vbaryon, bbshift, fvgas );
+						task_graph::task_id tuvgas = potential( "baryon velocity potential", "gas_velocity_potential", deps{tfvgas}, fvgas, uvgas );
+						
+						gradient( "baryon velocities", "gas_velocity", deps{tuvgas}, fvgas, uvgas, decic_baryons, cosmo.vfact, "high-res baryons",
+							[&]( int icoord, const grid_hierarchy& g ){
+								LOGUSER("Writing baryon velocities");
+								the_output_plugin->write_gas_velocity( icoord, g );
+							});
 					}
-					else 
-						the_poisson_solver->gradient(icoord, u, data_forIO );
-					
-					//... multiply to get velocity
-					data_forIO *= cosmo.vfact;
-										
-					double sigv = compute_finest_sigma( data_forIO );
-					LOGINFO("sigma of %c-velocity of high-res baryons is %f",'x'+icoord, sigv);
-					
-					coarsen_density( rh_Poisson, data_forIO, false );
-					LOGUSER("Writing baryon velocities");
-					the_output_plugin->write_gas_velocity(icoord, data_forIO);
 				}
-				u.deallocate();
-				f.deallocate();
-				data_forIO.deallocate();
-			}
-		/*********************************************************************************************/
-		/*********************************************************************************************/
-		/*** 2LPT ************************************************************************************/
-		/*********************************************************************************************/
-		}else {
-			//.. use 2LPT ...
-			LOGUSER("Entering 2LPT branch");
+				
+				//... the fields are only held by the tasks from here on
+				graph.run();
+			/*********************************************************************************************/
+			/*********************************************************************************************/
+			/*** 2LPT ************************************************************************************/
+			/*********************************************************************************************/
+			}else {
+				//.. use 2LPT ...
+				LOGUSER("Entering 2LPT branch");
 			
-			grid_hierarchy f( nbnd ), u1(nbnd), u2LPT(nbnd), f2LPT( nbnd );
+				grid_hierarchy f( nbnd ), u1(nbnd), u2LPT(nbnd), f2LPT( nbnd );
 			
 			
 			
-			tf_type my_tf_type = vcdm;
-			bool dm_only = !do_baryons;
-			if( !do_baryons || !the_transfer_function_plugin->tf_has_velocities() )
-				my_tf_type = total;
+				tf_type my_tf_type = vcdm;
+				bool dm_only = !do_baryons;
+				bool reuse_2LPT = dm_only && dopt.lpt_reuse == lpt_reuse_memory;
+				if( !do_baryons || !the_transfer_function_plugin->tf_has_velocities() )
+					my_tf_type = total;
 			
-			std::cout << "=============================================================\n";
-			if( my_tf_type == total )
-			{
-				std::cout << "   COMPUTING VELOCITIES\n";
-				LOGUSER("Computing velocities...");				
-			}else{
-				std::cout << "   COMPUTING DARK MATTER VELOCITIES\n";
-				LOGUSER("Computing dark matter velocities...");	
-			}
-			std::cout << "-------------------------------------------------------------\n";	
+				std::cout << "=============================================================\n";
+				if( my_tf_type == total )
+				{
+					std::cout << "   COMPUTING VELOCITIES\n";
+					LOGUSER("Computing velocities...");				
+					phase.next("velocities");
+				}else{
+					std::cout << "   COMPUTING DARK MATTER VELOCITIES\n";
+					LOGUSER("Computing dark matter velocities...");	
+					phase.next("dark matter velocities");
+				}
+				std::cout << "-------------------------------------------------------------\n";	
 
 			
-			GenerateDensityHierarchy(	cf, the_transfer_function_plugin, my_tf_type , rh_TF, rand, f, false, false );
-			coarsen_density(rh_Poisson, f, bspectral_sampling);
-			f.add_refinement_mask( rh_Poisson.get_coord_shift() );
-            normalize_density(f);
-			
-			if( dm_only )
-			{
-				the_output_plugin->write_dm_density(f);
-				the_output_plugin->write_dm_mass(f);	
-			}
+				compute_density( ckpt, "dm_velocity_density", cf, the_transfer_function_plugin, my_tf_type, rh_TF, rh_Poisson, rand, f, false, false, bspectral_sampling );
 			
-			u1 = f;	u1.zero();
+				if( dm_only )
+				{
+					the_output_plugin->write_dm_density(f);
+					the_output_plugin->write_dm_mass(f);	
+				}
 			
-			//... compute 1LPT term
-			err = the_poisson_solver->solve(f, u1);
+				//... compute 1LPT term
+				err = solve_potential( ckpt, "dm_velocity_potential", the_poisson_solver, f, u1 );
 			
+				if(!bdefd)
+					f.deallocate();
 			
-			//... compute 2LPT term
-			if(bdefd)
-				f2LPT=f;
-			else
-				f.deallocate();
-		
-			LOGINFO("Computing 2LPT term....");
-			if( !kspace2LPT )
-				compute_2LPT_source(u1, f2LPT, grad_order );
-			else{
-				LOGUSER("computing term using FFT");
-				compute_2LPT_source_FFT(cf, u1, f2LPT);
-			}
-            
-            LOGINFO("Solving 2LPT Poisson equation");
-			u2LPT = u1; u2LPT.zero();
-			err = the_poisson_solver->solve(f2LPT, u2LPT);
+				//... compute 2LPT term
+				err = solve_2LPT_potential( ckpt, "dm_velocity_2LPT", cf, the_poisson_solver, u1, f2LPT, u2LPT,
+											bdefd, kspace2LPT, grad_order );
             
 			
-			//... if doing the hybrid step, we need a combined source term
-			if( bdefd )
-			{
-				f2LPT*=6.0/7.0/vfac2lpt;
-				f+=f2LPT;
+				//... if doing the hybrid step, we need a combined source term
+				if( bdefd )
+				{
+					f += (6.0/7.0/vfac2lpt) * f2LPT;
 				
-				if( !dm_only )
+					if( !reuse_2LPT )
+						f2LPT.deallocate();
+				}
+				else
 					f2LPT.deallocate();
-			}
-			
-			//... add the 2LPT contribution
-			u2LPT *= 6.0/7.0/vfac2lpt;
-			u1 += u2LPT;
 			
+				//... add the 2LPT contribution
+				u1 += (6.0/7.0/vfac2lpt) * u2LPT;
 			
-			grid_hierarchy data_forIO(u1);
-			for( int icoord = 0; icoord < 3; ++icoord )
-			{
-				if(bdefd)
+				//... keep the 2LPT terms for the displacements, on disk if the memory plan says so
+				if( !reuse_2LPT )
+					u2LPT.deallocate();
+				else
 				{
-					data_forIO.zero();
-					*data_forIO.get_grid(data_forIO.levelmax()) = *f.get_grid(f.levelmax());
-					poisson_hybrid(*data_forIO.get_grid(data_forIO.levelmax()), icoord, grad_order, 
-						       data_forIO.levelmin()==data_forIO.levelmax(), decic_DM );
-					*data_forIO.get_grid(data_forIO.levelmax()) /= (1<<f.levelmax());
-					the_poisson_solver->gradient_add(icoord, u1, data_forIO );
+					if( mplan.is_staged("u2LPT") )
+						u2LPT.stage_out( staging_file(cf,"u2LPT") );
+					if( bdefd && mplan.is_staged("f2LPT") )
+						f2LPT.stage_out( staging_file(cf,"f2LPT") );
 				}
-				else 
-					the_poisson_solver->gradient(icoord, u1, data_forIO );
+			
+			
+				grid_hierarchy data_forIO(u1);
+				for( int icoord = 0; icoord < 3; ++icoord )
+				{
+					if( !ckpt.load( checkpoint::component("dm_velocity",icoord), data_forIO ) )
+					{
+						if(bdefd)
+						{
+							data_forIO.zero();
+							*data_forIO.writable(data_forIO.levelmax()) = *f.get_grid(f.levelmax());
+							poisson_hybrid(*data_forIO.get_grid(data_forIO.levelmax()), icoord, grad_order, 
+								       data_forIO.levelmin()==data_forIO.levelmax(), decic_DM );
+							*data_forIO.get_grid(data_forIO.levelmax()) /= (1<<f.levelmax());
+							the_poisson_solver->gradient_add(icoord, u1, data_forIO );
+						}
+						else 
+							the_poisson_solver->gradient(icoord, u1, data_forIO );
 				
-				data_forIO *= cosmo.vfact;
+						data_forIO *= cosmo.vfact;
 				
-				double sigv = compute_finest_sigma( data_forIO );
-				std::cerr << " - velocity component " << icoord << " : sigma = " << sigv << std::endl;
+						double sigv = compute_finest_sigma( data_forIO );
+						std::cerr << " - velocity component " << icoord << " : sigma = " << sigv << std::endl;
 				
-				coarsen_density( rh_Poisson, data_forIO, false );
-				LOGUSER("Writing CDM velocities");
-				the_output_plugin->write_dm_velocity(icoord, data_forIO);					
+						coarsen_density( rh_Poisson, data_forIO, false );
+						ckpt.save( checkpoint::component("dm_velocity",icoord), data_forIO );
+					}
+
+					LOGUSER("Writing CDM velocities");
+					the_output_plugin->write_dm_velocity(icoord, data_forIO);					
 				
-				if( do_baryons && !the_transfer_function_plugin->tf_has_velocities() && !bsph)
-				{	
-					LOGUSER("Writing baryon velocities");
-					the_output_plugin->write_gas_velocity(icoord, data_forIO);				
+					if( do_baryons && !the_transfer_function_plugin->tf_has_velocities() && !bsph)
+					{	
+						LOGUSER("Writing baryon velocities");
+						the_output_plugin->write_gas_velocity(icoord, data_forIO);				
+					}
 				}
-			}
-			data_forIO.deallocate();
-			if( !dm_only )
-				u1.deallocate();
+				data_forIO.deallocate();
+				if( !dm_only )
+					u1.deallocate();
 			
 			
-			if( do_baryons && (the_transfer_function_plugin->tf_has_velocities() || bsph) )
-			{
-				std::cout << "=============================================================\n";
-				std::cout << "   COMPUTING BARYON VELOCITIES\n";
-				std::cout << "-------------------------------------------------------------\n";
-				LOGUSER("Computing baryon displacements...");
-				
-				GenerateDensityHierarchy(	cf, the_transfer_function_plugin, vbaryon , rh_TF, rand, f, false, bbshift );
-				coarsen_density(rh_Poisson, f, bspectral_sampling);
-				f.add_refinement_mask( rh_Poisson.get_coord_shift() );
-                normalize_density(f);
-				
-				u1 = f;	u1.zero();
+				if( do_baryons && (the_transfer_function_plugin->tf_has_velocities() || bsph) )
+				{
+					std::cout << "=============================================================\n";
+					std::cout << "   COMPUTING BARYON VELOCITIES\n";
+					std::cout << "-------------------------------------------------------------\n";
+					LOGUSER("Computing baryon displacements...");
+					phase.next("baryon velocities");
 				
-				if(bdefd)
-					f2LPT=f;
+					compute_density( ckpt, "gas_velocity_density", cf, the_transfer_function_plugin, vbaryon, rh_TF, rh_Poisson, rand, f, false, bbshift, bspectral_sampling );
 				
-				//... compute 1LPT term
-				err = the_poisson_solver->solve(f, u1);
+					//... compute 1LPT term
+					err = solve_potential( ckpt, "gas_velocity_potential", the_poisson_solver, f, u1 );
 
-				LOGINFO("Writing baryon potential");
-				the_output_plugin->write_gas_potential(u1);
-				
-				//... compute 2LPT term
-				u2LPT = f; u2LPT.zero();
+					LOGINFO("Writing baryon potential");
+					the_output_plugin->write_gas_potential(u1);
 				
-				if( !kspace2LPT )
-					compute_2LPT_source(u1, f2LPT, grad_order );
-				else
-					compute_2LPT_source_FFT(cf, u1, f2LPT);
-				
-				
-				err = the_poisson_solver->solve(f2LPT, u2LPT);
+					//... compute 2LPT term
+					err = solve_2LPT_potential( ckpt, "gas_velocity_2LPT", cf, the_poisson_solver, u1, f2LPT, u2LPT,
+														bdefd, kspace2LPT, grad_order );
 				
-				//... if doing the hybrid step, we need a combined source term
-				if( bdefd )
-				{
-					f2LPT*=6.0/7.0/vfac2lpt;
-					f+=f2LPT;
-					
-					f2LPT.deallocate();
-				}
+					//... if doing the hybrid step, we need a combined source term
+					if( bdefd )
+					{
+						f += (6.0/7.0/vfac2lpt) * f2LPT;
+						f2LPT.deallocate();
+					}
 				
-				//... add the 2LPT contribution
-				u2LPT *= 6.0/7.0/vfac2lpt;
-				u1 += u2LPT;
-				u2LPT.deallocate();
+					//... add the 2LPT contribution
+					u1 += (6.0/7.0/vfac2lpt) * u2LPT;
+					u2LPT.deallocate();
 				
-				//grid_hierarchy data_forIO(u1);
-				data_forIO = u1;
-				for( int icoord = 0; icoord < 3; ++icoord )
-				{
-					if(bdefd)
+					//grid_hierarchy data_forIO(u1);
+					data_forIO = u1;
+					for( int icoord = 0; icoord < 3; ++icoord )
 					{
-						data_forIO.zero();
-						*data_forIO.get_grid(data_forIO.levelmax()) = *f.get_grid(f.levelmax());
-						poisson_hybrid(*data_forIO.get_grid(data_forIO.levelmax()), icoord, grad_order, 
-							       data_forIO.levelmin()==data_forIO.levelmax(), decic_baryons );					
-						*data_forIO.get_grid(data_forIO.levelmax()) /= (1<<f.levelmax());
-						the_poisson_solver->gradient_add(icoord, u1, data_forIO );
-					}
-					else 
-						the_poisson_solver->gradient(icoord, u1, data_forIO );
+						if( !ckpt.load( checkpoint::component("gas_velocity",icoord), data_forIO ) )
+						{
+							if(bdefd)
+							{
+								data_forIO.zero();
+								*data_forIO.writable(data_forIO.levelmax()) = *f.get_grid(f.levelmax());
+								poisson_hybrid(*data_forIO.get_grid(data_forIO.levelmax()), icoord, grad_order, 
+									       data_forIO.levelmin()==data_forIO.levelmax(), decic_baryons );					
+								*data_forIO.get_grid(data_forIO.levelmax()) /= (1<<f.levelmax());
+								the_poisson_solver->gradient_add(icoord, u1, data_forIO );
+							}
+							else 
+								the_poisson_solver->gradient(icoord, u1, data_forIO );
 					
-					data_forIO *= cosmo.vfact;
+							data_forIO *= cosmo.vfact;
 										
-					double sigv = compute_finest_sigma( data_forIO );
-					std::cerr << " - velocity component " << icoord << " : sigma = " << sigv << std::endl;
+							double sigv = compute_finest_sigma( data_forIO );
+							std::cerr << " - velocity component " << icoord << " : sigma = " << sigv << std::endl;
 					
-					coarsen_density( rh_Poisson, data_forIO, false );
-					LOGUSER("Writing baryon velocities");
-					the_output_plugin->write_gas_velocity(icoord, data_forIO);				
+							coarsen_density( rh_Poisson, data_forIO, false );
+							ckpt.save( checkpoint::component("gas_velocity",icoord), data_forIO );
+						}
+
+						LOGUSER("Writing baryon velocities");
+						the_output_plugin->write_gas_velocity(icoord, data_forIO);				
+					}
+					data_forIO.deallocate();
+					u1.deallocate();
 				}
-				data_forIO.deallocate();
-				u1.deallocate();
-			}
 			
 			
-			std::cout << "=============================================================\n";
-			std::cout << "   COMPUTING DARK MATTER DISPLACEMENTS\n";
-			std::cout << "-------------------------------------------------------------\n";
-			LOGUSER("Computing dark matter displacements...");
+				std::cout << "=============================================================\n";
+				std::cout << "   COMPUTING DARK MATTER DISPLACEMENTS\n";
+				std::cout << "-------------------------------------------------------------\n";
+				LOGUSER("Computing dark matter displacements...");
+				phase.next("dark matter displacements");
 			
-			//... if baryons are enabled, the displacements have to be recomputed
-			//... otherwise we can compute them directly from the velocities
-			if( !dm_only )
-			{
-				// my_tf_type is cdm if do_baryons==true, total otherwise
-				my_tf_type = cdm;
-				if( !do_baryons || !the_transfer_function_plugin->tf_is_distinct() )
-					my_tf_type = total;
-				
-				GenerateDensityHierarchy(	cf, the_transfer_function_plugin, my_tf_type , rh_TF, rand, f, false, false );
-				coarsen_density(rh_Poisson, f, bspectral_sampling);
-				f.add_refinement_mask( rh_Poisson.get_coord_shift() );
-                normalize_density(f);
-				
-				LOGUSER("Writing CDM data");
-				the_output_plugin->write_dm_density(f);
-				the_output_plugin->write_dm_mass(f);
-				u1 = f;	u1.zero();
-				
-				if(bdefd)
-					f2LPT=f;
+				//... if baryons are enabled, the displacements have to be recomputed
+				//... otherwise we can compute them directly from the velocities, unless
+				//... the memory plan decided not to keep the 2LPT terms
+				if( !reuse_2LPT )
+				{
+					// my_tf_type is cdm if do_baryons==true, total otherwise
+					my_tf_type = cdm;
+					if( !do_baryons || !the_transfer_function_plugin->tf_is_distinct() )
+						my_tf_type = total;
 				
-				//... compute 1LPT term
-				err = the_poisson_solver->solve(f, u1);
+					compute_density( ckpt, "dm_density", cf, the_transfer_function_plugin, my_tf_type, rh_TF, rh_Poisson, rand, f, false, false, bspectral_sampling );
 				
-				//... compute 2LPT term
-				u2LPT = f; u2LPT.zero();
+					if( !dm_only )
+					{
+						LOGUSER("Writing CDM data");
+						the_output_plugin->write_dm_density(f);
+						the_output_plugin->write_dm_mass(f);
+					}
+					//... compute 1LPT term
+					err = solve_potential( ckpt, "dm_potential", the_poisson_solver, f, u1 );
 				
-				if( !kspace2LPT )
-					compute_2LPT_source(u1, f2LPT, grad_order );
-				else
-					compute_2LPT_source_FFT(cf, u1, f2LPT);
+					//... compute 2LPT term
+					err = solve_2LPT_potential( ckpt, "dm_2LPT", cf, the_poisson_solver, u1, f2LPT, u2LPT,
+														bdefd, kspace2LPT, grad_order );
 				
-				err = the_poisson_solver->solve(f2LPT, u2LPT);
+					if( bdefd )
+					{
+						f += (3.0/7.0) * f2LPT;
+						f2LPT.deallocate();
+					}
 				
-				if( bdefd )
-				{
-					f2LPT*=3.0/7.0;
-					f+=f2LPT;
-					f2LPT.deallocate();
-				}
+					u1 += (3.0/7.0) * u2LPT;
+					u2LPT.deallocate();
+				}else{
+					//... reuse prior data
+					/*f-=f2LPT;
+					the_output_plugin->write_dm_density(f);
+					the_output_plugin->write_dm_mass(f);
+					f+=f2LPT;*/
 				
-				u2LPT *= 3.0/7.0;
-				u1 += u2LPT;
-				u2LPT.deallocate();
-			}else{
-				//... reuse prior data
-				/*f-=f2LPT;
-				the_output_plugin->write_dm_density(f);
-				the_output_plugin->write_dm_mass(f);
-				f+=f2LPT;*/
+					if( mplan.is_staged("u2LPT") )
+						u2LPT.stage_in( staging_file(cf,"u2LPT") );
+					if( bdefd && mplan.is_staged("f2LPT") )
+						f2LPT.stage_in( staging_file(cf,"f2LPT") );
 				
-				u2LPT *= 0.5;
-				u1 -= u2LPT;
-				u2LPT.deallocate();
+					//... the stored 2LPT terms are unscaled, so remove half of the 6/7 added above
+					u1 -= (3.0/7.0/vfac2lpt) * u2LPT;
+					u2LPT.deallocate();
 				
-				if(bdefd)
-				{
-					f2LPT *= 0.5;
-					f-=f2LPT;
-					f2LPT.deallocate();
+					if(bdefd)
+					{
+						f -= (3.0/7.0/vfac2lpt) * f2LPT;
+						f2LPT.deallocate();
+					}
 				}
-			}
 						
-			data_forIO = u1;
+				data_forIO = u1;
 			
-			for( int icoord = 0; icoord < 3; ++icoord )
-			{
-				//... displacement
-				if(bdefd)
+				for( int icoord = 0; icoord < 3; ++icoord )
 				{
-					data_forIO.zero();
-					*data_forIO.get_grid(data_forIO.levelmax()) = *f.get_grid(f.levelmax());
-					poisson_hybrid(*data_forIO.get_grid(data_forIO.levelmax()), icoord, grad_order, 
-						       data_forIO.levelmin()==data_forIO.levelmax(), decic_DM );
-					*data_forIO.get_grid(data_forIO.levelmax()) /= 1<<f.levelmax();
-					the_poisson_solver->gradient_add(icoord, u1, data_forIO );
-				}
-				else 
-					the_poisson_solver->gradient(icoord, u1, data_forIO );
+					if( !ckpt.load( checkpoint::component("dm_displacement",icoord), data_forIO ) )
+					{
+						//... displacement
+						if(bdefd)
+						{
+							data_forIO.zero();
+							*data_forIO.writable(data_forIO.levelmax()) = *f.get_grid(f.levelmax());
+							poisson_hybrid(*data_forIO.get_grid(data_forIO.levelmax()), icoord, grad_order, 
+								       data_forIO.levelmin()==data_forIO.levelmax(), decic_DM );
+							*data_forIO.get_grid(data_forIO.levelmax()) /= 1<<f.levelmax();
+							the_poisson_solver->gradient_add(icoord, u1, data_forIO );
+						}
+						else 
+							the_poisson_solver->gradient(icoord, u1, data_forIO );
 				
-				double dispmax = compute_finest_max( data_forIO );
-				LOGINFO("max. %c-displacement of HR particles is %f [mean dx]",'x'+icoord, dispmax*(double)(1ll<<data_forIO.levelmax()));
+						double dispmax = compute_finest_max( data_forIO );
+						LOGINFO("max. %c-displacement of HR particles is %f [mean dx]",'x'+icoord, dispmax*(double)(1ll<<data_forIO.levelmax()));
 
-				coarsen_density( rh_Poisson, data_forIO, false );
-				LOGUSER("Writing CDM displacements");
-				the_output_plugin->write_dm_position(icoord, data_forIO );	
-			}
+						coarsen_density( rh_Poisson, data_forIO, false );
+						ckpt.save( checkpoint::component("dm_displacement",icoord), data_forIO );
+					}
+
+					LOGUSER("Writing CDM displacements");
+					the_output_plugin->write_dm_position(icoord, data_forIO );	
+				}
 			
-			data_forIO.deallocate();
-			u1.deallocate();
+				data_forIO.deallocate();
+				u1.deallocate();
 			
 
-			if( do_baryons && !bsph )
-			{	
-				std::cout << "=============================================================\n";
-				std::cout << "   COMPUTING BARYON DENSITY\n";
-				std::cout << "-------------------------------------------------------------\n";
-				LOGUSER("Computing baryon density...");
+				if( do_baryons && !bsph )
+				{	
+					std::cout << "=============================================================\n";
+					std::cout << "   COMPUTING BARYON DENSITY\n";
+					std::cout << "-------------------------------------------------------------\n";
+					LOGUSER("Computing baryon density...");
+					phase.next("baryon density");
 				
-				GenerateDensityHierarchy(	cf, the_transfer_function_plugin, baryon , rh_TF, rand, f, true, false );
-				coarsen_density(rh_Poisson, f, bspectral_sampling);
-				f.add_refinement_mask( rh_Poisson.get_coord_shift() );
-                normalize_density(f);
+					compute_density( ckpt, "gas_density", cf, the_transfer_function_plugin, baryon, rh_TF, rh_Poisson, rand, f, true, false, bspectral_sampling );
 				
-				if( !do_LLA )
-					the_output_plugin->write_gas_density(f);
-				else 
-				{	
-					u1 = f;	u1.zero();
-					
-					//... compute 1LPT term
-					err = the_poisson_solver->solve(f, u1);
-					
-					//... compute 2LPT term
-					u2LPT = f; u2LPT.zero();
-					
-					if( !kspace2LPT )
-						compute_2LPT_source(u1, f2LPT, grad_order );
-					else
-						compute_2LPT_source_FFT(cf, u1, f2LPT);
+					if( !do_LLA )
+						the_output_plugin->write_gas_density(f);
+					else 
+					{	
+						//... compute 1LPT term
+						err = solve_potential( ckpt, "gas_potential", the_poisson_solver, f, u1 );
 					
-					err = the_poisson_solver->solve(f2LPT, u2LPT);
-					u2LPT *= 3.0/7.0;
-					u1 += u2LPT;
-					u2LPT.deallocate();
+						//... compute 2LPT term
+						err = solve_2LPT_potential( ckpt, "gas_2LPT", cf, the_poisson_solver, u1, f2LPT, u2LPT,
+															false, kspace2LPT, grad_order );
+						u1 += (3.0/7.0) * u2LPT;
+						u2LPT.deallocate();
 					
-					compute_LLA_density( u1, f, grad_order );
-                    normalize_density(f);
+						compute_LLA_density( u1, f, grad_order );
+	                    normalize_density(f);
 					
-					LOGUSER("Writing baryon density");
-					the_output_plugin->write_gas_density(f);
+						LOGUSER("Writing baryon density");
+						the_output_plugin->write_gas_density(f);
+					}
 				}
-			}
-			else if( do_baryons && bsph )
-			{
-				std::cout << "=============================================================\n";
-				std::cout << "   COMPUTING BARYON DISPLACEMENTS\n";
-				std::cout << "-------------------------------------------------------------\n";
-				LOGUSER("Computing baryon displacements...");
-				
-				GenerateDensityHierarchy(	cf, the_transfer_function_plugin, baryon , rh_TF, rand, f, false, bbshift );
-				coarsen_density(rh_Poisson, f, bspectral_sampling);
-				f.add_refinement_mask( rh_Poisson.get_coord_shift() );
-                normalize_density(f);
-				
-				LOGUSER("Writing baryon density");
-				the_output_plugin->write_gas_density(f);
-				u1 = f;	u1.zero();
-				
-				if(bdefd)
-					f2LPT=f;
+				else if( do_baryons && bsph )
+				{
+					std::cout << "=============================================================\n";
+					std::cout << "   COMPUTING BARYON DISPLACEMENTS\n";
+					std::cout << "-------------------------------------------------------------\n";
+					LOGUSER("Computing baryon displacements...");
+					phase.next("baryon displacements");
 				
-				//... compute 1LPT term
-				err = the_poisson_solver->solve(f, u1);
+					compute_density( ckpt, "gas_density", cf, the_transfer_function_plugin, baryon, rh_TF, rh_Poisson, rand, f, false, bbshift, bspectral_sampling );
 				
-				//... compute 2LPT term
-				u2LPT = f; u2LPT.zero();
-				
-				if( !kspace2LPT )
-					compute_2LPT_source(u1, f2LPT, grad_order );
-				else
-					compute_2LPT_source_FFT(cf, u1, f2LPT);
+					LOGUSER("Writing baryon density");
+					the_output_plugin->write_gas_density(f);
+					//... compute 1LPT term
+					err = solve_potential( ckpt, "gas_potential", the_poisson_solver, f, u1 );
 				
-				err = the_poisson_solver->solve(f2LPT, u2LPT);
+					//... compute 2LPT term
+					err = solve_2LPT_potential( ckpt, "gas_2LPT", cf, the_poisson_solver, u1, f2LPT, u2LPT,
+														bdefd, kspace2LPT, grad_order );
 				
-				if( bdefd )
-				{
-					f2LPT*=3.0/7.0;
-					f+=f2LPT;
-					f2LPT.deallocate();
-				}
+					if( bdefd )
+					{
+						f += (3.0/7.0) * f2LPT;
+						f2LPT.deallocate();
+					}
 				
-				u2LPT *= 3.0/7.0;
-				u1 += u2LPT;
-				u2LPT.deallocate();
+					u1 += (3.0/7.0) * u2LPT;
+					u2LPT.deallocate();
 				
-				data_forIO = u1;
+					data_forIO = u1;
 				
-				for( int icoord = 0; icoord < 3; ++icoord )
-				{
-					//... displacement
-					if(bdefd)
+					for( int icoord = 0; icoord < 3; ++icoord )
 					{
-						data_forIO.zero();
-						*data_forIO.get_grid(data_forIO.levelmax()) = *f.get_grid(f.levelmax());
-						poisson_hybrid(*data_forIO.get_grid(data_forIO.levelmax()), icoord, grad_order, 
-							       data_forIO.levelmin()==data_forIO.levelmax(), decic_baryons );
-						*data_forIO.get_grid(data_forIO.levelmax()) /= 1<<f.levelmax();
-						the_poisson_solver->gradient_add(icoord, u1, data_forIO );
-					}
-					else 
-						the_poisson_solver->gradient(icoord, u1, data_forIO );
+						if( !ckpt.load( checkpoint::component("gas_displacement",icoord), data_forIO ) )
+						{
+							//... displacement
+							if(bdefd)
+							{
+								data_forIO.zero();
+								*data_forIO.writable(data_forIO.levelmax()) = *f.get_grid(f.levelmax());
+								poisson_hybrid(*data_forIO.get_grid(data_forIO.levelmax()), icoord, grad_order, 
+									       data_forIO.levelmin()==data_forIO.levelmax(), decic_baryons );
+								*data_forIO.get_grid(data_forIO.levelmax()) /= 1<<f.levelmax();
+								the_poisson_solver->gradient_add(icoord, u1, data_forIO );
+							}
+							else 
+								the_poisson_solver->gradient(icoord, u1, data_forIO );
 					
-					coarsen_density( rh_Poisson, data_forIO, false );
-					LOGUSER("Writing baryon displacements");
-					the_output_plugin->write_gas_position(icoord, data_forIO );	
+							coarsen_density( rh_Poisson, data_forIO, false );
+							ckpt.save( checkpoint::component("gas_displacement",icoord), data_forIO );
+						}
+
+						LOGUSER("Writing baryon displacements");
+						the_output_plugin->write_gas_position(icoord, data_forIO );	
+					}
 				}
-			}
 
-		}
+			}
 		
-		//------------------------------------------------------------------------------
-		//... finish output
-		//------------------------------------------------------------------------------
+			//------------------------------------------------------------------------------
+			//... finish output
+			//------------------------------------------------------------------------------
 		
-		the_output_plugin->finalize();
-		delete the_output_plugin;
+			//... the hierarchies are gone, return the pooled blocks before the
+			//... output plug-in allocates its own buffers
+			mem_pool_release();
 		
-	}catch(std::runtime_error& excp){
-		LOGERR("Fatal error occured. Code will exit:");
-		LOGERR("Exception: %s",excp.what());
-		std::cerr << " - " << excp.what() << std::endl;
-		std::cerr << " - A fatal error occured. We need to exit...\n";
-		bfatal = true;
+			phase.next("finalize output");
+			the_output_plugin->finalize();
+			delete the_output_plugin;
+			ckpt.finalize();
+		
+			mem_pool_release();
+			LOGINFO("Field memory: planned peak %.2f GBytes",(double)mplan.peak_bytes()/1024.0/1024.0/1024.0);
+			mem_alloc_report();
+		
+		}catch(std::runtime_error& excp){
+			LOGERR("Fatal error occured. Code will exit:");
+			LOGERR("Exception: %s",excp.what());
+			std::cerr << " - " << excp.what() << std::endl;
+			std::cerr << " - A fatal error occured. We need to exit...\n";
+			bfatal = true;
+		}
+
+		if( !bfatal )
+		{	
+			std::cout << " - Wrote output file \'" << outfname << "\'\n     using plugin \'" << outformat << "\'...\n";
+			LOGUSER("Wrote output file \'%s\'.",outfname.c_str());
+		}
 	}
+	
+	if( ensemble_seeds.size() > 0 )
+		keep_tf_kernels( false );
 
 	std::cout << "=============================================================\n";
 	
-	
-
-	if( !bfatal )
-	{	
-		std::cout << " - Wrote output file \'" << outfname << "\'\n     using plugin \'" << outformat << "\'...\n";
-		LOGUSER("Wrote output file \'%s\'.",outfname.c_str());
+	phase.close();
+	if( MUSIC::trace::enabled() )
+	{
+		MUSIC::trace::write_json( tracefname );
+		MUSIC::trace::print_summary();
+		MUSIC::trace::log_summary();
+		std::cout << "=============================================================\n";
 	}
-	
+
 	//------------------------------------------------------------------------------
 	//... clean up
 	//------------------------------------------------------------------------------
@@ -1297,12 +1981,65 @@ int main (int argc, const char * argv[])
 	//------------------------------------------------------------------------------
 	std::cout << " - Done!" << std::endl << std::endl;
 	
-	ltime=time(NULL);
+	time_t ltime=time(NULL);
 	
 	LOGUSER("Run finished succesfully on %s",asctime( localtime(&ltime) ));
 	
 	cf.log_dump();
 	
 	
-	return 0;
+	return bfatal? 1 : 0;
+}
+
+#ifndef MUSIC_LIBRARY
+
+int main (int argc, const char * argv[]) 
+{
+	//------------------------------------------------------------------------------
+	//... parse command line options
+	//------------------------------------------------------------------------------
+	
+	splash();
+	
+	const char *paramfile = NULL;
+	bool bdry_run = false, bbad_args = false;
+	
+	for( int i=1; i<argc; ++i )
+	{
+		if( std::string(argv[i]) == "--dry-run" )
+			bdry_run = true;
+		else if( paramfile == NULL )
+			paramfile = argv[i];
+		else
+			bbad_args = true;
+	}
+	
+	if( paramfile == NULL || bbad_args ){
+		std::cout << " This version is compiled with the following plug-ins:\n";
+		
+		print_region_generator_plugins();
+		print_transfer_function_plugins();
+		print_RNG_plugins();
+		print_output_plugins();
+		
+		std::cerr << "\n In order to run, you need to specify a parameter file!\n"
+				  << " Usage: MUSIC [--dry-run] <parameter file>\n"
+				  << "   --dry-run : only estimate memory, FFT sizes and particle counts\n\n";
+		exit(0);
+	}
+	
+	//------------------------------------------------------------------------------
+	//... open log file
+	//------------------------------------------------------------------------------
+
+	MUSIC::open_log( paramfile );
+	
+	//------------------------------------------------------------------------------
+	//... read config file and run
+	//------------------------------------------------------------------------------
+	config_file cf(paramfile);
+	
+	return MUSIC::run( cf, paramfile, bdry_run );
 }
+
+#endif // MUSIC_LIBRARY
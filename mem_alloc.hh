@@ -0,0 +1,472 @@
+/*
+
+ mem_alloc.hh - This file is part of MUSIC -
+ a code to generate multi-scale initial conditions
+ for cosmological simulations
+
+ Copyright (C) 2010  Oliver Hahn
+
+*/
+
+#ifndef __MEM_ALLOC_HH
+#define __MEM_ALLOC_HH
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <utility>
+#include <limits>
+#include <map>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+#include "general.hh"
+
+/*!
+ * allocation of the large field buffers (Meshvar, DensityGrid, FFT scratch).
+ *
+ * All blocks are aligned to (at least) a SIMD vector width and can optionally
+ * be aligned to and advised as transparent huge pages. After allocation the
+ * memory is first touched by all OpenMP threads using a static schedule, i.e.
+ * thread i touches the i-th contiguous chunk. This is the same decomposition
+ * that '#pragma omp parallel for' produces for the outer (x-) loops over the
+ * grids, so that on NUMA machines the pages end up on the memory node of the
+ * thread that later works on them, instead of all on the node of the master
+ * thread.
+ *
+ * Optionally, released blocks are kept in a pool and handed out again for the
+ * next request of identical size, so that the per-stage temporaries of the
+ * driver (which all have the shape of the grid hierarchy) recycle their
+ * buffers, including the page placement, instead of going back to the system
+ * each time. The pool never
+ * grows the total footprint beyond its previous high-water mark: on a miss,
+ * cached blocks are released before new memory is requested. Since the cached
+ * blocks still count towards the resident memory, the pool is off by default
+ * and the driver empties it before the output is finalised.
+ *
+ * The behaviour is controlled by the [memory] section of the config file:
+ *   alignment     = 64      (bytes, power of two)
+ *   huge_pages    = no      (align large blocks to 2MB and advise THP)
+ *   first_touch   = yes     (parallel first-touch initialisation)
+ *   backend       = aligned (or 'fftw' to use fftw_malloc/fftw_free)
+ *   pool          = no      (recycle released blocks of identical size)
+ *   max_memory_gb = 0       (memory cap in GBytes, 0 for none, see mem_plan.hh)
+ *
+ * The settings need to be fixed before the first allocation, since blocks are
+ * released through the same backend they were obtained from.
+ */
+
+//! runtime settings of the field memory allocator
+struct mem_alloc_settings
+{
+	size_t alignment;	//!< alignment of all blocks in bytes
+	bool huge_pages;	//!< align large blocks to huge pages and advise the kernel to use them
+	bool first_touch;	//!< initialise memory in parallel with a static OpenMP schedule
+	bool use_fftw;		//!< use fftw_malloc/fftw_free as the backend
+	bool use_pool;		//!< recycle released blocks of identical size
+	size_t max_bytes;	//!< memory cap in bytes, 0 for none
+	bool locked;		//!< set once the first block has been allocated
+
+	mem_alloc_settings( void )
+	: alignment( 64 ), huge_pages( false ), first_touch( true ), use_fftw( false ), use_pool( false ),
+	  max_bytes( 0 ), locked( false )
+	{ }
+};
+
+//! book keeping of the field memory allocator
+struct mem_alloc_stats
+{
+	size_t live_bytes;		//!< bytes currently in use
+	size_t peak_bytes;		//!< high-water mark of live_bytes
+	size_t cached_bytes;	//!< bytes kept in the pool for reuse
+	size_t footprint_peak;	//!< high-water mark of live plus cached bytes
+	size_t nallocated;		//!< number of blocks obtained from the system
+	size_t nreused;			//!< number of requests served from the pool
+	size_t total_bytes;		//!< bytes handed out over the whole run
+
+	mem_alloc_stats( void )
+	: live_bytes( 0 ), peak_bytes( 0 ), cached_bytes( 0 ), footprint_peak( 0 ), nallocated( 0 ), nreused( 0 ),
+	  total_bytes( 0 )
+	{ }
+};
+
+//! global state of the field memory allocator
+struct mem_alloc_state
+{
+	mem_alloc_settings settings;
+	mem_alloc_stats stats;
+	std::multimap< size_t, void* > pool;		//!< released blocks by size
+	std::map< void*, size_t > blocks;			//!< size of every block in use
+	bool cap_warned;							//!< whether the cap warning has been issued
+
+	mem_alloc_state( void )
+	: cap_warned( false )
+	{ }
+};
+
+//! size of a (transparent) huge page on x86-64 linux
+const size_t mem_huge_page_size = 2*1024*1024;
+
+//! access the global allocator state
+inline mem_alloc_state& mem_alloc_get_state( void )
+{
+	static mem_alloc_state state;
+	return state;
+}
+
+//! access the global allocator settings
+inline mem_alloc_settings& mem_alloc_get_settings( void )
+{
+	return mem_alloc_get_state().settings;
+}
+
+//! access the allocator statistics
+inline const mem_alloc_stats& mem_alloc_get_stats( void )
+{
+	return mem_alloc_get_state().stats;
+}
+
+//! set up the allocator from the [memory] section of the config file
+inline void mem_alloc_init( config_file& cf )
+{
+	mem_alloc_settings& s = mem_alloc_get_settings();
+
+	size_t alignment = cf.getValueSafe<size_t>( "memory", "alignment", 64 );
+	bool huge_pages  = cf.getValueSafe<bool>( "memory", "huge_pages", false );
+	bool first_touch = cf.getValueSafe<bool>( "memory", "first_touch", true );
+	bool use_pool    = cf.getValueSafe<bool>( "memory", "pool", false );
+	double max_gb    = cf.getValueSafe<double>( "memory", "max_memory_gb", 0.0 );
+	std::string backend = cf.getValueSafe<std::string>( "memory", "backend", "aligned" );
+
+	if( alignment < sizeof(void*) || (alignment & (alignment-1)) != 0 )
+	{
+		LOGERR("memory alignment must be a power of two >= %d bytes, got %d", (int)sizeof(void*), (int)alignment );
+		throw std::runtime_error("invalid memory alignment");
+	}
+
+	if( backend != "aligned" && backend != "fftw" )
+	{
+		LOGERR("unknown memory backend \'%s\', must be \'aligned\' or \'fftw\'", backend.c_str() );
+		throw std::runtime_error("unknown memory backend");
+	}
+
+	if( s.locked && (backend=="fftw") != s.use_fftw )
+		LOGWARN("memory backend can not be changed after the first allocation, keeping current one.");
+	else
+		s.use_fftw = (backend=="fftw");
+
+	s.alignment   = alignment;
+	s.huge_pages  = huge_pages;
+	s.first_touch = first_touch;
+	s.use_pool    = use_pool;
+	s.max_bytes   = (max_gb > 0.0)? (size_t)(max_gb*1024.0*1024.0*1024.0) : 0;
+
+	LOGINFO("Field memory: backend=%s, alignment=%d bytes, huge pages=%s, first touch=%s, pool=%s",
+			s.use_fftw? "fftw" : "aligned", (int)s.alignment, s.huge_pages? "yes":"no", s.first_touch? "yes":"no",
+			s.use_pool? "yes":"no" );
+	if( s.max_bytes > 0 )
+		LOGINFO("Field memory cap is %.2f GBytes", max_gb );
+}
+
+//! obtain an aligned block from the system, returns NULL on failure
+inline void* mem_system_alloc( size_t nbytes )
+{
+	const mem_alloc_settings& s = mem_alloc_get_settings();
+	void *p = NULL;
+
+	if( s.use_fftw )
+	{
+#if defined(FFTW3) && defined(SINGLE_PRECISION)
+		p = fftwf_malloc( nbytes );
+#else
+		p = fftw_malloc( nbytes );
+#endif
+	}
+	else
+	{
+		size_t alignment = s.alignment;
+		if( s.huge_pages && nbytes >= mem_huge_page_size )
+			alignment = std::max( alignment, mem_huge_page_size );
+
+		if( posix_memalign( &p, alignment, nbytes ) != 0 )
+			p = NULL;
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+		if( p != NULL && s.huge_pages && nbytes >= mem_huge_page_size )
+			madvise( p, nbytes, MADV_HUGEPAGE );
+#endif
+	}
+
+	return p;
+}
+
+//! return a block to the system
+inline void mem_system_free( void *p )
+{
+	if( mem_alloc_get_settings().use_fftw )
+	{
+#if defined(FFTW3) && defined(SINGLE_PRECISION)
+		fftwf_free( p );
+#else
+		fftw_free( p );
+#endif
+	}
+	else
+		free( p );
+}
+
+//! release all blocks cached in the pool back to the system
+inline void mem_pool_release( void )
+{
+	mem_alloc_state& st = mem_alloc_get_state();
+
+	#pragma omp critical(mem_alloc)
+	{
+		for( std::multimap< size_t, void* >::iterator it=st.pool.begin(); it!=st.pool.end(); ++it )
+			mem_system_free( it->second );
+		st.pool.clear();
+		st.stats.cached_bytes = 0;
+	}
+}
+
+//! allocate an aligned block of memory without touching it
+/*! @param nbytes size of the block in bytes
+ *  @return pointer to the block, throws std::bad_alloc on failure
+ */
+inline void* mem_alloc_raw( size_t nbytes )
+{
+	mem_alloc_state& st = mem_alloc_get_state();
+	mem_alloc_stats& stats = st.stats;
+	void *p = NULL;
+	bool warn_cap = false;
+
+	if( nbytes == 0 )
+		nbytes = 1;
+
+	#pragma omp critical(mem_alloc)
+	{
+		st.settings.locked = true;
+
+		//... try to recycle a block of identical size
+		std::multimap< size_t, void* >::iterator it = st.pool.find( nbytes );
+		if( it != st.pool.end() )
+		{
+			p = it->second;
+			st.pool.erase( it );
+			stats.cached_bytes -= nbytes;
+			++stats.nreused;
+		}
+		else
+		{
+			//... do not let cached blocks push the footprint beyond its high-water mark
+			while( !st.pool.empty() && stats.live_bytes+stats.cached_bytes+nbytes > stats.footprint_peak )
+			{
+				std::multimap< size_t, void* >::iterator itl = --st.pool.end();
+				stats.cached_bytes -= itl->first;
+				mem_system_free( itl->second );
+				st.pool.erase( itl );
+			}
+
+			p = mem_system_alloc( nbytes );
+			if( p != NULL )
+				++stats.nallocated;
+		}
+
+		if( p != NULL )
+		{
+			st.blocks[p] = nbytes;
+			stats.live_bytes += nbytes;
+			stats.total_bytes += nbytes;
+			stats.peak_bytes = std::max( stats.peak_bytes, stats.live_bytes );
+			stats.footprint_peak = std::max( stats.footprint_peak, stats.live_bytes+stats.cached_bytes );
+
+			if( st.settings.max_bytes > 0 && stats.live_bytes > st.settings.max_bytes && !st.cap_warned )
+				warn_cap = st.cap_warned = true;
+		}
+	}
+
+	if( p == NULL )
+	{
+		LOGERR("Failed to allocate %.2f MBytes of field memory.", (double)nbytes/1024.0/1024.0 );
+		throw std::bad_alloc();
+	}
+
+	if( warn_cap )
+		LOGWARN("Field memory in use (%.2f GBytes) exceeds the memory cap of %.2f GBytes.",
+				(double)stats.live_bytes/1024.0/1024.0/1024.0, (double)st.settings.max_bytes/1024.0/1024.0/1024.0 );
+
+	return p;
+}
+
+//! release a block obtained from mem_alloc_raw
+inline void mem_free_raw( void *p )
+{
+	if( p == NULL )
+		return;
+
+	mem_alloc_state& st = mem_alloc_get_state();
+
+	#pragma omp critical(mem_alloc)
+	{
+		std::map< void*, size_t >::iterator it = st.blocks.find( p );
+
+		if( it == st.blocks.end() )
+			mem_system_free( p );
+		else
+		{
+			size_t nbytes = it->second;
+			st.blocks.erase( it );
+			st.stats.live_bytes -= nbytes;
+
+			if( st.settings.use_pool )
+			{
+				st.pool.insert( std::make_pair( nbytes, p ) );
+				st.stats.cached_bytes += nbytes;
+			}
+			else
+				mem_system_free( p );
+		}
+	}
+}
+
+//! write a summary of the allocator statistics to the log
+inline void mem_alloc_report( void )
+{
+	const mem_alloc_stats& stats = mem_alloc_get_stats();
+
+	LOGINFO("Field memory: peak in use %.2f GBytes, peak footprint %.2f GBytes",
+			(double)stats.peak_bytes/1024.0/1024.0/1024.0, (double)stats.footprint_peak/1024.0/1024.0/1024.0 );
+	LOGINFO("Field memory: %lu blocks allocated, %lu requests served from the pool",
+			(unsigned long)stats.nallocated, (unsigned long)stats.nreused );
+}
+
+/*****************************************************************************************************/
+
+//! copy a contiguous block of memory using all OpenMP threads
+/*! each thread copies one contiguous chunk, which also places the pages of a
+ *  freshly allocated destination on the thread's NUMA node
+ */
+template< typename T >
+inline void parallel_copy( T* dst, const T* src, size_t n )
+{
+	if( n == 0 || dst == src )
+		return;
+
+	#pragma omp parallel
+	{
+		size_t nthreads = omp_get_num_threads(), ithread = omp_get_thread_num();
+		size_t chunk = (n+nthreads-1)/nthreads;
+		size_t i0 = ithread*chunk;
+
+		if( i0 < n )
+			memcpy( dst+i0, src+i0, std::min(chunk,n-i0)*sizeof(T) );
+	}
+}
+
+//! set a contiguous block of memory to zero using all OpenMP threads
+template< typename T >
+inline void parallel_zero( T* dst, size_t n )
+{
+	if( n == 0 )
+		return;
+
+	#pragma omp parallel
+	{
+		size_t nthreads = omp_get_num_threads(), ithread = omp_get_thread_num();
+		size_t chunk = (n+nthreads-1)/nthreads;
+		size_t i0 = ithread*chunk;
+
+		if( i0 < n )
+			memset( dst+i0, 0, std::min(chunk,n-i0)*sizeof(T) );
+	}
+}
+
+//! allocate an aligned array of n elements of type T
+/*! the array is zero-initialised in parallel (first touch) unless this is
+ *  disabled in the settings, or the caller passes first_touch=false because it
+ *  will immediately fill the array using parallel_copy itself
+ */
+template< typename T >
+inline T* mem_allocate( size_t n, bool first_touch=true )
+{
+	T *p = reinterpret_cast<T*>( mem_alloc_raw( n*sizeof(T) ) );
+
+	if( first_touch && mem_alloc_get_settings().first_touch )
+		parallel_zero( p, n );
+
+	return p;
+}
+
+//! release an array obtained from mem_allocate
+template< typename T >
+inline void mem_deallocate( T* p )
+{
+	mem_free_raw( reinterpret_cast<void*>(p) );
+}
+
+/*****************************************************************************************************/
+
+//! STL allocator drawing from the field memory allocator
+/*! default construction of elements is a no-op, so that a container can be
+ *  resized without a serial initialisation pass, and then be initialised in
+ *  parallel with parallel_zero or parallel_copy
+ */
+template< typename T >
+class mem_allocator
+{
+public:
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+
+	template< typename U >
+	struct rebind { typedef mem_allocator<U> other; };
+
+	mem_allocator( void ) { }
+
+	template< typename U >
+	mem_allocator( const mem_allocator<U>& ) { }
+
+	inline T* allocate( size_t n )
+	{
+		if( n > std::numeric_limits<size_t>::max()/sizeof(T) )
+			throw std::bad_alloc();
+		return reinterpret_cast<T*>( mem_alloc_raw( n*sizeof(T) ) );
+	}
+
+	inline void deallocate( T* p, size_t )
+	{	mem_free_raw( reinterpret_cast<void*>(p) );	}
+
+	//! default-initialise instead of value-initialise, leaves PODs untouched
+	template< typename U >
+	inline void construct( U* p )
+	{	::new( reinterpret_cast<void*>(p) ) U;	}
+
+	template< typename U, typename... Args >
+	inline void construct( U* p, Args&&... args )
+	{	::new( reinterpret_cast<void*>(p) ) U( std::forward<Args>(args)... );	}
+
+	template< typename U >
+	inline void destroy( U* p )
+	{	p->~U();	}
+};
+
+template< typename T, typename U >
+inline bool operator==( const mem_allocator<T>&, const mem_allocator<U>& )
+{	return true;	}
+
+template< typename T, typename U >
+inline bool operator!=( const mem_allocator<T>&, const mem_allocator<U>& )
+{	return false;	}
+
+#endif // __MEM_ALLOC_HH
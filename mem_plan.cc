@@ -0,0 +1,227 @@
+/*
+
+ mem_plan.cc - This file is part of MUSIC -
+ a code to generate multi-scale initial conditions
+ for cosmological simulations
+
+ Copyright (C) 2010  Oliver Hahn
+
+*/
+
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+
+#include "mem_plan.hh"
+
+void memory_plan::add_buffer( const std::string& name, size_t nbytes, bool stageable )
+{
+	buffers_[name] = nbytes;
+
+	if( stageable )
+		stageable_.insert( name );
+}
+
+void memory_plan::add_stage( const std::string& name, const std::vector<std::string>& used,
+							 const std::vector<std::string>& held, const scratch_list& scratch )
+{
+	stage s;
+	s.name = name;
+	s.used = used;
+	s.held = held;
+	s.scratch = scratch;
+
+	for( size_t i=0; i<used.size(); ++i )
+		if( buffers_.count( used[i] ) == 0 )
+		{
+			LOGERR("memory plan : stage \'%s\' uses undeclared buffer \'%s\'",name.c_str(),used[i].c_str());
+			throw std::runtime_error("memory plan : undeclared buffer");
+		}
+
+	for( size_t i=0; i<held.size(); ++i )
+		if( buffers_.count( held[i] ) == 0 )
+		{
+			LOGERR("memory plan : stage \'%s\' holds undeclared buffer \'%s\'",name.c_str(),held[i].c_str());
+			throw std::runtime_error("memory plan : undeclared buffer");
+		}
+
+	stages_.push_back( s );
+}
+
+size_t memory_plan::buffer_bytes( const std::string& name ) const
+{
+	std::map<std::string,size_t>::const_iterator it = buffers_.find( name );
+	return (it!=buffers_.end())? it->second : 0;
+}
+
+size_t memory_plan::stage_bytes( size_t istage ) const
+{
+	const stage& s = stages_[istage];
+	size_t nbytes = 0;
+
+	for( size_t i=0; i<s.scratch.size(); ++i )
+		nbytes += s.scratch[i].second;
+
+	for( size_t i=0; i<s.used.size(); ++i )
+		nbytes += buffers_.find( s.used[i] )->second;
+
+	for( size_t i=0; i<s.held.size(); ++i )
+		if( !is_staged( s.held[i] ) )
+			nbytes += buffers_.find( s.held[i] )->second;
+
+	return nbytes;
+}
+
+size_t memory_plan::stage_bytes( const std::string& name ) const
+{
+	for( size_t i=0; i<stages_.size(); ++i )
+		if( stages_[i].name == name )
+			return stage_bytes( i );
+
+	return 0;
+}
+
+size_t memory_plan::peak_stage( void ) const
+{
+	size_t ipeak = 0, npeak = 0;
+
+	for( size_t i=0; i<stages_.size(); ++i )
+	{
+		size_t n = stage_bytes( i );
+		if( n > npeak )
+		{
+			npeak = n;
+			ipeak = i;
+		}
+	}
+
+	return ipeak;
+}
+
+size_t memory_plan::peak_bytes( void ) const
+{
+	if( stages_.empty() )
+		return 0;
+
+	return stage_bytes( peak_stage() );
+}
+
+bool memory_plan::stage_to_fit( size_t max_bytes )
+{
+	while( peak_bytes() > max_bytes )
+	{
+		const stage& s = stages_[ peak_stage() ];
+		std::string best;
+		size_t nbest = 0;
+
+		for( size_t i=0; i<s.held.size(); ++i )
+		{
+			const std::string& name = s.held[i];
+			size_t n = buffers_.find( name )->second;
+
+			if( stageable_.count( name ) && !is_staged( name ) && n > nbest )
+			{
+				best = name;
+				nbest = n;
+			}
+		}
+
+		if( nbest == 0 )
+			return false;
+
+		staged_.insert( best );
+	}
+
+	return true;
+}
+
+void memory_plan::log( void ) const
+{
+	size_t ipeak = peak_stage();
+
+	LOGUSER("Memory plan (%d stages):", (int)stages_.size());
+	for( size_t i=0; i<stages_.size(); ++i )
+	{
+		const stage& s = stages_[i];
+		std::string live;
+
+		for( size_t j=0; j<s.used.size(); ++j )
+			live += s.used[j] + " ";
+		for( size_t j=0; j<s.held.size(); ++j )
+			live += s.held[j] + (is_staged(s.held[j])? "(disk) " : "(held) ");
+		for( size_t j=0; j<s.scratch.size(); ++j )
+			if( s.scratch[j].second > 0 )
+				live += "[" + s.scratch[j].first + "] ";
+
+		LOGUSER("  %c %-34s %10.2f MB   %s", (i==ipeak)? '*':' ', s.name.c_str(),
+				(double)stage_bytes(i)/1024.0/1024.0, live.c_str() );
+	}
+}
+
+void memory_plan::print( bool details ) const
+{
+	size_t ipeak = peak_stage();
+	std::streamsize prec = std::cout.precision();
+
+	std::cout << " - Memory plan:\n";
+	for( size_t i=0; i<stages_.size(); ++i )
+	{
+		std::cout << "   " << ((i==ipeak)? '*' : ' ') << " "
+				  << std::setw(36) << std::left << stages_[i].name << std::right
+				  << std::setw(12) << std::fixed << std::setprecision(2) << (double)stage_bytes(i)/1024.0/1024.0 << " MB\n";
+
+		if( !details )
+			continue;
+
+		const stage& s = stages_[i];
+		for( size_t j=0; j<s.used.size(); ++j )
+			std::cout << "        " << std::setw(34) << std::left << s.used[j] << std::right
+					  << std::setw(12) << (double)buffer_bytes(s.used[j])/1024.0/1024.0 << " MB\n";
+		for( size_t j=0; j<s.held.size(); ++j )
+			std::cout << "        " << std::setw(34) << std::left
+					  << (s.held[j] + (is_staged(s.held[j])? " (on disk)" : " (held)")) << std::right
+					  << std::setw(12) << (is_staged(s.held[j])? 0.0 : (double)buffer_bytes(s.held[j])/1024.0/1024.0) << " MB\n";
+		for( size_t j=0; j<s.scratch.size(); ++j )
+			if( s.scratch[j].second > 0 )
+				std::cout << "        " << std::setw(34) << std::left << s.scratch[j].first << std::right
+						  << std::setw(12) << (double)s.scratch[j].second/1024.0/1024.0 << " MB\n";
+	}
+	std::cout << "   peak memory estimate : " << std::fixed << std::setprecision(2)
+			  << (double)peak_bytes()/1024.0/1024.0/1024.0 << " GB\n";
+	std::cout.unsetf( std::ios::floatfield );
+	std::cout.precision( prec );
+}
+
+size_t grid_level_bytes( const refinement_hierarchy& rh, unsigned ilevel, unsigned nbnd )
+{
+	size_t nx, ny, nz;
+
+	if( ilevel <= rh.levelmin() )
+		nx = ny = nz = (size_t)1<<ilevel;
+	else
+	{
+		nx = rh.size(ilevel,0);
+		ny = rh.size(ilevel,1);
+		nz = rh.size(ilevel,2);
+	}
+
+	return (nx+2*nbnd)*(ny+2*nbnd)*(nz+2*nbnd)*sizeof(real_t);
+}
+
+size_t grid_hierarchy_bytes( const refinement_hierarchy& rh, unsigned nbnd )
+{
+	size_t nbytes = 0, nmask = 0;
+
+	//... base hierarchy down to a single cell, then the refinement patches
+	for( unsigned ilevel=0; ilevel<=rh.levelmax(); ++ilevel )
+	{
+		nbytes += grid_level_bytes( rh, ilevel, nbnd );
+
+		if( ilevel <= rh.levelmin() )
+			nmask += ((size_t)1<<ilevel)*((size_t)1<<ilevel)*((size_t)1<<ilevel);
+		else
+			nmask += rh.size(ilevel,0)*rh.size(ilevel,1)*rh.size(ilevel,2);
+	}
+
+	return nbytes + nmask*sizeof(short);
+}
@@ -0,0 +1,138 @@
+/*
+
+ mem_plan.hh - This file is part of MUSIC -
+ a code to generate multi-scale initial conditions
+ for cosmological simulations
+
+ Copyright (C) 2010  Oliver Hahn
+
+*/
+
+#ifndef __MEM_PLAN_HH
+#define __MEM_PLAN_HH
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+
+#include "general.hh"
+#include "mesh.hh"
+
+/*!
+ * @class memory_plan
+ * @brief static model of the memory usage of the pipeline stages
+ *
+ * Before the run, the driver describes each of its stages by the buffers the
+ * stage works on, the buffers that are merely kept alive for a later stage,
+ * and the scratch memory the stage needs internally. From this the plan
+ * computes the live set and memory of every stage, and thus the peak memory
+ * of the run. Buffers that are only held across a stage can be marked to be
+ * staged to disk, which removes them from the live set of those stages.
+ */
+class memory_plan
+{
+public:
+	//! named parts of the temporary memory of a stage, e.g. FFT arrays or kernels
+	typedef std::vector< std::pair<std::string,size_t> > scratch_list;
+
+	//! a single stage of the pipeline
+	struct stage
+	{
+		std::string name;				//!< human readable name of the stage
+		std::vector<std::string> used;	//!< buffers accessed by the stage
+		std::vector<std::string> held;	//!< buffers only kept alive for a later stage
+		scratch_list scratch;			//!< temporary memory needed internally by the stage
+	};
+
+protected:
+	std::map<std::string,size_t> buffers_;	//!< size in bytes of every named buffer
+	std::set<std::string> stageable_;		//!< buffers that the driver can stage to disk
+	std::set<std::string> staged_;			//!< buffers that are staged to disk while held
+	std::vector<stage> stages_;				//!< the stages in order of execution
+
+public:
+
+	//! declare a named buffer
+	/*! @param name the name of the buffer
+	 *  @param nbytes its size in bytes
+	 *  @param stageable whether the driver can stage it to disk while it is held
+	 */
+	void add_buffer( const std::string& name, size_t nbytes, bool stageable=false );
+
+	//! append a stage
+	/*! @param name the name of the stage
+	 *  @param used buffers accessed by the stage
+	 *  @param held buffers only kept alive for later stages
+	 *  @param scratch temporary memory needed internally by the stage
+	 */
+	void add_stage( const std::string& name, const std::vector<std::string>& used,
+					const std::vector<std::string>& held, const scratch_list& scratch=scratch_list() );
+
+	//! the number of stages
+	size_t nstages( void ) const
+	{	return stages_.size();	}
+
+	//! access a stage
+	const stage& get_stage( size_t istage ) const
+	{	return stages_[istage];	}
+
+	//! the size of a named buffer
+	size_t buffer_bytes( const std::string& name ) const;
+
+	//! the memory needed during a stage
+	size_t stage_bytes( size_t istage ) const;
+
+	//! the memory needed during the first stage of a given name, 0 if there is none
+	size_t stage_bytes( const std::string& name ) const;
+
+	//! the index of the stage with the largest memory requirement
+	size_t peak_stage( void ) const;
+
+	//! the peak memory of the whole plan
+	size_t peak_bytes( void ) const;
+
+	//! stage held buffers to disk until the plan fits
+	/*! held, stageable buffers of the stage at the peak are staged, largest
+	 *  first, until either the plan fits or no candidate is left
+	 *  @param max_bytes the memory cap
+	 *  @return true if the plan fits the cap afterwards
+	 */
+	bool stage_to_fit( size_t max_bytes );
+
+	//! whether a buffer is staged to disk while it is held
+	bool is_staged( const std::string& name ) const
+	{	return staged_.count( name ) > 0;	}
+
+	//! whether any buffer is staged to disk
+	bool has_staging( void ) const
+	{	return !staged_.empty();	}
+
+	//! write a table with the memory of every stage to the log
+	void log( void ) const;
+
+	//! print a table with the memory of every stage to stdout
+	/*! @param details also list the buffers and scratch parts of every stage
+	 */
+	void print( bool details=false ) const;
+};
+
+//! memory in bytes of a single level of a grid_hierarchy, including the ghost zones
+/*! @param rh the refinement structure
+ *  @param ilevel the level, levels up to levelmin are full periodic cubes
+ *  @param nbnd the number of ghost cells
+ */
+size_t grid_level_bytes( const refinement_hierarchy& rh, unsigned ilevel, unsigned nbnd );
+
+//! memory in bytes of a grid_hierarchy on a given refinement structure
+/*! includes the ghost zones and the refinement masks
+ *  @param rh the refinement structure
+ *  @param nbnd the number of ghost cells
+ */
+size_t grid_hierarchy_bytes( const refinement_hierarchy& rh, unsigned nbnd );
+
+//! memory in bytes of an FFT array of a given size in real space, including the padding
+inline size_t fft_array_bytes( size_t nx, size_t ny, size_t nz )
+{	return nx*ny*2*(nz/2+1)*sizeof(fftw_real);	}
+
+#endif // __MEM_PLAN_HH
@@ -14,12 +14,15 @@
 #include <iostream>
 #include <iomanip>
 #include <vector>
+#include <memory>
 #include <stdexcept>
 
 #include <math.h>
+#include <stdio.h>
 
 #include "config_file.hh"
 #include "log.hh"
+#include "mesh_expr.hh"
 
 
 #include "region_generator.hh"
@@ -95,13 +98,30 @@ public:
                 ++count;
         return count;
     }
+    
+    //! get extent of the mask along a specified dimension
+    size_t size( unsigned dim ) const
+    {
+        if( dim == 0 ) return nx_;
+        if( dim == 1 ) return ny_;
+        return nz_;
+    }
+    
+    //! pointer to the flags, stored in the same order as the cells of the level
+    short* get_ptr( void )
+    {   return mask_.data();   }
+    
+    const short* get_ptr( void ) const
+    {   return mask_.data();   }
 };
 
 //! base class for all things that have rectangular mesh structure
 template<typename T>
-class Meshvar{
+class Meshvar : public mesh_expr< Meshvar<T> >{
 public:
 	typedef T real_t;
+	typedef T value_type;
+	typedef const Meshvar<T>& stored_type;
 	
 	size_t 
 		m_nx,	//!< x-extent of the rectangular mesh
@@ -119,14 +139,14 @@ public:
 	explicit Meshvar( size_t n, int offx, int offy, int offz )
 	: m_nx( n ), m_ny( n ), m_nz( n ), m_offx( offx ), m_offy( offy ), m_offz( offz )
 	{
-		m_pdata = new real_t[m_nx*m_ny*m_nz];
+		m_pdata = mem_allocate<real_t>( m_nx*m_ny*m_nz );
 	}
 	
 	//! constructor for rectangular mesh
 	Meshvar( size_t nx, size_t ny, size_t nz, int offx, int offy, int offz )
 	: m_nx( nx ), m_ny( ny ), m_nz( nz ), m_offx( offx ), m_offy( offy ), m_offz( offz )
 	{
-		m_pdata = new real_t[m_nx*m_ny*m_nz];
+		m_pdata = mem_allocate<real_t>( m_nx*m_ny*m_nz );
 	}
 	
 	//! variant copy constructor with optional copying of the actual data
@@ -140,11 +160,10 @@ public:
 		m_offy = m.m_offy;
 		m_offz = m.m_offz;
 		
-		m_pdata = new real_t[m_nx*m_ny*m_nz];
+		m_pdata = mem_allocate<real_t>( m_nx*m_ny*m_nz, !copy_over );
 		
 		if( copy_over )
-			for( size_t i=0; i<m_nx*m_ny*m_nz; ++i )
-				m_pdata[i] = m.m_pdata[i];
+			parallel_copy( m_pdata, m.m_pdata, m_nx*m_ny*m_nz );
 	}
 	
 	//! standard copy constructor
@@ -158,27 +177,41 @@ public:
 		m_offy = m.m_offy;
 		m_offz = m.m_offz;
 		
-		m_pdata = new real_t[m_nx*m_ny*m_nz];
+		m_pdata = mem_allocate<real_t>( m_nx*m_ny*m_nz, false );
 		
-		for( size_t i=0; i<m_nx*m_ny*m_nz; ++i )
-			m_pdata[i] = m.m_pdata[i];
+		parallel_copy( m_pdata, m.m_pdata, m_nx*m_ny*m_nz );
+	}
+	
+	//! move constructor, takes over the data block of m
+	Meshvar( Meshvar<real_t>&& m )
+	: m_nx( m.m_nx ), m_ny( m.m_ny ), m_nz( m.m_nz ), m_offx( m.m_offx ), m_offy( m.m_offy ), m_offz( m.m_offz ),
+	  m_pdata( m.m_pdata )
+	{
+		m.m_pdata = NULL;
 	}
 	
 	//! destructor
 	~Meshvar()
 	{
 		if( m_pdata != NULL )
-			delete[] m_pdata;
+			mem_deallocate( m_pdata );
 	}
 	
 	//! deallocate the data, but keep the structure
 	inline void deallocate( void )
 	{
 		if( m_pdata != NULL )
-			delete[] m_pdata;
+			mem_deallocate( m_pdata );
 		m_pdata = NULL;
 	}
 	
+	//! (re-)allocate the data after deallocate(), the content is zero
+	inline void allocate( void )
+	{
+		if( m_pdata == NULL )
+			m_pdata = mem_allocate<real_t>( m_nx*m_ny*m_nz );
+	}
+	
 	//! get extent of the mesh along a specified dimension (const)
 	inline size_t size( unsigned dim ) const
 	{
@@ -206,8 +239,7 @@ public:
 	//! set all the data to zero values
 	void zero( void )
 	{
-		for( size_t i=0; i<m_nx*m_ny*m_nz; ++i )
-			m_pdata[i] = 0.0;
+		parallel_zero( m_pdata, m_nx*m_ny*m_nz );
 	}
 	
 	//! direct array random acces to the data block
@@ -243,24 +275,21 @@ public:
 	//! direct multiplication of the whole data block with a number
 	Meshvar<real_t>& operator*=( real_t x )
 	{
-		for( size_t i=0; i<m_nx*m_ny*m_nz; ++i )
-			m_pdata[i] *= x;
+		mesh_expr_evaluate<mesh_ops::mul_assign>( m_pdata, m_nx*m_ny*m_nz, mesh_scalar<real_t>(x) );
 		return *this;
 	}
 	
 	//! direct addition of a number to the whole data block
 	Meshvar<real_t>& operator+=( real_t x )
 	{
-		for( size_t i=0; i<m_nx*m_ny*m_nz; ++i )
-			m_pdata[i] += x;
+		mesh_expr_evaluate<mesh_ops::add_assign>( m_pdata, m_nx*m_ny*m_nz, mesh_scalar<real_t>(x) );
 		return *this;
 	}
 
 	//! direct element-wise division of the whole data block by a number
 	Meshvar<real_t>& operator/=( real_t x )
 	{
-		for( size_t i=0; i<m_nx*m_ny*m_nz; ++i )
-			m_pdata[i] /= x;
+		mesh_expr_evaluate<mesh_ops::div_assign>( m_pdata, m_nx*m_ny*m_nz, mesh_scalar<real_t>(x) );
 		return *this;
 	}
 	
@@ -268,8 +297,7 @@ public:
 	//! direct subtraction of a number from the whole data block
 	Meshvar<real_t>& operator-=( real_t x )
 	{
-		for( size_t i=0; i<m_nx*m_ny*m_nz; ++i )
-			m_pdata[i] -= x;
+		mesh_expr_evaluate<mesh_ops::sub_assign>( m_pdata, m_nx*m_ny*m_nz, mesh_scalar<real_t>(x) );
 		return *this;
 	}
 	
@@ -281,8 +309,7 @@ public:
             LOGERR("Meshvar::operator*= : attempt to operate on incompatible data");
             throw std::runtime_error("Meshvar::operator*= : attempt to operate on incompatible data");
 		}
-		for( size_t i=0; i<m_nx*m_ny*m_nz; ++i )
-			m_pdata[i] *= v.m_pdata[i];
+		mesh_expr_evaluate<mesh_ops::mul_assign>( m_pdata, m_nx*m_ny*m_nz, v );
 		
 		return *this;
 	}
@@ -296,8 +323,7 @@ public:
             throw std::runtime_error("Meshvar::operator/= : attempt to operate on incompatible data");
 		}
         
-		for( size_t i=0; i<m_nx*m_ny*m_nz; ++i )
-			m_pdata[i] /= v.m_pdata[i];
+		mesh_expr_evaluate<mesh_ops::div_assign>( m_pdata, m_nx*m_ny*m_nz, v );
 		
 		return *this;
 	}
@@ -310,8 +336,7 @@ public:
             LOGERR("Meshvar::operator+= : attempt to operate on incompatible data");
             throw std::runtime_error("Meshvar::operator+= : attempt to operate on incompatible data");
 		}
-		for( size_t i=0; i<m_nx*m_ny*m_nz; ++i )
-			m_pdata[i] += v.m_pdata[i];
+		mesh_expr_evaluate<mesh_ops::add_assign>( m_pdata, m_nx*m_ny*m_nz, v );
 		
 		return *this;
 	}
@@ -324,8 +349,7 @@ public:
             LOGERR("Meshvar::operator-= : attempt to operate on incompatible data");
             throw std::runtime_error("Meshvar::operator-= : attempt to operate on incompatible data");
 		}
-		for( size_t i=0; i<m_nx*m_ny*m_nz; ++i )
-			m_pdata[i] -= v.m_pdata[i];
+		mesh_expr_evaluate<mesh_ops::sub_assign>( m_pdata, m_nx*m_ny*m_nz, v );
 		
 		return *this;
 	}
@@ -342,16 +366,77 @@ public:
 		m_offz = m.m_offz;
 		
 		if( m_pdata != NULL )
-			delete m_pdata;
+			mem_deallocate( m_pdata );
 		
-		m_pdata = new real_t[m_nx*m_ny*m_nz];
+		m_pdata = mem_allocate<real_t>( m_nx*m_ny*m_nz, false );
 		
-		for( size_t i=0; i<m_nx*m_ny*m_nz; ++i )
-			m_pdata[i] = m.m_pdata[i];
+		parallel_copy( m_pdata, m.m_pdata, m_nx*m_ny*m_nz );
 		
 		return *this;
 	}
 	
+	//! move assignment, takes over the data block of m
+	Meshvar<real_t>& operator=( Meshvar<real_t>&& m )
+	{
+		std::swap( m_nx, m.m_nx );
+		std::swap( m_ny, m.m_ny );
+		std::swap( m_nz, m.m_nz );
+		std::swap( m_offx, m.m_offx );
+		std::swap( m_offy, m.m_offy );
+		std::swap( m_offz, m.m_offz );
+		std::swap( m_pdata, m.m_pdata );
+		
+		return *this;
+	}
+	
+	//! evaluate an element-wise expression into the data block in a single pass
+	template< typename E >
+	Meshvar<real_t>& operator=( const mesh_expr<E>& e )
+	{
+		mesh_expr_evaluate<mesh_ops::assign>( m_pdata, m_nx*m_ny*m_nz, e );
+		return *this;
+	}
+	
+	//! add an element-wise expression to the data block in a single pass
+	template< typename E >
+	Meshvar<real_t>& operator+=( const mesh_expr<E>& e )
+	{
+		mesh_expr_evaluate<mesh_ops::add_assign>( m_pdata, m_nx*m_ny*m_nz, e );
+		return *this;
+	}
+	
+	//! subtract an element-wise expression from the data block in a single pass
+	template< typename E >
+	Meshvar<real_t>& operator-=( const mesh_expr<E>& e )
+	{
+		mesh_expr_evaluate<mesh_ops::sub_assign>( m_pdata, m_nx*m_ny*m_nz, e );
+		return *this;
+	}
+	
+	//! multiply the data block element-wise by an expression in a single pass
+	template< typename E >
+	Meshvar<real_t>& operator*=( const mesh_expr<E>& e )
+	{
+		mesh_expr_evaluate<mesh_ops::mul_assign>( m_pdata, m_nx*m_ny*m_nz, e );
+		return *this;
+	}
+	
+	//! divide the data block element-wise by an expression in a single pass
+	template< typename E >
+	Meshvar<real_t>& operator/=( const mesh_expr<E>& e )
+	{
+		mesh_expr_evaluate<mesh_ops::div_assign>( m_pdata, m_nx*m_ny*m_nz, e );
+		return *this;
+	}
+	
+	//! value at linear index i, used when the mesh appears in an expression
+	inline real_t eval( const size_t i ) const
+	{	return m_pdata[i];	}
+	
+	//! number of elements (including ghost zones), used when the mesh appears in an expression
+	inline size_t nelem( void ) const
+	{	return m_nx*m_ny*m_nz;	}
+	
 	real_t* get_ptr( void )
 	{	return m_pdata;		}
 };
@@ -402,6 +487,19 @@ public:
 	: Meshvar<real_t>( v, true ), m_nbnd( v.m_nbnd )
 	{   }
 	
+	//! move constructor
+	MeshvarBnd( MeshvarBnd<real_t>&& v )
+	: Meshvar<real_t>( std::move(v) ), m_nbnd( v.m_nbnd )
+	{   }
+	
+	//! move assignment
+	MeshvarBnd<real_t>& operator=( MeshvarBnd<real_t>&& v )
+	{
+		Meshvar<real_t>::operator=( std::move(v) );
+		std::swap( m_nbnd, v.m_nbnd );
+		return *this;
+	}
+	
 	//! get extent of the mesh along a specified dimension
 	inline size_t size( unsigned dim=0 ) const
 	{
@@ -434,17 +532,24 @@ public:
 			this->m_nz = m.m_nz;
 			
 			if( m_pdata != NULL )
-				delete[] m_pdata;
+				mem_deallocate( m_pdata );
 			
-			m_pdata = new real_t[m_nx*m_ny*m_nz];			
+			m_pdata = mem_allocate<real_t>( m_nx*m_ny*m_nz, false );
 		}
 		
-		for( size_t i=0; i<m_nx*m_ny*m_nz; ++i )
-			this->m_pdata[i] = m.m_pdata[i];
+		parallel_copy( m_pdata, m.m_pdata, m_nx*m_ny*m_nz );
 		
 		return *this;
 	}
 
+	//! evaluate an element-wise expression into the data block (including ghost zones) in a single pass
+	template< typename E >
+	MeshvarBnd<real_t>& operator=( const mesh_expr<E>& e )
+	{
+		Meshvar<real_t>::operator=( e );
+		return *this;
+	}
+
 	//! sets the value of all ghost zones to zero
 	void zero_bnd( void )
 	{
@@ -519,10 +624,14 @@ public:
 
 //! class that subsumes a nested grid collection
 template< typename T >
-class GridHierarchy
+class GridHierarchy : public hierarchy_expr< GridHierarchy<T> >
 {
 public:
 	
+	typedef T value_type;
+	typedef const GridHierarchy<T>& stored_type;
+	typedef Meshvar<T> level_type;
+	
 	//! number of ghost cells on boundary
 	size_t m_nbnd;
 	
@@ -530,7 +639,10 @@ public:
 	unsigned m_levelmin;
 	
 	//! vector of pointers to the underlying rectangular mesh data for each level
-	std::vector< MeshvarBnd<T>* > m_pgrids;
+	/*! levels are shared between copies of a hierarchy and only duplicated when
+	 *  one of the copies is modified (copy-on-write), see detach and writable
+	 */
+	std::vector< std::shared_ptr< MeshvarBnd<T> > > m_pgrids;
 	
 	std::vector<int> 
 		m_xoffabs,		//!< vector of x-offsets of a level mesh relative to the coarser level
@@ -542,6 +654,54 @@ public:
 	
 protected:
 	
+	//! identifies files written by save
+	static const unsigned hierarchy_file_magic = 0x4d474831;
+	
+	//! evaluate an expression level by level, each level being a single fused loop
+	template< typename Upd, typename E >
+	GridHierarchy<T>& evaluate_expr( const E& e, const char* opname )
+	{
+		if( e.nlevels() != 0 && e.nlevels() != m_pgrids.size() )
+		{
+			LOGERR("GridHierarchy::%s : attempt to operate on incompatible data", opname);
+			throw std::runtime_error("GridHierarchy : attempt to operate on incompatible data");
+		}
+		
+		for( unsigned i=0; i<m_pgrids.size(); ++i )
+		{
+			detach_level( i );
+			mesh_expr_evaluate<Upd>( m_pgrids[i]->get_ptr(), m_pgrids[i]->nelem(), e.level(i) );
+		}
+		
+		return *this;
+	}
+	
+	//! make sure a level is not shared with another hierarchy before it is modified
+	/*! @param ilevel the level to be detached
+	 *  @param copy_over whether the data needs to be copied, false if it will be overwritten anyway
+	 */
+	void detach_level( unsigned ilevel, bool copy_over=true )
+	{
+		if( m_pgrids[ilevel].use_count() > 1 )
+			m_pgrids[ilevel] = std::make_shared< MeshvarBnd<T> >( *m_pgrids[ilevel], copy_over );
+	}
+	
+	//! copy the refinement masks of another hierarchy
+	void copy_refinement_masks( const GridHierarchy<T>& gh )
+	{
+		for( size_t i=0; i<m_ref_masks.size(); ++i )
+			delete m_ref_masks[i];
+		m_ref_masks.clear();
+		
+		bhave_refmask = gh.bhave_refmask;
+		
+		if( bhave_refmask )
+		{
+			for( size_t i=0; i<gh.m_ref_masks.size(); ++i )
+				m_ref_masks.push_back( new refinement_mask( *(gh.m_ref_masks[i]) ) );
+		}
+	}
+	
 	//! check whether a given grid has identical hierarchy, dimensions to this 
 	bool is_consistent( const GridHierarchy<T>& gh )
 	{
@@ -567,6 +727,10 @@ public:
 	
 	
 	//! return a pointer to the MeshvarBnd object representing data for one level
+	/*! the level is returned as it is, even if it is shared with another hierarchy.
+	 *  Before a level is modified through the returned pointer, detach or writable
+	 *  needs to be called outside of parallel regions.
+	 */
 	MeshvarBnd<T> *get_grid( unsigned ilevel )
 	{	
 
@@ -575,7 +739,27 @@ public:
 			LOGERR("Attempt to access level %d but maxlevel = %d", ilevel, m_pgrids.size()-1);
 			throw std::runtime_error("Fatal: attempt to access non-existent grid");
 		}
-		return m_pgrids[ilevel];  
+		
+		return m_pgrids[ilevel].get();
+	}
+	
+	//! return a pointer to a level that may be modified, duplicating it first if it is shared
+	/*! not thread-safe, to be called outside of parallel regions
+	 */
+	MeshvarBnd<T> *writable( unsigned ilevel )
+	{
+		get_grid( ilevel );		//... throws for a non-existent level
+		detach_level( ilevel );
+		return m_pgrids[ilevel].get();
+	}
+	
+	//! duplicate all levels shared with other hierarchies, so that they can be modified through get_grid
+	/*! not thread-safe, to be called outside of parallel regions
+	 */
+	void detach( void )
+	{
+		for( unsigned i=0; i<m_pgrids.size(); ++i )
+			detach_level( i );
 	}
 
 	//! return a pointer to the MeshvarBnd object representing data for one level (const)	
@@ -587,7 +771,7 @@ public:
 			throw std::runtime_error("Fatal: attempt to access non-existent grid");
 		}
 
-		return m_pgrids[ilevel];  
+		return m_pgrids[ilevel].get();
 	}
 	
 	
@@ -601,27 +785,42 @@ public:
 		m_pgrids.clear();
 	}
 	
-	//! copy constructor
+	//! copy constructor, the level data is shared until either copy is modified
 	explicit GridHierarchy( const GridHierarchy<T> & gh )
+	: m_nbnd( gh.m_nbnd ), m_levelmin( gh.m_levelmin ), m_pgrids( gh.m_pgrids ),
+	  m_xoffabs( gh.m_xoffabs ), m_yoffabs( gh.m_yoffabs ), m_zoffabs( gh.m_zoffabs ), bhave_refmask( false )
 	{
-		for( unsigned i=0; i<=gh.levelmax(); ++i )
-			m_pgrids.push_back( new MeshvarBnd<T>( *gh.get_grid(i) ) );
-		
-		m_nbnd = gh.m_nbnd;
-		m_levelmin = gh.m_levelmin;
+		copy_refinement_masks( gh );
+	}
+	
+	//! variant copy constructor, creates a hierarchy with the same structure but optionally without copying the data
+	/*! @param gh the hierarchy whose structure is to be copied
+	 *  @param copy_over if false, new levels are allocated but their data is left uninitialised
+	 */
+	GridHierarchy( const GridHierarchy<T> & gh, bool copy_over )
+	: m_nbnd( gh.m_nbnd ), m_levelmin( gh.m_levelmin ),
+	  m_xoffabs( gh.m_xoffabs ), m_yoffabs( gh.m_yoffabs ), m_zoffabs( gh.m_zoffabs ), bhave_refmask( false )
+	{
+		if( copy_over )
+			m_pgrids = gh.m_pgrids;
+		else
+			for( unsigned i=0; i<gh.m_pgrids.size(); ++i )
+				m_pgrids.push_back( std::make_shared< MeshvarBnd<T> >( *gh.m_pgrids[i], false ) );
 		
-		m_xoffabs = gh.m_xoffabs;
-		m_yoffabs = gh.m_yoffabs;
-		m_zoffabs = gh.m_zoffabs;
-        
-        //ref_mask   = gh.ref_mask;
-        bhave_refmask = gh.bhave_refmask;
-        
-        if( bhave_refmask )
-        {
-            for( size_t i=0; i<gh.m_ref_masks.size(); ++i )
-                m_ref_masks.push_back( new refinement_mask( *(gh.m_ref_masks[i]) ) );
-        }
+		copy_refinement_masks( gh );
+	}
+	
+	//! move constructor
+	GridHierarchy( GridHierarchy<T> && gh )
+	: m_nbnd( gh.m_nbnd ), m_levelmin( gh.m_levelmin ), bhave_refmask( gh.bhave_refmask )
+	{
+		m_pgrids.swap( gh.m_pgrids );
+		m_xoffabs.swap( gh.m_xoffabs );
+		m_yoffabs.swap( gh.m_yoffabs );
+		m_zoffabs.swap( gh.m_zoffabs );
+		m_ref_masks.swap( gh.m_ref_masks );
+		gh.m_levelmin = 0;
+		gh.bhave_refmask = false;
 	}
 	
 	//! destructor
@@ -633,10 +832,8 @@ public:
 	//! free all memory occupied by the grid hierarchy
 	void deallocate()
 	{
-		for( unsigned i=0; i<m_pgrids.size(); ++i )
-			delete m_pgrids[i];
 		m_pgrids.clear();
-		std::vector< MeshvarBnd<T>* >().swap( m_pgrids );
+		std::vector< std::shared_ptr< MeshvarBnd<T> > >().swap( m_pgrids );
 		
 		m_xoffabs.clear();
 		m_yoffabs.clear();
@@ -647,6 +844,193 @@ public:
             delete m_ref_masks[i];
         m_ref_masks.clear();
 	}
+	
+	//! write the data of all levels to a file and release it, keeping the structure
+	/*! levels that are shared with another hierarchy are skipped, since their
+	 *  memory would not be released anyway. Use stage_in to restore the data.
+	 *  @param fname name of the staging file
+	 */
+	void stage_out( const std::string& fname )
+	{
+		FILE *fp = fopen( fname.c_str(), "wb" );
+		
+		if( fp == NULL )
+		{
+			LOGERR("Could not open staging file \'%s\' for writing.",fname.c_str());
+			throw std::runtime_error("Could not open staging file for writing");
+		}
+		
+		for( unsigned i=0; i<m_pgrids.size(); ++i )
+		{
+			MeshvarBnd<T>& g = *m_pgrids[i];
+			
+			if( m_pgrids[i].use_count() > 1 || g.get_ptr() == NULL )
+				continue;
+			
+			size_t n = g.nelem();
+			
+			if( fwrite( g.get_ptr(), sizeof(T), n, fp ) != n )
+			{
+				fclose( fp );
+				LOGERR("Could not write level %d to staging file \'%s\'.",i,fname.c_str());
+				throw std::runtime_error("Could not write to staging file");
+			}
+			
+			g.deallocate();
+		}
+		
+		fclose( fp );
+	}
+	
+	//! restore the data of all levels released by stage_out and remove the staging file
+	/*! @param fname name of the staging file
+	 */
+	void stage_in( const std::string& fname )
+	{
+		FILE *fp = fopen( fname.c_str(), "rb" );
+		
+		if( fp == NULL )
+		{
+			LOGERR("Could not open staging file \'%s\' for reading.",fname.c_str());
+			throw std::runtime_error("Could not open staging file for reading");
+		}
+		
+		for( unsigned i=0; i<m_pgrids.size(); ++i )
+		{
+			MeshvarBnd<T>& g = *m_pgrids[i];
+			
+			if( g.get_ptr() != NULL )
+				continue;
+			
+			size_t n = g.nelem();
+			g.allocate();
+			
+			if( fread( g.get_ptr(), sizeof(T), n, fp ) != n )
+			{
+				fclose( fp );
+				LOGERR("Could not read level %d from staging file \'%s\'.",i,fname.c_str());
+				throw std::runtime_error("Could not read from staging file");
+			}
+		}
+		
+		fclose( fp );
+		remove( fname.c_str() );
+	}
+	
+	//! write the complete hierarchy, including level layout and refinement masks, to a file
+	/*! the file is first written under a temporary name and then renamed, so that an
+	 *  interrupted write never leaves a truncated file behind. Use load to restore it.
+	 *  @param fname name of the checkpoint file
+	 */
+	void save( const std::string& fname ) const
+	{
+		std::string ftmp = fname + ".tmp";
+		FILE *fp = fopen( ftmp.c_str(), "wb" );
+		
+		if( fp == NULL )
+		{
+			LOGERR("Could not open checkpoint file \'%s\' for writing.",ftmp.c_str());
+			throw std::runtime_error("Could not open checkpoint file for writing");
+		}
+		
+		unsigned header[7] = { hierarchy_file_magic, (unsigned)sizeof(T), (unsigned)m_nbnd, m_levelmin,
+			(unsigned)m_pgrids.size(), (unsigned)m_ref_masks.size(), (unsigned)bhave_refmask };
+		bool ok = fwrite( header, sizeof(unsigned), 7, fp ) == 7;
+		
+		for( unsigned i=0; ok && i<m_pgrids.size(); ++i )
+		{
+			const MeshvarBnd<T>& g = *m_pgrids[i];
+			long layout[9] = { (long)size(i,0), (long)size(i,1), (long)size(i,2),
+				offset(i,0), offset(i,1), offset(i,2), offset_abs(i,0), offset_abs(i,1), offset_abs(i,2) };
+			
+			ok = m_pgrids[i]->get_ptr() != NULL
+				&& fwrite( layout, sizeof(long), 9, fp ) == 9
+				&& fwrite( m_pgrids[i]->get_ptr(), sizeof(T), g.nelem(), fp ) == g.nelem();
+		}
+		
+		for( unsigned i=0; ok && i<m_ref_masks.size(); ++i )
+		{
+			const refinement_mask& m = *m_ref_masks[i];
+			size_t msize[3] = { m.size(0), m.size(1), m.size(2) };
+			size_t n = msize[0]*msize[1]*msize[2];
+			
+			ok = fwrite( msize, sizeof(size_t), 3, fp ) == 3
+				&& fwrite( m.get_ptr(), sizeof(short), n, fp ) == n;
+		}
+		
+		ok = (fclose( fp ) == 0) && ok;
+		
+		if( !ok || rename( ftmp.c_str(), fname.c_str() ) != 0 )
+		{
+			remove( ftmp.c_str() );
+			LOGERR("Could not write checkpoint file \'%s\'.",fname.c_str());
+			throw std::runtime_error("Could not write checkpoint file");
+		}
+	}
+	
+	//! replace the hierarchy by one previously written by save
+	/*! @param fname name of the checkpoint file
+	 */
+	void load( const std::string& fname )
+	{
+		FILE *fp = fopen( fname.c_str(), "rb" );
+		
+		if( fp == NULL )
+		{
+			LOGERR("Could not open checkpoint file \'%s\' for reading.",fname.c_str());
+			throw std::runtime_error("Could not open checkpoint file for reading");
+		}
+		
+		unsigned header[7];
+		if( fread( header, sizeof(unsigned), 7, fp ) != 7 || header[0] != hierarchy_file_magic || header[1] != sizeof(T) )
+		{
+			fclose( fp );
+			LOGERR("File \'%s\' does not contain a grid hierarchy of matching type.",fname.c_str());
+			throw std::runtime_error("Invalid checkpoint file");
+		}
+		
+		this->deallocate();
+		m_nbnd = header[2];
+		m_levelmin = header[3];
+		
+		bool ok = true;
+		for( unsigned i=0; ok && i<header[4]; ++i )
+		{
+			long layout[9];
+			if( !(ok = fread( layout, sizeof(long), 9, fp ) == 9) )
+				break;
+			
+			m_pgrids.push_back( std::make_shared< MeshvarBnd<T> >( (int)m_nbnd, layout[0], layout[1], layout[2],
+																	 layout[3], layout[4], layout[5] ) );
+			m_xoffabs.push_back( layout[6] );
+			m_yoffabs.push_back( layout[7] );
+			m_zoffabs.push_back( layout[8] );
+			
+			MeshvarBnd<T>& g = *m_pgrids.back();
+			ok = fread( g.get_ptr(), sizeof(T), g.nelem(), fp ) == g.nelem();
+		}
+		
+		for( unsigned i=0; ok && i<header[5]; ++i )
+		{
+			size_t msize[3];
+			if( !(ok = fread( msize, sizeof(size_t), 3, fp ) == 3) )
+				break;
+			
+			m_ref_masks.push_back( new refinement_mask( msize[0], msize[1], msize[2] ) );
+			size_t n = msize[0]*msize[1]*msize[2];
+			ok = fread( m_ref_masks.back()->get_ptr(), sizeof(short), n, fp ) == n;
+		}
+		
+		bhave_refmask = header[6] != 0;
+		fclose( fp );
+		
+		if( !ok )
+		{
+			this->deallocate();
+			LOGERR("Checkpoint file \'%s\' is truncated.",fname.c_str());
+			throw std::runtime_error("Truncated checkpoint file");
+		}
+	}
     
     
     // meaning of the mask:
@@ -877,7 +1261,10 @@ public:
 	void zero( void )
 	{
 		for( unsigned i=0; i<m_pgrids.size(); ++i )
+		{
+			detach_level( i, false );
 			m_pgrids[i]->zero();
+		}
 	}
 	
 	
@@ -931,7 +1318,7 @@ public:
 		for( unsigned i=0; i<= lmax; ++i )
 		{
 			//std::cout << "....adding level " << i << " (" << n << ", " << n << ", " << n << ")" << std::endl;
-			m_pgrids.push_back( new MeshvarBnd<T>( m_nbnd, n, n, n, 0, 0, 0 ) );
+			m_pgrids.push_back( std::make_shared< MeshvarBnd<T> >( m_nbnd, n, n, n, 0, 0, 0 ) );
 			m_pgrids[i]->zero();
      		n *= 2;
 			
@@ -950,7 +1337,7 @@ public:
 	GridHierarchy<T>& operator*=( T x )
 	{
 		for( unsigned i=0; i<m_pgrids.size(); ++i )
-			(*m_pgrids[i]) *= x;
+			(*writable(i)) *= x;
 		return *this;
 	}
 	
@@ -958,7 +1345,7 @@ public:
 	GridHierarchy<T>& operator/=( T x )
 	{
 		for( unsigned i=0; i<m_pgrids.size(); ++i )
-			(*m_pgrids[i]) /= x;
+			(*writable(i)) /= x;
 		return *this;
 	}
 	
@@ -966,7 +1353,7 @@ public:
 	GridHierarchy<T>& operator+=( T x )
 	{
 		for( unsigned i=0; i<m_pgrids.size(); ++i )
-			(*m_pgrids[i]) += x;
+			(*writable(i)) += x;
 		return *this;
 	}
 	
@@ -974,7 +1361,7 @@ public:
 	GridHierarchy<T>& operator-=( T x )
 	{
 		for( unsigned i=0; i<m_pgrids.size(); ++i )
-			(*m_pgrids[i]) -= x;
+			(*writable(i)) -= x;
 		return *this;
 	}
 	
@@ -987,7 +1374,7 @@ public:
             throw std::runtime_error("GridHierarchy::operator*= : attempt to operate on incompatible data");
 		}
 		for( unsigned i=0; i<m_pgrids.size(); ++i )
-			(*m_pgrids[i]) *= *gh.get_grid(i);
+			(*writable(i)) *= *gh.get_grid(i);
 		return *this;
 	}
 	
@@ -1000,7 +1387,7 @@ public:
             throw std::runtime_error("GridHierarchy::operator/= : attempt to operate on incompatible data");
 		}
 		for( unsigned i=0; i<m_pgrids.size(); ++i )
-			(*m_pgrids[i]) /= *gh.get_grid(i);
+			(*writable(i)) /= *gh.get_grid(i);
 		return *this;
 	}
 	
@@ -1011,7 +1398,7 @@ public:
 			throw std::runtime_error("GridHierarchy::operator+= : attempt to operate on incompatible data");
 		
 		for( unsigned i=0; i<m_pgrids.size(); ++i )
-			(*m_pgrids[i]) += *gh.get_grid(i);
+			(*writable(i)) += *gh.get_grid(i);
 		return *this;
 	}
 	
@@ -1024,45 +1411,87 @@ public:
             throw std::runtime_error("GridHierarchy::operator-= : attempt to operate on incompatible data");
 		}
 		for( unsigned i=0; i<m_pgrids.size(); ++i )
-			(*m_pgrids[i]) -= *gh.get_grid(i);
+			(*writable(i)) -= *gh.get_grid(i);
 		return *this;
 	}
 	
-	//! assign (element-wise) two grid hierarchies
+	//! assign two grid hierarchies, the level data is shared until either is modified
 	GridHierarchy<T>& operator=( const GridHierarchy<T>& gh )
 	{
-        bhave_refmask = gh.bhave_refmask;
-
-        if( bhave_refmask )
-        {
-            for( unsigned i=0; i<=gh.levelmax(); ++i )
-                m_ref_masks.push_back( new refinement_mask( *(gh.m_ref_masks[i]) ) );
-        }
-      
-		if( !is_consistent(gh) )
-		{
-			for( unsigned i=0; i<m_pgrids.size(); ++i )
-				delete m_pgrids[i];
-			m_pgrids.clear();
-			
-			for( unsigned i=0; i<=gh.levelmax(); ++i )
-				m_pgrids.push_back( new MeshvarBnd<T>( *gh.get_grid(i) ) );
-			m_levelmin = gh.levelmin();
-			m_nbnd = gh.m_nbnd;
-			
-			m_xoffabs = gh.m_xoffabs;
-			m_yoffabs = gh.m_yoffabs;
-			m_zoffabs = gh.m_zoffabs;
-			
-			
+		if( this == &gh )
 			return *this;
-		}//throw std::runtime_error("GridHierarchy::operator= : attempt to operate on incompatible data");
 		
-		for( unsigned i=0; i<m_pgrids.size(); ++i )
-			(*m_pgrids[i]) = *gh.get_grid(i);
+		copy_refinement_masks( gh );
+		
+		m_pgrids = gh.m_pgrids;
+		m_levelmin = gh.levelmin();
+		m_nbnd = gh.m_nbnd;
+		
+		m_xoffabs = gh.m_xoffabs;
+		m_yoffabs = gh.m_yoffabs;
+		m_zoffabs = gh.m_zoffabs;
+		
+		return *this;
+	}
+	
+	//! move assignment
+	GridHierarchy<T>& operator=( GridHierarchy<T>&& gh )
+	{
+		std::swap( m_nbnd, gh.m_nbnd );
+		std::swap( m_levelmin, gh.m_levelmin );
+		std::swap( bhave_refmask, gh.bhave_refmask );
+		m_pgrids.swap( gh.m_pgrids );
+		m_xoffabs.swap( gh.m_xoffabs );
+		m_yoffabs.swap( gh.m_yoffabs );
+		m_zoffabs.swap( gh.m_zoffabs );
+		m_ref_masks.swap( gh.m_ref_masks );
+		
 		return *this;
 	}
 	
+	//! evaluate an element-wise expression of grid hierarchies in a single pass per level
+	template< typename E >
+	GridHierarchy<T>& operator=( const hierarchy_expr<E>& e )
+	{
+		return evaluate_expr<mesh_ops::assign>( e.self(), "operator=" );
+	}
+	
+	//! add an element-wise expression of grid hierarchies in a single pass per level
+	template< typename E >
+	GridHierarchy<T>& operator+=( const hierarchy_expr<E>& e )
+	{
+		return evaluate_expr<mesh_ops::add_assign>( e.self(), "operator+=" );
+	}
+	
+	//! subtract an element-wise expression of grid hierarchies in a single pass per level
+	template< typename E >
+	GridHierarchy<T>& operator-=( const hierarchy_expr<E>& e )
+	{
+		return evaluate_expr<mesh_ops::sub_assign>( e.self(), "operator-=" );
+	}
+	
+	//! multiply element-wise by an expression of grid hierarchies in a single pass per level
+	template< typename E >
+	GridHierarchy<T>& operator*=( const hierarchy_expr<E>& e )
+	{
+		return evaluate_expr<mesh_ops::mul_assign>( e.self(), "operator*=" );
+	}
+	
+	//! divide element-wise by an expression of grid hierarchies in a single pass per level
+	template< typename E >
+	GridHierarchy<T>& operator/=( const hierarchy_expr<E>& e )
+	{
+		return evaluate_expr<mesh_ops::div_assign>( e.self(), "operator/=" );
+	}
+	
+	//! the data of one level, used when the hierarchy appears in an expression
+	inline const Meshvar<T>& level( unsigned ilevel ) const
+	{	return *m_pgrids[ilevel];	}
+	
+	//! the number of levels, used when the hierarchy appears in an expression
+	inline size_t nlevels( void ) const
+	{	return m_pgrids.size();	}
+	
 	/*
 	//! assignment operator
 	GridHierarchy& operator=( const GridHierarchy<T>& gh )
@@ -1095,7 +1524,7 @@ public:
 	 */
 	void add_patch( unsigned xoff, unsigned yoff, unsigned zoff, unsigned nx, unsigned ny, unsigned nz )
 	{
-		m_pgrids.push_back( new MeshvarBnd<T>( m_nbnd, nx, ny, nz, xoff, yoff, zoff ) );
+		m_pgrids.push_back( std::make_shared< MeshvarBnd<T> >( m_nbnd, nx, ny, nz, xoff, yoff, zoff ) );
 		m_pgrids.back()->zero();
 		
 		//.. add absolute offsets (in units of current level grid cells)
@@ -1138,8 +1567,7 @@ public:
 					(*mnew)(i,j,k) = (*m_pgrids[ilevel])(i+dx,j+dy,k+dz);
 
 		//... replace in hierarchy
-		delete m_pgrids[ilevel];
-		m_pgrids[ilevel] = mnew;
+		m_pgrids[ilevel].reset( mnew );
 		
 		//... update offsets
 		m_xoffabs[ilevel] += dx;
@@ -1148,9 +1576,10 @@ public:
 		
 		if( ilevel < levelmax() )
 		{
-			m_pgrids[ilevel+1]->offset(0) -= dx;
-			m_pgrids[ilevel+1]->offset(1) -= dy;
-			m_pgrids[ilevel+1]->offset(2) -= dz;
+			MeshvarBnd<T> *pfine = writable(ilevel+1);
+			pfine->offset(0) -= dx;
+			pfine->offset(1) -= dy;
+			pfine->offset(2) -= dz;
 		}
 		
 		find_new_levelmin();
@@ -1185,8 +1614,7 @@ public:
 	}
 
     //... replace in hierarchy
-    delete m_pgrids[ilevel];
-    m_pgrids[ilevel] = mnew;
+    m_pgrids[ilevel].reset( mnew );
     
     //... update offsets
     m_xoffabs[ilevel] += dx;
@@ -1195,9 +1623,10 @@ public:
     
     if( ilevel < levelmax() )
       {
-	m_pgrids[ilevel+1]->offset(0) -= dx;
-	m_pgrids[ilevel+1]->offset(1) -= dy;
-	m_pgrids[ilevel+1]->offset(2) -= dz;
+	MeshvarBnd<T> *pfine = writable(ilevel+1);
+	pfine->offset(0) -= dx;
+	pfine->offset(1) -= dy;
+	pfine->offset(2) -= dz;
       }
 
     //... enforce top mean density over same patch
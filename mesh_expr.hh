@@ -0,0 +1,254 @@
+/*
+
+ mesh_expr.hh - This file is part of MUSIC -
+ a code to generate multi-scale initial conditions
+ for cosmological simulations
+
+ Copyright (C) 2010  Oliver Hahn
+
+*/
+
+#ifndef __MESH_EXPR_HH
+#define __MESH_EXPR_HH
+
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+#include "omp.h"
+#include "log.hh"
+#include "mem_alloc.hh"
+
+/*!
+ * expression templates for element-wise arithmetic on Meshvar, MeshvarBnd and
+ * GridHierarchy objects. An expression like  a += c*(b-d)  is not evaluated
+ * operand by operand, but builds a lightweight expression object that is then
+ * evaluated in a single OpenMP parallel and vectorised loop over the target
+ * data, i.e. with one pass over memory instead of one per operator.
+ */
+
+//! element-wise operations that can appear in a mesh expression
+namespace mesh_ops
+{
+	struct add { template< typename T > static inline T apply( T a, T b ) { return a+b; } };
+	struct sub { template< typename T > static inline T apply( T a, T b ) { return a-b; } };
+	struct mul { template< typename T > static inline T apply( T a, T b ) { return a*b; } };
+	struct div { template< typename T > static inline T apply( T a, T b ) { return a/b; } };
+
+	//! in-place update operations used when evaluating an expression into a mesh
+	struct assign     { template< typename T > static inline void update( T& a, T b ) { a  = b; } };
+	struct add_assign { template< typename T > static inline void update( T& a, T b ) { a += b; } };
+	struct sub_assign { template< typename T > static inline void update( T& a, T b ) { a -= b; } };
+	struct mul_assign { template< typename T > static inline void update( T& a, T b ) { a *= b; } };
+	struct div_assign { template< typename T > static inline void update( T& a, T b ) { a /= b; } };
+}
+
+/*****************************************************************************************************/
+
+//! CRTP base class of all element-wise mesh expressions
+/*! derived classes E need to provide
+ *   - typedef value_type      : the scalar type of the expression
+ *   - typedef stored_type     : how the node is held inside a parent expression
+ *   - value_type eval(size_t) : the value of the expression at a linear index
+ *   - size_t nelem()          : the number of elements (0 for scalars, which broadcast)
+ */
+template< typename E >
+class mesh_expr
+{
+public:
+	inline const E& self( void ) const
+	{	return static_cast<const E&>(*this);	}
+};
+
+//! a scalar constant inside a mesh expression
+template< typename T >
+class mesh_scalar : public mesh_expr< mesh_scalar<T> >
+{
+	T val_;
+
+public:
+	typedef T value_type;
+	typedef mesh_scalar<T> stored_type;
+
+	explicit mesh_scalar( T val )
+	: val_( val )
+	{ }
+
+	inline T eval( size_t ) const
+	{	return val_;	}
+
+	inline size_t nelem( void ) const
+	{	return 0;	}
+};
+
+//! a binary element-wise operation inside a mesh expression
+template< typename Op, typename L, typename R >
+class mesh_binary : public mesh_expr< mesh_binary<Op,L,R> >
+{
+	typename L::stored_type l_;
+	typename R::stored_type r_;
+
+public:
+	typedef typename L::value_type value_type;
+	typedef mesh_binary<Op,L,R> stored_type;
+
+	mesh_binary( const L& l, const R& r )
+	: l_( l ), r_( r )
+	{
+		if( l_.nelem() != 0 && r_.nelem() != 0 && l_.nelem() != r_.nelem() )
+		{
+			LOGERR("mesh expression : attempt to operate on incompatible data");
+			throw std::runtime_error("mesh expression : attempt to operate on incompatible data");
+		}
+	}
+
+	inline value_type eval( size_t i ) const
+	{	return Op::apply( l_.eval(i), r_.eval(i) );	}
+
+	inline size_t nelem( void ) const
+	{	return (l_.nelem()!=0)? l_.nelem() : r_.nelem();	}
+};
+
+//! evaluate an expression element-wise into a contiguous block of data
+/*! this is the single loop into which every expression is fused
+ *  @param pdata pointer to the target data
+ *  @param n number of elements in the target data
+ *  @param e the expression to be evaluated
+ */
+template< typename Upd, typename T, typename E >
+inline void mesh_expr_evaluate( T* pdata, size_t n, const mesh_expr<E>& ex )
+{
+	const E& e = ex.self();
+
+	if( e.nelem() != 0 && e.nelem() != n )
+	{
+		LOGERR("mesh expression : attempt to assign to incompatible data");
+		throw std::runtime_error("mesh expression : attempt to assign to incompatible data");
+	}
+
+	#pragma omp parallel for simd schedule(static)
+	for( ptrdiff_t i=0; i<(ptrdiff_t)n; ++i )
+		Upd::update( pdata[i], (T)e.eval(i) );
+}
+
+#define MESH_EXPR_BINARY_OPERATOR( OPSYM, OPNAME )                                            \
+template< typename L, typename R >                                                            \
+inline mesh_binary< mesh_ops::OPNAME, L, R >                                                  \
+operator OPSYM ( const mesh_expr<L>& l, const mesh_expr<R>& r )                               \
+{	return mesh_binary< mesh_ops::OPNAME, L, R >( l.self(), r.self() );	}                     \
+                                                                                              \
+template< typename L >                                                                        \
+inline mesh_binary< mesh_ops::OPNAME, L, mesh_scalar<typename L::value_type> >                \
+operator OPSYM ( const mesh_expr<L>& l, typename L::value_type r )                            \
+{	return mesh_binary< mesh_ops::OPNAME, L, mesh_scalar<typename L::value_type> >            \
+		( l.self(), mesh_scalar<typename L::value_type>(r) );	}                               \
+                                                                                              \
+template< typename R >                                                                        \
+inline mesh_binary< mesh_ops::OPNAME, mesh_scalar<typename R::value_type>, R >                \
+operator OPSYM ( typename R::value_type l, const mesh_expr<R>& r )                            \
+{	return mesh_binary< mesh_ops::OPNAME, mesh_scalar<typename R::value_type>, R >            \
+		( mesh_scalar<typename R::value_type>(l), r.self() );	}
+
+MESH_EXPR_BINARY_OPERATOR( +, add )
+MESH_EXPR_BINARY_OPERATOR( -, sub )
+MESH_EXPR_BINARY_OPERATOR( *, mul )
+MESH_EXPR_BINARY_OPERATOR( /, div )
+
+#undef MESH_EXPR_BINARY_OPERATOR
+
+/*****************************************************************************************************/
+
+//! CRTP base class of all element-wise grid hierarchy expressions
+/*! derived classes E need to provide
+ *   - typedef value_type         : the scalar type of the expression
+ *   - typedef stored_type        : how the node is held inside a parent expression
+ *   - typedef level_type         : the mesh expression type of a single level
+ *   - level_type level(unsigned) : the mesh expression for a given level
+ *   - size_t nlevels()           : the number of levels (0 for scalars, which broadcast)
+ */
+template< typename E >
+class hierarchy_expr
+{
+public:
+	inline const E& self( void ) const
+	{	return static_cast<const E&>(*this);	}
+};
+
+//! a scalar constant inside a grid hierarchy expression
+template< typename T >
+class hierarchy_scalar : public hierarchy_expr< hierarchy_scalar<T> >
+{
+	T val_;
+
+public:
+	typedef T value_type;
+	typedef hierarchy_scalar<T> stored_type;
+	typedef mesh_scalar<T> level_type;
+
+	explicit hierarchy_scalar( T val )
+	: val_( val )
+	{ }
+
+	inline level_type level( unsigned ) const
+	{	return level_type( val_ );	}
+
+	inline size_t nlevels( void ) const
+	{	return 0;	}
+};
+
+//! a binary element-wise operation inside a grid hierarchy expression
+template< typename Op, typename L, typename R >
+class hierarchy_binary : public hierarchy_expr< hierarchy_binary<Op,L,R> >
+{
+	typename L::stored_type l_;
+	typename R::stored_type r_;
+
+public:
+	typedef typename L::value_type value_type;
+	typedef hierarchy_binary<Op,L,R> stored_type;
+	typedef mesh_binary<Op,typename L::level_type,typename R::level_type> level_type;
+
+	hierarchy_binary( const L& l, const R& r )
+	: l_( l ), r_( r )
+	{
+		if( l_.nlevels() != 0 && r_.nlevels() != 0 && l_.nlevels() != r_.nlevels() )
+		{
+			LOGERR("hierarchy expression : attempt to operate on incompatible data");
+			throw std::runtime_error("hierarchy expression : attempt to operate on incompatible data");
+		}
+	}
+
+	inline level_type level( unsigned ilevel ) const
+	{	return level_type( l_.level(ilevel), r_.level(ilevel) );	}
+
+	inline size_t nlevels( void ) const
+	{	return (l_.nlevels()!=0)? l_.nlevels() : r_.nlevels();	}
+};
+
+#define HIERARCHY_EXPR_BINARY_OPERATOR( OPSYM, OPNAME )                                       \
+template< typename L, typename R >                                                            \
+inline hierarchy_binary< mesh_ops::OPNAME, L, R >                                             \
+operator OPSYM ( const hierarchy_expr<L>& l, const hierarchy_expr<R>& r )                     \
+{	return hierarchy_binary< mesh_ops::OPNAME, L, R >( l.self(), r.self() );	}                 \
+                                                                                              \
+template< typename L >                                                                        \
+inline hierarchy_binary< mesh_ops::OPNAME, L, hierarchy_scalar<typename L::value_type> >      \
+operator OPSYM ( const hierarchy_expr<L>& l, typename L::value_type r )                       \
+{	return hierarchy_binary< mesh_ops::OPNAME, L, hierarchy_scalar<typename L::value_type> >  \
+		( l.self(), hierarchy_scalar<typename L::value_type>(r) );	}                           \
+                                                                                              \
+template< typename R >                                                                        \
+inline hierarchy_binary< mesh_ops::OPNAME, hierarchy_scalar<typename R::value_type>, R >      \
+operator OPSYM ( typename R::value_type l, const hierarchy_expr<R>& r )                       \
+{	return hierarchy_binary< mesh_ops::OPNAME, hierarchy_scalar<typename R::value_type>, R >  \
+		( hierarchy_scalar<typename R::value_type>(l), r.self() );	}
+
+HIERARCHY_EXPR_BINARY_OPERATOR( +, add )
+HIERARCHY_EXPR_BINARY_OPERATOR( -, sub )
+HIERARCHY_EXPR_BINARY_OPERATOR( *, mul )
+HIERARCHY_EXPR_BINARY_OPERATOR( /, div )
+
+#undef HIERARCHY_EXPR_BINARY_OPERATOR
+
+#endif // __MESH_EXPR_HH
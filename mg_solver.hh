@@ -18,6 +18,7 @@
 #include "mg_interp.hh"
 
 #include "mesh.hh"
+#include "trace.hh"
 
 #define BEGIN_MULTIGRID_NAMESPACE namespace multigrid {
 #define END_MULTIGRID_NAMESPACE }
@@ -527,6 +528,9 @@ double solver<S,I,O,T>::solve( GridHierarchy<T>& uh, double acc, double h, bool
 	
 	bool fullverbose = false;
 	
+	//... the solution and the right-hand-side (FAS corrections) are modified in place
+	uh.detach();
+	m_pf->detach();
 	m_pu = &uh;
 	
 	//err = compute_RMS_resid( *m_pu, *m_pf, fullverbose );
@@ -534,6 +538,7 @@ double solver<S,I,O,T>::solve( GridHierarchy<T>& uh, double acc, double h, bool
 	//... iterate ...//
 	while (true)
 	{
+		MUSIC::trace_scope trace("multigrid V-cycle");
 		
 		LOGUSER("Performing multi-grid V-cycle...");
 		twoGrid( uh.levelmax() );
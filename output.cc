@@ -8,7 +8,14 @@
  
 */
 
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
 #include "output.hh"
+#include "trace.hh"
 
 
 std::map< std::string, output_plugin_creator *>& 
@@ -34,10 +41,87 @@ void print_output_plugins()
 		
 }
 
-output_plugin *select_output_plugin( config_file& cf )
+/*!
+ * @class traced_output_plugin
+ * @brief forwards every call to an output plug-in and records it as a traced phase
+ */
+class traced_output_plugin : public output_plugin
+{
+protected:
+	output_plugin *pplugin_;	//!< the plug-in doing the actual output
+	std::string name_;			//!< name of the plug-in
+	
+public:
+	traced_output_plugin( config_file& cf, output_plugin *pplugin, const std::string& name )
+	: output_plugin( cf ), pplugin_( pplugin ), name_( name )
+	{ }
+	
+	~traced_output_plugin()
+	{	delete pplugin_;	}
+	
+	void write_dm_mass( const grid_hierarchy& gh )
+	{	MUSIC::trace_scope trace("%s write_dm_mass",name_.c_str()); pplugin_->write_dm_mass( gh );	}
+	
+	void write_dm_density( const grid_hierarchy& gh )
+	{	MUSIC::trace_scope trace("%s write_dm_density",name_.c_str()); pplugin_->write_dm_density( gh );	}
+	
+	void write_dm_potential( const grid_hierarchy& gh )
+	{	MUSIC::trace_scope trace("%s write_dm_potential",name_.c_str()); pplugin_->write_dm_potential( gh );	}
+	
+	void write_dm_velocity( int coord, const grid_hierarchy& gh )
+	{	MUSIC::trace_scope trace("%s write_dm_velocity %c",name_.c_str(),'x'+coord); pplugin_->write_dm_velocity( coord, gh );	}
+	
+	void write_dm_position( int coord, const grid_hierarchy& gh )
+	{	MUSIC::trace_scope trace("%s write_dm_position %c",name_.c_str(),'x'+coord); pplugin_->write_dm_position( coord, gh );	}
+	
+	void write_gas_velocity( int coord, const grid_hierarchy& gh )
+	{	MUSIC::trace_scope trace("%s write_gas_velocity %c",name_.c_str(),'x'+coord); pplugin_->write_gas_velocity( coord, gh );	}
+	
+	void write_gas_position( int coord, const grid_hierarchy& gh )
+	{	MUSIC::trace_scope trace("%s write_gas_position %c",name_.c_str(),'x'+coord); pplugin_->write_gas_position( coord, gh );	}
+	
+	void write_gas_density( const grid_hierarchy& gh )
+	{	MUSIC::trace_scope trace("%s write_gas_density",name_.c_str()); pplugin_->write_gas_density( gh );	}
+	
+	void write_gas_potential( const grid_hierarchy& gh )
+	{	MUSIC::trace_scope trace("%s write_gas_potential",name_.c_str()); pplugin_->write_gas_potential( gh );	}
+	
+	void finalize( void )
+	{	MUSIC::trace_scope trace("%s finalize",name_.c_str()); pplugin_->finalize();	}
+};
+
+//! split a comma separated list, removing surrounding white space
+static std::vector<std::string> split_output_list( const std::string& list )
 {
-	std::string formatname = cf.getValue<std::string>( "output", "format" );
+	std::vector<std::string> items;
+	std::string::size_type pos = 0;
 	
+	while( pos <= list.size() )
+	{
+		std::string::size_type next = list.find( ',', pos );
+		if( next == std::string::npos )
+			next = list.size();
+		
+		std::string item = list.substr( pos, next-pos );
+		item.erase( 0, item.find_first_not_of( " \t" ) );
+		item.erase( item.find_last_not_of( " \t" )+1 );
+		
+		if( item.size() > 0 )
+			items.push_back( item );
+		pos = next+1;
+	}
+	
+	return items;
+}
+
+std::vector<std::string> get_output_formats( config_file& cf )
+{
+	return split_output_list( cf.getValue<std::string>( "output", "format" ) );
+}
+
+//! look up and create a single output plug-in
+static output_plugin *create_output_plugin( config_file& cf, const std::string& formatname )
+{
 	output_plugin_creator *the_output_plugin_creator 
 	= get_output_plugin_map()[ formatname ];
 	
@@ -53,8 +137,289 @@ output_plugin *select_output_plugin( config_file& cf )
 	output_plugin *the_output_plugin 
 	= the_output_plugin_creator->create( cf );
 	
+	//... record every output call when tracing
+	if( MUSIC::trace::enabled() )
+		the_output_plugin = new traced_output_plugin( cf, the_output_plugin, formatname );
+	
 	return the_output_plugin;
 }
 
+/*!
+ * @class fanout_output_plugin
+ * @brief forwards every call to one or several output plug-ins, each running on its own thread
+ *
+ * Every backend owns a worker thread and a queue of pending calls, so that
+ * the driver continues with the next field while the backends write. With a
+ * single format this is the asynchronous output of [output] async. A call
+ * is queued with a copy of the hierarchy, which shares the level data with
+ * the driver until the driver modifies it (copy-on-write). The queues hold
+ * at most [output] fanout_queue calls each, which bounds the memory kept
+ * alive by them. The HDF5 library is not thread-safe in general, so calls of
+ * the backends using it are serialised among each other. Every backend stages
+ * its temporary files under its own prefix, ___ic_temp_<index>_.
+ */
+class fanout_output_plugin : public output_plugin
+{
+protected:
+	typedef std::function< void( output_plugin* ) > call_type;
+	
+	//! a single output plug-in with its worker thread and queue
+	struct backend
+	{
+		std::string name;				//!< name of the format
+		output_plugin *pplugin;			//!< the plug-in doing the actual output
+		bool uses_hdf5;					//!< whether calls need to hold the HDF5 lock
+		std::deque< call_type > queue;	//!< pending calls
+		std::mutex mtx;					//!< protects queue, stop and error
+		std::condition_variable cv;		//!< signals changes of the queue
+		bool stop;						//!< no more calls will be queued
+		std::string error;				//!< message of the first failed call
+		std::thread worker;				//!< thread processing the queue
+	};
+	
+	std::vector< backend* > backends_;	//!< one per output format
+	size_t max_queue_;					//!< maximum number of pending calls per backend
+	std::mutex hdf5_mutex_;				//!< serialises backends using HDF5
+	
+	//! process the queue of a backend until it is stopped and empty
+	void run( backend *b, int ibackend )
+	{
+		MUSIC::trace::set_thread( 100+ibackend );
+		
+		while( true )
+		{
+			call_type call;
+			{
+				std::unique_lock<std::mutex> lock( b->mtx );
+				b->cv.wait( lock, [b]{ return b->stop || !b->queue.empty(); } );
+				
+				if( b->queue.empty() )
+					return;
+				
+				call = b->queue.front();
+			}
+			
+			//... after a failure, the remaining calls are only discarded
+			if( b->error.empty() )
+			{
+				try
+				{
+					std::unique_lock<std::mutex> hdf5_lock( hdf5_mutex_, std::defer_lock );
+					if( b->uses_hdf5 )
+						hdf5_lock.lock();
+					
+					call( b->pplugin );
+				}
+				catch( std::exception& e )
+				{
+					std::lock_guard<std::mutex> lock( b->mtx );
+					b->error = e.what();
+				}
+			}
+			
+			{
+				std::lock_guard<std::mutex> lock( b->mtx );
+				b->queue.pop_front();
+			}
+			b->cv.notify_all();
+		}
+	}
+	
+	//! throw if a backend has failed
+	void check_errors( void )
+	{
+		for( size_t i=0; i<backends_.size(); ++i )
+		{
+			std::string error;
+			{
+				std::lock_guard<std::mutex> lock( backends_[i]->mtx );
+				error = backends_[i]->error;
+			}
+			
+			if( !error.empty() )
+			{
+				LOGERR("Output plug-in \'%s\' failed: %s",backends_[i]->name.c_str(),error.c_str());
+				throw std::runtime_error("Output plug-in failed");
+			}
+		}
+	}
+	
+	//! queue a call on every backend, waiting while a queue is full
+	void enqueue( const call_type& call )
+	{
+		check_errors();
+		
+		for( size_t i=0; i<backends_.size(); ++i )
+		{
+			backend *b = backends_[i];
+			{
+				std::unique_lock<std::mutex> lock( b->mtx );
+				b->cv.wait( lock, [this,b]{ return b->queue.size() < max_queue_; } );
+				b->queue.push_back( call );
+			}
+			b->cv.notify_all();
+		}
+	}
+	
+	//! let all workers finish their queues and wait for them
+	void join( void )
+	{
+		for( size_t i=0; i<backends_.size(); ++i )
+		{
+			backend *b = backends_[i];
+			{
+				std::lock_guard<std::mutex> lock( b->mtx );
+				b->stop = true;
+			}
+			b->cv.notify_all();
+			
+			if( b->worker.joinable() )
+				b->worker.join();
+		}
+	}
+	
+	//! the copy of a hierarchy handed to the backends, sharing its level data
+	static std::shared_ptr<const grid_hierarchy> snapshot( const grid_hierarchy& gh )
+	{
+		return std::make_shared<const grid_hierarchy>( gh );
+	}
+	
+public:
+	
+	//! create one plug-in per format, each writing to its own file
+	/*! @param formats the output formats
+	 *  @param filenames the output file names, one per format
+	 */
+	fanout_output_plugin( config_file& cf, const std::vector<std::string>& formats, const std::vector<std::string>& filenames )
+	: output_plugin( cf ), max_queue_( std::max( 1u, cf.getValueSafe<unsigned>( "output", "fanout_queue", 2 ) ) )
+	{
+		//... the plug-ins read format, file name and the prefix of their temporary
+		//... files from the configuration while they are constructed. Each gets its
+		//... own prefix, as several plug-ins stage data under the same file names.
+		std::string format_list = cf.getValue<std::string>( "output", "format" );
+		std::string filename_list = cf.getValue<std::string>( "output", "filename" );
+		std::string temp_prefix = cf.getValueSafe<std::string>( "output", "temp_prefix", "___ic_temp_" );
+		
+		try
+		{
+			for( size_t i=0; i<formats.size(); ++i )
+			{
+				char prefix[32];
+				sprintf( prefix, "%d_", (int)i );
+				
+				cf.insertValue( "output", "format", formats[i] );
+				cf.insertValue( "output", "filename", filenames[i] );
+				cf.insertValue( "output", "temp_prefix", temp_prefix+prefix );
+				
+				backend *b = new backend;
+				b->name = formats[i];
+				b->uses_hdf5 = formats[i] == "enzo" || formats[i] == "arepo" || formats[i] == "generic";
+				b->stop = false;
+				b->pplugin = NULL;
+				backends_.push_back( b );
+				
+				b->pplugin = create_output_plugin( cf, formats[i] );
+			}
+		}
+		catch( ... )
+		{
+			cf.insertValue( "output", "format", format_list );
+			cf.insertValue( "output", "filename", filename_list );
+			cf.insertValue( "output", "temp_prefix", temp_prefix );
+			
+			for( size_t i=0; i<backends_.size(); ++i )
+			{
+				delete backends_[i]->pplugin;
+				delete backends_[i];
+			}
+			throw;
+		}
+		
+		cf.insertValue( "output", "format", format_list );
+		cf.insertValue( "output", "filename", filename_list );
+		cf.insertValue( "output", "temp_prefix", temp_prefix );
+		
+		for( size_t i=0; i<backends_.size(); ++i )
+			backends_[i]->worker = std::thread( &fanout_output_plugin::run, this, backends_[i], (int)i );
+		
+		if( backends_.size() == 1 )
+			LOGINFO("Writing output asynchronously, up to %d pending calls.",(int)max_queue_);
+		else
+			LOGINFO("Writing %d output formats concurrently, up to %d pending calls each.",(int)backends_.size(),(int)max_queue_);
+	}
+	
+	~fanout_output_plugin()
+	{
+		join();
+		
+		for( size_t i=0; i<backends_.size(); ++i )
+		{
+			delete backends_[i]->pplugin;
+			delete backends_[i];
+		}
+	}
+	
+	void write_dm_mass( const grid_hierarchy& gh )
+	{	std::shared_ptr<const grid_hierarchy> p = snapshot( gh ); enqueue( [p]( output_plugin *o ){ o->write_dm_mass( *p ); } );	}
+	
+	void write_dm_density( const grid_hierarchy& gh )
+	{	std::shared_ptr<const grid_hierarchy> p = snapshot( gh ); enqueue( [p]( output_plugin *o ){ o->write_dm_density( *p ); } );	}
+	
+	void write_dm_potential( const grid_hierarchy& gh )
+	{	std::shared_ptr<const grid_hierarchy> p = snapshot( gh ); enqueue( [p]( output_plugin *o ){ o->write_dm_potential( *p ); } );	}
+	
+	void write_dm_velocity( int coord, const grid_hierarchy& gh )
+	{	std::shared_ptr<const grid_hierarchy> p = snapshot( gh ); enqueue( [p,coord]( output_plugin *o ){ o->write_dm_velocity( coord, *p ); } );	}
+	
+	void write_dm_position( int coord, const grid_hierarchy& gh )
+	{	std::shared_ptr<const grid_hierarchy> p = snapshot( gh ); enqueue( [p,coord]( output_plugin *o ){ o->write_dm_position( coord, *p ); } );	}
+	
+	void write_gas_velocity( int coord, const grid_hierarchy& gh )
+	{	std::shared_ptr<const grid_hierarchy> p = snapshot( gh ); enqueue( [p,coord]( output_plugin *o ){ o->write_gas_velocity( coord, *p ); } );	}
+	
+	void write_gas_position( int coord, const grid_hierarchy& gh )
+	{	std::shared_ptr<const grid_hierarchy> p = snapshot( gh ); enqueue( [p,coord]( output_plugin *o ){ o->write_gas_position( coord, *p ); } );	}
+	
+	void write_gas_density( const grid_hierarchy& gh )
+	{	std::shared_ptr<const grid_hierarchy> p = snapshot( gh ); enqueue( [p]( output_plugin *o ){ o->write_gas_density( *p ); } );	}
+	
+	void write_gas_potential( const grid_hierarchy& gh )
+	{	std::shared_ptr<const grid_hierarchy> p = snapshot( gh ); enqueue( [p]( output_plugin *o ){ o->write_gas_potential( *p ); } );	}
+	
+	//! finalize all backends and wait until everything is written
+	void finalize( void )
+	{
+		enqueue( []( output_plugin *o ){ o->finalize(); } );
+		join();
+		check_errors();
+	}
+};
+
+output_plugin *select_output_plugin( config_file& cf )
+{
+	std::vector<std::string> formats = get_output_formats( cf );
+	
+	if( formats.size() == 1 )
+	{
+		//... a single format is written on the calling thread unless asked otherwise
+		if( !cf.getValueSafe<bool>( "output", "async", false ) )
+			return create_output_plugin( cf, formats[0] );
+		
+		std::cout << " - Writing output on a separate thread" << std::endl;
+		return new fanout_output_plugin( cf, formats, std::vector<std::string>( 1, cf.getValue<std::string>( "output", "filename" ) ) );
+	}
+	
+	std::vector<std::string> filenames = split_output_list( cf.getValue<std::string>( "output", "filename" ) );
+	
+	if( formats.size() == 0 || filenames.size() != formats.size() )
+	{
+		LOGERR("[output] needs one file name per format, got %d formats and %d file names.",(int)formats.size(),(int)filenames.size());
+		throw std::runtime_error("Mismatching output formats and file names");
+	}
+	
+	std::cout << " - Writing " << formats.size() << " output formats from a single run" << std::endl;
+	return new fanout_output_plugin( cf, formats, filenames );
+}
+
 
 
@@ -12,6 +12,7 @@
 #define __OUTPUT_HH
 
 #include <string>
+#include <vector>
 #include <map>
 
 #include "general.hh"
@@ -36,6 +37,9 @@ protected:
 	//! output file or directory name
 	std::string fname_;
 	
+	//! prefix of the names of temporary files, unique to every plug-in of a run
+	std::string temp_prefix_;
+	
 	//! minimum refinement level
 	unsigned levelmin_;
 	
@@ -74,6 +78,7 @@ public:
 	: cf_(cf)
 	{ 
 		fname_		= cf.getValue<std::string>("output","filename");
+		temp_prefix_	= cf.getValueSafe<std::string>("output","temp_prefix","___ic_temp_");
 		levelmin_	= cf.getValue<unsigned>( "setup", "levelmin" );
 		levelmax_	= cf.getValue<unsigned>( "setup", "levelmax" );
 
@@ -158,7 +163,15 @@ struct output_plugin_creator_concrete : public output_plugin_creator
 	}
 };
 
+//! the output formats of a run, [output] format may list several separated by commas
+std::vector<std::string> get_output_formats( config_file& cf );
+
 //! failsafe version to select the output plug-in
+/*! if several formats are given, the returned plug-in forwards every call to
+ *  one plug-in per format, see fanout_output_plugin in output.cc. With
+ *  [output] async = yes a single format is written on its own thread in the
+ *  same way, so that the driver computes the next field during the write.
+ */
 output_plugin *select_output_plugin( config_file& cf );
 
 #endif // __OUTPUT_HH
@@ -0,0 +1,223 @@
+/*
+
+ particle_batch.cc - This file is part of MUSIC -
+ a code to generate multi-scale initial conditions
+ for cosmological simulations
+
+ Copyright (C) 2010  Oliver Hahn
+
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "particle_batch.hh"
+
+particle_batch_plugin::particle_batch_plugin( config_file& cf, const std::string& format )
+: output_plugin( cf ), porder_( cf, format )
+{
+	batch_size_ = cf.getValueSafe<size_t>( "output", "particle_batch_size", 1048576 );
+
+	if( batch_size_ == 0 )
+	{
+		LOGERR("%s output: particle_batch_size needs to be positive.",format.c_str());
+		throw std::runtime_error("Invalid particle batch size");
+	}
+
+	for( int ic=0; ic<num_components; ++ic )
+		comp_fd_[ic] = -1;
+}
+
+particle_batch_plugin::~particle_batch_plugin()
+{
+	remove_components();
+}
+
+std::string particle_batch_plugin::component_fname( component ic ) const
+{
+	char fn[256];
+	sprintf( fn, "%sbatch_%02d.bin", temp_prefix_.c_str(), (int)ic );
+	return std::string( fn );
+}
+
+int particle_batch_plugin::open_component( component ic )
+{
+	if( comp_fd_[ic] >= 0 )
+		close( comp_fd_[ic] );
+
+	std::string fname = component_fname( ic );
+	comp_fd_[ic] = open( fname.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0644 );
+
+	if( comp_fd_[ic] < 0 )
+	{
+		LOGERR("Could not open temporary file '%s' : %s",fname.c_str(),strerror(errno));
+		throw std::runtime_error("Could not open temporary particle file");
+	}
+
+	return comp_fd_[ic];
+}
+
+void particle_batch_plugin::remove_components( void )
+{
+	for( int ic=0; ic<num_components; ++ic )
+		if( comp_fd_[ic] >= 0 )
+		{
+			close( comp_fd_[ic] );
+			remove( component_fname( (component)ic ).c_str() );
+			comp_fd_[ic] = -1;
+		}
+}
+
+void particle_batch_plugin::write_component( component ic, const real_t *p, size_t n, size_t first )
+{
+	const char *pc = reinterpret_cast<const char*>( p );
+	size_t nbytes = n*sizeof(real_t), offset = first*sizeof(real_t);
+
+	while( nbytes > 0 )
+	{
+		ssize_t nw = pwrite( comp_fd_[ic], pc, nbytes, (off_t)offset );
+		if( nw < 0 && errno == EINTR )
+			continue;
+		if( nw <= 0 )
+		{
+			LOGERR("Could not write to temporary file '%s' : %s",component_fname(ic).c_str(),strerror(errno));
+			throw std::runtime_error("I/O error while writing temporary particle file");
+		}
+		pc += nw;
+		nbytes -= nw;
+		offset += nw;
+	}
+}
+
+void particle_batch_plugin::read_component( component ic, real_t *p, size_t n, size_t first ) const
+{
+	char *pc = reinterpret_cast<char*>( p );
+	size_t nbytes = n*sizeof(real_t), offset = first*sizeof(real_t);
+
+	while( nbytes > 0 )
+	{
+		ssize_t nr = pread( comp_fd_[ic], pc, nbytes, (off_t)offset );
+		if( nr < 0 && errno == EINTR )
+			continue;
+		if( nr <= 0 )
+		{
+			LOGERR("Could not read from temporary file '%s' : %s",component_fname(ic).c_str(),
+				   (nr==0)? "unexpected end of file" : strerror(errno));
+			throw std::runtime_error("I/O error while reading temporary particle file");
+		}
+		pc += nr;
+		nbytes -= nr;
+		offset += nr;
+	}
+}
+
+void particle_batch_plugin::index_leaves( const grid_hierarchy& gh )
+{
+	slab_offset_.assign( gh.levelmax()+1, std::vector<size_t>() );
+	size_t nbefore = 0;
+
+	for( int ilevel=gh.levelmax(); ilevel>=(int)gh.levelmin(); --ilevel )
+	{
+		int nx = gh.get_grid(ilevel)->size(0), ny = gh.get_grid(ilevel)->size(1), nz = gh.get_grid(ilevel)->size(2);
+		std::vector<size_t>& offset = slab_offset_[ilevel];
+		offset.assign( nx+1, 0 );
+
+		#pragma omp parallel for
+		for( int i=0; i<nx; ++i )
+			for( int j=0; j<ny; ++j )
+				for( int k=0; k<nz; ++k )
+					if( gh.is_in_mask(ilevel,i,j,k) && !gh.is_refined(ilevel,i,j,k) )
+						++offset[i+1];
+
+		offset[0] = nbefore;
+		for( int i=0; i<nx; ++i )
+			offset[i+1] += offset[i];
+		nbefore = offset[nx];
+	}
+
+	//... the levels in output order, which is not level-major for a space-filling curve
+	level_.resize( nbefore );
+
+	if( porder_.enabled() )
+	{
+		size_t ip = 0;
+		porder_.for_each_leaf( gh, gh.levelmax(), gh.levelmin(), [&]( int ilevel, unsigned, unsigned, unsigned )
+		{	level_[ip++] = (unsigned char)ilevel;	} );
+	}
+	else
+	{
+		for( int ilevel=gh.levelmax(); ilevel>=(int)gh.levelmin(); --ilevel )
+			std::fill( level_.begin()+slab_offset_[ilevel].front(), level_.begin()+slab_offset_[ilevel].back(), (unsigned char)ilevel );
+	}
+}
+
+void particle_batch_plugin::gather_position( const grid_hierarchy& gh, component ic, int coord )
+{
+	gather( gh, ic, [&gh,coord]( int ilevel, int i, int j, int k )
+	{
+		double xx[3];
+		gh.cell_pos( ilevel, i, j, k, xx );
+		return (real_t)( xx[coord] + (*gh.get_grid(ilevel))(i,j,k) );
+	} );
+}
+
+void particle_batch_plugin::write_particles( void )
+{
+	const size_t np = level_.size(), nbatches = (np+batch_size_-1)/batch_size_;
+	std::exception_ptr error;
+
+	#pragma omp parallel
+	{
+		//... the components of the batch of this thread
+		std::vector<real_t> buf[num_components];
+
+		#pragma omp for schedule(dynamic,1)
+		for( long long ib=0; ib<(long long)nbatches; ++ib )
+		{
+			particle_batch b;
+			b.first = ib*batch_size_;
+			b.n = std::min( batch_size_, np-b.first );
+			b.level = &level_[b.first];
+
+			try
+			{
+				const real_t *pc[num_components];
+
+				for( int ic=0; ic<num_components; ++ic )
+				{
+					pc[ic] = NULL;
+					if( !has_component( (component)ic ) )
+						continue;
+
+					buf[ic].resize( b.n );
+					read_component( (component)ic, &buf[ic][0], b.n, b.first );
+					pc[ic] = &buf[ic][0];
+				}
+
+				for( int d=0; d<3; ++d )
+				{
+					b.pos[d]     = pc[dm_x+d];
+					b.vel[d]     = pc[dm_vx+d];
+					b.gas_pos[d] = pc[gas_x+d];
+					b.gas_vel[d] = pc[gas_vx+d];
+				}
+
+				write_particle_batch( b );
+			}
+			catch(...)
+			{
+				#pragma omp critical(particle_batch_error)
+				if( !error )
+					error = std::current_exception();
+			}
+		}
+	}
+
+	remove_components();
+
+	if( error )
+		std::rethrow_exception( error );
+}
@@ -0,0 +1,228 @@
+/*
+
+ particle_batch.hh - This file is part of MUSIC -
+ a code to generate multi-scale initial conditions
+ for cosmological simulations
+
+ Copyright (C) 2010  Oliver Hahn
+
+*/
+
+#ifndef __PARTICLE_BATCH_HH
+#define __PARTICLE_BATCH_HH
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+
+#include "general.hh"
+#include "config_file.hh"
+#include "mesh.hh"
+#include "output.hh"
+#include "mem_alloc.hh"
+#include "particle_order.hh"
+
+/*!
+ * @struct particle_batch
+ * @brief consecutive particles in output order, in structure-of-arrays layout
+ *
+ * Every particle belongs to one leaf cell. Its ID is its index in the output
+ * order, first+ip for the ip-th particle of the batch. Components that have
+ * not been written by the driver are NULL.
+ */
+struct particle_batch
+{
+	size_t first;					//!< index of the first particle in the output order
+	size_t n;						//!< number of particles
+	const unsigned char *level;		//!< refinement level of the leaf cell of every particle
+	const real_t *pos[3];			//!< dark matter positions, cell centre plus displacement in box units, not wrapped
+	const real_t *vel[3];			//!< dark matter velocities as passed to write_dm_velocity
+	const real_t *gas_pos[3];		//!< baryon positions in the same units, without any staggering
+	const real_t *gas_vel[3];		//!< baryon velocities as passed to write_gas_velocity
+};
+
+/*!
+ * @class particle_batch_plugin
+ * @brief base class for output plug-ins that write whole particles in batches
+ *
+ * The driver hands the displacements and velocities to the output plug-ins
+ * one component at a time, and never holds all of them at once. This class
+ * implements those calls by staging every component in a temporary file, in
+ * the order of particle_order, so that only the level of every particle is
+ * kept in memory. The leaf cells are indexed once, and the components are
+ * gathered with OpenMP, slab by slab, each slab written to its place in the
+ * file.
+ *
+ * Once all fields are written, the derived plug-in calls write_particles from
+ * its finalize. The particles are cut into batches that are read back from
+ * the temporary files and passed to write_particle_batch concurrently from
+ * several threads, so that a plug-in can build its records and write them to
+ * their place in the file in parallel. Every thread holds the components of
+ * one batch. The masses follow from the level of the particle and are left to
+ * the plug-in, as are the density and potential fields.
+ *
+ * [output]
+ * particle_batch_size = 1048576   (particles per batch)
+ */
+class particle_batch_plugin : public output_plugin
+{
+public:
+	//! the components gathered from the driver
+	enum component
+	{
+		dm_x, dm_y, dm_z, dm_vx, dm_vy, dm_vz,
+		gas_x, gas_y, gas_z, gas_vx, gas_vy, gas_vz,
+		num_components
+	};
+
+protected:
+	particle_order porder_;						//!< the output order of the leaf cells
+	size_t batch_size_;							//!< number of particles per batch
+	std::vector<unsigned char> level_;			//!< level of every particle, empty before the first component
+	std::vector< std::vector<size_t> > slab_offset_;	//!< index of the first leaf of every x-slab of every level
+	int comp_fd_[num_components];				//!< temporary files of the components written so far, -1 if not written
+
+	//! count the leaf cells of every slab and set the level of every particle
+	void index_leaves( const grid_hierarchy& gh );
+
+	//! name of the temporary file of a component
+	std::string component_fname( component ic ) const;
+
+	//! create the temporary file of a component, replacing an earlier one
+	int open_component( component ic );
+
+	//! close and remove the temporary files of all components
+	void remove_components( void );
+
+	//! write values of a component to their place in its temporary file
+	void write_component( component ic, const real_t *p, size_t n, size_t first );
+
+	//! read values of a component back from its temporary file
+	void read_component( component ic, real_t *p, size_t n, size_t first ) const;
+
+	//! gather a component from the leaf cells
+	/*! @param gh the hierarchy the values are taken from
+	 *  @param ic the component
+	 *  @param value called as value( ilevel, i, j, k ) for every leaf cell
+	 */
+	template< typename function >
+	void gather( const grid_hierarchy& gh, component ic, function value )
+	{
+		if( level_.empty() )
+			index_leaves( gh );
+
+		open_component( ic );
+
+		//... the sorted cells are visited in order and written in batches
+		if( porder_.enabled() )
+		{
+			std::vector<real_t> buf;
+			buf.reserve( batch_size_ );
+			size_t first = 0;
+
+			porder_.for_each_leaf( gh, gh.levelmax(), gh.levelmin(), [&]( int ilevel, unsigned i, unsigned j, unsigned k )
+			{
+				buf.push_back( value( ilevel, i, j, k ) );
+				if( buf.size() == batch_size_ )
+				{
+					write_component( ic, &buf[0], buf.size(), first );
+					first += buf.size();
+					buf.clear();
+				}
+			} );
+
+			if( !buf.empty() )
+				write_component( ic, &buf[0], buf.size(), first );
+			return;
+		}
+
+		//... the default order slab by slab in parallel, every slab to its place in the file
+		std::exception_ptr error;
+
+		for( int ilevel=gh.levelmax(); ilevel>=(int)gh.levelmin(); --ilevel )
+		{
+			const std::vector<size_t>& offset = slab_offset_[ilevel];
+			int nx = gh.get_grid(ilevel)->size(0), ny = gh.get_grid(ilevel)->size(1), nz = gh.get_grid(ilevel)->size(2);
+
+			#pragma omp parallel
+			{
+				std::vector<real_t> buf;
+
+				#pragma omp for schedule(dynamic)
+				for( int i=0; i<nx; ++i )
+				{
+					buf.clear();
+					for( int j=0; j<ny; ++j )
+						for( int k=0; k<nz; ++k )
+							if( gh.is_in_mask(ilevel,i,j,k) && !gh.is_refined(ilevel,i,j,k) )
+								buf.push_back( value( ilevel, i, j, k ) );
+
+					if( buf.empty() )
+						continue;
+
+					try
+					{
+						write_component( ic, &buf[0], buf.size(), offset[i] );
+					}
+					catch(...)
+					{
+						#pragma omp critical(particle_batch_error)
+						if( !error )
+							error = std::current_exception();
+					}
+				}
+			}
+		}
+
+		if( error )
+			std::rethrow_exception( error );
+	}
+
+	//! gather the positions, cell centre plus displacement, of one coordinate
+	void gather_position( const grid_hierarchy& gh, component ic, int coord );
+
+	//! cut the particles into batches and pass them to write_particle_batch
+	/*! the batches are read and written concurrently, the first exception
+	 *  thrown is rethrown once all threads are done. The temporary files of
+	 *  the components are removed afterwards.
+	 */
+	void write_particles( void );
+
+	//! write a batch of particles, called concurrently from several threads
+	virtual void write_particle_batch( const particle_batch& b ) = 0;
+
+public:
+
+	//! constructor
+	/*! @param cf the configuration
+	 *  @param format name of the output format in log messages
+	 */
+	particle_batch_plugin( config_file& cf, const std::string& format );
+
+	//! destructor, removes temporary files left by a failed run
+	~particle_batch_plugin();
+
+	//! number of particles, one per leaf cell
+	size_t particle_count( void ) const
+	{	return level_.size();	}
+
+	//! whether a component has been written by the driver
+	bool has_component( component ic ) const
+	{	return comp_fd_[ic] >= 0;	}
+
+	void write_dm_position( int coord, const grid_hierarchy& gh )
+	{	gather_position( gh, (component)(dm_x+coord), coord );	}
+
+	void write_dm_velocity( int coord, const grid_hierarchy& gh )
+	{	gather( gh, (component)(dm_vx+coord), [&gh]( int ilevel, int i, int j, int k ){ return (real_t)(*gh.get_grid(ilevel))(i,j,k); } );	}
+
+	void write_gas_position( int coord, const grid_hierarchy& gh )
+	{	gather_position( gh, (component)(gas_x+coord), coord );	}
+
+	void write_gas_velocity( int coord, const grid_hierarchy& gh )
+	{	gather( gh, (component)(gas_vx+coord), [&gh]( int ilevel, int i, int j, int k ){ return (real_t)(*gh.get_grid(ilevel))(i,j,k); } );	}
+};
+
+#endif // __PARTICLE_BATCH_HH
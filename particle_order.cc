@@ -0,0 +1,263 @@
+/*
+
+ particle_order.cc - This file is part of MUSIC -
+ a code to generate multi-scale initial conditions
+ for cosmological simulations
+
+ Copyright (C) 2010  Oliver Hahn
+
+*/
+
+#include <algorithm>
+#include <fstream>
+
+#include "particle_order.hh"
+
+//! a leaf cell with its key, sorted by key
+struct keyed_cell
+{
+	unsigned long long key;
+	particle_order::cell c;
+
+	bool operator<( const keyed_cell& o ) const
+	{	return key < o.key;	}
+};
+
+//! sort with OpenMP, each thread sorts a chunk, the chunks are then merged pairwise
+static void parallel_sort_cells( std::vector<keyed_cell>& v )
+{
+	size_t n = v.size();
+	int nchunks = std::max( 1, std::min( omp_get_max_threads(), (int)(n/1024) ) );
+	std::vector<size_t> bounds( nchunks+1 );
+	for( int i=0; i<=nchunks; ++i )
+		bounds[i] = n*i/nchunks;
+
+	#pragma omp parallel for schedule(dynamic)
+	for( int i=0; i<nchunks; ++i )
+		std::sort( v.begin()+bounds[i], v.begin()+bounds[i+1] );
+
+	if( nchunks == 1 )
+		return;
+
+	std::vector<keyed_cell> tmp( n );
+	std::vector<keyed_cell> *src = &v, *dst = &tmp;
+
+	for( int width=1; width<nchunks; width*=2 )
+	{
+		#pragma omp parallel for schedule(dynamic)
+		for( int i=0; i<nchunks; i+=2*width )
+		{
+			size_t lo = bounds[i], mid = bounds[std::min(i+width,nchunks)], hi = bounds[std::min(i+2*width,nchunks)];
+			std::merge( src->begin()+lo, src->begin()+mid, src->begin()+mid, src->begin()+hi, dst->begin()+lo );
+		}
+		std::swap( src, dst );
+	}
+
+	if( src != &v )
+		v.swap( tmp );
+}
+
+particle_order::particle_order( config_file& cf, const std::string& format )
+: curve_( curve_none ), levelmin_( 0 ), levelmax_( 0 )
+{
+	std::string curve = cf.getValueSafe<std::string>( "output", "particle_order", "none" );
+	write_keys_ = cf.getValueSafe<bool>( "output", "particle_order_keys", false );
+
+	if( curve == "morton" )
+		curve_ = curve_morton;
+	else if( curve == "hilbert" || curve == "peano-hilbert" )
+		curve_ = curve_hilbert;
+	else if( curve != "none" )
+	{
+		LOGERR("Unknown particle order \'%s\', use none, morton or hilbert.",curve.c_str());
+		throw std::runtime_error("Unknown particle order");
+	}
+
+	if( curve_ != curve_none )
+		LOGINFO("%s output: ordering the particles of each type along a %s curve.",format.c_str(),curve.c_str());
+}
+
+void particle_order::set_groups( const std::vector<int>& group_of_level )
+{
+	group_ = group_of_level;
+	cells_.clear();
+	keys_.clear();
+}
+
+void particle_order::check_range( int lfrom, int lto ) const
+{
+	if( (lfrom < (int)levelmax_ && group_[lfrom] == group_[lfrom+1])
+	   || (lto > (int)levelmin_ && group_[lto] == group_[lto-1]) )
+	{
+		LOGERR("Levels %d to %d do not cover whole particle types.",lto,lfrom);
+		throw std::runtime_error("Invalid level range for the particle order");
+	}
+}
+
+void particle_order::build( const grid_hierarchy& gh )
+{
+	levelmin_ = gh.levelmin();
+	levelmax_ = gh.levelmax();
+
+	if( 3*levelmax_ > 63 )
+	{
+		LOGERR("Particle order keys are limited to level 21, levelmax is %d.",levelmax_);
+		throw std::runtime_error("Particle order keys overflow");
+	}
+
+	//... by default every level is a particle type of its own
+	if( group_.size() <= levelmax_ )
+	{
+		group_.assign( levelmax_+1, 0 );
+		for( unsigned ilevel=levelmin_; ilevel<=levelmax_; ++ilevel )
+			group_[ilevel] = levelmax_-ilevel;
+	}
+
+	int ngroups = group_[levelmin_]+1;
+	cells_.assign( ngroups, std::vector<cell>() );
+	if( write_keys_ )
+		keys_.assign( ngroups, std::vector<unsigned long long>() );
+
+	for( int igroup=0; igroup<ngroups; ++igroup )
+	{
+		std::vector<keyed_cell> kc;
+
+		for( int ilevel=levelmax_; ilevel>=(int)levelmin_; --ilevel )
+		{
+			if( group_[ilevel] != igroup )
+				continue;
+
+			const MeshvarBnd<real_t>* g = gh.get_grid(ilevel);
+			unsigned nx = g->size(0), ny = g->size(1), nz = g->size(2);
+			unsigned shift = levelmax_-ilevel;
+			unsigned ox = gh.offset_abs(ilevel,0), oy = gh.offset_abs(ilevel,1), oz = gh.offset_abs(ilevel,2);
+
+			//... count the leaf cells of every slab, then fill and key them in parallel
+			std::vector<size_t> nslab( nx+1, 0 );
+
+			#pragma omp parallel for
+			for( int i=0; i<(int)nx; ++i )
+				for( unsigned j=0; j<ny; ++j )
+					for( unsigned k=0; k<nz; ++k )
+						if( gh.is_in_mask(ilevel,i,j,k) && !gh.is_refined(ilevel,i,j,k) )
+							++nslab[i+1];
+
+			size_t nbefore = kc.size();
+			for( unsigned i=0; i<nx; ++i )
+				nslab[i+1] += nslab[i];
+			kc.resize( nbefore+nslab[nx] );
+
+			#pragma omp parallel for
+			for( int i=0; i<(int)nx; ++i )
+			{
+				size_t ic = nbefore+nslab[i];
+				for( unsigned j=0; j<ny; ++j )
+					for( unsigned k=0; k<nz; ++k )
+						if( gh.is_in_mask(ilevel,i,j,k) && !gh.is_refined(ilevel,i,j,k) )
+						{
+							unsigned x = (ox+i)<<shift, y = (oy+j)<<shift, z = (oz+k)<<shift;
+
+							kc[ic].key = (curve_ == curve_hilbert)? hilbert_key( x, y, z, levelmax_ )
+																  : morton_key( x, y, z, levelmax_ );
+							kc[ic].c.level = ilevel;
+							kc[ic].c.i = i;
+							kc[ic].c.j = j;
+							kc[ic].c.k = k;
+							++ic;
+						}
+			}
+		}
+
+		parallel_sort_cells( kc );
+
+		cells_[igroup].resize( kc.size() );
+		if( write_keys_ )
+			keys_[igroup].resize( kc.size() );
+
+		#pragma omp parallel for
+		for( long long ic=0; ic<(long long)kc.size(); ++ic )
+		{
+			cells_[igroup][ic] = kc[ic].c;
+			if( write_keys_ )
+				keys_[igroup][ic] = kc[ic].key;
+		}
+	}
+}
+
+void particle_order::write_keys( const std::string& fname ) const
+{
+	if( !write_keys_ || curve_ == curve_none )
+		return;
+
+	std::ofstream ofs( fname.c_str(), std::ios::binary|std::ios::trunc );
+
+	long long ngroups = keys_.size();
+	ofs.write( (char*)&ngroups, sizeof(long long) );
+	for( size_t igroup=0; igroup<keys_.size(); ++igroup )
+	{
+		long long n = keys_[igroup].size();
+		ofs.write( (char*)&n, sizeof(long long) );
+	}
+	for( size_t igroup=0; igroup<keys_.size(); ++igroup )
+		if( keys_[igroup].size() > 0 )
+			ofs.write( (char*)&keys_[igroup][0], keys_[igroup].size()*sizeof(unsigned long long) );
+
+	if( ofs.bad() )
+	{
+		LOGERR("Could not write particle keys to \'%s\'.",fname.c_str());
+		throw std::runtime_error("I/O error while writing particle keys");
+	}
+
+	LOGINFO("Wrote particle order keys to \'%s\'.",fname.c_str());
+}
+
+unsigned long long particle_order::morton_key( unsigned x, unsigned y, unsigned z, unsigned bits )
+{
+	unsigned long long key = 0;
+	for( int b=(int)bits-1; b>=0; --b )
+		key = (key<<3) | (((x>>b)&1ull)<<2) | (((y>>b)&1ull)<<1) | ((z>>b)&1ull);
+	return key;
+}
+
+unsigned long long particle_order::hilbert_key( unsigned x, unsigned y, unsigned z, unsigned bits )
+{
+	//... J. Skilling, Programming the Hilbert curve, AIP Conf. Proc. 707 (2004)
+	unsigned X[3] = { x, y, z };
+
+	if( bits == 0 )
+		return 0;
+
+	unsigned M = 1u<<(bits-1), P, Q, t;
+
+	//... inverse undo
+	for( Q=M; Q>1; Q>>=1 )
+	{
+		P = Q-1;
+		for( int i=0; i<3; ++i )
+			if( X[i] & Q )
+				X[0] ^= P;
+			else
+			{
+				t = (X[0]^X[i]) & P;
+				X[0] ^= t;
+				X[i] ^= t;
+			}
+	}
+
+	//... Gray encode
+	for( int i=1; i<3; ++i )
+		X[i] ^= X[i-1];
+	t = 0;
+	for( Q=M; Q>1; Q>>=1 )
+		if( X[2] & Q )
+			t ^= Q-1;
+	for( int i=0; i<3; ++i )
+		X[i] ^= t;
+
+	//... interleave the transposed key
+	unsigned long long key = 0;
+	for( int b=(int)bits-1; b>=0; --b )
+		for( int i=0; i<3; ++i )
+			key = (key<<1) | ((X[i]>>b)&1ull);
+	return key;
+}
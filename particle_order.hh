@@ -0,0 +1,137 @@
+/*
+
+ particle_order.hh - This file is part of MUSIC -
+ a code to generate multi-scale initial conditions
+ for cosmological simulations
+
+ Copyright (C) 2010  Oliver Hahn
+
+*/
+
+#ifndef __PARTICLE_ORDER_HH
+#define __PARTICLE_ORDER_HH
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include "general.hh"
+#include "config_file.hh"
+#include "mesh.hh"
+
+/*!
+ * @class particle_order
+ * @brief order in which the output plug-ins write the particles of the leaf cells
+ *
+ * By default the particles are written level by level, from the finest to the
+ * coarsest, and in i-j-k order on each level. Optionally, the particles of
+ * each particle type are instead ordered along a space-filling curve through
+ * their Lagrangian cells, so that a simulation code reading the file in
+ * contiguous chunks starts with compact domains. The key of a cell at level l
+ * is that of its corner cell on the finest level, so that cells of different
+ * levels are ordered along the same curve.
+ *
+ * A plug-in declares which levels make up each of its particle types and then
+ * visits the leaf cells with for_each_leaf in all its write functions, so that
+ * positions, velocities, masses and IDs are ordered alike. The sorted cells
+ * are computed once from the first hierarchy and reused for all fields.
+ *
+ * [output]
+ * particle_order      = none | morton | hilbert   (default none)
+ * particle_order_keys = no                        (write the keys to <filename>.keys)
+ */
+class particle_order
+{
+public:
+	//! the space-filling curves
+	enum curve_type { curve_none, curve_morton, curve_hilbert };
+
+	//! a leaf cell
+	struct cell
+	{
+		unsigned level, i, j, k;
+	};
+
+protected:
+	curve_type curve_;						//!< the curve, curve_none for level-major i-j-k order
+	bool write_keys_;						//!< whether the keys are written to a file
+	std::vector<int> group_;				//!< group of every level, the levels of one particle type
+	std::vector< std::vector<cell> > cells_;				//!< sorted cells of every group
+	std::vector< std::vector<unsigned long long> > keys_;	//!< keys of the sorted cells, if written
+	unsigned levelmin_, levelmax_;			//!< levels of the hierarchy the cells were built from
+
+	//! sort the leaf cells of every group along the curve
+	void build( const grid_hierarchy& gh );
+
+	//! the groups of all levels between lfrom and lto need to be complete
+	void check_range( int lfrom, int lto ) const;
+
+public:
+
+	//! read the curve from the configuration
+	/*! @param cf the configuration
+	 *  @param format name of the output format in log messages
+	 */
+	particle_order( config_file& cf, const std::string& format );
+
+	//! whether the particles are reordered at all
+	bool enabled( void ) const
+	{	return curve_ != curve_none;	}
+
+	//! declare the particle types of the plug-in
+	/*! levels with the same group are ordered together. Groups are numbered
+	 *  0, 1, ... from the finest to the coarsest level, so that every group is
+	 *  a range of consecutive levels. By default every level is its own group.
+	 *  @param group_of_level the group of every level, indexed by level
+	 */
+	void set_groups( const std::vector<int>& group_of_level );
+
+	//! visit the leaf cells of the levels lfrom down to lto in output order
+	/*! @param gh the hierarchy, its refinement structure needs to be the same in every call
+	 *  @param lfrom the finest level to visit
+	 *  @param lto the coarsest level to visit
+	 *  @param f called as f( ilevel, i, j, k ) for every leaf cell
+	 */
+	template< typename function >
+	void for_each_leaf( const grid_hierarchy& gh, int lfrom, int lto, function f )
+	{
+		if( lfrom < lto )
+			return;
+
+		if( curve_ == curve_none )
+		{
+			for( int ilevel=lfrom; ilevel>=lto; --ilevel )
+				for( unsigned i=0; i<gh.get_grid(ilevel)->size(0); ++i )
+					for( unsigned j=0; j<gh.get_grid(ilevel)->size(1); ++j )
+						for( unsigned k=0; k<gh.get_grid(ilevel)->size(2); ++k )
+							if( gh.is_in_mask(ilevel,i,j,k) && !gh.is_refined(ilevel,i,j,k) )
+								f( ilevel, i, j, k );
+			return;
+		}
+
+		if( cells_.empty() )
+			build( gh );
+		check_range( lfrom, lto );
+
+		for( int igroup=group_[lfrom]; igroup<=group_[lto]; ++igroup )
+			for( size_t ic=0; ic<cells_[igroup].size(); ++ic )
+			{
+				const cell& c = cells_[igroup][ic];
+				f( (int)c.level, c.i, c.j, c.k );
+			}
+	}
+
+	//! write the keys of all particles, group by group, to a binary file
+	/*! the file holds the number of groups, the number of particles of each
+	 *  group and then the 64 bit keys, all as 64 bit integers
+	 */
+	void write_keys( const std::string& fname ) const;
+
+	//! Morton key of a cell on a grid of 2^bits cells per dimension
+	static unsigned long long morton_key( unsigned x, unsigned y, unsigned z, unsigned bits );
+
+	//! Peano-Hilbert key of a cell on a grid of 2^bits cells per dimension
+	static unsigned long long hilbert_key( unsigned x, unsigned y, unsigned z, unsigned bits );
+};
+
+#endif // __PARTICLE_ORDER_HH
@@ -26,6 +26,8 @@
 #include <sstream>
 #include <typeinfo>
 #include <vector>
+#include <map>
+#include <algorithm>
 #include <cstdlib>
 #include "hdf5.h"
 
@@ -766,9 +768,12 @@ struct HDFHyperslabWriter3Ds
 {
 	hid_t dset_id_, type_id_, file_id_;
 	
-	HDFHyperslabWriter3Ds( const std::string Filename, const std::string ObjName, size_t nd[3] )
+	//! create the dataset
+	/*! @param chunk0 number of slices in the first dimension per chunk, 0 for a contiguous dataset
+	 */
+	HDFHyperslabWriter3Ds( const std::string Filename, const std::string ObjName, size_t nd[3], size_t chunk0 = 0 )
 	{
-		hid_t filespace;
+		hid_t filespace, plist;
 		
 		hsize_t sizes[4] = { 1, nd[0], nd[1], nd[2] };
 		
@@ -777,8 +782,17 @@ struct HDFHyperslabWriter3Ds
 		
 		//std::cerr << "creating filespace : 1 x " << nd[0] << " x " << nd[1] << " x " << nd[2] << std::endl;
 		filespace	= H5Screate_simple( 4, sizes, NULL );
-		dset_id_	= H5Dcreate( file_id_, ObjName.c_str(), type_id_, filespace, H5P_DEFAULT );
+		plist		= H5Pcreate( H5P_DATASET_CREATE );
 		
+		if( chunk0 > 0 && nd[0] > 0 && nd[1] > 0 && nd[2] > 0 )
+		{
+			hsize_t chunks[4] = { 1, std::min<hsize_t>( chunk0, nd[0] ), nd[1], nd[2] };
+			H5Pset_chunk( plist, 4, chunks );
+		}
+		
+		dset_id_	= H5Dcreate( file_id_, ObjName.c_str(), type_id_, filespace, plist );
+		
+		H5Pclose(plist);
 		H5Sclose(filespace);
 	}
 	
@@ -1080,4 +1094,155 @@ inline void HDFWriteGroupAttribute<std::string>( const std::string Filename, con
   H5Gclose( HDF_GroupID );
   H5Fclose( HDF_FileID );
 }
+
+/*!
+ * @class HDFStreamFile
+ * @brief keeps an HDF5 file with its groups and datasets open while it is written piecewise
+ *
+ * The HDFWrite* functions above open and close the file for every object.
+ * This class opens the file once, and each dataset when it is first
+ * written, and closes them all in close() or the destructor. Datasets are
+ * created chunked, with chunks of about chunk_bytes, and with shuffle and
+ * deflate filters if a compression level > 0 is given. Datasets with
+ * several components per element are chunked one column at a time. A write
+ * of a single component then consists of whole chunks, and each chunk is
+ * filtered exactly once.
+ */
+class HDFStreamFile
+{
+protected:
+  hid_t HDF_FileID;
+  std::map< std::string, hid_t > groups_;
+  std::map< std::string, hid_t > datasets_;
+  size_t chunk_bytes_;
+  unsigned deflate_;
+
+  //! the handles cannot be shared
+  HDFStreamFile( const HDFStreamFile& );
+  HDFStreamFile& operator=( const HDFStreamFile& );
+
+  hid_t group( const std::string GrpName )
+  {
+    std::map< std::string, hid_t >::iterator it = groups_.find( GrpName );
+    if( it != groups_.end() )
+      return it->second;
+
+    hid_t HDF_GroupID = H5Gopen( HDF_FileID, GrpName.c_str() );
+    if( HDF_GroupID < 0 )
+      throw HDFException( std::string("[HDF_IO] could not open group \'")+GrpName+"\'" );
+
+    groups_[GrpName] = HDF_GroupID;
+    return HDF_GroupID;
+  }
+
+  //! open a dataset of n x ncomp elements, create it on first use
+  template< typename T >
+  hid_t dataset( const std::string GrpName, const std::string ObjName, hsize_t n, hsize_t ncomp )
+  {
+    std::string key = GrpName+"/"+ObjName;
+    std::map< std::string, hid_t >::iterator it = datasets_.find( key );
+    if( it != datasets_.end() )
+      return it->second;
+
+    hid_t HDF_GroupID = group( GrpName );
+    hid_t HDF_Type = GetDataType<T>();
+    hsize_t HDF_Dims[2] = { n, ncomp };
+    hid_t HDF_DataspaceID = H5Screate_simple( (ncomp>1)? 2 : 1, HDF_Dims, NULL );
+    hid_t HDF_PlistID = H5Pcreate( H5P_DATASET_CREATE );
+
+    //... chunks need to fit into the dataset, empty datasets stay contiguous
+    if( n > 0 && chunk_bytes_ > 0 )
+    {
+      hsize_t HDF_Chunk[2] = { std::max<hsize_t>( 1, std::min<hsize_t>( n, chunk_bytes_/sizeof(T) ) ), 1 };
+      H5Pset_chunk( HDF_PlistID, (ncomp>1)? 2 : 1, HDF_Chunk );
+
+      if( deflate_ > 0 )
+      {
+        H5Pset_shuffle( HDF_PlistID );
+        H5Pset_deflate( HDF_PlistID, deflate_ );
+      }
+    }
+
+    hid_t HDF_DatasetID = H5Dcreate( HDF_GroupID, ObjName.c_str(), HDF_Type, HDF_DataspaceID, HDF_PlistID );
+    H5Pclose( HDF_PlistID );
+    H5Sclose( HDF_DataspaceID );
+
+    if( HDF_DatasetID < 0 )
+      throw HDFException( std::string("[HDF_IO] could not create dataset \'")+key+"\'" );
+
+    datasets_[key] = HDF_DatasetID;
+    return HDF_DatasetID;
+  }
+
+public:
+
+  //! open an existing file for writing
+  /*! @param Filename the file, needs to exist
+   *  @param chunk_bytes the approximate size of a chunk in bytes, 0 for contiguous datasets
+   *  @param deflate the deflate compression level, 0 for none
+   */
+  HDFStreamFile( const std::string Filename, size_t chunk_bytes, unsigned deflate )
+  : chunk_bytes_( chunk_bytes ), deflate_( std::min( deflate, 9u ) )
+  {
+    HDF_FileID = H5Fopen( Filename.c_str(), H5F_ACC_RDWR, H5P_DEFAULT );
+    if( HDF_FileID < 0 )
+      throw HDFException( std::string("[HDF_IO] could not open file \'")+Filename+"\'" );
+  }
+
+  ~HDFStreamFile()
+  {
+    close();
+  }
+
+  //! write a dataset of n elements at once
+  template< typename T >
+  void WriteVector( const std::string GrpName, const std::string ObjName, const T* Data, hsize_t n )
+  {
+    hid_t HDF_DatasetID = dataset<T>( GrpName, ObjName, n, 1 );
+
+    if( n > 0 && H5Dwrite( HDF_DatasetID, GetDataType<T>(), H5S_ALL, H5S_ALL, H5P_DEFAULT, Data ) < 0 )
+      throw HDFException( std::string("[HDF_IO] could not write dataset \'")+ObjName+"\'" );
+  }
+
+  //! write component icomp of all n elements of an n x ncomp dataset
+  /*! the dataset is created when the first component is written
+   */
+  template< typename T >
+  void WriteComponent( const std::string GrpName, const std::string ObjName, hsize_t n, hsize_t ncomp, hsize_t icomp, const T* Data )
+  {
+    hid_t HDF_DatasetID = dataset<T>( GrpName, ObjName, n, ncomp );
+
+    if( n == 0 )
+      return;
+
+    hsize_t offset[2] = { 0, icomp }, count[2] = { n, 1 };
+    hid_t HDF_MemoryspaceID = H5Screate_simple( 1, &n, NULL );
+    hid_t HDF_DataspaceID   = H5Dget_space( HDF_DatasetID );
+
+    H5Sselect_hyperslab( HDF_DataspaceID, H5S_SELECT_SET, offset, NULL, count, NULL );
+    herr_t status = H5Dwrite( HDF_DatasetID, GetDataType<T>(), HDF_MemoryspaceID, HDF_DataspaceID, H5P_DEFAULT, Data );
+
+    H5Sclose( HDF_DataspaceID );
+    H5Sclose( HDF_MemoryspaceID );
+
+    if( status < 0 )
+      throw HDFException( std::string("[HDF_IO] could not write dataset \'")+ObjName+"\'" );
+  }
+
+  //! close all datasets, groups and the file
+  void close( void )
+  {
+    for( std::map< std::string, hid_t >::iterator it=datasets_.begin(); it!=datasets_.end(); ++it )
+      H5Dclose( it->second );
+    for( std::map< std::string, hid_t >::iterator it=groups_.begin(); it!=groups_.end(); ++it )
+      H5Gclose( it->second );
+    datasets_.clear();
+    groups_.clear();
+
+    if( HDF_FileID >= 0 )
+      H5Fclose( HDF_FileID );
+    HDF_FileID = -1;
+  }
+};
+
 #endif
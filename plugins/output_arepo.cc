@@ -21,6 +21,7 @@
 #include <algorithm>
 #include "output.hh"
 #include "HDF_IO.hh"
+#include "particle_order.hh"
 
 class arepo_output_plugin : public output_plugin
 { 
@@ -43,6 +44,13 @@ protected:
   bool doBaryons, useLongIDs, doublePrec;
   
   size_t npfine, npart, npcoarse;
+  
+  // output files, kept open until finalize()
+  std::vector< HDFStreamFile* > files_;
+  
+  // coarse DM positions/velocities, kept until combined with the gas if doBaryons
+  std::vector<double> coarsePos[3], coarseVel[3];
+  particle_order porder_;
   std::vector<size_t> levelcounts;
   
   // parameter file hints
@@ -51,48 +59,29 @@ protected:
   
   using output_plugin::cf_;
   
+  // split n particles over the files, the last file takes the remainder
+  hsize_t fileCount( unsigned i, size_t n )
+  {
+    hsize_t nfile = ceil( n / numFiles );
+    if( i == numFiles-1 )
+      nfile = n - (numFiles-1)*nfile;
+    return nfile;
+  }
+  
   // Nx1 vector (e.g. masses,particleids)
   template< typename T >
   void writeHDF5_a( std::string fieldName, int partTypeNum, const std::vector<T> &data )
   {
-    hid_t HDF_FileID, HDF_GroupID, HDF_DatasetID, HDF_DataspaceID, HDF_Type;
-    hsize_t HDF_Dims, offset = 0;
+    hsize_t offset = 0;
     
     std::stringstream GrpName;
     GrpName << "PartType" << partTypeNum;
     
     for( unsigned i=0; i < numFiles; i++ )
     {
-      std::string filename = fname_;
-      HDF_Dims = data.size();
+      hsize_t HDF_Dims = fileCount( i, data.size() );
       
-      // modify local filename and write size
-      if( numFiles > 1 )
-      {
-        std::stringstream s;
-        s << "." << i << ".hdf5";
-        filename.replace(filename.find(".hdf5"), 5, s.str());
-        
-        HDF_Dims = ceil( data.size() / numFiles );
-        if( i == numFiles-1 )
-          HDF_Dims = data.size() - offset;
-      }
-    
-      HDF_FileID = H5Fopen( filename.c_str(), H5F_ACC_RDWR, H5P_DEFAULT );
-      HDF_GroupID = H5Gopen( HDF_FileID, GrpName.str().c_str() );
-
-      HDF_Type         = GetDataType<T>();
-      HDF_DataspaceID  = H5Screate_simple(1, &HDF_Dims, NULL);
-      HDF_DatasetID    = H5Dcreate(HDF_GroupID, fieldName.c_str(), HDF_Type, HDF_DataspaceID, H5P_DEFAULT);
-      
-      // write and close
-      H5Dwrite( HDF_DatasetID, HDF_Type, H5S_ALL, H5S_ALL, H5P_DEFAULT, &data[offset] );
-      
-      H5Dclose( HDF_DatasetID );
-      H5Sclose( HDF_DataspaceID );
-
-      H5Gclose( HDF_GroupID );
-      H5Fclose( HDF_FileID );
+      files_[i]->WriteVector( GrpName.str(), fieldName, data.empty()? NULL : &data[offset], HDF_Dims );
       
       offset += HDF_Dims;
     }
@@ -100,76 +89,21 @@ protected:
   
   // Nx3 vector (e.g. pos,vel), where coord = index of the second dimension (written one at a time)
   template<typename T>
-  void writeHDF5_b( std::string fieldName, int coord, int partTypeNum, std::vector<T> &data, bool readFlag = false )
+  void writeHDF5_b( std::string fieldName, int coord, int partTypeNum, const std::vector<T> &data )
   {
-    hid_t HDF_FileID, HDF_GroupID, HDF_DatasetID, HDF_DataspaceID, HDF_Type;
-    hsize_t HDF_Dims[2], HDF_DimsMem[2], w_offset = 0;
+    hsize_t offset = 0;
     
     std::stringstream GrpName;
     GrpName << "PartType" << partTypeNum;
 
     for( unsigned i=0; i < numFiles; i++ )
     {
-      std::string filename = fname_;
-      HDF_Dims[0] = data.size();
-      
-      // modify local filename and write size
-      if( numFiles > 1 )
-      {
-        std::stringstream s;
-        s << "." << i << ".hdf5";
-        filename.replace(filename.find(".hdf5"), 5, s.str());
-        
-        HDF_Dims[0] = ceil( data.size() / numFiles );
-        if( i == numFiles-1 )
-          HDF_Dims[0] = data.size() - w_offset;
-      }
-    
-      HDF_FileID  = H5Fopen( filename.c_str(), H5F_ACC_RDWR, H5P_DEFAULT );
-      HDF_GroupID = H5Gopen( HDF_FileID, GrpName.str().c_str() );
-
-      HDF_Type    = GetDataType<T>();
-      HDF_Dims[1] = 3;
-      
-      // if dataset does not yet exist, create it (on first coord call) 
-      if( !(H5Lexists(HDF_GroupID, fieldName.c_str(), H5P_DEFAULT)) )
-      {
-        HDF_DataspaceID = H5Screate_simple(2, HDF_Dims, NULL);
-        HDF_DatasetID = H5Dcreate( HDF_GroupID, fieldName.c_str(), HDF_Type, HDF_DataspaceID, H5P_DEFAULT );
-        
-        H5Sclose( HDF_DataspaceID );
-        H5Dclose( HDF_DatasetID );
-      }
-      
-      // make memory space (just indicates the size/shape of data)
-      HDF_DimsMem[0] = HDF_Dims[0];
-      HDF_DimsMem[1] = 1;
-      hid_t HDF_MemoryspaceID = H5Screate_simple(2, HDF_DimsMem, NULL);
-      
-      // open hyperslab
-      hsize_t count[2]={1,1}, stride[2]={1,1}, offset[2]={0,0};
+      hsize_t HDF_Dims = fileCount( i, data.size() );
       
-      offset[1] = coord;       // set where in the second dimension to write
-      count[0]  = HDF_Dims[0]; // set size in the first dimension (num particles of this type)
+      // the dataset is created on the first coord call, each coord is a hyperslab
+      files_[i]->WriteComponent( GrpName.str(), fieldName, HDF_Dims, 3, coord, data.empty()? NULL : &data[offset] );
       
-      HDF_DatasetID   = H5Dopen(HDF_GroupID, fieldName.c_str());
-      HDF_DataspaceID = H5Dget_space(HDF_DatasetID);
-      
-      H5Sselect_hyperslab(HDF_DataspaceID, H5S_SELECT_SET, offset, stride, count, NULL);
-      
-      // write (or read) and close
-      if( readFlag )
-        H5Dread( HDF_DatasetID, HDF_Type, HDF_MemoryspaceID, HDF_DataspaceID, H5P_DEFAULT, 
-                 &data[w_offset] );
-      else
-        H5Dwrite( HDF_DatasetID, HDF_Type, HDF_MemoryspaceID, HDF_DataspaceID, H5P_DEFAULT, 
-                  &data[w_offset] );
-      
-      H5Dclose( HDF_DatasetID );
-      H5Gclose( HDF_GroupID );
-      H5Fclose( HDF_FileID );
-      
-      w_offset += HDF_Dims[0];
+      offset += HDF_Dims;
     }
   }
   
@@ -236,19 +170,13 @@ protected:
       
       std::vector<T> data(npcoarse);
       
-      for( int ilevel=gh.levelmax()-1; ilevel>=(int)gh.levelmin(); --ilevel )
+      porder_.for_each_leaf( gh, gh.levelmax()-1, gh.levelmin(), [&]( int ilevel, unsigned i, unsigned j, unsigned k )
       {
         // baryon particles live only on finest grid, these particles here are total matter particles
         T pmass = omega0 * rhoCrit * pow(boxSize*posFac,3.0)/pow(2,3*ilevel); 
         
-        for( unsigned i=0; i<gh.get_grid(ilevel)->size(0); ++i )
-          for( unsigned j=0; j<gh.get_grid(ilevel)->size(1); ++j )
-            for( unsigned k=0; k<gh.get_grid(ilevel)->size(2); ++k )
-              if( gh.is_in_mask(ilevel,i,j,k) && !gh.is_refined(ilevel,i,j,k) )
-              {
-                data[count++] = pmass;
-              }
-      }
+        data[count++] = pmass;
+      } );
       
       if( count != npcoarse )
         throw std::runtime_error("Internal consistency error while writing masses");
@@ -297,19 +225,16 @@ protected:
     std::vector<T> data(npfine);
     size_t count = 0;
     
-    for( unsigned i=0; i<gh.get_grid(ilevel)->size(0); ++i )
-      for( unsigned j=0; j<gh.get_grid(ilevel)->size(1); ++j )
-        for( unsigned k=0; k<gh.get_grid(ilevel)->size(2); ++k )
-          if( gh.is_in_mask(ilevel,i,j,k) && !gh.is_refined(ilevel,i,j,k) )
-          {
-            double xx[3];
-            gh.cell_pos(ilevel, i, j, k, xx);
-              
-            xx[coord] = (xx[coord] + (*gh.get_grid(ilevel))(i,j,k)) * boxSize;
-            xx[coord] = fmod( xx[coord] + boxSize,boxSize );
-            
-            data[count++] = (T) (xx[coord] * posFac);
-          }
+    porder_.for_each_leaf( gh, ilevel, ilevel, [&]( int ilevel, unsigned i, unsigned j, unsigned k )
+    {
+      double xx[3];
+      gh.cell_pos(ilevel, i, j, k, xx);
+        
+      xx[coord] = (xx[coord] + (*gh.get_grid(ilevel))(i,j,k)) * boxSize;
+      xx[coord] = fmod( xx[coord] + boxSize,boxSize );
+      
+      data[count++] = (T) (xx[coord] * posFac);
+    } );
             
     writeHDF5_b( "Coordinates", coord, HIGHRES_DM_PARTTYPE, data ); // write fine DM
     
@@ -322,27 +247,26 @@ protected:
       data = std::vector<T> (npcoarse,0.0);
       count = 0;
       
-      for( int ilevel=gh.levelmax()-1; ilevel>=(int)gh.levelmin(); --ilevel )
-        for( unsigned i=0; i<gh.get_grid(ilevel)->size(0); ++i )
-          for( unsigned j=0; j<gh.get_grid(ilevel)->size(1); ++j )
-            for( unsigned k=0; k<gh.get_grid(ilevel)->size(2); ++k )
-              if( gh.is_in_mask(ilevel,i,j,k) && !gh.is_refined(ilevel,i,j,k) )
-              {
-                double xx[3];
-                gh.cell_pos(ilevel, i, j, k, xx);
-                
-                xx[coord] = (xx[coord] + (*gh.get_grid(ilevel))(i,j,k)) * boxSize;
-                
-                if ( !doBaryons ) // if so, we will handle the mod in write_gas_position
-                  xx[coord] = fmod( xx[coord] + boxSize,boxSize ) * posFac;
-                                
-                data[count++] = (T) xx[coord];
-              }
+      porder_.for_each_leaf( gh, gh.levelmax()-1, gh.levelmin(), [&]( int ilevel, unsigned i, unsigned j, unsigned k )
+      {
+        double xx[3];
+        gh.cell_pos(ilevel, i, j, k, xx);
+        
+        xx[coord] = (xx[coord] + (*gh.get_grid(ilevel))(i,j,k)) * boxSize;
+        
+        if ( !doBaryons ) // if so, we will handle the mod in write_gas_position
+          xx[coord] = fmod( xx[coord] + boxSize,boxSize ) * posFac;
+                        
+        data[count++] = (T) xx[coord];
+      } );
         
         if( count != npcoarse )
           throw std::runtime_error("Internal consistency error while writing coarse DM pos");
-          
-        writeHDF5_b( "Coordinates", coord, coarsePartType, data ); // write coarse DM
+        
+        if( doBaryons ) // written in write_gas_position, once combined with the gas
+          coarsePos[coord].assign( data.begin(), data.end() );
+        else
+          writeHDF5_b( "Coordinates", coord, coarsePartType, data ); // write coarse DM
     }
   }
   
@@ -357,13 +281,10 @@ protected:
     std::vector<T> data(npfine);
     size_t count = 0;
     
-    for( unsigned i=0; i<gh.get_grid(ilevel)->size(0); ++i )
-      for( unsigned j=0; j<gh.get_grid(ilevel)->size(1); ++j )
-        for( unsigned k=0; k<gh.get_grid(ilevel)->size(2); ++k )
-          if( gh.is_in_mask(ilevel,i,j,k) && !gh.is_refined(ilevel,i,j,k) )
-          {
-            data[count++] = (T) (*gh.get_grid(ilevel))(i,j,k) * velFac;
-          }
+    porder_.for_each_leaf( gh, ilevel, ilevel, [&]( int ilevel, unsigned i, unsigned j, unsigned k )
+    {
+      data[count++] = (T) (*gh.get_grid(ilevel))(i,j,k) * velFac;
+    } );
             
     writeHDF5_b( "Velocities", coord, HIGHRES_DM_PARTTYPE, data ); // write fine DM
     
@@ -376,19 +297,18 @@ protected:
       data = std::vector<T> (npcoarse,0.0);
       count = 0;
       
-      for( int ilevel=gh.levelmax()-1; ilevel>=(int)gh.levelmin(); --ilevel )
-        for( unsigned i=0; i<gh.get_grid(ilevel)->size(0); ++i )
-          for( unsigned j=0; j<gh.get_grid(ilevel)->size(1); ++j )
-            for( unsigned k=0; k<gh.get_grid(ilevel)->size(2); ++k )
-              if( gh.is_in_mask(ilevel,i,j,k) && !gh.is_refined(ilevel,i,j,k) )
-              {
-                data[count++] = (T) (*gh.get_grid(ilevel))(i,j,k) * velFac;
-              }
+      porder_.for_each_leaf( gh, gh.levelmax()-1, gh.levelmin(), [&]( int ilevel, unsigned i, unsigned j, unsigned k )
+      {
+        data[count++] = (T) (*gh.get_grid(ilevel))(i,j,k) * velFac;
+      } );
         
         if( count != npcoarse )
           throw std::runtime_error("Internal consistency error while writing coarse DM pos");
-          
-        writeHDF5_b( "Velocities", coord, coarsePartType, data ); // write coarse DM
+        
+        if( doBaryons ) // written in write_gas_velocity, once combined with the gas
+          coarseVel[coord].assign( data.begin(), data.end() );
+        else
+          writeHDF5_b( "Velocities", coord, coarsePartType, data ); // write coarse DM
     }
   
   }
@@ -401,14 +321,10 @@ protected:
     std::vector<T> gas_data(npart); // read/write gas at all levels from the gh
     size_t count = 0;
     
-    for( int ilevel=levelmax_; ilevel>=(int)levelmin_; --ilevel )
-      for( unsigned i=0; i<gh.get_grid(ilevel)->size(0); ++i )
-        for( unsigned j=0; j<gh.get_grid(ilevel)->size(1); ++j )
-          for( unsigned k=0; k<gh.get_grid(ilevel)->size(2); ++k )
-            if( gh.is_in_mask(ilevel,i,j,k) && !gh.is_refined(ilevel,i,j,k) )
-            {
-              gas_data[count++] = (T) (*gh.get_grid(ilevel))(i,j,k) * velFac;
-            }
+    porder_.for_each_leaf( gh, levelmax_, levelmin_, [&]( int ilevel, unsigned i, unsigned j, unsigned k )
+    {
+      gas_data[count++] = (T) (*gh.get_grid(ilevel))(i,j,k) * velFac;
+    } );
             
     if( count != npart )
       throw std::runtime_error("Internal consistency error while writing GAS pos");
@@ -421,13 +337,15 @@ protected:
       
       std::vector<T> dm_data(npcoarse);
       
-      writeHDF5_b( "Velocities", coord, coarsePartType, dm_data, true ); // read coarse DM vels
+      if( coarseVel[coord].size() != npcoarse )
+        throw std::runtime_error("Internal consistency error: coarse DM vels need to be written before the gas");
       
-      // overwrite 
       for( size_t i=0; i < npcoarse; i++ )
-        dm_data[i] = facc*dm_data[i] + facb*gas_data[npfine + i];
+        dm_data[i] = facc*coarseVel[coord][i] + facb*gas_data[npfine + i];
+      
+      std::vector<double>().swap( coarseVel[coord] );
 
-      writeHDF5_b( "Velocities", coord, coarsePartType, dm_data ); // overwrite coarse DM vels
+      writeHDF5_b( "Velocities", coord, coarsePartType, dm_data ); // write coarse DM vels
     } // dm_data deallocated
     
     // restrict gas_data to fine only and request write
@@ -462,23 +380,19 @@ protected:
     
     double h = 1.0/(1ul<<gh.levelmax());
     
-    for( int ilevel=gh.levelmax(); ilevel>=(int)gh.levelmin(); --ilevel )
-      for( unsigned i=0; i<gh.get_grid(ilevel)->size(0); ++i )
-        for( unsigned j=0; j<gh.get_grid(ilevel)->size(1); ++j )
-          for( unsigned k=0; k<gh.get_grid(ilevel)->size(2); ++k )
-            if( gh.is_in_mask(ilevel,i,j,k) && !gh.is_refined(ilevel,i,j,k) )
-            {
-              double xx[3];
-              gh.cell_pos(ilevel, i, j, k, xx);
+    porder_.for_each_leaf( gh, gh.levelmax(), gh.levelmin(), [&]( int ilevel, unsigned i, unsigned j, unsigned k )
+    {
+      double xx[3];
+      gh.cell_pos(ilevel, i, j, k, xx);
+      
+      // shift particle positions (this has to be done as the same shift
+      // is used when computing the convolution kernel for SPH baryons)
+      xx[coord] += 0.5*h;
+                    
+      xx[coord] = (xx[coord] + (*gh.get_grid(ilevel))(i,j,k)) * boxSize;
               
-              // shift particle positions (this has to be done as the same shift
-              // is used when computing the convolution kernel for SPH baryons)
-              xx[coord] += 0.5*h;
-                            
-              xx[coord] = (xx[coord] + (*gh.get_grid(ilevel))(i,j,k)) * boxSize;
-                      
-              gas_data[count++] = xx[coord];
-            }
+      gas_data[count++] = xx[coord];
+    } );
           
     if( count != npart )
       throw std::runtime_error("Internal consistency error while writing coarse DM pos");
@@ -491,15 +405,17 @@ protected:
       
       std::vector<T> dm_data(npcoarse);
       
-      writeHDF5_b( "Coordinates", coord, coarsePartType, dm_data, true ); // read coarse DM vels
+      if( coarsePos[coord].size() != npcoarse )
+        throw std::runtime_error("Internal consistency error: coarse DM pos need to be written before the gas");
       
-      // overwrite 
       for( size_t i=0; i < npcoarse; i++ ) {
-        dm_data[i] = facc*dm_data[i] + facb*gas_data[npfine + i];
+        dm_data[i] = facc*coarsePos[coord][i] + facb*gas_data[npfine + i];
         dm_data[i] = fmod( dm_data[i] + boxSize, boxSize ) * posFac;
       }
+      
+      std::vector<double>().swap( coarsePos[coord] );
 
-      writeHDF5_b( "Coordinates", coord, coarsePartType, dm_data ); // overwrite coarse DM vels
+      writeHDF5_b( "Coordinates", coord, coarsePartType, dm_data ); // write coarse DM pos
     }
     
     // restrict gas_data to fine only and request write
@@ -517,7 +433,7 @@ protected:
   }
 
 public:
-  arepo_output_plugin( config_file& cf ) : output_plugin( cf )
+  arepo_output_plugin( config_file& cf ) : output_plugin( cf ), porder_( cf, "arepo" )
   {
     // ensure that everyone knows we want to do SPH, implies: bsph=1, bbshift=1, decic_baryons=1
     // -> instead of just writing gas densities (which are here ignored), the gas displacements are also written
@@ -528,6 +444,12 @@ public:
     massTable  = std::vector<double>(NTYPES,0.0);
     
     coarsePartType   = cf.getValueSafe<unsigned>("output","arepo_coarsetype",COARSE_DM_DEFAULT_PARTTYPE);
+    
+    // particles are ordered within their type: the finest level and all coarse levels together
+    std::vector<int> ptype_group( levelmax_+1, 0 );
+    for( unsigned ilevel=levelmin_; ilevel<levelmax_; ++ilevel )
+      ptype_group[ilevel] = 1;
+    porder_.set_groups( ptype_group );
     UnitLength_in_cm = cf.getValueSafe<double>("output","arepo_unitlength",3.085678e21); // 1.0 kpc
     UnitMass_in_g    = cf.getValueSafe<double>("output","arepo_unitmass",1.989e43); // 1.0e10 solar masses
     UnitVelocity_in_cm_per_s = cf.getValueSafe<double>("output","arepo_unitvel",1e5); // 1 km/sec
@@ -542,6 +464,10 @@ public:
     numFiles   = cf.getValueSafe<unsigned>("output","arepo_num_files",1);
     doublePrec = cf.getValueSafe<bool>("output","arepo_doubleprec",0);
     
+    // chunk size and compression of the datasets (deflate level 0 = no compression)
+    size_t chunkBytes = cf.getValueSafe<size_t>("output","arepo_chunksize_kb",1024) * 1024;
+    unsigned compress = cf.getValueSafe<unsigned>("output","arepo_compression",0);
+    
     for( unsigned i=0; i < numFiles; i++ )
       nPart.push_back( std::vector<unsigned int>(NTYPES,0) );
     
@@ -640,11 +566,22 @@ public:
         GrpName << "PartType" << coarsePartType;
         HDFCreateGroup(filename, GrpName.str().c_str()); // coarse DM
       }
+      
+      files_.push_back( new HDFStreamFile( filename, chunkBytes, compress ) );
     }
   }
   
   ~arepo_output_plugin()
-  { }
+  {
+    closeFiles();
+  }
+  
+  void closeFiles( void )
+  {
+    for( size_t i=0; i < files_.size(); i++ )
+      delete files_[i];
+    files_.clear();
+  }
   
   /* ------------------------------------------------------------------------------- */
   void write_dm_mass( const grid_hierarchy& gh )
@@ -710,6 +647,11 @@ public:
     // generate and add contiguous IDs for each particle type we have written
     generateAndWriteIDs();
     
+    // all datasets are written, the header is added through the filename based functions
+    closeFiles();
+    
+    porder_.write_keys( fname_+".keys" );
+    
     std::vector<unsigned int> nPartTotalLW(nPartTotal.size());
     std::vector<unsigned int> nPartTotalHW(nPartTotal.size());
     for( size_t i=0; i < nPartTotalHW.size(); i++ ) {
@@ -303,12 +303,12 @@ protected:
 		
 		// generate all temp file names
 		char fnx[256],fny[256],fnz[256],fnvx[256],fnvy[256],fnvz[256];
-		sprintf( fnx,  "___ic_temp_%05d.bin", 100*id_dm_pos+0 );
-		sprintf( fny,  "___ic_temp_%05d.bin", 100*id_dm_pos+1 );
-		sprintf( fnz,  "___ic_temp_%05d.bin", 100*id_dm_pos+2 );
-		sprintf( fnvx, "___ic_temp_%05d.bin", 100*id_dm_vel+0 );
-		sprintf( fnvy, "___ic_temp_%05d.bin", 100*id_dm_vel+1 );
-		sprintf( fnvz, "___ic_temp_%05d.bin", 100*id_dm_vel+2 );
+		sprintf( fnx,  "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_pos+0 );
+		sprintf( fny,  "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_pos+1 );
+		sprintf( fnz,  "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_pos+2 );
+		sprintf( fnvx, "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_vel+0 );
+		sprintf( fnvy, "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_vel+1 );
+		sprintf( fnvz, "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_vel+2 );
 		
 		// create buffers for temporary data
 		T_store *tmp1, *tmp2, *tmp3, *tmp4, *tmp5, *tmp6;
@@ -422,12 +422,12 @@ protected:
 		
 		// generate all temp file names
 		char fnx[256],fny[256],fnz[256],fnvx[256],fnvy[256],fnvz[256];
-		sprintf( fnx,  "___ic_temp_%05d.bin", 100*id_gas_pos+0 );
-		sprintf( fny,  "___ic_temp_%05d.bin", 100*id_gas_pos+1 );
-		sprintf( fnz,  "___ic_temp_%05d.bin", 100*id_gas_pos+2 );
-		sprintf( fnvx, "___ic_temp_%05d.bin", 100*id_gas_vel+0 );
-		sprintf( fnvy, "___ic_temp_%05d.bin", 100*id_gas_vel+1 );
-		sprintf( fnvz, "___ic_temp_%05d.bin", 100*id_gas_vel+2 );
+		sprintf( fnx,  "%s%05d.bin", temp_prefix_.c_str(), 100*id_gas_pos+0 );
+		sprintf( fny,  "%s%05d.bin", temp_prefix_.c_str(), 100*id_gas_pos+1 );
+		sprintf( fnz,  "%s%05d.bin", temp_prefix_.c_str(), 100*id_gas_pos+2 );
+		sprintf( fnvx, "%s%05d.bin", temp_prefix_.c_str(), 100*id_gas_vel+0 );
+		sprintf( fnvy, "%s%05d.bin", temp_prefix_.c_str(), 100*id_gas_vel+1 );
+		sprintf( fnvz, "%s%05d.bin", temp_prefix_.c_str(), 100*id_gas_vel+2 );
 		
 		// create buffers for temporary data
 		T_store *tmp1, *tmp2, *tmp3, *tmp4, *tmp5, *tmp6;
@@ -652,7 +652,7 @@ public:
 		double xfac = (double) header_.NGRIDC; 
 
 		char temp_fname[256];
-		sprintf( temp_fname, "___ic_temp_%05d.bin", 100*id_dm_pos+coord );
+		sprintf( temp_fname, "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_pos+coord );
 		std::ofstream ofs_temp( temp_fname, std::ios::binary|std::ios::trunc );
 		
 		size_t blksize = sizeof(T_store)*nptot;
@@ -716,7 +716,7 @@ public:
 		double vfac =  (header_.aexpN*header_.NGRIDC)/(100.0);  
         
 		char temp_fname[256];
-		sprintf( temp_fname, "___ic_temp_%05d.bin", 100*id_dm_vel+coord );
+		sprintf( temp_fname, "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_vel+coord );
 		std::ofstream ofs_temp( temp_fname, std::ios::binary|std::ios::trunc );
 		
 		size_t blksize = sizeof(T_store)*nptot;
@@ -782,7 +782,7 @@ public:
 		double xfac = (double) header_.NGRIDC; 
 
 		char temp_fname[256];
-		sprintf( temp_fname, "___ic_temp_%05d.bin", 100*id_gas_pos+coord );
+		sprintf( temp_fname, "%s%05d.bin", temp_prefix_.c_str(), 100*id_gas_pos+coord );
 		std::ofstream ofs_temp( temp_fname, std::ios::binary|std::ios::trunc );
 		
 		size_t blksize = sizeof(T_store)*nptot;
@@ -847,7 +847,7 @@ public:
 		double vfac =  (header_.aexpN*header_.NGRIDC)/(100.0);  
         
 		char temp_fname[256];
-		sprintf( temp_fname, "___ic_temp_%05d.bin", 100*id_gas_vel+coord );
+		sprintf( temp_fname, "%s%05d.bin", temp_prefix_.c_str(), 100*id_gas_vel+coord );
 		std::ofstream ofs_temp( temp_fname, std::ios::binary|std::ios::trunc );
 		
 		size_t blksize = sizeof(T_store)*nptot;
@@ -15,7 +15,10 @@ Copyright (C) 2010  Oliver Hahn
 
 #include "output.hh"
 
+#include <thread>
+
 #include "HDF_IO.hh"
+#include "refinement_pyramid.hh"
 
 #define MAX_SLAB_SIZE   268435456  // = 256 MBytes
 
@@ -49,6 +52,8 @@ protected:
   
   sim_header the_sim_header;
   
+  size_t chunk_bytes_;  //!< size of the chunks of the datasets, 0 for contiguous datasets
+  
   void write_sim_header( std::string fname, const sim_header& h )
   {
     HDFWriteGroupAttribute( fname, "/", "Dimensions", h.dimensions );
@@ -73,39 +78,110 @@ protected:
     HDFWriteDatasetAttribute( fname, dsetname, "TopGridStart", h.top_grid_start );
   }
   
+  //! header data of the patch of a level
+  void write_level_patch_header( const std::string& filename, const std::string& enzoname, unsigned ilevel,
+                                 const std::vector<int>& ng, const grid_hierarchy& gh )
+  {
+    patch_header ph;
+    
+    ph.component_rank       = 1;
+    ph.component_size       = (size_t)ng[0]*(size_t)ng[1]*(size_t)ng[2];
+    ph.dimensions           = ng;
+    ph.rank                 = 3;
+    
+    ph.top_grid_dims.assign(3, 1<<levelmin_);
+    
+    //... offset_abs is in units of the current level cell size
+    
+    double rfac = 1.0/(1<<(ilevel-levelmin_));
+    
+    ph.top_grid_start.push_back( (int)(gh.offset_abs(ilevel, 0)*rfac) );
+    ph.top_grid_start.push_back( (int)(gh.offset_abs(ilevel, 1)*rfac) );
+    ph.top_grid_start.push_back( (int)(gh.offset_abs(ilevel, 2)*rfac) );
+    
+    ph.top_grid_end.push_back( ph.top_grid_start[0] + (int)(ng[0]*rfac) );
+    ph.top_grid_end.push_back( ph.top_grid_start[1] + (int)(ng[1]*rfac) );
+    ph.top_grid_end.push_back( ph.top_grid_start[2] + (int)(ng[2]*rfac) );
+    
+    write_patch_header( filename, enzoname, ph );
+  }
+  
+  //! write one level of a field into a new file, slab by slab
+  /*! the dataset is chunked in whole slices of about enzo_chunksize_kb, and a
+   *  slab is a whole number of chunks, at most MAX_SLAB_SIZE for both buffers
+   *  together. A slab is packed in parallel into one buffer while the previous
+   *  one is written from the other by a separate thread. Only that thread
+   *  calls HDF5 while the slabs are written, so this also works with HDF5
+   *  builds that are not thread-safe.
+   *  @param value called as value(i,j,k) for every cell of the level
+   */
+  template< typename T, typename field >
+  void write_level_data( const std::string& filename, const std::string& enzoname, const std::vector<int>& ng, const field& value )
+  {
+    const size_t nslice = (size_t)ng[0] * (size_t)ng[1], slice_bytes = nslice*sizeof(T);
+    
+    size_t chunk_slices = std::max<size_t>( 1, std::min<size_t>( ng[2], chunk_bytes_/slice_bytes ) );
+    size_t slab_slices  = chunk_slices * std::max<size_t>( 1, (MAX_SLAB_SIZE/2) / (chunk_slices*slice_bytes) );
+    slab_slices = std::min<size_t>( slab_slices, ng[2] );
+    
+    size_t nsz[3] = { (size_t)ng[2], (size_t)ng[1], (size_t)ng[0] };
+    
+    HDFCreateFile( filename );
+    write_sim_header( filename, the_sim_header );
+    
+    //... create full array in file
+    HDFHyperslabWriter3Ds<T> slab_writer( filename, enzoname, nsz, (chunk_bytes_ > 0)? chunk_slices : 0 );
+    
+    //... two buffers, filled in parallel without a serial initialisation
+    std::vector< T, mem_allocator<T> > data_buf[2];
+    data_buf[0].resize( slab_slices*nslice );
+    data_buf[1].resize( slab_slices*nslice );
+    
+    std::thread writer;
+    
+    for( size_t slices_written=0, ibuf=0; slices_written < (size_t)ng[2]; slices_written += slab_slices, ibuf ^= 1 )
+      {
+	size_t slices_in_slab = std::min( (size_t)ng[2]-slices_written, slab_slices );
+	T *data = &data_buf[ibuf][0];
+	
+	//... the buffer was last written from two slabs ago, that writer has been joined
+        #pragma omp parallel for
+	for( int k=0; k<(int)slices_in_slab; ++k )
+	  for( int j=0; j<ng[1]; ++j )
+	    for( int i=0; i<ng[0]; ++i )
+	      data[ (size_t)(k*ng[1]+j)*(size_t)ng[0]+(size_t)i ] = value( i, j, k+slices_written );
+	
+	if( writer.joinable() )
+	  writer.join();
+	
+	writer = std::thread( [&slab_writer,&ng,data,slices_in_slab,slices_written]()
+	  {
+	    size_t count[3] = { slices_in_slab, (size_t)ng[1], (size_t)ng[0] };
+	    size_t offset[3] = { slices_written, 0, 0 };
+	    
+	    slab_writer.write_slab( data, count, offset );
+	  } );
+      }
+    
+    if( writer.joinable() )
+      writer.join();
+  }
+  
   void dump_mask( const grid_hierarchy& gh )
   {
     char enzoname[256], filename[256];
     std::string fieldname("RefinementMask");
     
+    //... flags of all levels in one parallel pass
+    refinement_pyramid pyramid( gh );
+    
     for(unsigned ilevel=levelmin_; ilevel<=levelmax_; ++ilevel )
       {
-	std::vector<int> ng, ng_fortran;
+	std::vector<int> ng;
 	ng.push_back( gh.get_grid(ilevel)->size(0) );
 	ng.push_back( gh.get_grid(ilevel)->size(1) );
 	ng.push_back( gh.get_grid(ilevel)->size(2) );
 	
-	ng_fortran.push_back( gh.get_grid(ilevel)->size(2) );
-	ng_fortran.push_back( gh.get_grid(ilevel)->size(1) );
-	ng_fortran.push_back( gh.get_grid(ilevel)->size(0) );
-	
-	//... need to copy data because we need to get rid of the ghost zones
-	//... write in slabs if data is more than MAX_SLAB_SIZE (default 128 MB)
-	
-	//... full 3D block size
-	size_t all_data_size = (size_t)ng[0] * (size_t)ng[1] * (size_t)ng[2];
-	
-	//... write in slabs of MAX_SLAB_SIZE unless all_data_size is anyway smaller
-	size_t max_slab_size = std::min((size_t)MAX_SLAB_SIZE/sizeof(double), all_data_size );
-	
-	//... but one slab hast to be at least the size of one slice
-	max_slab_size = std::max(((size_t)ng[0] * (size_t)ng[1]), max_slab_size );
-	
-	//... number of slices in one slab
-	size_t slices_in_slab = (size_t)((double)max_slab_size / ((size_t)ng[0] * (size_t)ng[1]));
-	
-	size_t nsz[3] = { ng[2], ng[1], ng[0] };
-	
 	if( levelmin_ != levelmax_ )
 	  sprintf( enzoname, "%s.%d", fieldname.c_str(), ilevel-levelmin_ );
 	else
@@ -113,80 +189,21 @@ protected:
 	
 	sprintf( filename, "%s/%s", fname_.c_str(), enzoname );
 	
-	HDFCreateFile( filename );
-	write_sim_header( filename, the_sim_header );
-	
-	//... create full array in file
-	HDFHyperslabWriter3Ds<int> *slab_writer = new HDFHyperslabWriter3Ds<int>( filename, enzoname, nsz );
-	
-	//... create buffer
-	int *data_buf = new int[ slices_in_slab * (size_t)ng[0] * (size_t)ng[1] ];
-
-	//... write slice by slice
-	size_t slices_written = 0;
-	while( slices_written < (size_t)ng[2] )
+	write_level_data<int>( filename, enzoname, ng, [&pyramid,ilevel]( int i, int j, int k )
 	  {
-	    slices_in_slab = std::min( (size_t)ng[2]-slices_written, slices_in_slab );
-	    
-            #pragma omp parallel for
-	    for( int k=0; k<(int)slices_in_slab; ++k )
-	      for( int j=0; j<ng[1]; ++j )
-		for( int i=0; i<ng[0]; ++i )
-		  {
-		    int mask_val = -1;
-		    
-		    if( gh.is_in_mask(ilevel,i,j,k+slices_written) )
-		      {
-			if( gh.is_refined(ilevel,i,j,k+slices_written) )
-			  mask_val = 1;
-			else
-			  mask_val = 0;
-		      }
-		    data_buf[ (size_t)(k*ng[1]+j)*(size_t)ng[0]+(size_t)i ] = mask_val;
-		  }
+	    int mask_val = -1;
 	    
-	    size_t count[3], offset[3];
-	    
-	    count[0] = slices_in_slab;
-	    count[1] = ng[1];
-	    count[2] = ng[0];
-	    
-	    offset[0] = slices_written;;
-	    offset[1] = 0;
-	    offset[2] = 0;
-	    
-	    slab_writer->write_slab( data_buf, count, offset );
-	    slices_written += slices_in_slab;
-	    
-	  }
-	
-
-	delete[] data_buf;
-	delete slab_writer;
-
-	//... header data for the patch
-	patch_header ph;
-
-	ph.component_rank       = 1;
-	ph.component_size       = (size_t)ng[0]*(size_t)ng[1]*(size_t)ng[2];
-	ph.dimensions           = ng;
-	ph.rank                 = 3;
-
-	ph.top_grid_dims.assign(3, 1<<levelmin_);
-
-	//... offset_abs is in units of the current level cell size
-	
-	double rfac = 1.0/(1<<(ilevel-levelmin_));
-	
-	ph.top_grid_start.push_back( (int)(gh.offset_abs(ilevel, 0)*rfac) );
-	ph.top_grid_start.push_back( (int)(gh.offset_abs(ilevel, 1)*rfac) );
-	ph.top_grid_start.push_back( (int)(gh.offset_abs(ilevel, 2)*rfac) );
-	
-	ph.top_grid_end.push_back( ph.top_grid_start[0] + (int)(ng[0]*rfac) );
-	ph.top_grid_end.push_back( ph.top_grid_start[1] + (int)(ng[1]*rfac) );
-	ph.top_grid_end.push_back( ph.top_grid_start[2] + (int)(ng[2]*rfac) );
+	    if( pyramid.test( refinement_pyramid::in_mask, ilevel, i, j, k ) )
+	      {
+		if( pyramid.test( refinement_pyramid::refined, ilevel, i, j, k ) )
+		  mask_val = 1;
+		else
+		  mask_val = 0;
+	      }
+	    return mask_val;
+	  } );
 	
-	write_patch_header( filename, enzoname, ph );
+	write_level_patch_header( filename, enzoname, ilevel, ng, gh );
       }
   }
 
@@ -196,33 +213,11 @@ protected:
     
     for(unsigned ilevel=levelmin_; ilevel<=levelmax_; ++ilevel )
       {
-	std::vector<int> ng, ng_fortran;
+	std::vector<int> ng;
 	ng.push_back( gh.get_grid(ilevel)->size(0) );
 	ng.push_back( gh.get_grid(ilevel)->size(1) );
 	ng.push_back( gh.get_grid(ilevel)->size(2) );
 	
-	ng_fortran.push_back( gh.get_grid(ilevel)->size(2) );
-	ng_fortran.push_back( gh.get_grid(ilevel)->size(1) );
-	ng_fortran.push_back( gh.get_grid(ilevel)->size(0) );
-	
-	
-	//... need to copy data because we need to get rid of the ghost zones
-	//... write in slabs if data is more than MAX_SLAB_SIZE (default 128 MB)
-	
-	//... full 3D block size
-	size_t all_data_size = (size_t)ng[0] * (size_t)ng[1] * (size_t)ng[2];
-	
-	//... write in slabs of MAX_SLAB_SIZE unless all_data_size is anyway smaller
-	size_t max_slab_size = std::min((size_t)MAX_SLAB_SIZE/sizeof(double), all_data_size );
-	
-	//... but one slab hast to be at least the size of one slice
-	max_slab_size = std::max(((size_t)ng[0] * (size_t)ng[1]), max_slab_size );
-	
-	//... number of slices in one slab
-	size_t slices_in_slab = (size_t)((double)max_slab_size / ((size_t)ng[0] * (size_t)ng[1]));
-	
-	size_t nsz[3] = { ng[2], ng[1], ng[0] };
-	
 	if( levelmin_ != levelmax_ )
 	  sprintf( enzoname, "%s.%d", fieldname.c_str(), ilevel-levelmin_ );
 	else
@@ -230,81 +225,18 @@ protected:
 	
 	sprintf( filename, "%s/%s", fname_.c_str(), enzoname );
 	
-	HDFCreateFile( filename );
-	write_sim_header( filename, the_sim_header );
+	//... need to copy data because we need to get rid of the ghost zones
+	const MeshvarBnd<real_t>& g = *gh.get_grid(ilevel);
 	
 #ifdef SINGLE_PRECISION
-	//... create full array in file
-	HDFHyperslabWriter3Ds<float> *slab_writer = new HDFHyperslabWriter3Ds<float>( filename, enzoname, nsz );
-	
-	//... create buffer
-	float *data_buf = new float[ slices_in_slab * (size_t)ng[0] * (size_t)ng[1] ];
+	typedef float T_store;
 #else
-	//... create full array in file
-	HDFHyperslabWriter3Ds<double> *slab_writer = new HDFHyperslabWriter3Ds<double>( filename, enzoname, nsz );
-	
-	//... create buffer
-	double *data_buf = new double[ slices_in_slab * (size_t)ng[0] * (size_t)ng[1] ];
+	typedef double T_store;
 #endif
+	write_level_data<T_store>( filename, enzoname, ng, [&g,factor,add]( int i, int j, int k )
+	  {	return (T_store)((add+g(i,j,k))*factor);	} );
 	
-	//... write slice by slice
-	size_t slices_written = 0;
-	while( slices_written < (size_t)ng[2] )
-	  {
-	    slices_in_slab = std::min( (size_t)ng[2]-slices_written, slices_in_slab );
-	    
-            #pragma omp parallel for
-	    for( int k=0; k<(int)slices_in_slab; ++k )
-	      for( int j=0; j<ng[1]; ++j )
-		for( int i=0; i<ng[0]; ++i )
-		  data_buf[ (size_t)(k*ng[1]+j)*(size_t)ng[0]+(size_t)i ] =
-		    (add+(*gh.get_grid(ilevel))(i,j,k+slices_written))*factor;
-	    
-	    size_t count[3], offset[3];
-	    
-	    count[0] = slices_in_slab;
-	    count[1] = ng[1];
-	    count[2] = ng[0];
-	    
-	    offset[0] = slices_written;;
-	    offset[1] = 0;
-	    offset[2] = 0;
-	    
-	    slab_writer->write_slab( data_buf, count, offset );
-	    slices_written += slices_in_slab;
-	    
-	  }
-	
-	//... free buffer
-	delete[] data_buf;
-	
-	//... finalize writing and close dataset
-	delete slab_writer;
-	
-	
-	//... header data for the patch
-	patch_header ph;
-	
-	ph.component_rank       = 1;
-	ph.component_size       = (size_t)ng[0]*(size_t)ng[1]*(size_t)ng[2];
-	ph.dimensions           = ng;
-	ph.rank                         = 3;
-	
-	ph.top_grid_dims.assign(3, 1<<levelmin_);
-	
-	//... offset_abs is in units of the current level cell size
-	
-	double rfac = 1.0/(1<<(ilevel-levelmin_));
-	
-	ph.top_grid_start.push_back( (int)(gh.offset_abs(ilevel, 0)*rfac) );
-	ph.top_grid_start.push_back( (int)(gh.offset_abs(ilevel, 1)*rfac) );
-	ph.top_grid_start.push_back( (int)(gh.offset_abs(ilevel, 2)*rfac) );
-	
-	ph.top_grid_end.push_back( ph.top_grid_start[0] + (int)(ng[0]*rfac) );
-	ph.top_grid_end.push_back( ph.top_grid_start[1] + (int)(ng[1]*rfac) );
-	ph.top_grid_end.push_back( ph.top_grid_start[2] + (int)(ng[2]*rfac) );
-	
-	write_patch_header( filename, enzoname, ph );
+	write_level_patch_header( filename, enzoname, ilevel, ng, gh );
       }
   }
   
@@ -322,6 +254,8 @@ public:
     bool bhave_hydro = cf_.getValue<bool>("setup","baryons");
     bool align_top                  = cf.getValueSafe<bool>( "setup", "align_top", false );
     
+    chunk_bytes_ = cf.getValueSafe<size_t>( "output", "enzo_chunksize_kb", 4096 ) * 1024;
+    
     if( !align_top )
       LOGWARN("Old ENZO versions may require \'align_top=true\'!");
     
@@ -10,11 +10,13 @@
 
 #include <fstream>
 #include <map>
+#include <exception>
 #include "log.hh"
 #include "region_generator.hh"
 #include "output.hh"
 #include "mg_interp.hh"
 #include "mesh.hh"
+#include "particle_order.hh"
 
 const int empty_fill_bytes = 56;
 
@@ -70,6 +72,9 @@ protected:
   
   std::string fname;
   
+  //! order of the particles within each type
+  particle_order porder_;
+  
   enum iofields {
     id_dm_mass, id_dm_vel, id_dm_pos, id_gas_vel, id_gas_rho, id_gas_temp, id_gas_pos
   };
@@ -79,6 +84,7 @@ protected:
   size_t block_buf_size_;
   size_t npartmax_;
   unsigned nfiles_;
+  int nwriters_;
   
   unsigned bndparticletype_;
   bool bmorethan2bnd_;
@@ -278,8 +284,8 @@ protected:
         
 	/*** positions ***/
 	
-	sprintf( fc, "___ic_temp_%05d.bin", 100*id_dm_pos+icomp );
-	sprintf( fb, "___ic_temp_%05d.bin", 100*id_gas_pos+icomp );
+	sprintf( fc, "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_pos+icomp );
+	sprintf( fb, "%s%05d.bin", temp_prefix_.c_str(), 100*id_gas_pos+icomp );
         
 	iffs1.open( fc, nptot, npfine*sizeof(T_store) );
 	iffs2.open( fb, nptot, npfine*sizeof(T_store) );
@@ -309,8 +315,8 @@ protected:
         
 	/*** velocities ***/
         
-	sprintf( fc, "___ic_temp_%05d.bin", 100*id_dm_vel+icomp );
-	sprintf( fb, "___ic_temp_%05d.bin", 100*id_gas_vel+icomp );
+	sprintf( fc, "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_vel+icomp );
+	sprintf( fb, "%s%05d.bin", temp_prefix_.c_str(), 100*id_gas_vel+icomp );
         
 	iffs1.open( fc, nptot, npfine*sizeof(T_store) );
 	iffs2.open( fb, nptot, npfine*sizeof(T_store) );
@@ -342,403 +348,320 @@ protected:
     
   }
   
-  void assemble_gadget_file( void )
+  //! name of the temporary file of a field component
+  std::string temp_fname( int id, int coord ) const
   {
+    char fn[256];
+    sprintf( fn, "%s%05d.bin", temp_prefix_.c_str(), 100*id+coord );
+    return std::string( fn );
+  }
+  
+  //! the particles that go into one output file
+  struct gadget_file_part
+  {
+    size_t np[6];        //!< number of particles of each type
+    size_t np_tot;       //!< total number of particles
+    size_t off_gas;      //!< offset into the temporary gas files
+    size_t off_dm;       //!< offset into the temporary dm files
+    size_t off_coarse;   //!< offset into the temporary mass file
+    size_t id_first;     //!< ID of the first particle
+  };
+  
+  typedef std::vector< T_store, mem_allocator<T_store> > aligned_buffer;
+  
+  //! copy n values from three temporary files, interleave them and append them to ofs
+  void write_interleaved( std::ofstream& ofs, int id, size_t npfile, size_t offset, size_t n, bool wrap,
+			  aligned_buffer& tmp1, aligned_buffer& tmp2, aligned_buffer& tmp3, aligned_buffer& adata3 )
+  {
+    pistream iffs1, iffs2, iffs3;
     
-    if( do_baryons_ )
-      combine_components_for_coarse();
-    
-    
-    
-    //............................................................................
-    //... copy from the temporary files, interleave the data and save ............
-		
-    char fnx[256],fny[256],fnz[256],fnvx[256],fnvy[256],fnvz[256],fnm[256];
-    char fnbx[256], fnby[256], fnbz[256], fnbvx[256], fnbvy[256], fnbvz[256];
-    
-    sprintf( fnx,  "___ic_temp_%05d.bin", 100*id_dm_pos+0 );
-    sprintf( fny,  "___ic_temp_%05d.bin", 100*id_dm_pos+1 );
-    sprintf( fnz,  "___ic_temp_%05d.bin", 100*id_dm_pos+2 );
-    sprintf( fnvx, "___ic_temp_%05d.bin", 100*id_dm_vel+0 );
-    sprintf( fnvy, "___ic_temp_%05d.bin", 100*id_dm_vel+1 );
-    sprintf( fnvz, "___ic_temp_%05d.bin", 100*id_dm_vel+2 );
-    sprintf( fnm,  "___ic_temp_%05d.bin", 100*id_dm_mass  );
-    
-    sprintf( fnbx,  "___ic_temp_%05d.bin", 100*id_gas_pos+0 );
-    sprintf( fnby,  "___ic_temp_%05d.bin", 100*id_gas_pos+1 );
-    sprintf( fnbz,  "___ic_temp_%05d.bin", 100*id_gas_pos+2 );
-    sprintf( fnbvx, "___ic_temp_%05d.bin", 100*id_gas_vel+0 );
-    sprintf( fnbvy, "___ic_temp_%05d.bin", 100*id_gas_vel+1 );
-    sprintf( fnbvz, "___ic_temp_%05d.bin", 100*id_gas_vel+2 );
-    
+    iffs1.open( temp_fname( id, 0 ), npfile, offset*sizeof(T_store) );
+    iffs2.open( temp_fname( id, 1 ), npfile, offset*sizeof(T_store) );
+    iffs3.open( temp_fname( id, 2 ), npfile, offset*sizeof(T_store) );
     
-    pistream iffs1, iffs2, iffs3;
+    size_t npleft = n, n2read = std::min( block_buf_size_, npleft );
     
+    while( n2read > 0ul )
+      {
+	iffs1.read( reinterpret_cast<char*>(&tmp1[0]), n2read*sizeof(T_store) );
+	iffs2.read( reinterpret_cast<char*>(&tmp2[0]), n2read*sizeof(T_store) );
+	iffs3.read( reinterpret_cast<char*>(&tmp3[0]), n2read*sizeof(T_store) );
+	
+	if( wrap )
+	  for( size_t i=0; i<n2read; ++i )
+	    {
+	      adata3[3*i+0] = fmod(tmp1[i]+header_.BoxSize,header_.BoxSize);
+	      adata3[3*i+1] = fmod(tmp2[i]+header_.BoxSize,header_.BoxSize);
+	      adata3[3*i+2] = fmod(tmp3[i]+header_.BoxSize,header_.BoxSize);
+	    }
+	else
+	  for( size_t i=0; i<n2read; ++i )
+	    {
+	      adata3[3*i+0] = tmp1[i];
+	      adata3[3*i+1] = tmp2[i];
+	      adata3[3*i+2] = tmp3[i];
+	    }
+	
+	ofs.write( reinterpret_cast<char*>(&adata3[0]), 3*n2read*sizeof(T_store) );
+	
+	npleft -= n2read;
+	n2read = std::min( block_buf_size_, npleft );
+      }
+  }
+  
+  //! write one output file from its ranges of the temporary files
+  /*! does not touch any state shared with other files, so that several files
+   *  can be written at the same time
+   */
+  void write_gadget_file( unsigned ifile, const gadget_file_part& part, bool bneed_long_ids, double ceint )
+  {
     const size_t 
       nptot = np_per_type_[0]+np_per_type_[1]+np_per_type_[2]+np_per_type_[3]+np_per_type_[4]+np_per_type_[5],
-      //npgas = np_fine_gas_,
       npcdm = nptot-np_per_type_[0];
     
-    size_t
-      wrote_coarse = 0,
-      wrote_gas  = 0,
-      wrote_dm   = 0;
+    const bool bbaryons = np_per_type_[0] > 0 && part.np[0] > 0ul;
     
-    size_t
-      npleft = nptot, 
-      n2read = std::min((size_t)block_buf_size_,npleft);
+    std::string ffname = fname_;
+    if( nfiles_ > 1 )
+      {
+	char suffix[32];
+	sprintf( suffix, ".%d", ifile );
+	ffname += suffix;
+      }
     
-    std::cout << " - Gadget2 : writing " << nptot << " particles to file...\n";
-    for( int i=0; i<6; ++i )
-      if( np_per_type_[i] > 0 )
-	LOGINFO("      type   %d : %12llu [m=%g]", i, np_per_type_[i], header_.mass[i] );
+    std::ofstream ofs( ffname.c_str(), std::ios::binary|std::ios::trunc );
+    if( !ofs.good() )
+      {
+	LOGERR("gadget-2 output plug-in could not open output file \'%s\' for writing!",ffname.c_str());
+	throw std::runtime_error(std::string("gadget-2 output plug-in could not open output file \'")+ffname+"\' for writing!\n");
+      }
     
-    bool bbaryons = np_per_type_[0] > 0;
+    //... staging buffers, large blocks are written to the file without further copying
+    aligned_buffer tmp1( block_buf_size_ ), tmp2( block_buf_size_ ), tmp3( block_buf_size_ ), adata3( 3*block_buf_size_ );
     
-    std::vector<T_store> adata3;
-    adata3.reserve( 3*block_buf_size_ );
-    T_store *tmp1, *tmp2, *tmp3;
+    int blksize = sizeof(header);
     
-    tmp1 = new T_store[block_buf_size_];
-    tmp2 = new T_store[block_buf_size_];
-    tmp3 = new T_store[block_buf_size_];
+    //... write the header .......................................................
     
-    //... for multi-file output
-    //int fileno = 0;
-    //size_t npart_left = nptot;
+    header this_header( header_ );
+    for( int i=0; i<6; ++i ){
+      this_header.npart[i] = part.np[i];
+      this_header.npartTotal[i] = (unsigned)np_per_type_[i];
+      this_header.npartTotalHighWord[i] = (unsigned)(np_per_type_[i]>>32);
+    }
     
-    //std::vector<unsigned> nfdm_per_file, nfgas_per_file, nc_per_file;
-        
-    std::vector< std::vector<unsigned> > np_per_file;
-    std::vector<unsigned> np_tot_per_file;
+    ofs.write( (char *)&blksize, sizeof(int) );
+    ofs.write( (char *)&this_header, sizeof(header) );
+    ofs.write( (char *)&blksize, sizeof(int) );
     
-    distribute_particles( nfiles_, np_per_file, np_tot_per_file );
+    //... particle positions ..................................................
+    blksize = 3ul*part.np_tot*sizeof(T_store);
+    ofs.write( (char *)&blksize, sizeof(int) );
     
-    if( nfiles_ > 1 )
-      {
-	LOGINFO("Gadget2 : distributing particles to %d files", nfiles_ );
-	//<< "                 " << std::setw(12) << "type 0" << "," << std::setw(12) << "type 1" << "," << std::setw(12) << "type " << bndparticletype_ << std::endl;
-	for( unsigned i=0; i<nfiles_; ++i )
-	  LOGINFO("      file %i : %12llu", i, np_tot_per_file[i], header_.mass[i] );
-      }
+    if( bbaryons )
+      write_interleaved( ofs, id_gas_pos, npcdm, part.off_gas, part.np[0], true, tmp1, tmp2, tmp3, adata3 );
+    write_interleaved( ofs, id_dm_pos, npcdm, part.off_dm, part.np_tot-part.np[0], true, tmp1, tmp2, tmp3, adata3 );
     
+    ofs.write( reinterpret_cast<char*>(&blksize), sizeof(int) );
     
-    size_t curr_block_buf_size = block_buf_size_;
+    //... particle velocities ..................................................
+    blksize = 3ul*part.np_tot*sizeof(T_store);
+    ofs.write( reinterpret_cast<char*>(&blksize), sizeof(int) );
     
-    size_t idcount = 0;
-    bool bneed_long_ids = blongids_;
-    if( nptot >= 1ul<<32 && !bneed_long_ids )
-      {
-	bneed_long_ids = true;
-	LOGWARN("Need long particle IDs, will write 64bit, make sure to enable in Gadget!");
-      }   
+    if( bbaryons )
+      write_interleaved( ofs, id_gas_vel, npcdm, part.off_gas, part.np[0], false, tmp1, tmp2, tmp3, adata3 );
+    write_interleaved( ofs, id_dm_vel, npcdm, part.off_dm, part.np_tot-part.np[0], false, tmp1, tmp2, tmp3, adata3 );
     
-    for( unsigned ifile=0; ifile<nfiles_; ++ifile )
+    ofs.write( reinterpret_cast<char*>(&blksize), sizeof(int) );
+    
+    //... particle IDs ..........................................................
+    size_t idcount = part.id_first;
+    size_t npleft  = part.np_tot;
+    size_t n2read  = std::min( block_buf_size_, npleft );
+    
+    blksize = bneed_long_ids? sizeof(size_t)*part.np_tot : sizeof(unsigned)*part.np_tot;
+    
+    //... generate contiguous IDs and store in file ..
+    ofs.write( reinterpret_cast<char*>(&blksize), sizeof(int) );
+    while( n2read > 0ul )
       {
-	
-	if( nfiles_ > 1 )
+	if( bneed_long_ids )
 	  {
-	    char ffname[256];
-	    sprintf(ffname,"%s.%d",fname_.c_str(), ifile);
-	    ofs_.open(ffname, std::ios::binary|std::ios::trunc );
+	    size_t *long_ids = reinterpret_cast<size_t*>( &adata3[0] );
+	    for( size_t i=0; i<n2read; ++i )
+	      long_ids[i] = idcount++;
+	    ofs.write( reinterpret_cast<char*>(long_ids), n2read*sizeof(size_t) );
 	  }else{
-	  ofs_.open(fname_.c_str(), std::ios::binary|std::ios::trunc );
+	  unsigned *short_ids = reinterpret_cast<unsigned*>( &adata3[0] );
+	  for( size_t i=0; i<n2read; ++i )
+	    short_ids[i] = idcount++;
+	  ofs.write( reinterpret_cast<char*>(short_ids), n2read*sizeof(unsigned) );
 	}
+	npleft -= n2read;
+	n2read = std::min( block_buf_size_, npleft );
+      }
+    ofs.write( reinterpret_cast<char*>(&blksize), sizeof(int) );
+    
+    //... particle masses .......................................................
+    if( bmorethan2bnd_ )
+      {
+	size_t npcoarse = part.np[bndparticletype_];
+	pistream iffs1;
+	iffs1.open( temp_fname( id_dm_mass, 0 ), np_per_type_[bndparticletype_], part.off_coarse*sizeof(T_store) );
 	
-        
-	size_t np_this_file = np_tot_per_file[ifile];
-	
-	int blksize = sizeof(header);
-	
-	//... write the header .......................................................
-	
-	header this_header( header_ );
-	for( int i=0; i<6; ++i ){
-	  this_header.npart[i] = np_per_file[ifile][i];
-	  this_header.npartTotal[i] = (unsigned)np_per_type_[i];
-	  this_header.npartTotalHighWord[i] = (unsigned)(np_per_type_[i]>>32);
-	}
-            
-	ofs_.write( (char *)&blksize, sizeof(int) );
-	ofs_.write( (char *)&this_header, sizeof(header) );
-	ofs_.write( (char *)&blksize, sizeof(int) );
-	
-	
-	//... particle positions ..................................................
-	blksize = 3ul*np_this_file*sizeof(T_store);
-	ofs_.write( (char *)&blksize, sizeof(int) );
-	
-	if( bbaryons && np_per_file[ifile][0] > 0ul )
-	  {
-	    
-	    iffs1.open( fnbx, npcdm, wrote_gas*sizeof(T_store) );
-	    iffs2.open( fnby, npcdm, wrote_gas*sizeof(T_store) );
-	    iffs3.open( fnbz, npcdm, wrote_gas*sizeof(T_store) );
-	    
-	    npleft = np_per_file[ifile][0];
-	    n2read = std::min(curr_block_buf_size,npleft);
-	    while( n2read > 0ul )
-	      {
-		iffs1.read( reinterpret_cast<char*>(&tmp1[0]), n2read*sizeof(T_store) );
-		iffs2.read( reinterpret_cast<char*>(&tmp2[0]), n2read*sizeof(T_store) );
-		iffs3.read( reinterpret_cast<char*>(&tmp3[0]), n2read*sizeof(T_store) );
-		
-		for( size_t i=0; i<n2read; ++i )
-		  {
-		    adata3.push_back( fmod(tmp1[i]+header_.BoxSize,header_.BoxSize) );
-		    adata3.push_back( fmod(tmp2[i]+header_.BoxSize,header_.BoxSize) );
-		    adata3.push_back( fmod(tmp3[i]+header_.BoxSize,header_.BoxSize) );
-		  }
-		ofs_.write( reinterpret_cast<char*>(&adata3[0]), 3*n2read*sizeof(T_store) );
-		
-		adata3.clear();
-		npleft -= n2read;
-		n2read = std::min( curr_block_buf_size,npleft );
-	      }
-	    iffs1.close();
-	    iffs2.close();
-	    iffs3.close();
-	    
-            
-	  }
-	
-	npleft = np_this_file - np_per_file[ifile][0];
-	n2read = std::min(curr_block_buf_size,npleft);
-	
-	iffs1.open( fnx, npcdm, wrote_dm*sizeof(T_store) );
-	iffs2.open( fny, npcdm, wrote_dm*sizeof(T_store) );
-	iffs3.open( fnz, npcdm, wrote_dm*sizeof(T_store) );
-	
-	while( n2read > 0ul )
-	  {
-	    iffs1.read( reinterpret_cast<char*>(&tmp1[0]), n2read*sizeof(T_store) );
-	    iffs2.read( reinterpret_cast<char*>(&tmp2[0]), n2read*sizeof(T_store) );
-	    iffs3.read( reinterpret_cast<char*>(&tmp3[0]), n2read*sizeof(T_store) );
-	    
-	    for( size_t i=0; i<n2read; ++i )
-	      {
-		adata3.push_back( fmod(tmp1[i]+header_.BoxSize,header_.BoxSize) );
-		adata3.push_back( fmod(tmp2[i]+header_.BoxSize,header_.BoxSize) );
-		adata3.push_back( fmod(tmp3[i]+header_.BoxSize,header_.BoxSize) );
-	      }
-	    ofs_.write( reinterpret_cast<char*>(&adata3[0]), 3*n2read*sizeof(T_store) );
-	    
-	    adata3.clear();
-	    npleft -= n2read;
-	    n2read = std::min( curr_block_buf_size,npleft );
-	  }
-	ofs_.write( reinterpret_cast<char*>(&blksize), sizeof(int) );
-	
-	iffs1.close();
-	iffs2.close();
-	iffs3.close();
-	
-	
-	//... particle velocities ..................................................
-	blksize = 3ul*np_this_file*sizeof(T_store);
-	ofs_.write( reinterpret_cast<char*>(&blksize), sizeof(int) );
-	
-	
-	if( bbaryons && np_per_file[ifile][0] > 0ul )
-	  {
-	    iffs1.open( fnbvx, npcdm, wrote_gas*sizeof(T_store) );
-	    iffs2.open( fnbvy, npcdm, wrote_gas*sizeof(T_store) );
-	    iffs3.open( fnbvz, npcdm, wrote_gas*sizeof(T_store) );
-	    
-	    npleft = np_per_file[ifile][0];
-	    n2read = std::min(curr_block_buf_size,npleft);
-	    while( n2read > 0ul )
-	      {
-		iffs1.read( reinterpret_cast<char*>(&tmp1[0]), n2read*sizeof(T_store) );
-		iffs2.read( reinterpret_cast<char*>(&tmp2[0]), n2read*sizeof(T_store) );
-		iffs3.read( reinterpret_cast<char*>(&tmp3[0]), n2read*sizeof(T_store) );
-		
-		for( size_t i=0; i<n2read; ++i )
-		  {
-		    adata3.push_back( tmp1[i] );
-		    adata3.push_back( tmp2[i] );
-		    adata3.push_back( tmp3[i] );
-		  }
-		
-		ofs_.write( reinterpret_cast<char*>(&adata3[0]), 3*n2read*sizeof(T_store) );
-		
-		adata3.clear();
-		npleft -= n2read;
-		n2read = std::min( curr_block_buf_size,npleft );
-	      }
-	    
-	    iffs1.close();
-	    iffs2.close();
-	    iffs3.close();
-	    
-	    
-	  }
-	
-	iffs1.open( fnvx, npcdm, wrote_dm*sizeof(T_store) );
-	iffs2.open( fnvy, npcdm, wrote_dm*sizeof(T_store) );
-	iffs3.open( fnvz, npcdm, wrote_dm*sizeof(T_store) );
+	npleft  = npcoarse;
+	n2read  = std::min( block_buf_size_, npleft );
+	blksize = npcoarse*sizeof(T_store);
 	
-	npleft = np_this_file - np_per_file[ifile][0];
-	n2read = std::min(curr_block_buf_size,npleft);
+	ofs.write( reinterpret_cast<char*>(&blksize), sizeof(int) );
 	while( n2read > 0ul )
 	  {
 	    iffs1.read( reinterpret_cast<char*>(&tmp1[0]), n2read*sizeof(T_store) );
-	    iffs2.read( reinterpret_cast<char*>(&tmp2[0]), n2read*sizeof(T_store) );
-	    iffs3.read( reinterpret_cast<char*>(&tmp3[0]), n2read*sizeof(T_store) );
-	    
-	    for( size_t i=0; i<n2read; ++i )
-	      {
-		adata3.push_back( tmp1[i] );
-		adata3.push_back( tmp2[i] );
-		adata3.push_back( tmp3[i] );
-	      }
-	    
-	    ofs_.write( reinterpret_cast<char*>(&adata3[0]), 3*n2read*sizeof(T_store) );
+	    ofs.write( reinterpret_cast<char*>(&tmp1[0]), n2read*sizeof(T_store) );
 	    
-	    adata3.clear();
 	    npleft -= n2read;
-	    n2read = std::min( curr_block_buf_size,npleft );
+	    n2read = std::min( block_buf_size_, npleft );
 	  }
-	ofs_.write( reinterpret_cast<char*>(&blksize), sizeof(int) );
-	
-	iffs1.close();
-	iffs2.close();
-	iffs3.close();
-	
-	//... particle IDs ..........................................................
-	std::vector<unsigned> short_ids;
-	std::vector<size_t> long_ids;
-        
-	if( bneed_long_ids )
-	  long_ids.assign(curr_block_buf_size,0);
-	else
-	  short_ids.assign(curr_block_buf_size,0);
-	
-	npleft	= np_this_file;
-	n2read	= std::min(curr_block_buf_size,npleft);
-	blksize = sizeof(unsigned)*np_this_file;
-        
-	if( bneed_long_ids )
-	  blksize = sizeof(size_t)*np_this_file;
+	ofs.write( reinterpret_cast<char*>(&blksize), sizeof(int) );
+      }
+    
+    //... initial internal energy for gas particles
+    if( bbaryons )
+      {
+	for( size_t i=0; i<block_buf_size_; ++i )
+	  tmp1[i] = ceint;
 	
+	npleft	= part.np[0];
+	n2read	= std::min( block_buf_size_, npleft );
+	blksize = sizeof(T_store)*part.np[0];
 	
-	//... generate contiguous IDs and store in file ..
-	ofs_.write( reinterpret_cast<char*>(&blksize), sizeof(int) );
+	ofs.write( reinterpret_cast<char*>(&blksize), sizeof(int) );
 	while( n2read > 0ul )
 	  {
-	    if( bneed_long_ids )
-	      {
-                   for( size_t i=0; i<n2read; ++i )
-		     long_ids[i] = idcount++;
-                   ofs_.write( reinterpret_cast<char*>(&long_ids[0]), n2read*sizeof(size_t) );
-                }else{
-	      for( size_t i=0; i<n2read; ++i )
-		short_ids[i] = idcount++;
-	      ofs_.write( reinterpret_cast<char*>(&short_ids[0]), n2read*sizeof(unsigned) );
-	    }
+	    ofs.write( reinterpret_cast<char*>(&tmp1[0]), n2read*sizeof(T_store) );
 	    npleft -= n2read;
-	    n2read = std::min( curr_block_buf_size,npleft );
+	    n2read = std::min( block_buf_size_, npleft );
 	  }
-	ofs_.write( reinterpret_cast<char*>(&blksize), sizeof(int) );
-	
-	std::vector<unsigned>().swap( short_ids );
-	std::vector<size_t>().swap( long_ids );
+	ofs.write( reinterpret_cast<char*>(&blksize), sizeof(int) );
+      }
+    
+    ofs.flush();
+    
+    if( ofs.bad() )
+      {
+	LOGERR("I/O error while writing gadget-2 output file \'%s\'.",ffname.c_str());
+	throw std::runtime_error("I/O error while writing gadget-2 output file");
+      }
+    
+    ofs.close();
+  }
+  
+  void assemble_gadget_file( void )
+  {
+    
+    if( do_baryons_ )
+      combine_components_for_coarse();
+    
+    
+    
+    const size_t 
+      nptot = np_per_type_[0]+np_per_type_[1]+np_per_type_[2]+np_per_type_[3]+np_per_type_[4]+np_per_type_[5];
+    
+    std::cout << " - Gadget2 : writing " << nptot << " particles to file...\n";
+    for( int i=0; i<6; ++i )
+      if( np_per_type_[i] > 0 )
+	LOGINFO("      type   %d : %12llu [m=%g]", i, np_per_type_[i], header_.mass[i] );
+    
+    std::vector< std::vector<unsigned> > np_per_file;
+    std::vector<unsigned> np_tot_per_file;
+    
+    distribute_particles( nfiles_, np_per_file, np_tot_per_file );
+    
+    if( nfiles_ > 1 )
+      {
+	LOGINFO("Gadget2 : distributing particles to %d files", nfiles_ );
+	for( unsigned i=0; i<nfiles_; ++i )
+	  LOGINFO("      file %i : %12llu", i, np_tot_per_file[i], header_.mass[i] );
+      }
+    
+    bool bneed_long_ids = blongids_;
+    if( nptot >= 1ul<<32 && !bneed_long_ids )
+      {
+	bneed_long_ids = true;
+	LOGWARN("Need long particle IDs, will write 64bit, make sure to enable in Gadget!");
+      }   
+    
+    //... initial internal energy of the gas particles
+    double ceint = 0.0;
+    if( np_per_type_[0] > 0 )
+      {
+	const double astart = 1./(1.+header_.redshift);
+	const double npol  = (fabs(1.0-gamma_)>1e-7)? 1.0/(gamma_-1.) : 1.0;
+	const double unitv = 1e5;
+	const double h2    = header_.HubbleParam*header_.HubbleParam;//*0.0001;
+	const double adec  = 1.0/(160.*pow(omegab_*h2/0.022,2.0/5.0));
+	const double Tcmb0 = 2.726;
+	const double Tini  = astart<adec? Tcmb0/astart : Tcmb0/astart/astart*adec;
+	const double mu    = (Tini>1.e4) ? 4.0/(8.-5.*YHe_) : 4.0/(1.+3.*(1.-YHe_));
+	ceint = 1.3806e-16/1.6726e-24 * Tini * npol / mu / unitv / unitv;
 	
+	LOGINFO("Gadget2 : set initial gas temperature to %.2f K/mu",Tini/mu);
+      }
+    
+    //... the part of every temporary file that goes into each output file
+    std::vector<gadget_file_part> parts( nfiles_ );
+    size_t wrote_gas = 0, wrote_dm = 0, wrote_coarse = 0, idcount = 0;
+    
+    for( unsigned ifile=0; ifile<nfiles_; ++ifile )
+      {
+	for( int i=0; i<6; ++i )
+	  parts[ifile].np[i] = np_per_file[ifile][i];
+	parts[ifile].np_tot     = np_tot_per_file[ifile];
+	parts[ifile].off_gas    = wrote_gas;
+	parts[ifile].off_dm     = wrote_dm;
+	parts[ifile].off_coarse = wrote_coarse;
+	parts[ifile].id_first   = idcount;
 	
-	//... particle masses .......................................................
-	if( bmorethan2bnd_ )//bmultimass_ && bmorethan2bnd_ && nc_per_file[ifile] > 0ul)
+	wrote_gas    += np_per_file[ifile][0];
+	wrote_dm     += np_tot_per_file[ifile]-np_per_file[ifile][0];
+	wrote_coarse += np_per_file[ifile][bndparticletype_];
+	idcount      += np_tot_per_file[ifile];
+      }
+    
+    //... every file is written by its own worker, which reads its ranges of the
+    //... temporary files independently of the others
+    int nwriters = std::max( 1, std::min<int>( nfiles_, nwriters_ ) );
+    std::exception_ptr first_error;
+    
+    if( nwriters > 1 )
+      LOGINFO("Gadget2 : writing %d files with %d concurrent writers", nfiles_, nwriters );
+    
+    #pragma omp parallel for schedule(dynamic,1) num_threads(nwriters)
+    for( int ifile=0; ifile<(int)nfiles_; ++ifile )
+      {
+	try
 	  {
-	    unsigned npcoarse = np_per_file[ifile][bndparticletype_];// nc_per_file[ifile];//header_.npart[5];
-	    iffs1.open( fnm, np_per_type_[bndparticletype_], wrote_coarse*sizeof(T_store) );
-	    
-	    npleft  = npcoarse;
-	    n2read  = std::min(curr_block_buf_size,npleft);
-	    blksize = npcoarse*sizeof(T_store);
-	    
-	    ofs_.write( reinterpret_cast<char*>(&blksize), sizeof(int) );
-	    while( n2read > 0ul )
-	      {
-		iffs1.read( reinterpret_cast<char*>(&tmp1[0]), n2read*sizeof(T_store) );
-		ofs_.write( reinterpret_cast<char*>(&tmp1[0]), n2read*sizeof(T_store) );
-		
-		npleft -= n2read;
-		n2read = std::min( curr_block_buf_size,npleft );
-		
-	      }
-	    ofs_.write( reinterpret_cast<char*>(&blksize), sizeof(int) );
-	    
-	    iffs1.close();
-	    
+	    write_gadget_file( ifile, parts[ifile], bneed_long_ids, ceint );
 	  }
-	
-	
-	//... initial internal energy for gas particles
-	if( bbaryons && np_per_file[ifile][0] > 0ul )
+	catch(...)
 	  {
-	    
-	    std::vector<T_store> eint(curr_block_buf_size,0.0);
-	    
-	    const double astart = 1./(1.+header_.redshift);
-	    const double npol  = (fabs(1.0-gamma_)>1e-7)? 1.0/(gamma_-1.) : 1.0;
-	    const double unitv = 1e5;
-	    const double h2    = header_.HubbleParam*header_.HubbleParam;//*0.0001;
-	    const double adec  = 1.0/(160.*pow(omegab_*h2/0.022,2.0/5.0));
-	    const double Tcmb0 = 2.726;
-	    const double Tini  = astart<adec? Tcmb0/astart : Tcmb0/astart/astart*adec;
-	    const double mu    = (Tini>1.e4) ? 4.0/(8.-5.*YHe_) : 4.0/(1.+3.*(1.-YHe_));
-	    const double ceint = 1.3806e-16/1.6726e-24 * Tini * npol / mu / unitv / unitv;
-	    
-	    npleft	= np_per_file[ifile][0];
-	    n2read	= std::min(curr_block_buf_size,npleft);
-	    blksize = sizeof(T_store)*np_per_file[ifile][0]; //*npgas
-	    
-	    ofs_.write( reinterpret_cast<char*>(&blksize), sizeof(int) );
-	    while( n2read > 0ul )
-	      {
-		for( size_t i=0; i<n2read; ++i )
-		  eint[i] = ceint;
-		ofs_.write( reinterpret_cast<char*>(&eint[0]), n2read*sizeof(T_store) );
-		npleft -= n2read;
-		n2read = std::min( curr_block_buf_size,npleft );
-	      }
-	    ofs_.write( reinterpret_cast<char*>(&blksize), sizeof(int) );
-	    
-	    static bool bdisplayed = false;
-	    if( !bdisplayed )
-	      {
-		LOGINFO("Gadget2 : set initial gas temperature to %.2f K/mu",Tini/mu);
-		bdisplayed = true;
-	      }
+	    #pragma omp critical(gadget2_write)
+	    if( !first_error )
+	      first_error = std::current_exception();
 	  }
-	
-	
-	ofs_.flush();
-	ofs_.close();
-	
-	wrote_gas       += np_per_file[ifile][0];
-	wrote_dm        += np_this_file-np_per_file[ifile][0];
-	wrote_coarse    += np_per_file[ifile][5];
-	
-        
       }
     
-    delete[] tmp1;
-    delete[] tmp2;
-    delete[] tmp3;
-    
-    remove( fnbx );
-    remove( fnby );
-    remove( fnbz );
-    remove( fnx );
-    remove( fny );
-    remove( fnz );
-    remove( fnbvx );
-    remove( fnbvy );
-    remove( fnbvz );
-    remove( fnvx );
-    remove( fnvy );
-    remove( fnvz );
-    remove( fnm );
+    if( first_error )
+      std::rethrow_exception( first_error );
+    
+    for( int coord=0; coord<3; ++coord )
+      {
+	remove( temp_fname( id_gas_pos, coord ).c_str() );
+	remove( temp_fname( id_dm_pos, coord ).c_str() );
+	remove( temp_fname( id_gas_vel, coord ).c_str() );
+	remove( temp_fname( id_dm_vel, coord ).c_str() );
+      }
+    remove( temp_fname( id_dm_mass, 0 ).c_str() );
     
   }
   
@@ -804,7 +727,7 @@ protected:
   
 public:
   gadget2_output_plugin( config_file& cf )
-  : output_plugin( cf )
+  : output_plugin( cf ), porder_( cf, "gadget2" )
   {
 
     units_mass_.insert( std::pair<std::string,double>( "1e10Msol", 1.0 ) );         // 1e10 M_o/h (default)
@@ -829,6 +752,9 @@ public:
     
     nfiles_ = cf.getValueSafe<unsigned>("output","gadget_num_files",1);
     
+    //... number of files written at the same time, each by its own thread
+    nwriters_ = cf.getValueSafe<int>("output","gadget_num_writers",omp_get_max_threads());
+    
     blongids_ = cf.getValueSafe<bool>("output","gadget_longids",false);
     
     shift_halfcell_ = cf.getValueSafe<bool>("output","gadget_cell_centered",false);
@@ -938,6 +864,13 @@ public:
 
     spread_coarse_acrosstypes_ = cf.getValueSafe<bool>("output","gadget_spreadcoarse",false);
     bndparticletype_ = 5;
+    
+    //... particles are ordered within their type: type 1 is the finest level, the coarse
+    //... levels are either spread over types 2 to 5 or all of the same type
+    std::vector<int> ptype_group( levelmax_+1, 0 );
+    for( unsigned ilevel=levelmin_; ilevel<levelmax_; ++ilevel )
+      ptype_group[ilevel] = spread_coarse_acrosstypes_? std::min<int>(levelmax_-ilevel,4) : 1;
+    porder_.set_groups( ptype_group );
 
     if( !spread_coarse_acrosstypes_ )
       {
@@ -1014,7 +947,7 @@ public:
 	temp_dat.reserve(block_buf_size_);
 	
 	char temp_fname[256];
-	sprintf( temp_fname, "___ic_temp_%05d.bin", 100*id_dm_mass );
+	sprintf( temp_fname, "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_mass );
 	std::ofstream ofs_temp( temp_fname, std::ios::binary|std::ios::trunc );
 	
 	size_t blksize = sizeof(T_store)*npcoarse;
@@ -1025,28 +958,22 @@ public:
 	if( !spread_coarse_acrosstypes_ )
 	  levelmaxcoarse = gh.levelmax()-1;
 	
-	for( int ilevel=levelmaxcoarse; ilevel>=(int)gh.levelmin(); --ilevel )
+	porder_.for_each_leaf( gh, levelmaxcoarse, gh.levelmin(), [&]( int ilevel, unsigned i, unsigned j, unsigned k )
 	  {
 	    // baryon particles live only on finest grid
 	    // these particles here are total matter particles
 	    double pmass = header_.Omega0 * rhoc * pow(header_.BoxSize,3.)/pow(2,3*ilevel);	
 	    
-	    for( unsigned i=0; i<gh.get_grid(ilevel)->size(0); ++i )
-	      for( unsigned j=0; j<gh.get_grid(ilevel)->size(1); ++j )
-		for( unsigned k=0; k<gh.get_grid(ilevel)->size(2); ++k )
-		  if( gh.is_in_mask(ilevel,i,j,k) && !gh.is_refined(ilevel,i,j,k) )
-		    {
-		      if( temp_dat.size() <  block_buf_size_ )
-			temp_dat.push_back( pmass );	
-		      else
-			{
-			  ofs_temp.write( (char*)&temp_dat[0], sizeof(T_store)*block_buf_size_ );	
-			  nwritten += block_buf_size_;
-			  temp_dat.clear();
-			  temp_dat.push_back( pmass );	
-			}
-		    }
-	  }
+	    if( temp_dat.size() <  block_buf_size_ )
+	      temp_dat.push_back( pmass );	
+	    else
+	      {
+		ofs_temp.write( (char*)&temp_dat[0], sizeof(T_store)*block_buf_size_ );	
+		nwritten += block_buf_size_;
+		temp_dat.clear();
+		temp_dat.push_back( pmass );	
+	      }
+	  } );
 	
 	if( temp_dat.size() > 0 )
 	  {	
@@ -1094,7 +1021,7 @@ public:
     temp_data.reserve( block_buf_size_ );
     
     char temp_fname[256];
-    sprintf( temp_fname, "___ic_temp_%05d.bin", 100*id_dm_pos+coord );
+    sprintf( temp_fname, "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_pos+coord );
     std::ofstream ofs_temp( temp_fname, std::ios::binary|std::ios::trunc );
     
     size_t blksize = sizeof(T_store)*npart;
@@ -1102,11 +1029,7 @@ public:
     
     double xfac = header_.BoxSize;
     
-    for( int ilevel=gh.levelmax(); ilevel>=(int)gh.levelmin(); --ilevel )
-      for( unsigned i=0; i<gh.get_grid(ilevel)->size(0); ++i )
-	for( unsigned j=0; j<gh.get_grid(ilevel)->size(1); ++j )
-	  for( unsigned k=0; k<gh.get_grid(ilevel)->size(2); ++k )
-	    if( gh.is_in_mask(ilevel,i,j,k) && !gh.is_refined(ilevel,i,j,k) )
+    porder_.for_each_leaf( gh, gh.levelmax(), gh.levelmin(), [&]( int ilevel, unsigned i, unsigned j, unsigned k )
 	      {
 		double xx[3];
 		gh.cell_pos(ilevel, i, j, k, xx);
@@ -1124,7 +1047,7 @@ public:
 		    temp_data.clear();
 		    temp_data.push_back( xx[coord] );
 		  }
-	      }
+	      } );
     
     if( temp_data.size() > 0 )
       {	
@@ -1172,17 +1095,13 @@ public:
     size_t nwritten = 0;
     
     char temp_fname[256];
-    sprintf( temp_fname, "___ic_temp_%05d.bin", 100*id_dm_vel+coord );
+    sprintf( temp_fname, "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_vel+coord );
     std::ofstream ofs_temp( temp_fname, std::ios::binary|std::ios::trunc );
     
     size_t blksize = sizeof(T_store)*npart;
     ofs_temp.write( (char *)&blksize, sizeof(size_t) );
     
-    for( int ilevel=levelmax_; ilevel>=(int)levelmin_; --ilevel )
-      for( unsigned i=0; i<gh.get_grid(ilevel)->size(0); ++i )
-	for( unsigned j=0; j<gh.get_grid(ilevel)->size(1); ++j )
-	  for( unsigned k=0; k<gh.get_grid(ilevel)->size(2); ++k )
-	    if( gh.is_in_mask(ilevel,i,j,k) && !gh.is_refined(ilevel,i,j,k) )
+    porder_.for_each_leaf( gh, levelmax_, levelmin_, [&]( int ilevel, unsigned i, unsigned j, unsigned k )
 	      {
 		if( temp_data.size() < block_buf_size_ )
 		  temp_data.push_back( (*gh.get_grid(ilevel))(i,j,k) * vfac );
@@ -1194,7 +1113,7 @@ public:
 		    temp_data.push_back( (*gh.get_grid(ilevel))(i,j,k) * vfac );
 		  }
 		
-	      }
+	      } );
     if( temp_data.size() > 0 )
       {	
 	ofs_temp.write( (char*)&temp_data[0], temp_data.size()*sizeof(T_store) );
@@ -1251,18 +1170,14 @@ public:
     size_t nwritten = 0;
     
     char temp_fname[256];
-    sprintf( temp_fname, "___ic_temp_%05d.bin", 100*id_gas_vel+coord );
+    sprintf( temp_fname, "%s%05d.bin", temp_prefix_.c_str(), 100*id_gas_vel+coord );
     std::ofstream ofs_temp( temp_fname, std::ios::binary|std::ios::trunc );
     
     size_t blksize = sizeof(T_store)*npart;
     ofs_temp.write( (char *)&blksize, sizeof(size_t) );
     
     
-    for( int ilevel=levelmax_; ilevel>=(int)levelmin_; --ilevel )
-      for( unsigned i=0; i<gh.get_grid(ilevel)->size(0); ++i )
-	for( unsigned j=0; j<gh.get_grid(ilevel)->size(1); ++j )
-	  for( unsigned k=0; k<gh.get_grid(ilevel)->size(2); ++k )
-	    if( gh.is_in_mask(ilevel,i,j,k) && !gh.is_refined(ilevel,i,j,k) )
+    porder_.for_each_leaf( gh, levelmax_, levelmin_, [&]( int ilevel, unsigned i, unsigned j, unsigned k )
 	      {
 		if( temp_data.size() < block_buf_size_ )
 		  temp_data.push_back( (*gh.get_grid(ilevel))(i,j,k) * vfac );
@@ -1274,7 +1189,7 @@ public:
 		    temp_data.push_back( (*gh.get_grid(ilevel))(i,j,k) * vfac );
 		  }
 		
-	      }
+	      } );
     
     
     if( temp_data.size() > 0 )
@@ -1324,7 +1239,7 @@ public:
     temp_data.reserve( block_buf_size_ );
     
     char temp_fname[256];
-    sprintf( temp_fname, "___ic_temp_%05d.bin", 100*id_gas_pos+coord );
+    sprintf( temp_fname, "%s%05d.bin", temp_prefix_.c_str(), 100*id_gas_pos+coord );
     std::ofstream ofs_temp( temp_fname, std::ios::binary|std::ios::trunc );
     
     size_t blksize = sizeof(T_store)*npart;
@@ -1334,13 +1249,7 @@ public:
     
     double h = 1.0/(1ul<<gh.levelmax());
     
-    for( int ilevel=gh.levelmax(); ilevel>=(int)gh.levelmin(); --ilevel )
-      {	
-   	for( unsigned i=0; i<gh.get_grid(ilevel)->size(0); ++i )
-	  for( unsigned j=0; j<gh.get_grid(ilevel)->size(1); ++j )
-	    for( unsigned k=0; k<gh.get_grid(ilevel)->size(2); ++k )
-	      //if( ! gh.is_refined(ilevel,i,j,k) )
-	      if( gh.is_in_mask(ilevel,i,j,k) && !gh.is_refined(ilevel,i,j,k) )
+    porder_.for_each_leaf( gh, gh.levelmax(), gh.levelmin(), [&]( int ilevel, unsigned i, unsigned j, unsigned k )
 		{
 		  double xx[3];
 		  gh.cell_pos(ilevel, i, j, k, xx);
@@ -1362,8 +1271,7 @@ public:
 		      temp_data.clear();
 		      temp_data.push_back( xx[coord] );
 		    }
-		}
-      }
+		} );
     
     if( temp_data.size() > 0 )
       {	
@@ -1394,6 +1302,7 @@ public:
   void finalize( void )
   {	
     this->assemble_gadget_file();
+    porder_.write_keys( fname_+".keys" );
   }
 };
 
@@ -9,10 +9,19 @@
  */
 
 #include <fstream>
+#include <cstring>
+#include <map>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 #include "log.hh"
 #include "output.hh"
 #include "mg_interp.hh"
 #include "mesh.hh"
+#include "particle_order.hh"
 
 template< typename T_store=float >
 class gadget2_2comp_output_plugin : public output_plugin
@@ -54,6 +63,8 @@ protected:
 	
 	bool do_glass_;
 	std::string fname_glass_baryon_, fname_glass_cdm_;
+	unsigned glass_tiles_;			//!< number of replicas of the glass per dimension
+	bool glass_sort_;				//!< whether the glass particles are visited in Morton order
 	
 	enum iofields {
 		id_dm_mass, id_dm_vel, id_dm_pos, id_gas_vel, id_gas_rho, id_gas_temp, id_gas_pos
@@ -253,20 +264,20 @@ protected:
 		char fnx[256],fny[256],fnz[256],fnvx[256],fnvy[256],fnvz[256],fnm[256];
 		char fnbx[256], fnby[256], fnbz[256], fnbvx[256], fnbvy[256], fnbvz[256];
 		
-		sprintf( fnx,  "___ic_temp_%05d.bin", 100*id_dm_pos+0 );
-		sprintf( fny,  "___ic_temp_%05d.bin", 100*id_dm_pos+1 );
-		sprintf( fnz,  "___ic_temp_%05d.bin", 100*id_dm_pos+2 );
-		sprintf( fnvx, "___ic_temp_%05d.bin", 100*id_dm_vel+0 );
-		sprintf( fnvy, "___ic_temp_%05d.bin", 100*id_dm_vel+1 );
-		sprintf( fnvz, "___ic_temp_%05d.bin", 100*id_dm_vel+2 );
-		sprintf( fnm,  "___ic_temp_%05d.bin", 100*id_dm_mass  );
+		sprintf( fnx,  "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_pos+0 );
+		sprintf( fny,  "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_pos+1 );
+		sprintf( fnz,  "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_pos+2 );
+		sprintf( fnvx, "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_vel+0 );
+		sprintf( fnvy, "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_vel+1 );
+		sprintf( fnvz, "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_vel+2 );
+		sprintf( fnm,  "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_mass  );
 
-		sprintf( fnbx,  "___ic_temp_%05d.bin", 100*id_gas_pos+0 );
-		sprintf( fnby,  "___ic_temp_%05d.bin", 100*id_gas_pos+1 );
-		sprintf( fnbz,  "___ic_temp_%05d.bin", 100*id_gas_pos+2 );
-		sprintf( fnbvx, "___ic_temp_%05d.bin", 100*id_gas_vel+0 );
-		sprintf( fnbvy, "___ic_temp_%05d.bin", 100*id_gas_vel+1 );
-		sprintf( fnbvz, "___ic_temp_%05d.bin", 100*id_gas_vel+2 );
+		sprintf( fnbx,  "%s%05d.bin", temp_prefix_.c_str(), 100*id_gas_pos+0 );
+		sprintf( fnby,  "%s%05d.bin", temp_prefix_.c_str(), 100*id_gas_pos+1 );
+		sprintf( fnbz,  "%s%05d.bin", temp_prefix_.c_str(), 100*id_gas_pos+2 );
+		sprintf( fnbvx, "%s%05d.bin", temp_prefix_.c_str(), 100*id_gas_vel+0 );
+		sprintf( fnbvy, "%s%05d.bin", temp_prefix_.c_str(), 100*id_gas_vel+1 );
+		sprintf( fnbvz, "%s%05d.bin", temp_prefix_.c_str(), 100*id_gas_vel+2 );
 
 		pistream iffs1, iffs2, iffs3;
 		
@@ -584,14 +595,224 @@ protected:
         remove( fnm );
 	}
 	
+	//! a Gadget glass file, mapped into memory rather than read
+	class glass_file
+	{
+	protected:
+		int fd_;
+		void *map_;
+		size_t map_bytes_;
+		io_header head_;
+		const float *pos_;
+		std::map< size_t, std::vector<unsigned> > order_;	//!< Morton order of the first n particles, by n
+		
+		glass_file( const glass_file& );
+		glass_file& operator=( const glass_file& );
+		
+	public:
+		
+		explicit glass_file( const std::string& fname )
+		: fd_( -1 ), map_( MAP_FAILED ), map_bytes_( 0 ), pos_( NULL )
+		{
+			struct stat st;
+			
+			fd_ = open( fname.c_str(), O_RDONLY );
+			if( fd_ < 0 || fstat( fd_, &st ) != 0 )
+			{
+				if( fd_ >= 0 )
+					close( fd_ );
+				LOGERR("could not open glass input file \'%s\'",fname.c_str());
+				throw std::runtime_error("could not open glass input file");
+			}
+			
+			map_bytes_ = st.st_size;
+			
+			//... header block, then the block markers around the positions
+			const size_t off_pos = 3*sizeof(unsigned)+sizeof(io_header);
+			if( map_bytes_ >= off_pos )
+				map_ = mmap( NULL, map_bytes_, PROT_READ, MAP_SHARED, fd_, 0 );
+			
+			if( map_ == MAP_FAILED )
+			{
+				close( fd_ );
+				LOGERR("could not map glass input file \'%s\'",fname.c_str());
+				throw std::runtime_error("could not map glass input file");
+			}
+			
+			const char *p = reinterpret_cast<const char*>( map_ );
+			unsigned blksz = *reinterpret_cast<const unsigned*>( p );
+			memcpy( &head_, p+sizeof(unsigned), sizeof(io_header) );
+			
+			size_t ntot = 0;
+			for( int i=0; i<6; ++i )
+				ntot += head_.npart[i];
+			
+			if( blksz != sizeof(io_header) || map_bytes_ < off_pos + 3*sizeof(float)*ntot )
+			{
+				munmap( map_, map_bytes_ );
+				close( fd_ );
+				LOGERR("glass input file \'%s\' is not a valid Gadget file",fname.c_str());
+				throw std::runtime_error("invalid glass input file");
+			}
+			
+			pos_ = reinterpret_cast<const float*>( p+off_pos );
+			
+			//... the positions are read once, front to back, per field
+			madvise( map_, map_bytes_, MADV_WILLNEED );
+		}
+		
+		~glass_file()
+		{
+			if( map_ != MAP_FAILED )
+				munmap( map_, map_bytes_ );
+			if( fd_ >= 0 )
+				close( fd_ );
+			map_ = MAP_FAILED;
+			fd_ = -1;
+		}
+		
+		const io_header& header( void ) const
+		{	return head_;	}
+		
+		//! positions of all particles, starting with type 0
+		const float* positions( void ) const
+		{	return pos_;	}
+		
+		//! the first n particles sorted by the Morton key of their position
+		const std::vector<unsigned>& morton_order( size_t n )
+		{
+			std::vector<unsigned>& order = order_[n];
+			if( order.size() == n )
+				return order;
+			
+			//... 10 bits per dimension for the key, the index breaks ties
+			const unsigned bits = 10;
+			const float fac = (float)(1u<<bits) / head_.BoxSize;
+			std::vector<unsigned long long> key( n );
+			
+			#pragma omp parallel for
+			for( long long ip=0; ip<(long long)n; ++ip )
+			{
+				unsigned x[3];
+				for( int d=0; d<3; ++d )
+					x[d] = std::min( (1u<<bits)-1, (unsigned)std::max( 0.0f, pos_[3*ip+d]*fac ) );
+				key[ip] = (particle_order::morton_key( x[0], x[1], x[2], bits )<<32) | (unsigned long long)ip;
+			}
+			
+			std::sort( key.begin(), key.end() );
+			
+			order.resize( n );
+			#pragma omp parallel for
+			for( long long ip=0; ip<(long long)n; ++ip )
+				order[ip] = (unsigned)(key[ip] & 0xffffffffull);
+			
+			return order;
+		}
+	};
+	
+	std::map< std::string, glass_file* > glass_files_;
+	
+	//! the glass in a file, mapped on first use
+	glass_file& get_glass( const std::string& fname )
+	{
+		if( glass_files_.find( fname ) == glass_files_.end() )
+			glass_files_[fname] = new glass_file( fname );
+		return *glass_files_[fname];
+	}
+	
+	//! number of particles of a type once the glass is tiled over the box
+	size_t glass_count( const glass_file& glass, int itype ) const
+	{	return (size_t)glass.header().npart[itype] * glass_tiles_ * glass_tiles_ * glass_tiles_;	}
+	
+	//! set the particle numbers of a type in the header from the tiled glass
+	void set_glass_header( const glass_file& glass, int itype )
+	{
+		size_t n = glass_count( glass, itype );
+		header_.npart[itype] = (unsigned)n;
+		header_.npartTotal[itype] = (unsigned)n;
+		header_.npartTotalHighWord[itype] = (unsigned)(n>>32);
+	}
+	
+	//! interpolate the finest grid to the tiled glass particles of a type and append them to a temporary file
+	/*! the glass is replicated glass_tiles_ times per dimension over the box. The
+	 *  tiles are visited in Morton order and, if glass_sort_ is set, the particles
+	 *  within a tile as well, so that consecutive particles sample nearby cells of
+	 *  the grid. The particles are gathered and interpolated in parallel blocks of
+	 *  block_buf_size_.
+	 *  @param ofs_temp the temporary file
+	 *  @param glass the glass
+	 *  @param itype particle type whose number of particles is used
+	 *  @param icoord the component of the displacement, -1 for the velocity
+	 *  @param gh the field
+	 *  @return number of particles written
+	 */
+	size_t write_glass_data( std::ofstream& ofs_temp, glass_file& glass, int itype, int icoord, const grid_hierarchy& gh )
+	{
+		const size_t nglass = glass.header().npart[itype], ntiles = (size_t)glass_tiles_*glass_tiles_*glass_tiles_;
+		const float lglass = glass.header().BoxSize;
+		const float *gpos = glass.positions();
+		
+		//... tiles in Morton order
+		unsigned tbits = 0;
+		while( (1u<<tbits) < glass_tiles_ )
+			++tbits;
+		
+		std::vector< std::pair<unsigned long long,unsigned> > tiles( ntiles );
+		for( unsigned t=0; t<ntiles; ++t )
+		{
+			unsigned tx = t/(glass_tiles_*glass_tiles_), ty = (t/glass_tiles_)%glass_tiles_, tz = t%glass_tiles_;
+			tiles[t] = std::make_pair( particle_order::morton_key( tx, ty, tz, tbits ), t );
+		}
+		std::sort( tiles.begin(), tiles.end() );
+		
+		const std::vector<unsigned> *order = glass_sort_? &glass.morton_order( nglass ) : NULL;
+		
+		std::vector<float> pos_tmp( 3*block_buf_size_ );
+		std::vector<T_store> temp_data( block_buf_size_ );
+		
+		size_t npinter = nglass * ntiles, npartdone = 0;
+		
+		while( npartdone < npinter )
+		{
+			size_t npart2read = std::min( npinter-npartdone, block_buf_size_ );
+			
+			#pragma omp parallel for
+			for( long long ip=0; ip<(long long)npart2read; ++ip )
+			{
+				size_t ig = npartdone+ip, q = ig % nglass;
+				unsigned t = tiles[ig / nglass].second;
+				float toff[3] = { (float)(t/(glass_tiles_*glass_tiles_)) * lglass, (float)((t/glass_tiles_)%glass_tiles_) * lglass, (float)(t%glass_tiles_) * lglass };
+				
+				if( order != NULL )
+					q = (*order)[q];
+				
+				for( int d=0; d<3; ++d )
+					pos_tmp[3*ip+d] = gpos[3*q+d] + toff[d];
+			}
+			
+			if( icoord < 0 )
+				get_cic_velocity( &pos_tmp[0], npart2read, lglass*glass_tiles_, gh, &temp_data[0] );
+			else
+				get_cic_displacement( icoord, &pos_tmp[0], npart2read, lglass*glass_tiles_, gh, &temp_data[0] );
+			
+			ofs_temp.write( (char*)&temp_data[0], sizeof(T_store)*npart2read );
+			
+			npartdone += npart2read;
+		}
+		
+		return npinter;
+	}
+	
 	void get_cic_displacement( size_t icoord, const float* ppos, size_t np, float l, const grid_hierarchy& gh, T_store* valp )
 	{
 		size_t N = gh.size(gh.levelmax(), 0);
+		const MeshvarBnd<real_t>& g = *gh.get_grid(levelmax_);
 		
 		float facconv   = 1.f / l * (float)N/(float)(1ul<<levelmax_);
 		float suboffset = (float)(gh.offset_abs(levelmax_, icoord))/((float)(1ul<<levelmax_));
 		
-		for( size_t ip=0; ip < np; ++ip )
+		#pragma omp parallel for
+		for( long long ip=0; ip < (long long)np; ++ip )
 		{
 			float u,v,w;
 			
@@ -631,14 +852,14 @@ protected:
 			disp += suboffset;
 			disp += ppos[3*ip+icoord] * facconv;
 			
-			disp += f1*(*gh.get_grid(levelmax_))(i,j,k);
-			disp += f2*(*gh.get_grid(levelmax_))(i,j,k1);
-			disp += f3*(*gh.get_grid(levelmax_))(i,j1,k);
-			disp += f4*(*gh.get_grid(levelmax_))(i,j1,k1);
-			disp += f5*(*gh.get_grid(levelmax_))(i1,j,k);
-			disp += f6*(*gh.get_grid(levelmax_))(i1,j,k1);
-			disp += f7*(*gh.get_grid(levelmax_))(i1,j1,k);
-			disp += f8*(*gh.get_grid(levelmax_))(i1,j1,k1);
+			disp += f1*g(i,j,k);
+			disp += f2*g(i,j,k1);
+			disp += f3*g(i,j1,k);
+			disp += f4*g(i,j1,k1);
+			disp += f5*g(i1,j,k);
+			disp += f6*g(i1,j,k1);
+			disp += f7*g(i1,j1,k);
+			disp += f8*g(i1,j1,k1);
 			
 			
 			
@@ -658,9 +879,11 @@ protected:
 			vfac /= 1000.0;
 		
 		size_t N = gh.size(gh.levelmax(), 0);
+		const MeshvarBnd<real_t>& g = *gh.get_grid(levelmax_);
 		//float facconv   = 1.f / l * (float)N/(float)(1ul<<levelmax_);
 		
-		for( size_t ip=0; ip < np; ++ip )
+		#pragma omp parallel for
+		for( long long ip=0; ip < (long long)np; ++ip )
 		{
 			float u,v,w;
 			
@@ -696,14 +919,14 @@ protected:
 			
 			float vel = 0.0f;
 			
-			vel += f1*(*gh.get_grid(levelmax_))(i,j,k);
-			vel += f2*(*gh.get_grid(levelmax_))(i,j,k1);
-			vel += f3*(*gh.get_grid(levelmax_))(i,j1,k);
-			vel += f4*(*gh.get_grid(levelmax_))(i,j1,k1);
-			vel += f5*(*gh.get_grid(levelmax_))(i1,j,k);
-			vel += f6*(*gh.get_grid(levelmax_))(i1,j,k1);
-			vel += f7*(*gh.get_grid(levelmax_))(i1,j1,k);
-			vel += f8*(*gh.get_grid(levelmax_))(i1,j1,k1);
+			vel += f1*g(i,j,k);
+			vel += f2*g(i,j,k1);
+			vel += f3*g(i,j1,k);
+			vel += f4*g(i,j1,k1);
+			vel += f5*g(i1,j,k);
+			vel += f6*g(i1,j,k1);
+			vel += f7*g(i1,j1,k);
+			vel += f8*g(i1,j1,k1);
 			
 			vel *= vfac;			
 			
@@ -796,6 +1019,10 @@ public:
 				fname_glass_baryon_ = fname_glass_cdm_;//cf.getValue<std::string>("output","glass_file_baryon");
 		}
 		
+		//... replicate a small glass over the box, and visit it in Morton order
+		glass_tiles_ = std::max( 1u, cf.getValueSafe<unsigned>("output","glass_tiles",1) );
+		glass_sort_  = cf.getValueSafe<bool>("output","glass_sort",true);
+		
 		
 		//... set time ......................................................
 		header_.redshift = cf.getValue<double>("setup","zstart");
@@ -858,7 +1085,7 @@ public:
 			temp_dat.reserve(block_buf_size_);
 			
 			char temp_fname[256];
-			sprintf( temp_fname, "___ic_temp_%05d.bin", 100*id_dm_mass );
+			sprintf( temp_fname, "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_mass );
 			std::ofstream ofs_temp( temp_fname, std::ios::binary|std::ios::trunc );
 			
 			unsigned long long blksize = sizeof(T_store)*npcoarse;
@@ -964,7 +1191,7 @@ public:
 		double xfac = header_.BoxSize;
 		
 		char temp_fname[256];
-		sprintf( temp_fname, "___ic_temp_%05d.bin", 100*id_dm_pos+coord );
+		sprintf( temp_fname, "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_pos+coord );
 		std::ofstream ofs_temp( temp_fname, std::ios::binary|std::ios::trunc );
         
         //... if baryons are present, then stagger the two fields
@@ -1020,80 +1247,24 @@ public:
 		else
 		{
 			
-			std::ifstream ofg( fname_glass_cdm_.c_str(), std::ios::binary );
-			
-			if( !ofg.good() )
-				LOGERR("could not open glass input file \'%s\'",fname_glass_cdm_.c_str());
+			glass_file& glass = get_glass( fname_glass_cdm_ );
 			
-			io_header glasshead;
-			unsigned blksz;
-			
-			ofg.read( reinterpret_cast<char*>(&blksz), sizeof(unsigned) );
-			assert( blksz == sizeof(io_header) );
-			
-			ofg.read( reinterpret_cast<char*>(&glasshead), sizeof( io_header ) );
-			
-			//size_t nreq = gh.size(gh.levelmax(), 0)*gh.size(gh.levelmax(), 1)*gh.size(gh.levelmax(), 2);
-			/*if( nreq != (size_t)glasshead.npart[1] )
-			{
-				LOGERR("glass file contains %d particles, but should contain %ld",glasshead.npart[1],nreq);
-				throw std::runtime_error("glass file does not contain the right amount of particles");
-			}*/
-			
-			ofg.read( reinterpret_cast<char*>(&blksz), sizeof(unsigned) );
-			ofg.read( reinterpret_cast<char*>(&blksz), sizeof(unsigned) );
-			//assert( blksz == glasshead.npart[1]*sizeof(float)*3 );
-			
-			
-			float lglass = glasshead.BoxSize;
-			
-			
-			blksize = sizeof(T_store)*glasshead.npart[1];
-			//ofs_temp.write( (char *)&blksize, sizeof(int) );
-			ofs_temp.write( (char *)&blksize, sizeof(unsigned long long) );
-						
-			header_.npart[1] = glasshead.npart[1];
-			header_.npartTotal[1] = glasshead.npartTotal[1];
-			header_.npartTotalHighWord[1] = 0;
+			set_glass_header( glass, 1 );
 
 			double rhoc = 27.7519737;
 			if( kpcunits_ )
 				rhoc *= 10.0; // in h^2 M_sol / kpc^3
 			
             if( do_baryons_ )
-                header_.mass[1] = omegac_ * rhoc * pow(header_.BoxSize,3.)/(glasshead.npart[1]);
+                header_.mass[1] = omegac_ * rhoc * pow(header_.BoxSize,3.)/glass_count( glass, 1 );
 			else
-                header_.mass[1] = omegam_ * rhoc * pow(header_.BoxSize,3.)/(glasshead.npart[1]);
+                header_.mass[1] = omegam_ * rhoc * pow(header_.BoxSize,3.)/glass_count( glass, 1 );
             
-			// read glass, do interpolation and write
-			size_t npartdone=0;
-			size_t npinter = glasshead.npart[1];
-			
-			blksize = sizeof(T_store)*npinter;
+			// interpolate to the glass and write
+			blksize = sizeof(T_store)*npart;
 			ofs_temp.write( (char *)&blksize, sizeof(unsigned long long) );
 			
-			float *pos_tmp = new float[3*block_buf_size_];
-			temp_data.assign( block_buf_size_, 0.0 );
-			
-			while( npartdone < npinter )
-			{
-				size_t npart2read = std::min(npinter-npartdone,block_buf_size_);
-				
-				ofg.read( reinterpret_cast<char*>(&pos_tmp[0]), npart2read*sizeof(float)*3 );
-				get_cic_displacement( coord, pos_tmp, npart2read, lglass,  gh, &temp_data[0] );
-				ofs_temp.write( (char*)&temp_data[0], sizeof(T_store)*npart2read );
-
-                        //        std::cout << "npart2read " << npart2read << "\n";
-                        //        std::cout << "pos temp " << temp_data[0] << " " << temp_data[1] << " " << temp_data[2] << "\n";
-                        //        std::cout << "pos temp " << temp_data[npart2read-1] << " " << temp_data[npart2read-2] << " " << temp_data[npart2read-3] <<"\n";
-				
-				npartdone += npart2read;
-				nwritten += npart2read;
-
-			}
-
-			delete[] pos_tmp;
-			temp_data.clear();
+			nwritten += write_glass_data( ofs_temp, glass, 1, coord, gh );
 								
 			// do all lower levels with standard cartesian grid
 			for( int ilevel=gh.levelmax()-1; ilevel>=(int)gh.levelmin(); --ilevel )
@@ -1178,7 +1349,7 @@ public:
 		unsigned long long blksize;
 		
 		char temp_fname[256];
-		sprintf( temp_fname, "___ic_temp_%05d.bin", 100*id_dm_vel+coord );
+		sprintf( temp_fname, "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_vel+coord );
 		std::ofstream ofs_temp( temp_fname, std::ios::binary|std::ios::trunc );
 		
 		
@@ -1209,53 +1380,15 @@ public:
 		else
 		{
 			
-			std::ifstream ofg( fname_glass_cdm_.c_str(), std::ios::binary );
-			
-			if( !ofg.good() )
-				LOGERR("could not open glass input file \'%s\'",fname_glass_cdm_.c_str());
-			
-			io_header glasshead;
-			unsigned blksz;
-			
-			ofg.read( reinterpret_cast<char*>(&blksz), sizeof(unsigned) );
-			assert( blksz == sizeof(io_header) );
+			glass_file& glass = get_glass( fname_glass_cdm_ );
 			
-			ofg.read( reinterpret_cast<char*>(&glasshead), sizeof( io_header ) );
+			set_glass_header( glass, 1 );
 			
-			ofg.read( reinterpret_cast<char*>(&blksz), sizeof(unsigned) );
-			ofg.read( reinterpret_cast<char*>(&blksz), sizeof(unsigned) );
-			//assert( blksz == glasshead.npart[1]*sizeof(float)*3 );
-			
-			header_.npart[1] = glasshead.npart[1];
-			header_.npartTotal[1] = glasshead.npartTotal[1];
-			header_.npartTotalHighWord[1] = glasshead.npartTotalHighWord[1];
-			float lglass = glasshead.BoxSize;
-			
-			// read glass, do interpolation and write
-			size_t npartdone=0;
-			size_t npinter = glasshead.npart[1];
-			
-			blksize = sizeof(T_store)*npinter;
+			// interpolate to the glass and write
+			blksize = sizeof(T_store)*npart;
 			ofs_temp.write( (char *)&blksize, sizeof(unsigned long long) );
 			
-			float *pos_tmp = new float[3*block_buf_size_];
-			temp_data.assign( block_buf_size_, 0.0 );
-			
-			while( npartdone < npinter )
-			{
-				size_t npart2read = std::min(npinter-npartdone,block_buf_size_);
-				
-				ofg.read( reinterpret_cast<char*>(&pos_tmp[0]), npart2read*sizeof(float)*3 );
-				get_cic_velocity( pos_tmp, npart2read, lglass,  gh, &temp_data[0] );
-				ofs_temp.write( (char*)&temp_data[0], sizeof(T_store)*npart2read );
-				
-				npartdone += npart2read;
-				nwritten += npart2read;
-				
-			}
-			
-			delete[] pos_tmp;
-			temp_data.clear();
+			nwritten += write_glass_data( ofs_temp, glass, 1, -1, gh );
 			
 			for( int ilevel=levelmax_-1; ilevel>=(int)levelmin_; --ilevel )
 				for( unsigned i=0; i<gh.get_grid(ilevel)->size(0); ++i )
@@ -1335,7 +1468,7 @@ public:
 		unsigned nwritten = 0;
 		
 		char temp_fname[256];
-		sprintf( temp_fname, "___ic_temp_%05d.bin", 100*id_gas_vel+coord );
+		sprintf( temp_fname, "%s%05d.bin", temp_prefix_.c_str(), 100*id_gas_vel+coord );
 		std::ofstream ofs_temp( temp_fname, std::ios::binary|std::ios::trunc );
 
 		unsigned long long blksize;
@@ -1372,63 +1505,16 @@ public:
 					}
 		}else{
 			
-			std::ifstream ofg( fname_glass_baryon_.c_str(), std::ios::binary );
-			
-			if( !ofg.good() )
-				LOGERR("could not open glass input file \'%s\'",fname_glass_cdm_.c_str());
-			
-			io_header glasshead;
-			unsigned blksz;
-			
-			ofg.read( reinterpret_cast<char*>(&blksz), sizeof(unsigned) );
-			assert( blksz == sizeof(io_header) );
-			
-			ofg.read( reinterpret_cast<char*>(&glasshead), sizeof( io_header ) );
-			
-			//size_t nreq = gh.size(gh.levelmax(), 0)*gh.size(gh.levelmax(), 1)*gh.size(gh.levelmax(), 2);
-			/*if( nreq != (size_t)glasshead.npart[1] )
-			{
-				LOGERR("glass file contains %d particles, but should contain %ld",glasshead.npart[1],nreq);
-				throw std::runtime_error("glass file does not contain the right amount of particles");
-			}*/
-			
-			ofg.read( reinterpret_cast<char*>(&blksz), sizeof(unsigned) );
-			ofg.read( reinterpret_cast<char*>(&blksz), sizeof(unsigned) );
-			//assert( blksz == (glasshead.npart[1]+glasshead.npart[2])*sizeof(float)*3 );
-			//ofg.seekg( sizeof(float)*3*glasshead.npart[1], std::ios_base::cur );
+			glass_file& glass = get_glass( fname_glass_baryon_ );
 			
 			// do the highest level with the glass
-			float lglass = glasshead.BoxSize;
+			set_glass_header( glass, 2 );
 			
-			header_.npart[2] = glasshead.npart[2];
-			header_.npartTotal[2] = glasshead.npartTotal[2];
-			header_.npartTotalHighWord[2] = glasshead.npartTotalHighWord[2];
-			
-			// read glass, do interpolation and write
-			size_t npartdone=0;
-			size_t npinter = (size_t)glasshead.npart[2];
-			
-			
-			blksize = sizeof(T_store)*npinter;
+			// interpolate to the glass and write
+			blksize = sizeof(T_store)*npart;
 			ofs_temp.write( (char *)&blksize, sizeof(unsigned long long) );
 			
-			float *pos_tmp = new float[3*block_buf_size_];
-			temp_data.assign( block_buf_size_, 0.0 );
-			
-			while( npartdone < npinter )
-			{
-				size_t npart2read = std::min(npinter-npartdone,block_buf_size_);
-				
-				ofg.read( reinterpret_cast<char*>(&pos_tmp[0]), npart2read*sizeof(float)*3 );
-				get_cic_velocity( pos_tmp, npart2read, lglass,  gh, &temp_data[0] );
-				ofs_temp.write( (char*)&temp_data[0], sizeof(T_store)*npart2read );
-				
-				npartdone += npart2read;
-				nwritten += npart2read;
-			}
-			
-			delete[] pos_tmp;
-			temp_data.clear();
+			nwritten += write_glass_data( ofs_temp, glass, 2, -1, gh );
 			
 			for( int ilevel=levelmax_-1; ilevel>=(int)levelmin_; --ilevel )
 				for( unsigned i=0; i<gh.get_grid(ilevel)->size(0); ++i )
@@ -1507,7 +1593,7 @@ public:
 		
 		
 		char temp_fname[256];
-		sprintf( temp_fname, "___ic_temp_%05d.bin", 100*id_gas_pos+coord );
+		sprintf( temp_fname, "%s%05d.bin", temp_prefix_.c_str(), 100*id_gas_pos+coord );
 		std::ofstream ofs_temp( temp_fname, std::ios::binary|std::ios::trunc );
 		
 		unsigned long long blksize;
@@ -1572,72 +1658,21 @@ public:
 					}
 		}else{
 			
-			std::ifstream ofg( fname_glass_baryon_.c_str(), std::ios::binary );
-			
-			if( !ofg.good() )
-				LOGERR("could not open glass input file \'%s\'",fname_glass_cdm_.c_str());
-			
-			io_header glasshead;
-			unsigned blksz;
-			
-			ofg.read( reinterpret_cast<char*>(&blksz), sizeof(unsigned) );
-			assert( blksz == sizeof(io_header) );
+			glass_file& glass = get_glass( fname_glass_baryon_ );
 			
-			ofg.read( reinterpret_cast<char*>(&glasshead), sizeof( io_header ) );
-			
-			//size_t nreq = gh.size(gh.levelmax(), 0)*gh.size(gh.levelmax(), 1)*gh.size(gh.levelmax(), 2);
-			/*if( nreq != (size_t)glasshead.npart[1] )
-			{
-				LOGERR("glass file contains %d particles, but should contain %ld",glasshead.npart[1],nreq);
-				throw std::runtime_error("glass file does not contain the right amount of particles");
-			}*/
-			
-			ofg.read( reinterpret_cast<char*>(&blksz), sizeof(unsigned) );
-			ofg.read( reinterpret_cast<char*>(&blksz), sizeof(unsigned) );
-			//assert( blksz == (glasshead.npart[1]+glasshead.npart[2])*sizeof(float)*3 );
-			//ofg.seekg( sizeof(float)*3*glasshead.npart[1], std::ios_base::cur );
-			
-			float lglass = glasshead.BoxSize;
-			
-			
-			blksize = sizeof(T_store)*glasshead.npart[1];
-			ofs_temp.write( (char *)&blksize, sizeof(unsigned long long) );
-			
-			header_.npart[2] = glasshead.npart[2];
-			header_.npartTotal[2] = glasshead.npartTotal[2];
-			header_.npartTotalHighWord[2] = glasshead.npartTotalHighWord[2];
+			set_glass_header( glass, 2 );
 			
 			double rhoc = 27.7519737;
 			if( kpcunits_ )
 				rhoc *= 10.0; // in h^2 M_sol / kpc^3
 			
-			header_.mass[2] = omegab_ * rhoc * pow(header_.BoxSize,3.)/(glasshead.npart[2]);
-			
-			// read glass, do interpolation and write
-			size_t npartdone=0;
-			size_t npinter = glasshead.npart[2];
+			header_.mass[2] = omegab_ * rhoc * pow(header_.BoxSize,3.)/glass_count( glass, 2 );
 			
-			blksize = sizeof(T_store)*npinter;
+			// interpolate to the glass and write
+			blksize = sizeof(T_store)*npart;
 			ofs_temp.write( (char *)&blksize, sizeof(unsigned long long) );
 			
-			float *pos_tmp = new float[3*block_buf_size_];
-			temp_data.assign( block_buf_size_, 0.0 );
-			
-			while( npartdone < npinter )
-			{
-				size_t npart2read = std::min(npinter-npartdone,block_buf_size_);
-				
-				ofg.read( reinterpret_cast<char*>(&pos_tmp[0]), npart2read*sizeof(float)*3 );
-				get_cic_displacement( coord, pos_tmp, npart2read, lglass,  gh, &temp_data[0] );
-				ofs_temp.write( (char*)&temp_data[0], sizeof(T_store)*npart2read );
-				
-				npartdone += npart2read;
-				nwritten += npart2read;
-				
-			}
-			
-			delete[] pos_tmp;
-			temp_data.clear();		
+			nwritten += write_glass_data( ofs_temp, glass, 2, coord, gh );
 		}
 		
 		if( temp_data.size() > 0 )
@@ -1674,6 +1709,11 @@ public:
 	
 	void finalize( void )
 	{	
+		//... unmap the glass
+		for( typename std::map< std::string, glass_file* >::iterator it=glass_files_.begin(); it!=glass_files_.end(); ++it )
+			delete it->second;
+		glass_files_.clear();
+		
 		this->assemble_gadget_file();
 	}
 };
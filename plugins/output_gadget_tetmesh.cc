@@ -13,6 +13,7 @@
 #include <iostream>
 #include <bitset>
 #include <map>
+#include <vector>
 #include <cstring>
 #include <algorithm>
 
@@ -48,9 +49,6 @@ const MyIDType vert_long[8][3] = { {0,0,0}, {0,0,1}, {0,1,0}, {0,1,1}, {1,0,0},
 const int conn[][4] = { {1,0,2,4}, {3,1,2,4}, {3,5,1,4}, {3,6,5,4}, {3,2,6,4}, {3,7,5,6} };
 
 
-std::map<MyIDType,size_t> idmap;
-typedef std::map<MyIDType,size_t>::iterator idmap_it;
-
 const size_t num_p_realloc_blocksize = 1000000;
 const size_t newnum_p_per_split = 19;
 
@@ -129,6 +127,130 @@ size_t num_p, num_p_alloc;
 int TetRefinementIDFactor = 0;
 
 
+/*!
+ * @class lagrange_id_map
+ * @brief maps the Lagrange IDs of the particles to their index in P
+ *
+ * An open-addressing hash table with linear probing. A slot only holds the
+ * index of a particle, the key is its Lagrange ID without decoration bits,
+ * so that the table needs 16 bytes per particle at a load factor of 1/2.
+ * It refers to P and has to be rebuilt whenever P is reordered. The Lagrange
+ * IDs are unique after delete_duplicates, which allows to insert in parallel.
+ */
+class lagrange_id_map
+{
+protected:
+	size_t *slot_;		//!< particle index of every slot, npos if empty
+	size_t mask_;		//!< number of slots minus one, a power of two
+	
+	static size_t hash( MyIDType key )
+	{
+		unsigned long long h = (unsigned long long)key;
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdull;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ull;
+		h ^= h >> 33;
+		return (size_t)h;
+	}
+	
+public:
+	static const size_t npos = (size_t)-1;
+	
+	lagrange_id_map( void )
+	: slot_( NULL ), mask_( 0 )
+	{ }
+	
+	~lagrange_id_map()
+	{	clear();	}
+	
+	void clear( void )
+	{
+		free( slot_ );
+		slot_ = NULL;
+		mask_ = 0;
+	}
+	
+	//! index all n particles of p, their Lagrange IDs need to be unique
+	void build( particle *p, size_t n )
+	{
+		size_t nslots = 16;
+		while( nslots < 2*n )
+			nslots <<= 1;
+		
+		clear();
+		slot_ = (size_t*)malloc( sizeof(size_t)*nslots );
+		mask_ = nslots-1;
+		
+		#pragma omp parallel for
+		for( long long i=0; i<(long long)nslots; ++i )
+			slot_[i] = npos;
+		
+		#pragma omp parallel for
+		for( long long ip=0; ip<(long long)n; ++ip )
+		{
+			size_t h = hash( REMOVE_DECORATION_BITS(p[ip].Lagrange_ID) ) & mask_;
+			while( !__sync_bool_compare_and_swap( &slot_[h], npos, (size_t)ip ) )
+				h = (h+1) & mask_;
+		}
+	}
+	
+	//! the index of the particle with a given Lagrange ID, npos if there is none
+	size_t find( MyIDType lid ) const
+	{
+		if( slot_ == NULL )
+			return npos;
+		
+		size_t h = hash( lid ) & mask_;
+		while( slot_[h] != npos )
+		{
+			if( REMOVE_DECORATION_BITS(P[slot_[h]].Lagrange_ID) == lid )
+				return slot_[h];
+			h = (h+1) & mask_;
+		}
+		return npos;
+	}
+};
+
+lagrange_id_map idmap;
+
+
+//! sort the particles with OpenMP, each thread sorts a chunk, the chunks are then merged pairwise
+/*! @param tmp a buffer of n particles
+ */
+template< typename compare >
+void parallel_sort_particles( particle *p, particle *tmp, size_t n, compare comp )
+{
+	int nchunks = std::max( 1, std::min( omp_get_max_threads(), (int)(n/1024) ) );
+	std::vector<size_t> bounds( nchunks+1 );
+	for( int i=0; i<=nchunks; ++i )
+		bounds[i] = n*i/nchunks;
+	
+	#pragma omp parallel for schedule(dynamic)
+	for( int i=0; i<nchunks; ++i )
+		std::sort( p+bounds[i], p+bounds[i+1], comp );
+	
+	particle *src = p, *dst = tmp;
+	for( int width=1; width<nchunks; width*=2 )
+	{
+		#pragma omp parallel for schedule(dynamic)
+		for( int i=0; i<nchunks; i+=2*width )
+		{
+			size_t lo = bounds[i], mid = bounds[std::min(i+width,nchunks)], hi = bounds[std::min(i+2*width,nchunks)];
+			std::merge( src+lo, src+mid, src+mid, src+hi, dst+lo, comp );
+		}
+		std::swap( src, dst );
+	}
+	
+	if( src != p )
+	{
+		#pragma omp parallel for
+		for( long long i=0; i<(long long)n; ++i )
+			p[i] = src[i];
+	}
+}
+
+
 
 inline real_t get_cic( const grid_hierarchy & gh, int ilevel, real_t u, real_t v, real_t w )
 {
@@ -210,14 +332,12 @@ MyIDType compute_midpoint( const MyIDType *connect )
     
     MyIDType lid1, lid2, newlid, lcoord1[3], lcoord2[3];
     
-    idmap_it it;
-    
-    if( (it=idmap.find( REMOVE_DECORATION_BITS(connect[0]) )) == idmap.end() )
+    if( idmap.find( REMOVE_DECORATION_BITS(connect[0]) ) == lagrange_id_map::npos )
     { lid1 = 0; std::cerr << "1111 -- UWEHFFB YAUDASBOHASDJ" << std::endl; }
     else
         lid1 = connect[0];
     
-    if( (it=idmap.find( connect[1] )) == idmap.end() )
+    if( idmap.find( connect[1] ) == lagrange_id_map::npos )
     { lid2 = 0; std::cerr << "1111 -- UWEHFFB YAUDASBOHASDJ" << std::endl; }
     else
         lid2 = connect[1];
@@ -242,12 +362,13 @@ MyIDType compute_midpoint( const MyIDType *connect )
 
 
 
-void split_lagrange_cube( size_t ip )
+//! split the cube of a particle, writing the newnum_p_per_split new particles to pnew
+/*! only modifies the spawning particle itself, so that cubes can be split in parallel
+ */
+void split_lagrange_cube( particle& pspawn, particle *pnew )
 {
     int k, count;
     
-    size_t newi = num_p;//, new_tracer_id = num_p;
-    
     const int massc_edge[][2] = {{0,1},{0,2},{1,2},{0,4},{1,4},{2,4},{3,4}};
     const int nmassc = 7; // +1 for the already existing 0
                           //                              8    9    10     11    12    13    14    15    16   17     18   19
@@ -272,9 +393,7 @@ void split_lagrange_cube( size_t ip )
     //float newmass = P[ip].Mass * 0.125;
     //float zeromass = newmass; // this should eventually be set to zero
     //int masslesstype = 2;
-    int this_level = P[ip].Level + 1;
-    
-    tetgrid_levelmax = std::max(this_level,tetgrid_levelmax);
+    int this_level = pspawn.Level + 1;
     
     count = 0;
     
@@ -282,41 +401,36 @@ void split_lagrange_cube( size_t ip )
     // insert mass carying "true" particles
     for( k=0; k<nmassc; ++k )
     {
-        MyIDType edge_ids[2] = { P[ip].get_vertex( massc_edge[k][0] ), P[ip].get_vertex( massc_edge[k][1] ) };
+        MyIDType edge_ids[2] = { pspawn.get_vertex( massc_edge[k][0] ), pspawn.get_vertex( massc_edge[k][1] ) };
         
-        P[newi+count].Lagrange_ID = compute_midpoint( edge_ids );
+        pnew[count].Lagrange_ID = compute_midpoint( edge_ids );
         
-        assert( REMOVE_DECORATION_BITS(P[newi+count].Lagrange_ID) == REMOVE_DECORATION_BITS(P[ip].get_vertex(k+1,1)));
+        assert( REMOVE_DECORATION_BITS(pnew[count].Lagrange_ID) == REMOVE_DECORATION_BITS(pspawn.get_vertex(k+1,1)));
         
-        //P[newi+count].ID = new_tracer_id+count;
-        //P[newi+count].Mass = newmass;
-        P[newi+count].Type = 1;
-        P[newi+count].Level = this_level;
+        //pnew[count].Mass = newmass;
+        pnew[count].Type = 1;
+        pnew[count].Level = this_level;
         count++;
     }
     // the innermost particle is a freely moving particle to begin with
-    SET_FREE_PARTICLE_BIT( P[newi+count-1].Lagrange_ID );
+    SET_FREE_PARTICLE_BIT( pnew[count-1].Lagrange_ID );
     
     // insert massless helper particles
     for( k=0; k<nmassl; ++k )
     {
-        MyIDType edge_ids[2] = { P[ip].get_vertex( massl_edge[k][0] ), P[ip].get_vertex( massl_edge[k][1] ) };
+        MyIDType edge_ids[2] = { pspawn.get_vertex( massl_edge[k][0] ), pspawn.get_vertex( massl_edge[k][1] ) };
         
-        //P[newi+count].ID = new_tracer_id+count;
-        P[newi+count].Lagrange_ID = compute_midpoint( edge_ids );
+        pnew[count].Lagrange_ID = compute_midpoint( edge_ids );
         
-        //P[newi+count].Mass = zeromass;
-        P[newi+count].Type = 2;//masslesstype;
-        P[newi+count].Level = this_level;
+        //pnew[count].Mass = zeromass;
+        pnew[count].Type = 2;//masslesstype;
+        pnew[count].Level = this_level;
         count++;
     }
     
     // update spawning particle
-    //P[ip].Mass = newmass;
-    P[ip].Level = this_level;
-    
-    
-    num_p += count;
+    //pspawn.Mass = newmass;
+    pspawn.Level = this_level;
 }
 
 void init_base_grid( int ilevel, size_t prealloc_particles = 0 )
@@ -332,8 +446,7 @@ void init_base_grid( int ilevel, size_t prealloc_particles = 0 )
     
     //double dx = 1.0 / nbase;
     
-    num_p = 0;
-    
+    #pragma omp parallel for
     for( size_t ix=0; ix<nbase; ++ix )
         for( size_t iy=0; iy<nbase; ++iy )
             for( size_t iz=0; iz<nbase; ++iz )
@@ -350,54 +463,96 @@ void init_base_grid( int ilevel, size_t prealloc_particles = 0 )
                 P[idx].Level = ilevel;
                 
                 SET_FREE_PARTICLE_BIT( P[idx].Lagrange_ID );
-                
-                //... insert into access map
-                //lid = REMOVE_FREE_PARTICLE_BIT( REMOVE_REFINEMENT_COUNTER( P[idx].Lagrange_ID ) );
-                idmap[ REMOVE_DECORATION_BITS(P[idx].Lagrange_ID) ] = num_p;
-                
-                num_p++;
             }
     
+    num_p = nbase*nbase*nbase;
+    
+    //... insert into access map
+    idmap.build( P, num_p );
+    
     tetgrid_levelmax = ilevel;
 }
 
 
 
+//! merge a duplicate q of a vertex into p
+inline void merge_duplicate( particle& p, const particle& q )
+{
+    p.Lagrange_ID = ADD_REFINEMENT_COUNTERS( p.Lagrange_ID, q.Lagrange_ID );
+    
+    // check if the vertex is part of all neighbouring, if yes, set as 'free' vertex
+    size_t lid = REMOVE_DECORATION_BITS( p.Lagrange_ID );
+    size_t rx = GET_SUBSHIFT( lid, 2, p.Level );
+    size_t ry = GET_SUBSHIFT( lid, 1, p.Level );
+    size_t rz = GET_SUBSHIFT( lid, 0, p.Level );
+    
+    int num_h = rx+ry+rz;  // type of vertex: 1 is on edge, 2 is on face, 3 is in vol
+    int req_h[] = {4,2,1}; // required: 4x ref for edge, 2x for face, 1x for volume
+    
+    int ref_count = GET_REFINEMENT_COUNTER( p.Lagrange_ID );
+    if( ref_count == req_h[ num_h-1 ] )
+        SET_FREE_PARTICLE_BIT( p.Lagrange_ID );
+}
+
+//! sort the particles by Lagrange ID, merge duplicate vertices and rebuild the access map
+/*! the sorted particles are cut into one chunk per thread at vertex boundaries,
+ *  every chunk first counts and then merges its distinct vertices
+ */
 void delete_duplicates( void )
 {
-    std::sort<particle*>( P, P+num_p );
+    particle *tmp = (particle*)malloc( sizeof(particle) * num_p );
+    
+    parallel_sort_particles( P, tmp, num_p, std::less<particle>() );
     
-    idmap.clear();
-    idmap[ REMOVE_DECORATION_BITS(P[0].Lagrange_ID) ] = 0;
+    int nchunks = omp_get_max_threads();
+    std::vector<size_t> bounds( nchunks+1 ), offsets( nchunks+1, 0 );
+    
+    bounds[0] = 0;
+    for( int i=1; i<=nchunks; ++i )
+    {
+        size_t b = std::max( bounds[i-1], num_p*i/nchunks );
+        while( b > 0 && b < num_p && REMOVE_DECORATION_BITS(P[b].Lagrange_ID) == REMOVE_DECORATION_BITS(P[b-1].Lagrange_ID) )
+            ++b;
+        bounds[i] = b;
+    }
     
-    size_t j=1;
-    for( size_t i=1; i<num_p; ++i )
+    //... count the distinct vertices of every chunk
+    #pragma omp parallel for
+    for( int i=0; i<nchunks; ++i )
     {
-        if( REMOVE_DECORATION_BITS(P[i].Lagrange_ID) != REMOVE_DECORATION_BITS(P[j-1].Lagrange_ID) )
+        size_t n = 0;
+        for( size_t ip=bounds[i]; ip<bounds[i+1]; ++ip )
+            if( ip == 0 || REMOVE_DECORATION_BITS(P[ip].Lagrange_ID) != REMOVE_DECORATION_BITS(P[ip-1].Lagrange_ID) )
+                ++n;
+        offsets[i+1] = n;
+    }
+    
+    for( int i=0; i<nchunks; ++i )
+        offsets[i+1] += offsets[i];
+    
+    //... merge the duplicates into the first particle of each vertex
+    #pragma omp parallel for
+    for( int i=0; i<nchunks; ++i )
+    {
+        size_t j = offsets[i];
+        for( size_t ip=bounds[i]; ip<bounds[i+1]; ++ip )
         {
-            memcpy( &P[j], &P[i], sizeof(particle) );
-            idmap[ REMOVE_DECORATION_BITS(P[j].Lagrange_ID) ] = j;
-            ++j;
-        }else{
-            P[j-1].Lagrange_ID = ADD_REFINEMENT_COUNTERS( P[j-1].Lagrange_ID, P[i].Lagrange_ID );
-            
-            // check if the vertex is part of all neighbouring, if yes, set as 'free' vertex
-            size_t lid = REMOVE_DECORATION_BITS( P[j-1].Lagrange_ID );
-            size_t rx = GET_SUBSHIFT( lid, 2, P[j-1].Level );
-            size_t ry = GET_SUBSHIFT( lid, 1, P[j-1].Level );
-            size_t rz = GET_SUBSHIFT( lid, 0, P[j-1].Level );
-            
-            int num_h = rx+ry+rz;  // type of vertex: 1 is on edge, 2 is on face, 3 is in vol
-            int req_h[] = {4,2,1}; // required: 4x ref for edge, 2x for face, 1x for volume
-            
-            int ref_count = GET_REFINEMENT_COUNTER( P[j-1].Lagrange_ID );
-            if( ref_count == req_h[ num_h-1 ] )
-                SET_FREE_PARTICLE_BIT( P[j-1].Lagrange_ID );
-            
+            if( ip == 0 || REMOVE_DECORATION_BITS(P[ip].Lagrange_ID) != REMOVE_DECORATION_BITS(P[ip-1].Lagrange_ID) )
+                tmp[j++] = P[ip];
+            else
+                merge_duplicate( tmp[j-1], P[ip] );
         }
     }
-    //size_t ndeleted = num_p-j;
-    num_p = j;
+    
+    num_p = offsets[nchunks];
+    
+    #pragma omp parallel for
+    for( long long ip=0; ip<(long long)num_p; ++ip )
+        P[ip] = tmp[ip];
+    
+    free( tmp );
+    
+    idmap.build( P, num_p );
 }
 
 
@@ -594,17 +749,17 @@ protected:
 		char fnx[256],fny[256],fnz[256],fnvx[256],fnvy[256],fnvz[256],fnm[256];
 		char fnc[256], fnl[256], fnlid[256];
         
-		sprintf( fnx,  "___ic_temp_%05d.bin", 100*id_dm_pos+0 );
-		sprintf( fny,  "___ic_temp_%05d.bin", 100*id_dm_pos+1 );
-		sprintf( fnz,  "___ic_temp_%05d.bin", 100*id_dm_pos+2 );
-		sprintf( fnvx, "___ic_temp_%05d.bin", 100*id_dm_vel+0 );
-		sprintf( fnvy, "___ic_temp_%05d.bin", 100*id_dm_vel+1 );
-		sprintf( fnvz, "___ic_temp_%05d.bin", 100*id_dm_vel+2 );
-		sprintf( fnm,  "___ic_temp_%05d.bin", 100*id_dm_mass  );
+		sprintf( fnx,  "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_pos+0 );
+		sprintf( fny,  "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_pos+1 );
+		sprintf( fnz,  "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_pos+2 );
+		sprintf( fnvx, "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_vel+0 );
+		sprintf( fnvy, "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_vel+1 );
+		sprintf( fnvz, "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_vel+2 );
+		sprintf( fnm,  "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_mass  );
 
-		sprintf( fnc,  "___ic_temp_%05d.bin", 100*id_dm_conn );
-		sprintf( fnl,  "___ic_temp_%05d.bin", 100*id_dm_level );
-		sprintf( fnlid,  "___ic_temp_%05d.bin", 100*id_dm_lagrangeid );
+		sprintf( fnc,  "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_conn );
+		sprintf( fnl,  "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_level );
+		sprintf( fnlid,  "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_lagrangeid );
 		
     	pistream iffs1, iffs2, iffs3;
 	    
@@ -1055,14 +1210,21 @@ public:
             off[2] = gh.offset_abs(ilevel, 2) * (1<<rfac);// + (1<<(rfac-1));
             
             
-            size_t num_p_before_refinement_sweep = num_p;
+            //... every thread collects the particles it spawns in its own buffer
+            std::vector< std::vector<particle> > spawned( omp_get_max_threads() );
+            MyIDType lid_not_found = -1;
+            
+            #pragma omp parallel
+            {
+            std::vector<particle>& pnew = spawned[ omp_get_thread_num() ];
             
-            for( size_t ip=0; ip<num_p_before_refinement_sweep; ++ip )
+            #pragma omp for schedule(dynamic,4096)
+            for( long long ip=0; ip<(long long)num_p; ++ip )
             {
                 if( P[ip].Level != ilevel || !P[ip].can_refine() )
                     continue;
 
-                MyIDType lidsum = 0, xc[3] = {0,0,0};
+                MyIDType xc[3] = {0,0,0};
                 
                 bool foundall = true;
                 bool dorefine = true;
@@ -1071,18 +1233,15 @@ public:
                 
                 for( int i=0; i<8; ++i )
                 {
-                    idmap_it it = idmap.find( REMOVE_DECORATION_BITS( P[ip].get_vertex(i) ) );
+                    size_t cid = idmap.find( REMOVE_DECORATION_BITS( P[ip].get_vertex(i) ) );
                     
-                    if( it==idmap.end() ){
+                    if( cid == lagrange_id_map::npos ){
                         foundall = false;
-                        LOGERR("This should not happen : Lagrange ID %llu not found!", REMOVE_DECORATION_BITS( P[ip].get_vertex(i) ));
-                        throw std::runtime_error("FATAL");
+                        #pragma omp critical
+                        lid_not_found = REMOVE_DECORATION_BITS( P[ip].get_vertex(i) );
                         break;
                     }
                     
-                    
-                    
-                    size_t cid = (*it).second;
                     MyIDType lid = P[cid].Lagrange_ID;
                     
                     lid = REMOVE_DECORATION_BITS(lid);
@@ -1115,21 +1274,48 @@ public:
                         dorefine = false;
                         break;
                     }
-                    
-                    lidsum += lid;
                 }
                 
                 if( !foundall ) continue;
                 if( !dorefine ) continue;
                 
-                if( num_p + newnum_p_per_split > num_p_alloc )
-                {
-                    P = (particle*) realloc( P, (num_p_alloc+=num_p_realloc_blocksize)*sizeof(particle) );
-                    LOGINFO("reallocated particle buffer. new size = %llu MBytes.",  num_p_alloc * sizeof(particle)/1024/1024 );
-                }
-                split_lagrange_cube( ip );
+                size_t n = pnew.size();
+                pnew.resize( n + newnum_p_per_split );
+                split_lagrange_cube( P[ip], &pnew[n] );
+            }
             }
             
+            if( lid_not_found != -1 )
+            {
+                LOGERR("This should not happen : Lagrange ID %llu not found!", lid_not_found );
+                throw std::runtime_error("FATAL");
+            }
+            
+            //... append the spawned particles to P
+            std::vector<size_t> offsets( spawned.size()+1, num_p );
+            for( size_t i=0; i<spawned.size(); ++i )
+                offsets[i+1] = offsets[i] + spawned[i].size();
+            
+            if( offsets.back() > num_p )
+                tetgrid_levelmax = std::max( ilevel+1, tetgrid_levelmax );
+            
+            if( offsets.back() > num_p_alloc )
+            {
+                num_p_alloc = offsets.back() + num_p_realloc_blocksize;
+                P = (particle*) realloc( P, num_p_alloc*sizeof(particle) );
+                LOGINFO("reallocated particle buffer. new size = %llu MBytes.",  num_p_alloc * sizeof(particle)/1024/1024 );
+            }
+            
+            #pragma omp parallel for schedule(dynamic)
+            for( int i=0; i<(int)spawned.size(); ++i )
+            {
+                if( spawned[i].size() > 0 )
+                    memcpy( &P[offsets[i]], &spawned[i][0], spawned[i].size()*sizeof(particle) );
+                std::vector<particle>().swap( spawned[i] );
+            }
+            
+            num_p = offsets.back();
+            
             delete_duplicates();
             LOGINFO("refined tet mesh to level %d : now have %lld particles", ilevel+1, num_p );
             
@@ -1144,7 +1330,11 @@ public:
         
         
         /// now we sort all particles by type
-        std::sort<particle*>( P, P+num_p, sortP_bytype );
+        {
+            particle *tmp = (particle*)malloc( sizeof(particle) * num_p );
+            parallel_sort_particles( P, tmp, num_p, sortP_bytype );
+            free( tmp );
+        }
 
         
         
@@ -1168,19 +1358,17 @@ public:
         header_.tetgrid_baselevel = tetgrid_baselevel;
         
         
-        idmap.clear();
-        
         size_t num_p_t1 = 0, num_p_t2 = 0, num_p_t5 = 0;
-        for( size_t ip=0; ip<num_p; ++ip )
+        #pragma omp parallel for reduction(+:num_p_t1,num_p_t2,num_p_t5)
+        for( long long ip=0; ip<(long long)num_p; ++ip )
         {
             if( P[ip].Type == 1 ) num_p_t1++;
             else if( P[ip].Type == 2 ) num_p_t2++;
             else if( P[ip].Type == 5 ) num_p_t5++;
-            
-            
-            idmap[ REMOVE_DECORATION_BITS( P[ip].Lagrange_ID ) ] = ip;
         }
         
+        idmap.build( P, num_p );
+        
         np_type1_ = num_p_t1;
         np_type2_ = num_p_t2;
         np_type5_ = num_p_t5;
@@ -1206,7 +1394,7 @@ public:
 			temp_dat.reserve(block_buf_size_);
             
             char temp_fname[256];
-			sprintf( temp_fname, "___ic_temp_%05d.bin", 100*id_dm_mass );
+			sprintf( temp_fname, "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_mass );
 			std::ofstream ofs_temp( temp_fname, std::ios::binary|std::ios::trunc );
             
             double mfac = header_.Omega0 * rhoc * pow(header_.BoxSize,3.);
@@ -1264,7 +1452,7 @@ public:
 			temp_dat.reserve(block_buf_size_);
             
             char temp_fname[256];
-			sprintf( temp_fname, "___ic_temp_%05d.bin", 100*id_dm_conn );
+			sprintf( temp_fname, "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_conn );
 			std::ofstream ofs_temp( temp_fname, std::ios::binary|std::ios::trunc );
             
             size_t blksize = sizeof(long long)*num_p*8;
@@ -1281,7 +1469,11 @@ public:
                     if( blagrangeids_as_vertids_ )
                         lid = REMOVE_DECORATION_BITS(P[ip].get_vertex(j));
                     else
-                        lid = (long long)idmap[ REMOVE_DECORATION_BITS(P[ip].get_vertex(j)) ];
+                    {
+                        lid = idmap.find( REMOVE_DECORATION_BITS(P[ip].get_vertex(j)) );
+                        if( lid == lagrange_id_map::npos )
+                            lid = 0;
+                    }
                 }
                 
                 if( temp_dat.size() < block_buf_size_ )
@@ -1323,7 +1515,7 @@ public:
 			temp_dat.reserve(block_buf_size_);
             
             char temp_fname[256];
-			sprintf( temp_fname, "___ic_temp_%05d.bin", 100*id_dm_level );
+			sprintf( temp_fname, "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_level );
 			std::ofstream ofs_temp( temp_fname, std::ios::binary|std::ios::trunc );
             
             size_t blksize = sizeof(int)*num_p;
@@ -1369,7 +1561,7 @@ public:
 			temp_dat.reserve(block_buf_size_);
             
             char temp_fname[256];
-			sprintf( temp_fname, "___ic_temp_%05d.bin", 100*id_dm_lagrangeid );
+			sprintf( temp_fname, "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_lagrangeid );
 			std::ofstream ofs_temp( temp_fname, std::ios::binary|std::ios::trunc );
             
             size_t blksize = sizeof(size_t)*num_p;
@@ -1420,7 +1612,7 @@ public:
         double xfac = header_.BoxSize;
         
         char temp_fname[256];
-        sprintf( temp_fname, "___ic_temp_%05d.bin", 100*id_dm_pos+coord );
+        sprintf( temp_fname, "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_pos+coord );
         std::ofstream ofs_temp( temp_fname, std::ios::binary|std::ios::trunc );
         
         // write all particle masses
@@ -1486,7 +1678,7 @@ public:
         temp_dat.reserve(block_buf_size_);
         
         char temp_fname[256];
-        sprintf( temp_fname, "___ic_temp_%05d.bin", 100*id_dm_vel+coord );
+        sprintf( temp_fname, "%s%05d.bin", temp_prefix_.c_str(), 100*id_dm_vel+coord );
 		std::ofstream ofs_temp( temp_fname, std::ios::binary|std::ios::trunc );
         
         // write all particle masses
@@ -11,7 +11,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fstream>
+#include <thread>
+#include <algorithm>
 #include "output.hh"
+#include "refinement_pyramid.hh"
 
 
 //! Implementation of class grafic2_output_plugin 
@@ -36,6 +39,7 @@ protected:
   //float metal_floor_;
     int passive_variable_index_;
     float passive_variable_value_;
+	size_t slab_buffer_bytes_;	//!< size of each of the two buffers of write_sliced_array
 	
 	void write_file_header( std::ofstream& ofs, unsigned ilevel, const grid_hierarchy& gh )
 	{
@@ -72,213 +76,126 @@ protected:
 		
 	}
 	
-	void write_sliced_array( std::ofstream& ofs, unsigned ilevel, const grid_hierarchy& gh, float fac = 1.0f )
+	//! transpose the z-slices i0..i0+ns-1 of a field into Fortran order, i.e. x fastest
+	/*! the threads take rows of constant y, within which the x range is
+	 *  blocked so that the slices of a block stay in cache while each source
+	 *  run in z is read once
+	 *  @param value called as value(k,j,i) for the cell (k,j,i) of the field
+	 */
+	template< typename field >
+	void transpose_slices( unsigned n1, unsigned n2, unsigned i0, unsigned ns, const field& value, float* data )
+	{
+		const size_t nslice = (size_t)n1*n2;
+		const unsigned nblock = 64;
+		
+		#pragma omp parallel for schedule(static)
+		for( int j=0; j<(int)n2; ++j )
+			for( unsigned kb=0; kb<n1; kb+=nblock )
+			{
+				unsigned ke = std::min( kb+nblock, n1 );
+				for( unsigned k=kb; k<ke; ++k )
+				{
+					float* dst = data + (size_t)j*n1 + k;
+					for( unsigned i=0; i<ns; ++i )
+						dst[i*nslice] = value(k,j,i0+i);
+				}
+			}
+	}
+	
+	//! write a field as one Fortran record per z-slice
+	/*! batches of slices are transposed into one of two buffers while the
+	 *  previous batch is written from the other one by a separate thread
+	 */
+	template< typename field >
+	void write_slices( std::ofstream& ofs, unsigned n1, unsigned n2, unsigned n3, const field& value )
 	{
-		unsigned n1,n2,n3;
-		n1 = gh.get_grid(ilevel)->size(0);
-		n2 = gh.get_grid(ilevel)->size(1);
-		n3 = gh.get_grid(ilevel)->size(2);
+		const size_t nslice = (size_t)n1*n2;
+		
+		unsigned nbatch = (unsigned)std::max<size_t>( 1, std::min<size_t>( n3, slab_buffer_bytes_/(nslice*sizeof(float)) ) );
 		
-		std::vector<float> data(n1*n2,0.0f);
+		std::vector<float> data[2];
+		data[0].resize( nbatch*nslice );
+		data[1].resize( nbatch*nslice );
 		
-		for( unsigned i=0; i<n3; ++i )
+		std::thread writer;
+		
+		for( unsigned i0=0, ibuf=0; i0<n3; i0+=nbatch, ibuf^=1 )
 		{
+			unsigned ns = std::min( nbatch, n3-i0 );
 			
-			data.clear();
-			
-			for( unsigned j=0; j<n2; ++j )
-				for( unsigned k=0; k<n1; ++k )
-					data[j*n1+k] = (*gh.get_grid(ilevel))(k,j,i) * fac;
+			//... the buffer was last used by the writer two batches ago, which has been joined
+			transpose_slices( n1, n2, i0, ns, value, &data[ibuf][0] );
 			
-			unsigned blksize = n1*n2*sizeof(float);
-			
-			ofs.write( reinterpret_cast<char*> (&blksize), sizeof(unsigned) );
-			ofs.write( reinterpret_cast<char*> (&data[0]), blksize );
-			ofs.write( reinterpret_cast<char*> (&blksize), sizeof(unsigned) );
+			if( writer.joinable() )
+				writer.join();
 			
+			const float* buf = &data[ibuf][0];
+			writer = std::thread( [&ofs,buf,ns,nslice]()
+			{
+				unsigned blksize = nslice*sizeof(float);
+				
+				for( unsigned i=0; i<ns; ++i )
+				{
+					ofs.write( reinterpret_cast<const char*> (&blksize), sizeof(unsigned) );
+					ofs.write( reinterpret_cast<const char*> (buf+i*nslice), blksize );
+					ofs.write( reinterpret_cast<const char*> (&blksize), sizeof(unsigned) );
+				}
+			} );
+		}
+		
+		if( writer.joinable() )
+			writer.join();
+		
+		if( ofs.bad() )
+		{
+			LOGERR("grafic2 output plug-in: I/O error while writing a %dx%dx%d field.",n1,n2,n3);
+			throw std::runtime_error("I/O error in grafic2 output plug-in");
 		}
 	}
+	
+	void write_sliced_array( std::ofstream& ofs, unsigned ilevel, const grid_hierarchy& gh, float fac = 1.0f )
+	{
+		const MeshvarBnd<real_t>& g = *gh.get_grid(ilevel);
+		
+		write_slices( ofs, g.size(0), g.size(1), g.size(2), [&g,fac]( unsigned k, unsigned j, unsigned i )
+		{	return (float)(g(k,j,i) * fac);	} );
+	}
     
-    size_t restrict_mask( size_t n1, size_t n2, size_t n3, size_t o1, size_t o2, size_t o3,
-                        size_t n1c, size_t n2c, size_t n3c, const float* finemask, float* coarsemask )
-    {
-        //unsigned n1p = n1/2, n2p = n2/2, n3p = n3/2;
-        
-        for( size_t i=0; i<n1c*n2c*n3c; ++i )
-            coarsemask[i] = 0.0f;
-        
-        for( size_t i=0; i<n1; ++i )
-        {
-            size_t ii=i/2+o1;
-            for( size_t j=0; j<n2; ++j )
-            {
-                size_t jj=j/2+o2;
-                for( size_t k=0; k<n3; ++k )
-                {
-                    size_t kk=k/2+o3;
-                    if( finemask[ (i*n2+j)*n3+k ] )
-                        coarsemask[(ii*n2c+jj)*n3c+kk] += 1.0f;
-                }
-            }
-        }
-        
-        size_t count_ref = 0;
-        for( size_t i=0; i<n1c*n2c*n3c; ++i )
-            if( coarsemask[i] > 0.1f )
-            {
-                coarsemask[i] = 1.0f;
-                ++count_ref;
-            }
-        return count_ref;
-        
-        
-    }
-    
+    //! write the refinement map and passive variable of all levels
+    /*! a cell is refined if it covers leaf cells of levelmax, cf. tools/ramses/get_music_refmask.f90
+     */
     void write_refinement_mask( const grid_hierarchy& gh )
     {
+        refinement_pyramid pyramid( gh );
         
-        // generate mask for highest level
-        char ff[256];
-       
-        size_t n1,n2,n3;
-            n1 = gh.get_grid(gh.levelmax())->size(0);
-            n2 = gh.get_grid(gh.levelmax())->size(1);
-            n3 = gh.get_grid(gh.levelmax())->size(2);
-        
-        std::vector<float> data(n1*n2*n3,0.0f);
-        
-        // do finest level
+        for( unsigned ilevel=levelmax_; ilevel>=levelmin_; --ilevel )
         {
-            // get mask for levelmax
-            for( size_t i=0; i<n1; ++i )
-                for( size_t j=0; j<n2; ++j )
-                    for( size_t k=0; k<n3; ++k )
-                        if( gh.is_in_mask(gh.levelmax(),i,j,k) && !gh.is_refined(gh.levelmax(),i,j,k) )
-                            data[(i*n2+j)*n3+k] = 1.0;
-                        else
-                            data[(i*n2+j)*n3+k] = 0.0;
+            char ff[256];
+            unsigned n1 = gh.get_grid(ilevel)->size(0), n2 = gh.get_grid(ilevel)->size(1), n3 = gh.get_grid(ilevel)->size(2);
             
-            // write mask
-            sprintf(ff,"%s/level_%03d/ic_refmap",fname_.c_str(), gh.levelmax() );
-            std::ofstream ofs(ff,std::ios::binary|std::ios::trunc);
-	    write_file_header( ofs, gh.levelmax(), gh );
-
-	    std::ofstream ofs_metals;
-	    
-	    if( passive_variable_value_ > 0.0f )
-	      {
-            sprintf(ff,"%s/level_%03d/ic_pvar_%05d",fname_.c_str(), gh.levelmax(), passive_variable_index_ );
-            ofs_metals.open(ff,std::ios::binary|std::ios::trunc);
-            write_file_header( ofs_metals, gh.levelmax(), gh );
-	      }
-
-           
-            
-            std::vector<float> block(n1*n2,0.0f);
-            for( unsigned k=0; k<n3; ++k )
-            {
-                for( unsigned j=0; j<n2; ++j )
-                    for( unsigned i=0; i<n1; ++i )
-                        block[j*n1+i] = data[(i*n2+j)*n3+k];
-                
-                unsigned blksize = n1*n2*sizeof(float);
-                
-                ofs.write( reinterpret_cast<char*> (&blksize), sizeof(unsigned) );
-                ofs.write( reinterpret_cast<char*> (&block[0]), blksize );
-                ofs.write( reinterpret_cast<char*> (&blksize), sizeof(unsigned) );
-
-
-		if( passive_variable_value_ > 0.0f ){
-
-		  for( unsigned j=0; j<n2; ++j )
-		    for( unsigned i=0; i<n1; ++i )
-		      block[j*n1+i] = data[(i*n2+j)*n3+k] * passive_variable_value_;
-                
-		  unsigned blksize = n1*n2*sizeof(float);
-                
-		  ofs_metals.write( reinterpret_cast<char*> (&blksize), sizeof(unsigned) );
-		  ofs_metals.write( reinterpret_cast<char*> (&block[0]), blksize );
-		  ofs_metals.write( reinterpret_cast<char*> (&blksize), sizeof(unsigned) );
-		}
-            }
-        }
-        
-        // do all coarser levels
-        for( unsigned ilevel=levelmax_-1; ilevel>=levelmin_; --ilevel )
-        {
-            size_t n1c,n2c,n3c,o1,o2,o3;
-            n1c = gh.get_grid(ilevel)->size(0);
-            n2c = gh.get_grid(ilevel)->size(1);
-            n3c = gh.get_grid(ilevel)->size(2);
-            
-            n1 = gh.get_grid(ilevel+1)->size(0);
-            n2 = gh.get_grid(ilevel+1)->size(1);
-            n3 = gh.get_grid(ilevel+1)->size(2);
-            
-            o1 = gh.get_grid(ilevel+1)->offset(0);
-            o2 = gh.get_grid(ilevel+1)->offset(1);
-            o3 = gh.get_grid(ilevel+1)->offset(2);
-            
-            std::vector<float> data_coarse( n1c*n2c*n3c, 0.0f );
-            
-            /*if( ilevel <= levelmax_-2 )
-            {
-                for( size_t i=0; i<n1*n2*n3; ++i )
-                    data[i] = 0.0;
-                
-                for( unsigned i=2; i<n1-2; ++i )
-                    for( unsigned j=2; j<n2-2; ++j )
-                        for( unsigned k=2; k<n3-2; ++k )
-                            data[(i*n2+j)*n3+k] = 1.0;
-			    }*/
-            
-            size_t nref;
-            nref = restrict_mask( n1, n2, n3, o1, o2, o3, n1c, n2c, n3c, &data[0], &data_coarse[0] );
-            
-            LOGINFO("%f of cells on level %d are refined",(double)nref/(n1c*n2c*n3c),ilevel);
+            if( ilevel < levelmax_ )
+                LOGINFO("%f of cells on level %d are refined",(double)pyramid.count_covering(ilevel)/((double)n1*n2*n3),ilevel);
             
             sprintf(ff,"%s/level_%03d/ic_refmap",fname_.c_str(), ilevel );
             std::ofstream ofs(ff,std::ios::binary|std::ios::trunc);
             write_file_header( ofs, ilevel, gh );
-
-	    std::ofstream ofs_metals;
-	    if( passive_variable_value_ > 0.0f )
-	      {
-		sprintf(ff,"%s/level_%03d/ic_pvar_%05d",fname_.c_str(), ilevel, passive_variable_index_ );
-		ofs_metals.open(ff,std::ios::binary|std::ios::trunc);
-		write_file_header( ofs_metals, ilevel, gh );
-	      }
-
-
-            std::vector<float> block(n1c*n2c,0.0f);
-            for( unsigned i=0; i<n3c; ++i )
+            
+            write_slices( ofs, n1, n2, n3, [&pyramid,ilevel]( unsigned k, unsigned j, unsigned i )
+            {	return pyramid.test( refinement_pyramid::covers_finest, ilevel, k, j, i )? 1.0f : 0.0f;	} );
+            
+            if( passive_variable_value_ > 0.0f )
             {
-                for( unsigned j=0; j<n2c; ++j )
-                    for( unsigned k=0; k<n1c; ++k )
-                        block[j*n1c+k] = data_coarse[(k*n2c+j)*n3c+i];
-                
-                unsigned blksize = n1c*n2c*sizeof(float);
-                
-                ofs.write( reinterpret_cast<char*> (&blksize), sizeof(unsigned) );
-                ofs.write( reinterpret_cast<char*> (&block[0]), blksize );
-                ofs.write( reinterpret_cast<char*> (&blksize), sizeof(unsigned) );
-
-		if( passive_variable_value_ > 0.0f ){
-
-		  for( unsigned j=0; j<n2c; ++j )
-                    for( unsigned k=0; k<n1c; ++k )
-                        block[j*n1c+k] = data_coarse[(k*n2c+j)*n3c+i] * passive_variable_value_;
+                sprintf(ff,"%s/level_%03d/ic_pvar_%05d",fname_.c_str(), ilevel, passive_variable_index_ );
+                std::ofstream ofs_metals(ff,std::ios::binary|std::ios::trunc);
+                write_file_header( ofs_metals, ilevel, gh );
                 
-		  unsigned blksize = n1c*n2c*sizeof(float);
-                
-		  ofs_metals.write( reinterpret_cast<char*> (&blksize), sizeof(unsigned) );
-		  ofs_metals.write( reinterpret_cast<char*> (&block[0]), blksize );
-		  ofs_metals.write( reinterpret_cast<char*> (&blksize), sizeof(unsigned) );
-		}
+                const float pvar = passive_variable_value_;
+                write_slices( ofs_metals, n1, n2, n3, [&pyramid,ilevel,pvar]( unsigned k, unsigned j, unsigned i )
+                {	return pyramid.test( refinement_pyramid::covers_finest, ilevel, k, j, i )? pvar : 0.0f;	} );
             }
             
-            data.swap( data_coarse );
-            
+            if( ilevel == 0 )
+                break;
         }
     }
     
@@ -478,6 +395,9 @@ public:
       //metal_floor_ = cf.getValueSafe<float>("output","ramses_metal_floor",1e-5);
         passive_variable_index_ = cf.getValueSafe<int>("output","ramses_pvar_idx",1);
         passive_variable_value_ = cf.getValueSafe<float>("output","ramses_pvar_val",1.0f);
+		
+		//... slices are transposed and written in batches of about this size
+		slab_buffer_bytes_ = cf.getValueSafe<size_t>("output","grafic2_buffer_mb",64) << 20;
 	}
 	
 	/*~grafic2_output_plugin()
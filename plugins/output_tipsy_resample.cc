@@ -9,12 +9,11 @@
 
 
 #include <stdio.h>
-#include <rpc/types.h>
-#include <rpc/xdr.h>
 #include <fstream>
 #include <unistd.h>
 
 #include "output.hh"
+#include "tipsy_io.hh"
 
 
 template < typename T_store = float >class tipsy_output_plugin_res:public output_plugin
@@ -80,7 +79,6 @@ protected:
     };
 
     dump header_;
-    FILE *fp_;
     unsigned block_buf_size_;
     size_t npartmax_;
     bool bmorethan2bnd_;
@@ -215,33 +213,6 @@ protected:
         }
     };
 
-    int xdr_dump (XDR * xdrs, T_store * fp)
-    {
-        return 0;
-    }
-
-    int convert_header_XDR (XDR * pxdrs, struct dump *ph)
-    {
-        int pad = 0;
-
-        if (!xdr_double (pxdrs, &ph->time))
-            return 0;
-        if (!xdr_int (pxdrs, &ph->nbodies))
-            return 0;
-        if (!xdr_int (pxdrs, &ph->ndim))
-            return 0;
-        if (!xdr_int (pxdrs, &ph->nsph))
-            return 0;
-        if (!xdr_int (pxdrs, &ph->ndark))
-            return 0;
-        if (!xdr_int (pxdrs, &ph->nstar))
-            return 0;
-        if (!xdr_int (pxdrs, &pad))
-            return 0;
-        return 1;
-        
-    }
-
     inline T_store mass2eps (T_store & m)
     {
         return pow (m / omegam_, 0.333333333333) * epsfac_;
@@ -268,8 +239,8 @@ protected:
 
                 /*** positions ***/
 
-            sprintf (fc, "___ic_temp_%05d.bin", 100 * id_dm_pos + icomp);
-            sprintf (fb, "___ic_temp_%05d.bin", 100 * id_gas_pos + icomp);
+            sprintf (fc, "%s%05d.bin", temp_prefix_.c_str(), 100 * id_dm_pos + icomp);
+            sprintf (fb, "%s%05d.bin", temp_prefix_.c_str(), 100 * id_gas_pos + icomp);
 
             iffs1.open (fc, nptot, npfine * sizeof (T_store));
             iffs2.open (fb, nptot, npfine * sizeof (T_store));
@@ -299,8 +270,8 @@ protected:
 
             /*** velocities ***/
 
-            sprintf (fc, "___ic_temp_%05d.bin", 100 * id_dm_vel + icomp);
-            sprintf (fb, "___ic_temp_%05d.bin", 100 * id_gas_vel + icomp);
+            sprintf (fc, "%s%05d.bin", temp_prefix_.c_str(), 100 * id_dm_vel + icomp);
+            sprintf (fb, "%s%05d.bin", temp_prefix_.c_str(), 100 * id_gas_vel + icomp);
 
             iffs1.open (fc, nptot, npfine * sizeof (T_store));
             iffs2.open (fb, nptot, npfine * sizeof (T_store));
@@ -332,15 +303,16 @@ protected:
 
     }
 
+    //! interleave the temporary files into particle records and write them
+    /*! the records of a block are built in parallel, converted to XDR byte
+     *  order and written with a single positional write
+     */
     void assemble_tipsy_file (void)
     {
 
         if (with_baryons_ && bmultimass_)
             combine_components_for_coarse ();
 
-
-        fp_ = fopen (fname_.c_str (), "w+");
-
         //............................................................................
         //... copy from the temporary files, interleave the data and save ............
 
@@ -349,65 +321,47 @@ protected:
         char fnbx[256], fnby[256], fnbz[256], fnbvx[256], fnbvy[256], fnbvz[256],
           fnbm[256];
 
-        sprintf (fnx, "___ic_temp_%05d.bin", 100 * id_dm_pos + 0);
-        sprintf (fny, "___ic_temp_%05d.bin", 100 * id_dm_pos + 1);
-        sprintf (fnz, "___ic_temp_%05d.bin", 100 * id_dm_pos + 2);
-        sprintf (fnvx, "___ic_temp_%05d.bin", 100 * id_dm_vel + 0);
-        sprintf (fnvy, "___ic_temp_%05d.bin", 100 * id_dm_vel + 1);
-        sprintf (fnvz, "___ic_temp_%05d.bin", 100 * id_dm_vel + 2);
-        sprintf (fnm, "___ic_temp_%05d.bin", 100 * id_dm_mass);
+        sprintf (fnx, "%s%05d.bin", temp_prefix_.c_str(), 100 * id_dm_pos + 0);
+        sprintf (fny, "%s%05d.bin", temp_prefix_.c_str(), 100 * id_dm_pos + 1);
+        sprintf (fnz, "%s%05d.bin", temp_prefix_.c_str(), 100 * id_dm_pos + 2);
+        sprintf (fnvx, "%s%05d.bin", temp_prefix_.c_str(), 100 * id_dm_vel + 0);
+        sprintf (fnvy, "%s%05d.bin", temp_prefix_.c_str(), 100 * id_dm_vel + 1);
+        sprintf (fnvz, "%s%05d.bin", temp_prefix_.c_str(), 100 * id_dm_vel + 2);
+        sprintf (fnm, "%s%05d.bin", temp_prefix_.c_str(), 100 * id_dm_mass);
 
-        sprintf (fnbx, "___ic_temp_%05d.bin", 100 * id_gas_pos + 0);
-        sprintf (fnby, "___ic_temp_%05d.bin", 100 * id_gas_pos + 1);
-        sprintf (fnbz, "___ic_temp_%05d.bin", 100 * id_gas_pos + 2);
-        sprintf (fnbvx, "___ic_temp_%05d.bin", 100 * id_gas_vel + 0);
-        sprintf (fnbvy, "___ic_temp_%05d.bin", 100 * id_gas_vel + 1);
-        sprintf (fnbvz, "___ic_temp_%05d.bin", 100 * id_gas_vel + 2);
-        sprintf (fnbm, "___ic_temp_%05d.bin", 100 * id_gas_mass);
+        sprintf (fnbx, "%s%05d.bin", temp_prefix_.c_str(), 100 * id_gas_pos + 0);
+        sprintf (fnby, "%s%05d.bin", temp_prefix_.c_str(), 100 * id_gas_pos + 1);
+        sprintf (fnbz, "%s%05d.bin", temp_prefix_.c_str(), 100 * id_gas_pos + 2);
+        sprintf (fnbvx, "%s%05d.bin", temp_prefix_.c_str(), 100 * id_gas_vel + 0);
+        sprintf (fnbvy, "%s%05d.bin", temp_prefix_.c_str(), 100 * id_gas_vel + 1);
+        sprintf (fnbvz, "%s%05d.bin", temp_prefix_.c_str(), 100 * id_gas_vel + 2);
+        sprintf (fnbm, "%s%05d.bin", temp_prefix_.c_str(), 100 * id_gas_mass);
 
 
-        pistream ifs_x, ifs_y, ifs_z, ifs_vx, ifs_vy, ifs_vz, ifs_m;
-        pistream ifs_bx, ifs_by, ifs_bz, ifs_bvx, ifs_bvy, ifs_bvz;
+        pistream ifs[7];
 
 
         const unsigned
-          nptot = header_.nbodies, npgas = header_.nsph, npcdm = header_.ndark;
+          npgas = header_.nsph, npcdm = header_.ndark;
 
-        unsigned
-          npleft = nptot, n2read = std::min ((unsigned) block_buf_size_, npleft);
-
-        //std::cout << " - Writing " << nptot << " particles to tipsy file...\n";
+        unsigned npleft, n2read;
 
         LOGINFO
           ("TIPSY : output plugin will write:\n       DM particles   : %d\n       SPH particles  : %d",
            header_.ndark, header_.nsph);
 
+        //... the seven components of a block, and its records
+        std::vector < T_store > tmp[7];
+        for (int ic = 0; ic < 7; ++ic)
+            tmp[ic].resize (block_buf_size_);
 
+        std::vector < T_store > records (12 * (size_t) block_buf_size_);
 
-        std::vector < T_store > adata3;
-        adata3.reserve (3 * block_buf_size_);
-        T_store *tmp1, *tmp2, *tmp3, *tmp4, *tmp5, *tmp6, *tmp7;
-
-        tmp1 = new T_store[block_buf_size_];
-        tmp2 = new T_store[block_buf_size_];
-        tmp3 = new T_store[block_buf_size_];
-        tmp4 = new T_store[block_buf_size_];
-        tmp5 = new T_store[block_buf_size_];
-        tmp6 = new T_store[block_buf_size_];
-        tmp7 = new T_store[block_buf_size_];
-
-
-        T_store zero = (T_store) 0.0;
-
-        while (true)
-          {
         //... write the header .......................................................
-        XDR xdrs;
-        xdrstdio_create (&xdrs, fp_, XDR_ENCODE);
-        convert_header_XDR (&xdrs, &header_);
+        tipsy_file tf (fname_, false);
+        tf.write_header (header_.time, header_.nbodies, header_.ndim, header_.nsph, header_.ndark, header_.nstar);
 
-        std::vector < T_store > dump_store (9 * block_buf_size_,
-                            (T_store) 0.0);
+        size_t offset = tipsy_file::header_bytes ();
 
         //... sph particles ..................................................
         if (with_baryons_)
@@ -431,142 +385,104 @@ protected:
                1.e4) ? 4.0 / (8. - 5. * YHe_) : 4.0 / (1. + 3. * (1. - YHe_));
             //const double ceint = 1.3806e-16/1.6726e-24 * Tini * npol / mu / unitv / unitv;
 
-            T_store temperature = (T_store) Tini;
+            const T_store temperature = (T_store) Tini;
             LOGINFO("TIPSY : set initial gas temperature to %.2f K (mu = %.2f)", Tini, mu);
 
 
             // write
-            ifs_x.open (fnbx, npcdm);
-            ifs_y.open (fnby, npcdm);
-            ifs_z.open (fnbz, npcdm);
-            ifs_vx.open (fnbvx, npcdm);
-            ifs_vy.open (fnbvy, npcdm);
-            ifs_vz.open (fnbvz, npcdm);
-            ifs_m.open (fnbm, npgas);
+            ifs[0].open (fnbx, npcdm);
+            ifs[1].open (fnby, npcdm);
+            ifs[2].open (fnbz, npcdm);
+            ifs[3].open (fnbvx, npcdm);
+            ifs[4].open (fnbvy, npcdm);
+            ifs[5].open (fnbvz, npcdm);
+            ifs[6].open (fnbm, npgas);
 
             npleft = npgas;
             n2read = std::min (block_buf_size_, npleft);
             while (n2read > 0)
-              {
-            ifs_x.read (reinterpret_cast < char *>(&tmp1[0]),
-                    n2read * sizeof (T_store));
-            ifs_y.read (reinterpret_cast < char *>(&tmp2[0]),
-                    n2read * sizeof (T_store));
-            ifs_z.read (reinterpret_cast < char *>(&tmp3[0]),
-                    n2read * sizeof (T_store));
-            ifs_vx.read (reinterpret_cast < char *>(&tmp4[0]),
-                     n2read * sizeof (T_store));
-            ifs_vy.read (reinterpret_cast < char *>(&tmp5[0]),
-                     n2read * sizeof (T_store));
-            ifs_vz.read (reinterpret_cast < char *>(&tmp6[0]),
-                     n2read * sizeof (T_store));
-            ifs_m.read (reinterpret_cast < char *>(&tmp7[0]),
-                    n2read * sizeof (T_store));
-
-            for (size_t i = 0; i < n2read; ++i)
             {
-                xdr_dump (&xdrs, &tmp7[i]);	// mass
-                xdr_dump (&xdrs, &tmp1[i]);	// x
-                xdr_dump (&xdrs, &tmp2[i]);	// y
-                xdr_dump (&xdrs, &tmp3[i]);	// z
-                xdr_dump (&xdrs, &tmp4[i]);	// vx
-                xdr_dump (&xdrs, &tmp5[i]);	// vy
-                xdr_dump (&xdrs, &tmp6[i]);	// vz
-                xdr_dump (&xdrs, &zero);	// rho
-                xdr_dump (&xdrs, &temperature);	// temp
-
-                T_store eps = mass2eps (tmp7[i]);
-
-                xdr_dump (&xdrs, &eps);	// epsilon / hsmooth
-                xdr_dump (&xdrs, &zero);	// metals
-                xdr_dump (&xdrs, &zero);	//potential
-            }
-
-
-
-            npleft -= n2read;
-            n2read = std::min (block_buf_size_, npleft);
-        }
-
-	    ifs_x.close ();
-	    ifs_y.close ();
-	    ifs_z.close ();
-	    ifs_vx.close ();
-	    ifs_vy.close ();
-	    ifs_vz.close ();
-	    ifs_m.close ();
-
-	  }
-
+                for (int ic = 0; ic < 7; ++ic)
+                    ifs[ic].read (reinterpret_cast < char *>(&tmp[ic][0]), n2read * sizeof (T_store));
 
+                #pragma omp parallel for
+                for (long long i = 0; i < (long long) n2read; ++i)
+                {
+                    T_store *r = &records[12 * i];
+
+                    r[0] = tmp[6][i];	// mass
+                    r[1] = tmp[0][i];	// x
+                    r[2] = tmp[1][i];	// y
+                    r[3] = tmp[2][i];	// z
+                    r[4] = tmp[3][i];	// vx
+                    r[5] = tmp[4][i];	// vy
+                    r[6] = tmp[5][i];	// vz
+                    r[7] = 0.0;	// rho
+                    r[8] = temperature;	// temp
+                    r[9] = mass2eps (tmp[6][i]);	// epsilon / hsmooth
+                    r[10] = 0.0;	// metals
+                    r[11] = 0.0;	// potential
+                }
 
-	//... dark matter particles ..................................................
-	LOGINFO ("TIPSY : writing DM data");
+                tf.write_values (&records[0], 12 * (size_t) n2read, offset);
+                offset += 12 * (size_t) n2read * sizeof (T_store);
 
-	ifs_x.open (fnx, npcdm);
-	ifs_y.open (fny, npcdm);
-	ifs_z.open (fnz, npcdm);
-	ifs_vx.open (fnvx, npcdm);
-	ifs_vy.open (fnvy, npcdm);
-	ifs_vz.open (fnvz, npcdm);
-	ifs_m.open (fnm, npcdm);
+                npleft -= n2read;
+                n2read = std::min (block_buf_size_, npleft);
+            }
 
-	npleft = npcdm;
-	n2read = std::min (block_buf_size_, npleft);
-              while (n2read > 0)
-              {
-                  ifs_x.read (reinterpret_cast < char *>(&tmp1[0]),
-                              n2read * sizeof (T_store));
-                  ifs_y.read (reinterpret_cast < char *>(&tmp2[0]),
-                              n2read * sizeof (T_store));
-                  ifs_z.read (reinterpret_cast < char *>(&tmp3[0]),
-                              n2read * sizeof (T_store));
-                  ifs_vx.read (reinterpret_cast < char *>(&tmp4[0]),
-                               n2read * sizeof (T_store));
-                  ifs_vy.read (reinterpret_cast < char *>(&tmp5[0]),
-                               n2read * sizeof (T_store));
-                  ifs_vz.read (reinterpret_cast < char *>(&tmp6[0]),
-                               n2read * sizeof (T_store));
-                  ifs_m.read (reinterpret_cast < char *>(&tmp7[0]),
-                              n2read * sizeof (T_store));
+            for (int ic = 0; ic < 7; ++ic)
+                ifs[ic].close ();
 
-                for (size_t i = 0; i < n2read; ++i)
-                {
-                    xdr_dump (&xdrs, &tmp7[i]);	// mass
-                    xdr_dump (&xdrs, &tmp1[i]);	// x
-                    xdr_dump (&xdrs, &tmp2[i]);	// y
-                    xdr_dump (&xdrs, &tmp3[i]);	// z
-                    xdr_dump (&xdrs, &tmp4[i]);	// vx
-                    xdr_dump (&xdrs, &tmp5[i]);	// vy
-                    xdr_dump (&xdrs, &tmp6[i]);	// vz
+        }
 
-                    T_store eps = mass2eps (tmp7[i]);
 
-                    xdr_dump (&xdrs, &eps);	// epsilon
-                    xdr_dump (&xdrs, &zero);	//potential
 
-                }
+        //... dark matter particles ..................................................
+        LOGINFO ("TIPSY : writing DM data");
 
+        ifs[0].open (fnx, npcdm);
+        ifs[1].open (fny, npcdm);
+        ifs[2].open (fnz, npcdm);
+        ifs[3].open (fnvx, npcdm);
+        ifs[4].open (fnvy, npcdm);
+        ifs[5].open (fnvz, npcdm);
+        ifs[6].open (fnm, npcdm);
 
+        npleft = npcdm;
+        n2read = std::min (block_buf_size_, npleft);
+        while (n2read > 0)
+        {
+            for (int ic = 0; ic < 7; ++ic)
+                ifs[ic].read (reinterpret_cast < char *>(&tmp[ic][0]), n2read * sizeof (T_store));
 
-                npleft -= n2read;
-                n2read = std::min (block_buf_size_, npleft);
+            #pragma omp parallel for
+            for (long long i = 0; i < (long long) n2read; ++i)
+            {
+                T_store *r = &records[9 * i];
+
+                r[0] = tmp[6][i];	// mass
+                r[1] = tmp[0][i];	// x
+                r[2] = tmp[1][i];	// y
+                r[3] = tmp[2][i];	// z
+                r[4] = tmp[3][i];	// vx
+                r[5] = tmp[4][i];	// vy
+                r[6] = tmp[5][i];	// vz
+                r[7] = mass2eps (tmp[6][i]);	// epsilon
+                r[8] = 0.0;	// potential
             }
 
-              ifs_x.close ();
-              ifs_y.close ();
-              ifs_z.close ();
-              ifs_vx.close ();
-              ifs_vy.close ();
-              ifs_vz.close ();
-              ifs_m.close ();
-
+            tf.write_values (&records[0], 9 * (size_t) n2read, offset);
+            offset += 9 * (size_t) n2read * sizeof (T_store);
 
-              break;
-          }
+            npleft -= n2read;
+            n2read = std::min (block_buf_size_, npleft);
+        }
 
+        for (int ic = 0; ic < 7; ++ic)
+            ifs[ic].close ();
 
-        fclose (fp_);
+        tf.close_file ();
 
         // clean up temp files
         unlink (fnx);
@@ -714,7 +630,7 @@ public:
         temp_dat.reserve (block_buf_size_);
 
         char temp_fname[256];
-        sprintf (temp_fname, "___ic_temp_%05d.bin", 100 * id_dm_mass);
+        sprintf (temp_fname, "%s%05d.bin", temp_prefix_.c_str(), 100 * id_dm_mass);
         std::ofstream ofs_temp (temp_fname, std::ios::binary | std::ios::trunc);
 
 
@@ -799,7 +715,7 @@ public:
             temp_dat.reserve (block_buf_size_);
 
             char temp_fname[256];
-            sprintf (temp_fname, "___ic_temp_%05d.bin", 100 * id_gas_mass);
+            sprintf (temp_fname, "%s%05d.bin", temp_prefix_.c_str(), 100 * id_gas_mass);
             ofs_temp.open (temp_fname, std::ios::binary | std::ios::trunc);
 
 
@@ -948,7 +864,7 @@ public:
 
 
         char temp_fname[256];
-        sprintf (temp_fname, "___ic_temp_%05d.bin", 100 * id_dm_pos + coord);
+        sprintf (temp_fname, "%s%05d.bin", temp_prefix_.c_str(), 100 * id_dm_pos + coord);
         std::ofstream ofs_temp (temp_fname, std::ios::binary | std::ios::trunc);
 
         size_t blksize = sizeof (T_store) * nptot;
@@ -1061,7 +977,7 @@ public:
         double vfac = 2.894405 / (100.0 * astart_);
 
         char temp_fname[256];
-        sprintf (temp_fname, "___ic_temp_%05d.bin", 100 * id_dm_vel + coord);
+        sprintf (temp_fname, "%s%05d.bin", temp_prefix_.c_str(), 100 * id_dm_vel + coord);
         std::ofstream ofs_temp (temp_fname, std::ios::binary | std::ios::trunc);
 
         size_t blksize = sizeof (T_store) * nptot;
@@ -1172,7 +1088,7 @@ public:
         double vfac = 2.894405 / (100.0 * astart_);
 
         char temp_fname[256];
-        sprintf (temp_fname, "___ic_temp_%05d.bin", 100 * id_gas_vel + coord);
+        sprintf (temp_fname, "%s%05d.bin", temp_prefix_.c_str(), 100 * id_gas_vel + coord);
         std::ofstream ofs_temp (temp_fname, std::ios::binary | std::ios::trunc);
 
         size_t blksize = sizeof (T_store) * npart;
@@ -1266,7 +1182,7 @@ public:
 
 
         char temp_fname[256];
-        sprintf (temp_fname, "___ic_temp_%05d.bin", 100 * id_gas_pos + coord);
+        sprintf (temp_fname, "%s%05d.bin", temp_prefix_.c_str(), 100 * id_gas_pos + coord);
         std::ofstream ofs_temp (temp_fname, std::ios::binary | std::ios::trunc);
 
         size_t blksize = sizeof (T_store) * npart;
@@ -1378,19 +1294,6 @@ public:
     }
 };
 
-template <>
-int tipsy_output_plugin_res < float >::xdr_dump (XDR * xdrs, float *p)
-{
-    return xdr_float (xdrs, p);
-}
-
-template <>
-int tipsy_output_plugin_res < double >::xdr_dump (XDR * xdrs, double *p)
-{
-    return xdr_double (xdrs, p);
-}
-
-
 namespace
 {
   output_plugin_creator_concrete< tipsy_output_plugin_res<float> >creator1 ("tipsy_resample");
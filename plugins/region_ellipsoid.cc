@@ -21,6 +21,7 @@
 #include <gsl/gsl_eigen.h>
 
 #include "region_generator.hh"
+#include "output.hh"
 
 
 /***** Math helper functions ******/
@@ -730,8 +731,8 @@ public:
       
         // conditions should be added here
         {
-          std::string output_plugin = cf.getValue<std::string>("output","format");
-          if( output_plugin == std::string("grafic2") )
+          std::vector<std::string> formats = get_output_formats( cf );
+          if( std::find( formats.begin(), formats.end(), "grafic2" ) != formats.end() )
             do_extra_padding_ = true;
         }
     }
@@ -0,0 +1,158 @@
+/*
+
+ tipsy_io.hh - This file is part of MUSIC -
+ a code to generate multi-scale initial conditions
+ for cosmological simulations
+
+ Copyright (C) 2010  Oliver Hahn
+
+ */
+
+#ifndef __TIPSY_IO_HH
+#define __TIPSY_IO_HH
+
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "log.hh"
+
+//! convert values in place to XDR, i.e. big-endian, byte order
+/*! the loops compile to vector byte shuffles, on big-endian hosts nothing is done
+ */
+inline void tipsy_to_xdr( float *p, size_t n )
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	for( size_t i=0; i<n; ++i )
+	{
+		uint32_t u;
+		memcpy( &u, p+i, sizeof(u) );
+		u = __builtin_bswap32( u );
+		memcpy( p+i, &u, sizeof(u) );
+	}
+#endif
+}
+
+inline void tipsy_to_xdr( double *p, size_t n )
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	for( size_t i=0; i<n; ++i )
+	{
+		uint64_t u;
+		memcpy( &u, p+i, sizeof(u) );
+		u = __builtin_bswap64( u );
+		memcpy( p+i, &u, sizeof(u) );
+	}
+#endif
+}
+
+inline void tipsy_to_xdr( int *p, size_t n )
+{
+	tipsy_to_xdr( reinterpret_cast<float*>(p), n );
+}
+
+/*!
+ * @class tipsy_file
+ * @brief a tipsy file written with positional writes
+ *
+ * The header and the particle records are written to their offset in the
+ * file, so that blocks of records can be written from several threads at
+ * once and in any order. Unless the file is native, the values are written in
+ * XDR byte order, which for float, double and int is plain big-endian.
+ */
+class tipsy_file
+{
+protected:
+	int fd_;
+	bool native_;
+	std::string fname_;
+
+	tipsy_file( const tipsy_file& );
+	tipsy_file& operator=( const tipsy_file& );
+
+	void pwrite_all( const char *p, size_t nbytes, size_t offset )
+	{
+		while( nbytes > 0 )
+		{
+			ssize_t nw = pwrite( fd_, p, nbytes, (off_t)offset );
+			if( nw < 0 && errno == EINTR )
+				continue;
+			if( nw <= 0 )
+			{
+				LOGERR("TIPSY : could not write to file \'%s\' : %s",fname_.c_str(),strerror(errno));
+				throw std::runtime_error("I/O error while writing TIPSY file");
+			}
+			p += nw;
+			nbytes -= nw;
+			offset += nw;
+		}
+	}
+
+public:
+
+	//! size of the header in the file, native and XDR alike
+	static size_t header_bytes( void )
+	{	return sizeof(double) + 6*sizeof(int);	}
+
+	tipsy_file( const std::string& fname, bool native )
+	: native_( native ), fname_( fname )
+	{
+		fd_ = open( fname.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644 );
+		if( fd_ < 0 )
+		{
+			LOGERR("TIPSY : could not open file \'%s\' for writing : %s",fname.c_str(),strerror(errno));
+			throw std::runtime_error("could not open TIPSY file for writing");
+		}
+	}
+
+	~tipsy_file()
+	{
+		if( fd_ >= 0 )
+			close( fd_ );
+	}
+
+	//! write the header, with the pad set to zero
+	void write_header( double time, int nbodies, int ndim, int nsph, int ndark, int nstar )
+	{
+		char buf[sizeof(double)+6*sizeof(int)];
+		int ih[6] = { nbodies, ndim, nsph, ndark, nstar, 0 };
+
+		if( !native_ )
+		{
+			tipsy_to_xdr( &time, 1 );
+			tipsy_to_xdr( ih, 6 );
+		}
+
+		memcpy( buf, &time, sizeof(double) );
+		memcpy( buf+sizeof(double), ih, 6*sizeof(int) );
+		pwrite_all( buf, sizeof(buf), 0 );
+	}
+
+	//! write values at a byte offset, they are converted to XDR byte order in place
+	template< typename T >
+	void write_values( T *p, size_t n, size_t offset )
+	{
+		if( !native_ )
+			tipsy_to_xdr( p, n );
+
+		pwrite_all( reinterpret_cast<const char*>(p), n*sizeof(T), offset );
+	}
+
+	//! flush the file to disk and close it
+	void close_file( void )
+	{
+		if( fd_ >= 0 && close( fd_ ) != 0 )
+		{
+			fd_ = -1;
+			LOGERR("TIPSY : could not close file \'%s\' : %s",fname_.c_str(),strerror(errno));
+			throw std::runtime_error("I/O error while closing TIPSY file");
+		}
+		fd_ = -1;
+	}
+};
+
+#endif // __TIPSY_IO_HH
@@ -12,6 +12,7 @@
 
 #include "poisson.hh"
 #include "Numerics.hh"
+#include "trace.hh"
 
 std::map< std::string, poisson_plugin_creator *>& 
 get_poisson_plugin_map()
@@ -62,6 +63,7 @@ typedef multigrid::solver< stencil_19P<double>, interp_O7_fluxcorr, mg_straight,
 
 double multigrid_poisson_plugin::solve( grid_hierarchy& f, grid_hierarchy& u )
 {
+	MUSIC::trace_scope trace("multigrid Poisson solver");
 	LOGUSER("Initializing multi-grid Poisson solver...");
 	
 	unsigned verbosity = cf_.getValueSafe<unsigned>("setup","verbosity",2);
@@ -159,9 +161,11 @@ double multigrid_poisson_plugin::solve( grid_hierarchy& f, grid_hierarchy& u )
 	return err;
 }
 
-double multigrid_poisson_plugin::gradient( int dir, grid_hierarchy& u, grid_hierarchy& Du )
+double multigrid_poisson_plugin::gradient( int dir, const grid_hierarchy& u, grid_hierarchy& Du )
 {
+	MUSIC::trace_scope trace("gradient %c",'x'+dir);
 	Du = u;
+	Du.detach();
 	
 	unsigned order = cf_.getValueSafe<unsigned>( "poisson", "grad_order", 4 );
 	
@@ -184,9 +188,10 @@ double multigrid_poisson_plugin::gradient( int dir, grid_hierarchy& u, grid_hier
 	return 0.0;
 }
 
-double multigrid_poisson_plugin::gradient_add( int dir, grid_hierarchy& u, grid_hierarchy& Du )
+double multigrid_poisson_plugin::gradient_add( int dir, const grid_hierarchy& u, grid_hierarchy& Du )
 {
-	//Du = u;
+	MUSIC::trace_scope trace("gradient %c",'x'+dir);
+	Du.detach();
 	
 	unsigned order = cf_.getValueSafe<unsigned>( "poisson", "grad_order", 4 );
 	
@@ -209,7 +214,7 @@ double multigrid_poisson_plugin::gradient_add( int dir, grid_hierarchy& u, grid_
 	return 0.0;
 }
 
-void multigrid_poisson_plugin::implementation::gradient_O2( int dir, grid_hierarchy& u, grid_hierarchy& Du )
+void multigrid_poisson_plugin::implementation::gradient_O2( int dir, const grid_hierarchy& u, grid_hierarchy& Du )
 {
 	LOGUSER("Computing a 2nd order finite difference gradient...");
 	
@@ -217,33 +222,34 @@ void multigrid_poisson_plugin::implementation::gradient_O2( int dir, grid_hierar
 	{
 		double h = pow(2.0,ilevel);
 		meshvar_bnd *pvar = Du.get_grid(ilevel);
+		const meshvar_bnd *pu = u.get_grid(ilevel);
 		
 		if( dir == 0 )
 #pragma omp parallel for
-			for( int ix = 0; ix < (int)(*u.get_grid(ilevel)).size(0); ++ix )
-				for( int iy = 0; iy < (int)(*u.get_grid(ilevel)).size(1); ++iy )
-					for( int iz = 0; iz < (int)(*u.get_grid(ilevel)).size(2); ++iz )
-						(*pvar)(ix,iy,iz) = 0.5*((*u.get_grid(ilevel))(ix+1,iy,iz)-(*u.get_grid(ilevel))(ix-1,iy,iz))*h;
+			for( int ix = 0; ix < (int)pu->size(0); ++ix )
+				for( int iy = 0; iy < (int)pu->size(1); ++iy )
+					for( int iz = 0; iz < (int)pu->size(2); ++iz )
+						(*pvar)(ix,iy,iz) = 0.5*((*pu)(ix+1,iy,iz)-(*pu)(ix-1,iy,iz))*h;
 		
 		else if( dir == 1 )
 #pragma omp parallel for
-			for( int ix = 0; ix < (int)(*u.get_grid(ilevel)).size(0); ++ix )
-				for( int iy = 0; iy < (int)(*u.get_grid(ilevel)).size(1); ++iy )
-					for( int iz = 0; iz < (int)(*u.get_grid(ilevel)).size(2); ++iz )
-						(*pvar)(ix,iy,iz) = 0.5*((*u.get_grid(ilevel))(ix,iy+1,iz)-(*u.get_grid(ilevel))(ix,iy-1,iz))*h;
+			for( int ix = 0; ix < (int)pu->size(0); ++ix )
+				for( int iy = 0; iy < (int)pu->size(1); ++iy )
+					for( int iz = 0; iz < (int)pu->size(2); ++iz )
+						(*pvar)(ix,iy,iz) = 0.5*((*pu)(ix,iy+1,iz)-(*pu)(ix,iy-1,iz))*h;
 		
 		else if( dir == 2 )
 #pragma omp parallel for
-			for( int ix = 0; ix < (int)(*u.get_grid(ilevel)).size(0); ++ix )
-				for( int iy = 0; iy < (int)(*u.get_grid(ilevel)).size(1); ++iy )
-					for( int iz = 0; iz < (int)(*u.get_grid(ilevel)).size(2); ++iz )
-						(*pvar)(ix,iy,iz) = 0.5*((*u.get_grid(ilevel))(ix,iy,iz+1)-(*u.get_grid(ilevel))(ix,iy,iz-1))*h;	
+			for( int ix = 0; ix < (int)pu->size(0); ++ix )
+				for( int iy = 0; iy < (int)pu->size(1); ++iy )
+					for( int iz = 0; iz < (int)pu->size(2); ++iz )
+						(*pvar)(ix,iy,iz) = 0.5*((*pu)(ix,iy,iz+1)-(*pu)(ix,iy,iz-1))*h;	
 	}
 	
 	LOGUSER("Done computing a 2nd order finite difference gradient.");
 }
 
-void multigrid_poisson_plugin::implementation::gradient_add_O2( int dir, grid_hierarchy& u, grid_hierarchy& Du )
+void multigrid_poisson_plugin::implementation::gradient_add_O2( int dir, const grid_hierarchy& u, grid_hierarchy& Du )
 {
 	LOGUSER("Computing a 2nd order finite difference gradient...");
 	
@@ -251,33 +257,34 @@ void multigrid_poisson_plugin::implementation::gradient_add_O2( int dir, grid_hi
 	{
 		double h = pow(2.0,ilevel);
 		meshvar_bnd *pvar = Du.get_grid(ilevel);
+		const meshvar_bnd *pu = u.get_grid(ilevel);
 		
 		if( dir == 0 )
 			#pragma omp parallel for
-			for( int ix = 0; ix < (int)(*Du.get_grid(ilevel)).size(0); ++ix )
-				for( int iy = 0; iy < (int)(*Du.get_grid(ilevel)).size(1); ++iy )
-					for( int iz = 0; iz < (int)(*Du.get_grid(ilevel)).size(2); ++iz )
-						(*pvar)(ix,iy,iz) += 0.5*((*u.get_grid(ilevel))(ix+1,iy,iz)-(*u.get_grid(ilevel))(ix-1,iy,iz))*h;
+			for( int ix = 0; ix < (int)pvar->size(0); ++ix )
+				for( int iy = 0; iy < (int)pvar->size(1); ++iy )
+					for( int iz = 0; iz < (int)pvar->size(2); ++iz )
+						(*pvar)(ix,iy,iz) += 0.5*((*pu)(ix+1,iy,iz)-(*pu)(ix-1,iy,iz))*h;
 		
 		else if( dir == 1 )
 			#pragma omp parallel for
-			for( int ix = 0; ix < (int)(*Du.get_grid(ilevel)).size(0); ++ix )
-				for( int iy = 0; iy < (int)(*Du.get_grid(ilevel)).size(1); ++iy )
-					for( int iz = 0; iz < (int)(*Du.get_grid(ilevel)).size(2); ++iz )
-						(*pvar)(ix,iy,iz) += 0.5*((*u.get_grid(ilevel))(ix,iy+1,iz)-(*u.get_grid(ilevel))(ix,iy-1,iz))*h;
+			for( int ix = 0; ix < (int)pvar->size(0); ++ix )
+				for( int iy = 0; iy < (int)pvar->size(1); ++iy )
+					for( int iz = 0; iz < (int)pvar->size(2); ++iz )
+						(*pvar)(ix,iy,iz) += 0.5*((*pu)(ix,iy+1,iz)-(*pu)(ix,iy-1,iz))*h;
 		
 		else if( dir == 2 )
 			#pragma omp parallel for
-			for( int ix = 0; ix < (int)(*Du.get_grid(ilevel)).size(0); ++ix )
-				for( int iy = 0; iy < (int)(*Du.get_grid(ilevel)).size(1); ++iy )
-					for( int iz = 0; iz < (int)(*Du.get_grid(ilevel)).size(2); ++iz )
-						(*pvar)(ix,iy,iz) += 0.5*((*u.get_grid(ilevel))(ix,iy,iz+1)-(*u.get_grid(ilevel))(ix,iy,iz-1))*h;	
+			for( int ix = 0; ix < (int)pvar->size(0); ++ix )
+				for( int iy = 0; iy < (int)pvar->size(1); ++iy )
+					for( int iz = 0; iz < (int)pvar->size(2); ++iz )
+						(*pvar)(ix,iy,iz) += 0.5*((*pu)(ix,iy,iz+1)-(*pu)(ix,iy,iz-1))*h;	
 	}
 	
 	LOGUSER("Done computing a 4th order finite difference gradient.");
 }
 
-void multigrid_poisson_plugin::implementation::gradient_O4( int dir, grid_hierarchy& u, grid_hierarchy& Du )
+void multigrid_poisson_plugin::implementation::gradient_O4( int dir, const grid_hierarchy& u, grid_hierarchy& Du )
 {
 	LOGUSER("Computing a 4th order finite difference gradient...");
 	
@@ -285,44 +292,45 @@ void multigrid_poisson_plugin::implementation::gradient_O4( int dir, grid_hierar
 	{
 		double h = pow(2.0,ilevel);
 		meshvar_bnd *pvar = Du.get_grid(ilevel);
+		const meshvar_bnd *pu = u.get_grid(ilevel);
 		
 		h /= 12.0;
 		
 		if( dir == 0 )
 #pragma omp parallel for
-			for( int ix = 0; ix < (int)(*u.get_grid(ilevel)).size(0); ++ix )
-				for( int iy = 0; iy < (int)(*u.get_grid(ilevel)).size(1); ++iy )
-					for( int iz = 0; iz < (int)(*u.get_grid(ilevel)).size(2); ++iz )
-						(*pvar)(ix,iy,iz) = ((*u.get_grid(ilevel))(ix-2,iy,iz)
-											-8.0*(*u.get_grid(ilevel))(ix-1,iy,iz)
-											 +8.0*(*u.get_grid(ilevel))(ix+1,iy,iz)
-											 -(*u.get_grid(ilevel))(ix+2,iy,iz))*h;
+			for( int ix = 0; ix < (int)pu->size(0); ++ix )
+				for( int iy = 0; iy < (int)pu->size(1); ++iy )
+					for( int iz = 0; iz < (int)pu->size(2); ++iz )
+						(*pvar)(ix,iy,iz) = ((*pu)(ix-2,iy,iz)
+											-8.0*(*pu)(ix-1,iy,iz)
+											 +8.0*(*pu)(ix+1,iy,iz)
+											 -(*pu)(ix+2,iy,iz))*h;
 		
 		else if( dir == 1 )
 #pragma omp parallel for
-			for( int ix = 0; ix < (int)(*u.get_grid(ilevel)).size(0); ++ix )
-				for( int iy = 0; iy < (int)(*u.get_grid(ilevel)).size(1); ++iy )
-					for( int iz = 0; iz < (int)(*u.get_grid(ilevel)).size(2); ++iz )
-						(*pvar)(ix,iy,iz) = ((*u.get_grid(ilevel))(ix,iy-2,iz)
-											 -8.0*(*u.get_grid(ilevel))(ix,iy-1,iz)
-											 +8.0*(*u.get_grid(ilevel))(ix,iy+1,iz)
-											 -(*u.get_grid(ilevel))(ix,iy+2,iz))*h;
+			for( int ix = 0; ix < (int)pu->size(0); ++ix )
+				for( int iy = 0; iy < (int)pu->size(1); ++iy )
+					for( int iz = 0; iz < (int)pu->size(2); ++iz )
+						(*pvar)(ix,iy,iz) = ((*pu)(ix,iy-2,iz)
+											 -8.0*(*pu)(ix,iy-1,iz)
+											 +8.0*(*pu)(ix,iy+1,iz)
+											 -(*pu)(ix,iy+2,iz))*h;
 		
 		else if( dir == 2 )
 #pragma omp parallel for
-			for( int ix = 0; ix < (int)(*u.get_grid(ilevel)).size(0); ++ix )
-				for( int iy = 0; iy < (int)(*u.get_grid(ilevel)).size(1); ++iy )
-					for( int iz = 0; iz < (int)(*u.get_grid(ilevel)).size(2); ++iz )
-						(*pvar)(ix,iy,iz) = ((*u.get_grid(ilevel))(ix,iy,iz-2)
-											 -8.0*(*u.get_grid(ilevel))(ix,iy,iz-1)
-											 +8.0*(*u.get_grid(ilevel))(ix,iy,iz+1)
-											 -(*u.get_grid(ilevel))(ix,iy,iz+2))*h;
+			for( int ix = 0; ix < (int)pu->size(0); ++ix )
+				for( int iy = 0; iy < (int)pu->size(1); ++iy )
+					for( int iz = 0; iz < (int)pu->size(2); ++iz )
+						(*pvar)(ix,iy,iz) = ((*pu)(ix,iy,iz-2)
+											 -8.0*(*pu)(ix,iy,iz-1)
+											 +8.0*(*pu)(ix,iy,iz+1)
+											 -(*pu)(ix,iy,iz+2))*h;
 	}		
 	
 	LOGUSER("Done computing a 4th order finite difference gradient.");
 }
 
-void multigrid_poisson_plugin::implementation::gradient_add_O4( int dir, grid_hierarchy& u, grid_hierarchy& Du )
+void multigrid_poisson_plugin::implementation::gradient_add_O4( int dir, const grid_hierarchy& u, grid_hierarchy& Du )
 {
 	LOGUSER("Computing a 4th order finite difference gradient...");
 	
@@ -330,38 +338,39 @@ void multigrid_poisson_plugin::implementation::gradient_add_O4( int dir, grid_hi
 	{
 		double h = pow(2.0,ilevel);
 		meshvar_bnd *pvar = Du.get_grid(ilevel);
+		const meshvar_bnd *pu = u.get_grid(ilevel);
 		
 		h /= 12.0;
 		
 		if( dir == 0 )
 #pragma omp parallel for
-			for( int ix = 0; ix < (int)(*u.get_grid(ilevel)).size(0); ++ix )
-				for( int iy = 0; iy < (int)(*u.get_grid(ilevel)).size(1); ++iy )
-					for( int iz = 0; iz < (int)(*u.get_grid(ilevel)).size(2); ++iz )
-						(*pvar)(ix,iy,iz) += ((*u.get_grid(ilevel))(ix-2,iy,iz)
-											 -8.0*(*u.get_grid(ilevel))(ix-1,iy,iz)
-											 +8.0*(*u.get_grid(ilevel))(ix+1,iy,iz)
-											 -(*u.get_grid(ilevel))(ix+2,iy,iz))*h;
+			for( int ix = 0; ix < (int)pu->size(0); ++ix )
+				for( int iy = 0; iy < (int)pu->size(1); ++iy )
+					for( int iz = 0; iz < (int)pu->size(2); ++iz )
+						(*pvar)(ix,iy,iz) += ((*pu)(ix-2,iy,iz)
+											 -8.0*(*pu)(ix-1,iy,iz)
+											 +8.0*(*pu)(ix+1,iy,iz)
+											 -(*pu)(ix+2,iy,iz))*h;
 		
 		else if( dir == 1 )
 #pragma omp parallel for
-			for( int ix = 0; ix < (int)(*u.get_grid(ilevel)).size(0); ++ix )
-				for( int iy = 0; iy < (int)(*u.get_grid(ilevel)).size(1); ++iy )
-					for( int iz = 0; iz < (int)(*u.get_grid(ilevel)).size(2); ++iz )
-						(*pvar)(ix,iy,iz) += ((*u.get_grid(ilevel))(ix,iy-2,iz)
-											 -8.0*(*u.get_grid(ilevel))(ix,iy-1,iz)
-											 +8.0*(*u.get_grid(ilevel))(ix,iy+1,iz)
-											 -(*u.get_grid(ilevel))(ix,iy+2,iz))*h;
+			for( int ix = 0; ix < (int)pu->size(0); ++ix )
+				for( int iy = 0; iy < (int)pu->size(1); ++iy )
+					for( int iz = 0; iz < (int)pu->size(2); ++iz )
+						(*pvar)(ix,iy,iz) += ((*pu)(ix,iy-2,iz)
+											 -8.0*(*pu)(ix,iy-1,iz)
+											 +8.0*(*pu)(ix,iy+1,iz)
+											 -(*pu)(ix,iy+2,iz))*h;
 		
 		else if( dir == 2 )
 #pragma omp parallel for
-			for( int ix = 0; ix < (int)(*u.get_grid(ilevel)).size(0); ++ix )
-				for( int iy = 0; iy < (int)(*u.get_grid(ilevel)).size(1); ++iy )
-					for( int iz = 0; iz < (int)(*u.get_grid(ilevel)).size(2); ++iz )
-						(*pvar)(ix,iy,iz) += ((*u.get_grid(ilevel))(ix,iy,iz-2)
-											 -8.0*(*u.get_grid(ilevel))(ix,iy,iz-1)
-											 +8.0*(*u.get_grid(ilevel))(ix,iy,iz+1)
-											 -(*u.get_grid(ilevel))(ix,iy,iz+2))*h;
+			for( int ix = 0; ix < (int)pu->size(0); ++ix )
+				for( int iy = 0; iy < (int)pu->size(1); ++iy )
+					for( int iz = 0; iz < (int)pu->size(2); ++iz )
+						(*pvar)(ix,iy,iz) += ((*pu)(ix,iy,iz-2)
+											 -8.0*(*pu)(ix,iy,iz-1)
+											 +8.0*(*pu)(ix,iy,iz+1)
+											 -(*pu)(ix,iy,iz+2))*h;
 	}		
 	
 	
@@ -369,7 +378,7 @@ void multigrid_poisson_plugin::implementation::gradient_add_O4( int dir, grid_hi
 }
 
 
-void multigrid_poisson_plugin::implementation::gradient_O6( int dir, grid_hierarchy& u, grid_hierarchy& Du )
+void multigrid_poisson_plugin::implementation::gradient_O6( int dir, const grid_hierarchy& u, grid_hierarchy& Du )
 {
 	LOGUSER("Computing a 6th order finite difference gradient...");
 	
@@ -377,53 +386,54 @@ void multigrid_poisson_plugin::implementation::gradient_O6( int dir, grid_hierar
 	{
 		double h = pow(2.0,ilevel);
 		meshvar_bnd *pvar = Du.get_grid(ilevel);
+		const meshvar_bnd *pu = u.get_grid(ilevel);
 		
 		h /= 60.;
 		if( dir == 0 )
 			#pragma omp parallel for
-			for( int ix = 0; ix < (int)(*u.get_grid(ilevel)).size(0); ++ix )
-				for( int iy = 0; iy < (int)(*u.get_grid(ilevel)).size(1); ++iy )
-					for( int iz = 0; iz < (int)(*u.get_grid(ilevel)).size(2); ++iz )
+			for( int ix = 0; ix < (int)pu->size(0); ++ix )
+				for( int iy = 0; iy < (int)pu->size(1); ++iy )
+					for( int iz = 0; iz < (int)pu->size(2); ++iz )
 						(*pvar)(ix,iy,iz) = 
-						(-(*u.get_grid(ilevel))(ix-3,iy,iz)
-						 +9.0*(*u.get_grid(ilevel))(ix-2,iy,iz)
-						 -45.0*(*u.get_grid(ilevel))(ix-1,iy,iz)
-						 +45.0*(*u.get_grid(ilevel))(ix+1,iy,iz)
-						 -9.0*(*u.get_grid(ilevel))(ix+2,iy,iz)
-						 +(*u.get_grid(ilevel))(ix+3,iy,iz))*h;
+						(-(*pu)(ix-3,iy,iz)
+						 +9.0*(*pu)(ix-2,iy,iz)
+						 -45.0*(*pu)(ix-1,iy,iz)
+						 +45.0*(*pu)(ix+1,iy,iz)
+						 -9.0*(*pu)(ix+2,iy,iz)
+						 +(*pu)(ix+3,iy,iz))*h;
 		
 		else if( dir == 1 )
 			#pragma omp parallel for
-			for( int ix = 0; ix < (int)(*u.get_grid(ilevel)).size(0); ++ix )
-				for( int iy = 0; iy < (int)(*u.get_grid(ilevel)).size(1); ++iy )
-					for( int iz = 0; iz < (int)(*u.get_grid(ilevel)).size(2); ++iz )
+			for( int ix = 0; ix < (int)pu->size(0); ++ix )
+				for( int iy = 0; iy < (int)pu->size(1); ++iy )
+					for( int iz = 0; iz < (int)pu->size(2); ++iz )
 						(*pvar)(ix,iy,iz) = 
-						(-(*u.get_grid(ilevel))(ix,iy-3,iz)
-						 +9.0*(*u.get_grid(ilevel))(ix,iy-2,iz)
-						 -45.0*(*u.get_grid(ilevel))(ix,iy-1,iz)
-						 +45.0*(*u.get_grid(ilevel))(ix,iy+1,iz)
-						 -9.0*(*u.get_grid(ilevel))(ix,iy+2,iz)
-						 +(*u.get_grid(ilevel))(ix,iy+3,iz))*h;
+						(-(*pu)(ix,iy-3,iz)
+						 +9.0*(*pu)(ix,iy-2,iz)
+						 -45.0*(*pu)(ix,iy-1,iz)
+						 +45.0*(*pu)(ix,iy+1,iz)
+						 -9.0*(*pu)(ix,iy+2,iz)
+						 +(*pu)(ix,iy+3,iz))*h;
 		
 		else if( dir == 2 )
 			#pragma omp parallel for
-			for( int ix = 0; ix < (int)(*u.get_grid(ilevel)).size(0); ++ix )
-				for( int iy = 0; iy < (int)(*u.get_grid(ilevel)).size(1); ++iy )
-					for( int iz = 0; iz < (int)(*u.get_grid(ilevel)).size(2); ++iz )
+			for( int ix = 0; ix < (int)pu->size(0); ++ix )
+				for( int iy = 0; iy < (int)pu->size(1); ++iy )
+					for( int iz = 0; iz < (int)pu->size(2); ++iz )
 						(*pvar)(ix,iy,iz) = 
-						(-(*u.get_grid(ilevel))(ix,iy,iz-3)
-						 +9.0*(*u.get_grid(ilevel))(ix,iy,iz-2)
-						 -45.0*(*u.get_grid(ilevel))(ix,iy,iz-1)
-						 +45.0*(*u.get_grid(ilevel))(ix,iy,iz+1)
-						 -9.0*(*u.get_grid(ilevel))(ix,iy,iz+2)
-						 +(*u.get_grid(ilevel))(ix,iy,iz+3))*h;
+						(-(*pu)(ix,iy,iz-3)
+						 +9.0*(*pu)(ix,iy,iz-2)
+						 -45.0*(*pu)(ix,iy,iz-1)
+						 +45.0*(*pu)(ix,iy,iz+1)
+						 -9.0*(*pu)(ix,iy,iz+2)
+						 +(*pu)(ix,iy,iz+3))*h;
 	}
 		
 	LOGUSER("Done computing a 6th order finite difference gradient.");
 }
 	
 
-void multigrid_poisson_plugin::implementation::gradient_add_O6( int dir, grid_hierarchy& u, grid_hierarchy& Du )
+void multigrid_poisson_plugin::implementation::gradient_add_O6( int dir, const grid_hierarchy& u, grid_hierarchy& Du )
 {
 	LOGUSER("Computing a 6th order finite difference gradient...");
 	
@@ -431,46 +441,47 @@ void multigrid_poisson_plugin::implementation::gradient_add_O6( int dir, grid_hi
 	{
 		double h = pow(2.0,ilevel);
 		meshvar_bnd *pvar = Du.get_grid(ilevel);
+		const meshvar_bnd *pu = u.get_grid(ilevel);
 		
 		h /= 60.;
 		if( dir == 0 )
 			#pragma omp parallel for
-			for( int ix = 0; ix < (int)(*u.get_grid(ilevel)).size(0); ++ix )
-				for( int iy = 0; iy < (int)(*u.get_grid(ilevel)).size(1); ++iy )
-					for( int iz = 0; iz < (int)(*u.get_grid(ilevel)).size(2); ++iz )
+			for( int ix = 0; ix < (int)pu->size(0); ++ix )
+				for( int iy = 0; iy < (int)pu->size(1); ++iy )
+					for( int iz = 0; iz < (int)pu->size(2); ++iz )
 						(*pvar)(ix,iy,iz) += 
-						(-(*u.get_grid(ilevel))(ix-3,iy,iz)
-						 +9.0*(*u.get_grid(ilevel))(ix-2,iy,iz)
-						 -45.0*(*u.get_grid(ilevel))(ix-1,iy,iz)
-						 +45.0*(*u.get_grid(ilevel))(ix+1,iy,iz)
-						 -9.0*(*u.get_grid(ilevel))(ix+2,iy,iz)
-						 +(*u.get_grid(ilevel))(ix+3,iy,iz))*h;
+						(-(*pu)(ix-3,iy,iz)
+						 +9.0*(*pu)(ix-2,iy,iz)
+						 -45.0*(*pu)(ix-1,iy,iz)
+						 +45.0*(*pu)(ix+1,iy,iz)
+						 -9.0*(*pu)(ix+2,iy,iz)
+						 +(*pu)(ix+3,iy,iz))*h;
 		
 		else if( dir == 1 )
 			#pragma omp parallel for
-			for( int ix = 0; ix < (int)(*u.get_grid(ilevel)).size(0); ++ix )
-				for( int iy = 0; iy < (int)(*u.get_grid(ilevel)).size(1); ++iy )
-					for( int iz = 0; iz < (int)(*u.get_grid(ilevel)).size(2); ++iz )
+			for( int ix = 0; ix < (int)pu->size(0); ++ix )
+				for( int iy = 0; iy < (int)pu->size(1); ++iy )
+					for( int iz = 0; iz < (int)pu->size(2); ++iz )
 						(*pvar)(ix,iy,iz) += 
-						(-(*u.get_grid(ilevel))(ix,iy-3,iz)
-						 +9.0*(*u.get_grid(ilevel))(ix,iy-2,iz)
-						 -45.0*(*u.get_grid(ilevel))(ix,iy-1,iz)
-						 +45.0*(*u.get_grid(ilevel))(ix,iy+1,iz)
-						 -9.0*(*u.get_grid(ilevel))(ix,iy+2,iz)
-						 +(*u.get_grid(ilevel))(ix,iy+3,iz))*h;
+						(-(*pu)(ix,iy-3,iz)
+						 +9.0*(*pu)(ix,iy-2,iz)
+						 -45.0*(*pu)(ix,iy-1,iz)
+						 +45.0*(*pu)(ix,iy+1,iz)
+						 -9.0*(*pu)(ix,iy+2,iz)
+						 +(*pu)(ix,iy+3,iz))*h;
 		
 		else if( dir == 2 )
 			#pragma omp parallel for
-			for( int ix = 0; ix < (int)(*u.get_grid(ilevel)).size(0); ++ix )
-				for( int iy = 0; iy < (int)(*u.get_grid(ilevel)).size(1); ++iy )
-					for( int iz = 0; iz < (int)(*u.get_grid(ilevel)).size(2); ++iz )
+			for( int ix = 0; ix < (int)pu->size(0); ++ix )
+				for( int iy = 0; iy < (int)pu->size(1); ++iy )
+					for( int iz = 0; iz < (int)pu->size(2); ++iz )
 						(*pvar)(ix,iy,iz) += 
-						(-(*u.get_grid(ilevel))(ix,iy,iz-3)
-						 +9.0*(*u.get_grid(ilevel))(ix,iy,iz-2)
-						 -45.0*(*u.get_grid(ilevel))(ix,iy,iz-1)
-						 +45.0*(*u.get_grid(ilevel))(ix,iy,iz+1)
-						 -9.0*(*u.get_grid(ilevel))(ix,iy,iz+2)
-						 +(*u.get_grid(ilevel))(ix,iy,iz+3))*h;
+						(-(*pu)(ix,iy,iz-3)
+						 +9.0*(*pu)(ix,iy,iz-2)
+						 -45.0*(*pu)(ix,iy,iz-1)
+						 +45.0*(*pu)(ix,iy,iz+1)
+						 -9.0*(*pu)(ix,iy,iz+2)
+						 +(*pu)(ix,iy,iz+3))*h;
 	}
 	
 	LOGUSER("Done computing a 6th order finite difference gradient.");
@@ -484,6 +495,7 @@ void multigrid_poisson_plugin::implementation::gradient_add_O6( int dir, grid_hi
 
 double fft_poisson_plugin::solve( grid_hierarchy& f, grid_hierarchy& u )
 {
+	MUSIC::trace_scope trace("FFT Poisson solver");
 	LOGUSER("Entering k-space Poisson solver...");
 	
 	unsigned verbosity = cf_.getValueSafe<unsigned>("setup","verbosity",2);
@@ -494,6 +506,8 @@ double fft_poisson_plugin::solve( grid_hierarchy& f, grid_hierarchy& u )
 		throw std::runtime_error("fft_poisson_plugin::solve : k-space method can only be used in unigrid mode (levelmin=levelmax)");
 	}
 	
+	u.detach();
+	
 	if( verbosity > 0 )
 	{	
 		std::cout << "-------------------------------------------------------------\n";
@@ -505,10 +519,11 @@ double fft_poisson_plugin::solve( grid_hierarchy& f, grid_hierarchy& u )
 	ny = f.get_grid(f.levelmax())->size(1);
 	nz = f.get_grid(f.levelmax())->size(2);
 	nzp = 2*(nz/2+1);
+	trace.fft( nx, ny, nz );
 	
 	
 	//... copy data ..................................................
-	fftw_real *data = new fftw_real[(size_t)nx*(size_t)ny*(size_t)nzp];
+	fftw_real *data = mem_allocate<fftw_real>( (size_t)nx*(size_t)ny*(size_t)nzp );
 	fftw_complex *cdata = reinterpret_cast<fftw_complex*> (data);
 	
 	#pragma omp parallel for
@@ -615,7 +630,7 @@ double fft_poisson_plugin::solve( grid_hierarchy& f, grid_hierarchy& u )
 				(*u.get_grid(u.levelmax()))(i,j,k) = data[idx];
 			}
 	
-	delete[] data;
+	mem_deallocate( data );
 	
 	//... set boundary values ................................
 	int nb = u.get_grid(u.levelmax())->m_nbnd;
@@ -665,8 +680,9 @@ double fft_poisson_plugin::solve( grid_hierarchy& f, grid_hierarchy& u )
 }
 
 
-double fft_poisson_plugin::gradient( int dir, grid_hierarchy& u, grid_hierarchy& Du )
+double fft_poisson_plugin::gradient( int dir, const grid_hierarchy& u, grid_hierarchy& Du )
 {
+	MUSIC::trace_scope trace("gradient %c",'x'+dir);
 	
 	LOGUSER("Computing a gradient in k-space...\n");
 	
@@ -674,14 +690,16 @@ double fft_poisson_plugin::gradient( int dir, grid_hierarchy& u, grid_hierarchy&
 		throw std::runtime_error("fft_poisson_plugin::gradient : k-space method can only be used in unigrid mode (levelmin=levelmax)");
 	
 	Du = u;
+	Du.detach();
 	int nx,ny,nz,nzp;
 	nx = u.get_grid(u.levelmax())->size(0);
 	ny = u.get_grid(u.levelmax())->size(1);
 	nz = u.get_grid(u.levelmax())->size(2);
 	nzp = 2*(nz/2+1);
+	trace.fft( nx, ny, nz );
 	
 	//... copy data ..................................................
-	fftw_real *data = new fftw_real[(size_t)nx*(size_t)ny*(size_t)nzp];
+	fftw_real *data = mem_allocate<fftw_real>( (size_t)nx*(size_t)ny*(size_t)nzp );
 	fftw_complex *cdata = reinterpret_cast<fftw_complex*> (data);
 	
 	#pragma omp parallel for
@@ -831,7 +849,7 @@ double fft_poisson_plugin::gradient( int dir, grid_hierarchy& u, grid_hierarchy&
 					dmax = fabs(data[idx]);
 			}
 
-	delete[] data;
+	mem_deallocate( data );
 	
 	LOGUSER("Done with k-space gradient.\n");
 	
@@ -1103,6 +1121,7 @@ void poisson_hybrid( T& f, int idir, int order, bool periodic, bool deconvolve_c
 	int xo=0,yo=0,zo=0;
 	int nmax = std::max(nx,std::max(ny,nz));
 	
+	MUSIC::trace_scope trace("hybrid gradient %c",'x'+idir);
 	LOGUSER("Entering hybrid Poisson solver...");
 	
 	if(!periodic)
@@ -1122,7 +1141,8 @@ void poisson_hybrid( T& f, int idir, int order, bool periodic, bool deconvolve_c
 	}
 	
 	
-	data		= new fftw_real[(size_t)nxp*(size_t)nyp*(size_t)(nzp+2)];
+	trace.fft( nxp, nyp, nzp );
+	data		= mem_allocate<fftw_real>( (size_t)nxp*(size_t)nyp*(size_t)(nzp+2) );
 	
 	if(idir==0)
 		std::cout << "   - Performing hybrid Poisson step... (" << nxp <<  ", " << nyp << ", " << nzp << ")\n";
@@ -1178,7 +1198,7 @@ void poisson_hybrid( T& f, int idir, int order, bool periodic, bool deconvolve_c
 				f(i,j,k) = data[idx];
 			}
 	
-	delete[] data;
+	mem_deallocate( data );
 
 	LOGUSER("Done with hybrid Poisson solve.");
 }
@@ -40,10 +40,10 @@ public:
 	virtual double solve( grid_hierarchy& f, grid_hierarchy& u ) = 0;
 	
 	//! compute the gradient of u
-	virtual double gradient( int dir, grid_hierarchy& u, grid_hierarchy& Du ) = 0;
+	virtual double gradient( int dir, const grid_hierarchy& u, grid_hierarchy& Du ) = 0;
 	
 	//! compute the gradient and add
-	virtual double gradient_add( int dir, grid_hierarchy& u, grid_hierarchy& Du ) = 0;
+	virtual double gradient_add( int dir, const grid_hierarchy& u, grid_hierarchy& Du ) = 0;
 	
 };
 
@@ -105,10 +105,10 @@ public:
 	double solve( grid_hierarchy& f, grid_hierarchy& u );
 	
 	//! compute the gradient of u
-	double gradient( int dir, grid_hierarchy& u, grid_hierarchy& Du );
+	double gradient( int dir, const grid_hierarchy& u, grid_hierarchy& Du );
 	
 	//! compute the gradient and add
-	double gradient_add( int dir, grid_hierarchy& u, grid_hierarchy& Du );
+	double gradient_add( int dir, const grid_hierarchy& u, grid_hierarchy& Du );
 	
 protected:
 	
@@ -125,22 +125,22 @@ protected:
 		double solve_O6( grid_hierarchy& f, grid_hierarchy& u );
 		
 		//! compute 2nd order FD gradient
-		void gradient_O2( int dir, grid_hierarchy& u, grid_hierarchy& Du );
+		void gradient_O2( int dir, const grid_hierarchy& u, grid_hierarchy& Du );
 
 		//! compute and add 2nd order FD gradient
-		void gradient_add_O2( int dir, grid_hierarchy& u, grid_hierarchy& Du );
+		void gradient_add_O2( int dir, const grid_hierarchy& u, grid_hierarchy& Du );
 		
 		//! compute 4th order FD gradient
-		void gradient_O4( int dir, grid_hierarchy& u, grid_hierarchy& Du );
+		void gradient_O4( int dir, const grid_hierarchy& u, grid_hierarchy& Du );
 		
 		//! compute and add 4th order FD gradient
-		void gradient_add_O4( int dir, grid_hierarchy& u, grid_hierarchy& Du );
+		void gradient_add_O4( int dir, const grid_hierarchy& u, grid_hierarchy& Du );
 		
 		//! compute 6th order FD gradient
-		void gradient_O6( int dir, grid_hierarchy& u, grid_hierarchy& Du );
+		void gradient_O6( int dir, const grid_hierarchy& u, grid_hierarchy& Du );
 		
 		//! compute and add 6th order FD gradient
-		void gradient_add_O6( int dir, grid_hierarchy& u, grid_hierarchy& Du );
+		void gradient_add_O6( int dir, const grid_hierarchy& u, grid_hierarchy& Du );
 	};
 };
 
@@ -162,10 +162,10 @@ public:
 	double solve( grid_hierarchy& f, grid_hierarchy& u );
 	
 	//! compute the gradient of u
-	double gradient( int dir, grid_hierarchy& u, grid_hierarchy& Du );
+	double gradient( int dir, const grid_hierarchy& u, grid_hierarchy& Du );
 	
 	//! compute the gradient and add
-	double gradient_add( int dir, grid_hierarchy& u, grid_hierarchy& Du ){ return 0.0; }
+	double gradient_add( int dir, const grid_hierarchy& u, grid_hierarchy& Du ){ return 0.0; }
 	
 	
 };
@@ -9,6 +9,7 @@
  */
 
 #include "random.hh"
+#include "trace.hh"
 
 // TODO: move all this into a plugin!!!
 
@@ -1621,6 +1622,8 @@ void random_number_generator<rng,T>::compute_random_numbers( void )
 	bool rndsign = pcf_->getValueSafe<bool>("random","grafic_sign",false);
 	bool brealspace_tf = !pcf_->getValue<bool>("setup","kspace_TF");
 	
+	MUSIC::trace_scope trace("white noise level %d",levelmin_);
+	
 	std::vector< rng* > randc(std::max(levelmax_,levelmin_seed_)+1,(rng*)NULL);
 	
 	//--- FILL ALL WHITE NOISE ARRAYS FOR WHICH WE NEED THE FULL FIELD ---//
@@ -1721,6 +1724,8 @@ void random_number_generator<rng,T>::compute_random_numbers( void )
 		x0[1] = prefh_->offset_abs(ilevel, 1) - lfac*shift[1] - lx[1]/4;
 		x0[2] = prefh_->offset_abs(ilevel, 2) - lfac*shift[2] - lx[2]/4;
 		
+		trace.next("white noise level %d",ilevel);
+		
 		if( randc[ilevel] == NULL )
 		  randc[ilevel] = new rng( *randc[ilevel-1], ran_cube_size_, rngseeds_[ilevel], kavg, ilevel==levelmin_+1, x0, lx );
 		delete randc[ilevel-1];
@@ -1739,6 +1744,7 @@ void random_number_generator<rng,T>::compute_random_numbers( void )
     
 	//... make sure that the coarse grid contains oct averages where it overlaps with a fine grid
 	//... this also ensures that constraints enforced on fine grids are carried to the coarser grids
+	trace.next("white noise averaging");
 	if( brealspace_tf )
 	  {
 	    for( int ilevel=levelmax_; ilevel>levelmin_; --ilevel )
@@ -0,0 +1,109 @@
+/*
+
+ refinement_pyramid.cc - This file is part of MUSIC -
+ a code to generate multi-scale initial conditions
+ for cosmological simulations
+
+ Copyright (C) 2010  Oliver Hahn
+
+*/
+
+#include <algorithm>
+
+#include "refinement_pyramid.hh"
+
+refinement_pyramid::refinement_pyramid( const grid_hierarchy& gh )
+: levelmin_( gh.levelmin() ), levelmax_( gh.levelmax() )
+{
+	levels_.resize( levelmax_-levelmin_+1 );
+	ncovering_.assign( levelmax_-levelmin_+1, 0 );
+
+	//... flags from the refinement masks of the hierarchy
+	for( unsigned ilevel=levelmin_; ilevel<=levelmax_; ++ilevel )
+	{
+		level_bits& l = levels_[ilevel-levelmin_];
+		l.nx = gh.get_grid(ilevel)->size(0);
+		l.ny = gh.get_grid(ilevel)->size(1);
+		l.nz = gh.get_grid(ilevel)->size(2);
+		l.nwords = (l.nz+63)/64;
+
+		for( int f=0; f<3; ++f )
+			l.bits[f].assign( (size_t)l.nx*l.ny*l.nwords, 0ull );
+
+		#pragma omp parallel for
+		for( int i=0; i<(int)l.nx; ++i )
+			for( unsigned j=0; j<l.ny; ++j )
+			{
+				size_t irow = ((size_t)i*l.ny+j)*l.nwords;
+				for( unsigned k=0; k<l.nz; ++k )
+				{
+					unsigned long long b = 1ull << (k&63);
+					if( gh.is_in_mask(ilevel,i,j,k) )
+						l.bits[in_mask][irow+(k>>6)] |= b;
+					if( gh.is_refined(ilevel,i,j,k) )
+						l.bits[refined][irow+(k>>6)] |= b;
+				}
+			}
+	}
+
+	//... the leaf cells of the finest level, then restrict bottom-up
+	level_bits& lmax = levels_.back();
+	size_t ncov = 0;
+
+	#pragma omp parallel for reduction(+:ncov)
+	for( long long iw=0; iw<(long long)lmax.bits[in_mask].size(); ++iw )
+	{
+		lmax.bits[covers_finest][iw] = lmax.bits[in_mask][iw] & ~lmax.bits[refined][iw];
+		ncov += __builtin_popcountll( lmax.bits[covers_finest][iw] );
+	}
+	ncovering_.back() = ncov;
+
+	for( unsigned ilevel=levelmax_; ilevel>levelmin_; --ilevel )
+		restrict_level( gh, ilevel );
+}
+
+void refinement_pyramid::restrict_level( const grid_hierarchy& gh, unsigned ilevel )
+{
+	const level_bits& lf = levels_[ilevel-levelmin_];
+	level_bits& lc = levels_[ilevel-1-levelmin_];
+	const std::vector<unsigned long long>& fine = lf.bits[covers_finest];
+	std::vector<unsigned long long>& coarse = lc.bits[covers_finest];
+
+	//... offset of the fine grid in units of coarse cells
+	const unsigned o1 = gh.get_grid(ilevel)->offset(0), o2 = gh.get_grid(ilevel)->offset(1), o3 = gh.get_grid(ilevel)->offset(2);
+	const unsigned nxc = (lf.nx+1)/2;
+	size_t ncov = 0;
+
+	//... every thread owns the coarse rows of its coarse cells in x
+	#pragma omp parallel for reduction(+:ncov)
+	for( int ic=0; ic<(int)nxc; ++ic )
+	{
+		for( unsigned i=2*ic; i<std::min<unsigned>(2*ic+2,lf.nx); ++i )
+			for( unsigned j=0; j<lf.ny; ++j )
+			{
+				size_t ifrow = ((size_t)i*lf.ny+j)*lf.nwords;
+				size_t icrow = ((size_t)(ic+o1)*lc.ny+(j/2+o2))*lc.nwords;
+
+				for( size_t iw=0; iw<lf.nwords; ++iw )
+				{
+					unsigned long long w = fine[ifrow+iw];
+					while( w )
+					{
+						unsigned k = iw*64 + __builtin_ctzll( w );
+						unsigned kc = k/2+o3;
+						coarse[icrow+(kc>>6)] |= 1ull << (kc&63);
+						w &= w-1;
+					}
+				}
+			}
+
+		for( unsigned jc=0; jc<lc.ny; ++jc )
+		{
+			size_t icrow = ((size_t)(ic+o1)*lc.ny+jc)*lc.nwords;
+			for( size_t iw=0; iw<lc.nwords; ++iw )
+				ncov += __builtin_popcountll( coarse[icrow+iw] );
+		}
+	}
+
+	ncovering_[ilevel-1-levelmin_] = ncov;
+}
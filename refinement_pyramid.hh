@@ -0,0 +1,74 @@
+/*
+
+ refinement_pyramid.hh - This file is part of MUSIC -
+ a code to generate multi-scale initial conditions
+ for cosmological simulations
+
+ Copyright (C) 2010  Oliver Hahn
+
+*/
+
+#ifndef __REFINEMENT_PYRAMID_HH
+#define __REFINEMENT_PYRAMID_HH
+
+#include <vector>
+
+#include "general.hh"
+#include "mesh.hh"
+
+/*!
+ * @class refinement_pyramid
+ * @brief bit masks of the refinement structure of all levels of a hierarchy
+ *
+ * For every cell of every level three flags are kept as bits: whether the
+ * cell is in the mask, whether it is refined, and whether it covers a leaf
+ * cell of the finest level. The last one is restricted level by level from
+ * levelmax down to levelmin, a coarse cell is set if any of its children on
+ * the next finer grid is set. This is the refinement map that the grafic2
+ * (RAMSES) output writes.
+ *
+ * All flags are computed in one parallel pass when the object is built. The
+ * bits of each row in z are padded to whole 64 bit words, so that threads
+ * working on different rows never write the same word.
+ */
+class refinement_pyramid
+{
+public:
+	//! the flags of a cell
+	enum flag { in_mask=0, refined=1, covers_finest=2 };
+
+protected:
+	//! the bits of one level
+	struct level_bits
+	{
+		unsigned nx, ny, nz;					//!< size of the grid
+		size_t nwords;							//!< number of words in a row
+		std::vector<unsigned long long> bits[3];	//!< one bit set per flag
+	};
+
+	std::vector<level_bits> levels_;	//!< indexed by level-levelmin
+	std::vector<size_t> ncovering_;		//!< number of cells that cover the finest level
+	unsigned levelmin_, levelmax_;
+
+	//! restrict the covers_finest bits of a level to the next coarser one
+	void restrict_level( const grid_hierarchy& gh, unsigned ilevel );
+
+public:
+
+	//! compute the flags of all levels of a hierarchy
+	explicit refinement_pyramid( const grid_hierarchy& gh );
+
+	//! test a flag of a cell
+	bool test( flag f, unsigned ilevel, unsigned i, unsigned j, unsigned k ) const
+	{
+		const level_bits& l = levels_[ilevel-levelmin_];
+		size_t iw = ((size_t)i*l.ny+j)*l.nwords + (k>>6);
+		return (l.bits[f][iw] >> (k&63)) & 1ull;
+	}
+
+	//! number of cells of a level that cover leaf cells of the finest level
+	size_t count_covering( unsigned ilevel ) const
+	{	return ncovering_[ilevel-levelmin_];	}
+};
+
+#endif // __REFINEMENT_PYRAMID_HH
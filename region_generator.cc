@@ -1,5 +1,6 @@
 #include <algorithm>
 #include "region_generator.hh"
+#include "output.hh"
 
 std::map< std::string, region_generator_plugin_creator *>&
 get_region_generator_plugin_map()
@@ -140,8 +141,8 @@ public:
             // conditions should be added here
             {
                 do_extra_padding_ = false;
-                std::string output_plugin = cf.getValue<std::string>("output","format");
-                if( output_plugin == std::string("grafic2") )
+                std::vector<std::string> formats = get_output_formats( cf );
+                if( std::find( formats.begin(), formats.end(), "grafic2" ) != formats.end() )
                     do_extra_padding_ = true;
                 padding_fine_ = 0.0;
                 if( do_extra_padding_ )
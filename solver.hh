@@ -418,6 +418,7 @@ double solver<S,O,T>::solve( GridHierarchy<T>& uh, double acc, double h, bool ve
 	double err;
 	
 	GridHierarchy<T> uhnew(uh);//, fsave(*m_pf);
+	m_pf->detach();
 	m_pu = &uh;
 	
     unsigned niter = 0;
@@ -427,6 +428,7 @@ double solver<S,O,T>::solve( GridHierarchy<T>& uh, double acc, double h, bool ve
 	{
 		
 		
+		uh.detach();
 		twoGrid( uh.levelmax() );
 		err = compute_error( *m_pu, uhnew, verbose );
 		++niter;
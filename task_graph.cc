@@ -0,0 +1,309 @@
+/*
+
+ task_graph.cc - This file is part of MUSIC -
+ a code to generate multi-scale initial conditions
+ for cosmological simulations
+
+ Copyright (C) 2010  Oliver Hahn
+
+*/
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <sys/time.h>
+
+#include "task_graph.hh"
+#include "mem_alloc.hh"
+#include "trace.hh"
+
+//! wall clock time in seconds
+static double task_clock( void )
+{
+	struct timeval tv;
+	gettimeofday( &tv, NULL );
+	return (double)tv.tv_sec + 1e-6*(double)tv.tv_usec;
+}
+
+//! field memory currently in use
+static size_t task_live_bytes( void )
+{
+	size_t n;
+	#pragma omp critical(mem_alloc)
+	n = mem_alloc_get_stats().live_bytes;
+	return n;
+}
+
+//! set the number of threads of the FFTW plans made from now on
+/*! the planner setting is global and not per thread, so that the tasks running
+ *  at the same time all plan with the smallest of their thread shares
+ */
+static void task_fftw_threads( int nthreads )
+{
+#if defined(FFTW3) and not defined(SINGLETHREAD_FFTW)
+	#ifdef SINGLE_PRECISION
+	fftwf_plan_with_nthreads( nthreads );
+	#else
+	fftw_plan_with_nthreads( nthreads );
+	#endif
+#endif
+}
+
+//! the smallest thread share of the running tasks
+static int min_share( const std::vector<bool>& slot_busy, const std::vector<int>& slot_threads, int nthreads )
+{
+	int n = nthreads;
+	for( size_t i=0; i<slot_busy.size(); ++i )
+		if( slot_busy[i] )
+			n = std::min( n, slot_threads[i] );
+	return n;
+}
+
+task_graph::task_graph( unsigned max_tasks, size_t max_bytes )
+: max_tasks_( std::max( 1u, max_tasks ) ), max_bytes_( max_bytes )
+{ }
+
+task_graph::task_id task_graph::add( const std::string& name, const std::vector<task_id>& deps,
+									 const std::function<void(void)>& work, size_t nbytes, const std::string& resource )
+{
+	task t;
+	t.name = name;
+	t.work = work;
+	t.resource = resource;
+	t.nbytes = nbytes;
+	t.started = t.done = false;
+	t.t_start = t.t_end = 0.0;
+
+	for( size_t i=0; i<deps.size(); ++i )
+	{
+		if( deps[i] >= tasks_.size() )
+		{
+			LOGERR("Task \'%s\' depends on a task that has not been added before it.",name.c_str());
+			throw std::runtime_error("Invalid task dependency");
+		}
+		t.deps.push_back( deps[i] );
+	}
+
+	tasks_.push_back( t );
+	return tasks_.size()-1;
+}
+
+bool task_graph::is_ready( task_id id ) const
+{
+	for( size_t i=0; i<tasks_[id].deps.size(); ++i )
+		if( !tasks_[tasks_[id].deps[i]].done )
+			return false;
+	return true;
+}
+
+std::exception_ptr task_graph::execute( task_id id, int nthreads, int tid )
+{
+	std::exception_ptr error;
+
+	if( tid >= 0 )
+		MUSIC::trace::set_thread( tid );
+	omp_set_num_threads( nthreads );
+
+	try
+	{
+		MUSIC::trace_scope phase( "%s", tasks_[id].name.c_str() );
+		std::cout << " - " << tasks_[id].name << std::endl;
+		LOGINFO("Starting task \'%s\' with %d threads.",tasks_[id].name.c_str(),nthreads);
+		tasks_[id].work();
+	}
+	catch(...)
+	{
+		error = std::current_exception();
+	}
+
+	return error;
+}
+
+void task_graph::run( void )
+{
+	int nthreads = omp_get_max_threads();
+	double t0 = task_clock();
+
+	//... sequential: the order in which the tasks were added
+	if( max_tasks_ == 1 )
+	{
+		for( task_id id=0; id<tasks_.size(); ++id )
+		{
+			tasks_[id].started = true;
+			tasks_[id].t_start = task_clock() - t0;
+			std::exception_ptr error = execute( id, nthreads, -1 );
+			tasks_[id].t_end = task_clock() - t0;
+			tasks_[id].done = true;
+			tasks_[id].work = std::function<void(void)>();
+
+			if( error )
+				std::rethrow_exception( error );
+		}
+
+		log_timing( task_clock() - t0 );
+		return;
+	}
+
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::vector<std::thread> threads( max_tasks_ );
+	std::vector<task_id> slot_task( max_tasks_ );
+	std::vector<int> slot_threads( max_tasks_, 0 );
+	std::vector<bool> slot_busy( max_tasks_, false ), slot_finished( max_tasks_, false );
+	std::vector<std::string> busy_resources;
+	std::exception_ptr first_error;
+	size_t ndone = 0;
+	unsigned nrunning = 0;
+	int nthreads_used = 0;
+
+	std::unique_lock<std::mutex> lock( mtx );
+
+	while( ndone < tasks_.size() )
+	{
+		//... collect the ready tasks that can start now, in the order they were added
+		std::vector<task_id> startable;
+		if( !first_error && (nrunning==0 || nthreads_used<nthreads) )
+		{
+			std::vector<std::string> resources( busy_resources );
+			size_t nbytes = 0;
+
+			int nfree = std::max( 1, nthreads-nthreads_used );
+
+			for( task_id id=0; id<tasks_.size() && nrunning+startable.size()<max_tasks_ && (int)startable.size()<nfree; ++id )
+			{
+				const task& t = tasks_[id];
+
+				if( t.started || !is_ready( id ) )
+					continue;
+				if( !t.resource.empty() && std::find( resources.begin(), resources.end(), t.resource ) != resources.end() )
+					continue;
+				if( nrunning+startable.size() > 0 && max_bytes_ > 0 && task_live_bytes() + nbytes + t.nbytes > max_bytes_ )
+					continue;
+
+				if( !t.resource.empty() )
+					resources.push_back( t.resource );
+				nbytes += t.nbytes;
+				startable.push_back( id );
+			}
+		}
+
+		//... the OpenMP threads left are shared among the tasks started now, so that a
+		//... task starting alone gets all of them and the tasks running at the same
+		//... time never use more than nthreads in total. A task that becomes ready
+		//... while all threads are in use waits for a running task to finish
+		for( size_t is=0; is<startable.size(); ++is )
+		{
+			task_id id = startable[is];
+			task& t = tasks_[id];
+
+			unsigned islot = 0;
+			while( slot_busy[islot] )
+				++islot;
+
+			int ntask = std::max( 1, (nthreads-nthreads_used) / (int)(startable.size()-is) );
+
+			t.started = true;
+			t.t_start = task_clock() - t0;
+			if( !t.resource.empty() )
+				busy_resources.push_back( t.resource );
+			slot_busy[islot] = true;
+			slot_task[islot] = id;
+			slot_threads[islot] = ntask;
+			nthreads_used += ntask;
+			++nrunning;
+
+			//... the shares grow within a batch, so the FFTW setting is already at
+			//... its smallest once the first task of the batch is launched
+			task_fftw_threads( min_share( slot_busy, slot_threads, nthreads ) );
+
+			threads[islot] = std::thread( [this,id,islot,ntask,t0,&mtx,&cv,&slot_finished,&first_error]()
+			{
+				//... trace thread numbers 200+ keep the tasks apart from the OpenMP and output threads
+				std::exception_ptr error = execute( id, ntask, 200+(int)islot );
+
+				std::lock_guard<std::mutex> guard( mtx );
+				tasks_[id].t_end = task_clock() - t0;
+				if( error && !first_error )
+					first_error = error;
+				slot_finished[islot] = true;
+				cv.notify_one();
+			} );
+		}
+
+		if( nrunning == 0 )
+		{
+			if( first_error )
+				break;
+
+			LOGERR("No task of the remaining %d can be started.",(int)(tasks_.size()-ndone));
+			throw std::runtime_error("Task graph cannot make progress");
+		}
+
+		cv.wait( lock, [&]{ return std::find( slot_finished.begin(), slot_finished.end(), true ) != slot_finished.end(); } );
+
+		for( unsigned islot=0; islot<max_tasks_; ++islot )
+		{
+			if( !slot_finished[islot] )
+				continue;
+
+			lock.unlock();
+			threads[islot].join();
+			lock.lock();
+
+			task& t = tasks_[slot_task[islot]];
+			t.done = true;
+			if( !t.resource.empty() )
+				busy_resources.erase( std::find( busy_resources.begin(), busy_resources.end(), t.resource ) );
+
+			//... release the buffers held by the task
+			lock.unlock();
+			t.work = std::function<void(void)>();
+			lock.lock();
+
+			slot_finished[islot] = false;
+			slot_busy[islot] = false;
+			nthreads_used -= slot_threads[islot];
+			--nrunning;
+			++ndone;
+		}
+
+		if( nrunning > 0 )
+			task_fftw_threads( min_share( slot_busy, slot_threads, nthreads ) );
+	}
+
+	lock.unlock();
+	omp_set_num_threads( nthreads );
+	task_fftw_threads( nthreads );
+
+	if( first_error )
+		std::rethrow_exception( first_error );
+
+	log_timing( task_clock() - t0 );
+}
+
+void task_graph::log_timing( double twall ) const
+{
+	//... the longest chain of dependent tasks, the tasks are in topological order
+	std::vector<double> tpath( tasks_.size(), 0.0 );
+	double tcrit = 0.0, tsum = 0.0;
+
+	for( task_id id=0; id<tasks_.size(); ++id )
+	{
+		double tdep = 0.0;
+		for( size_t i=0; i<tasks_[id].deps.size(); ++i )
+			tdep = std::max( tdep, tpath[tasks_[id].deps[i]] );
+
+		double dt = tasks_[id].t_end - tasks_[id].t_start;
+		tpath[id] = tdep + dt;
+		tcrit = std::max( tcrit, tpath[id] );
+		tsum += dt;
+
+		LOGINFO("Task %-40s %10.3f s to %10.3f s",tasks_[id].name.c_str(),tasks_[id].t_start,tasks_[id].t_end);
+	}
+
+	LOGUSER("Ran %d tasks on up to %d threads in %.3f s, critical path %.3f s, sequential %.3f s.",
+			(int)tasks_.size(), (int)max_tasks_, twall, tcrit, tsum );
+}
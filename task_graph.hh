@@ -0,0 +1,110 @@
+/*
+
+ task_graph.hh - This file is part of MUSIC -
+ a code to generate multi-scale initial conditions
+ for cosmological simulations
+
+ Copyright (C) 2010  Oliver Hahn
+
+*/
+
+#ifndef __TASK_GRAPH_HH
+#define __TASK_GRAPH_HH
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <exception>
+
+#include "general.hh"
+
+/*!
+ * @class task_graph
+ * @brief runs the stages of the driver as a graph of dependent tasks
+ *
+ * Every task names the tasks it depends on, which need to have been added
+ * before it, so that the order in which tasks are added is a valid sequential
+ * order. Tasks that use the same resource, e.g. the transfer function kernels
+ * or the output plug-in, never run at the same time.
+ *
+ * The buffers of a task are owned by its work function, typically as
+ * shared pointers captured by a lambda. The function is destroyed as soon as
+ * the task has finished, so that a buffer is released once the last task
+ * using it is done.
+ *
+ * Up to max_tasks ready tasks run at the same time, each on its own thread
+ * with a share of the OpenMP threads; together they never use more than
+ * the OpenMP threads available. The threads are split among the tasks that
+ * start together, so that a task that starts alone gets all of them. Since
+ * the FFTW planner setting is global, FFTW plans with the smallest share of
+ * the running tasks. When a memory cap is given, a task is only started next
+ * to others if the field memory in use plus the memory declared by the task
+ * fits the cap. With max_tasks=1 the tasks run one by
+ * one on the calling thread, in the order they were added.
+ *
+ * [scheduler]
+ * max_tasks = 2            (1 runs the stages one after the other)
+ */
+class task_graph
+{
+public:
+	typedef size_t task_id;
+
+protected:
+
+	//! a single task
+	struct task
+	{
+		std::string name;					//!< name, also of the traced phase
+		std::function<void(void)> work;		//!< the work, destroyed once the task has finished
+		std::vector<task_id> deps;			//!< tasks that need to finish first
+		std::string resource;				//!< tasks with the same resource are not run concurrently
+		size_t nbytes;						//!< field memory needed while the task runs
+		bool started, done;
+		double t_start, t_end;				//!< wall clock times in seconds
+	};
+
+	std::vector<task> tasks_;
+	unsigned max_tasks_;	//!< maximum number of concurrent tasks
+	size_t max_bytes_;		//!< memory cap in bytes, 0 for none
+
+	//! whether all dependencies of a task have finished
+	bool is_ready( task_id id ) const;
+
+	//! run a task on the calling thread, returns the exception it threw, if any
+	std::exception_ptr execute( task_id id, int nthreads, int tid );
+
+	//! log the wall time of the tasks and of the critical path
+	void log_timing( double twall ) const;
+
+public:
+
+	//! an empty graph
+	/*! @param max_tasks the maximum number of tasks running at the same time
+	 *  @param max_bytes the memory cap, 0 for none
+	 */
+	task_graph( unsigned max_tasks, size_t max_bytes );
+
+	//! add a task
+	/*! @param name the name of the task
+	 *  @param deps the tasks that need to finish before this one starts
+	 *  @param work the work of the task
+	 *  @param nbytes the field memory the task needs while it runs
+	 *  @param resource tasks with the same non-empty resource never run concurrently
+	 *  @return the id of the task
+	 */
+	task_id add( const std::string& name, const std::vector<task_id>& deps, const std::function<void(void)>& work,
+				 size_t nbytes=0, const std::string& resource="" );
+
+	//! the number of tasks
+	size_t size( void ) const
+	{	return tasks_.size();	}
+
+	//! run all tasks
+	/*! if a task throws, no further tasks are started and the first exception
+	 *  is rethrown once the running tasks have finished
+	 */
+	void run( void );
+};
+
+#endif // __TASK_GRAPH_HH
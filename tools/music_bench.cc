@@ -0,0 +1,782 @@
+/*
+
+ music_bench.cc - This file is part of MUSIC -
+ a code to generate multi-scale initial conditions
+ for cosmological simulations
+
+ Copyright (C) 2010  Oliver Hahn
+
+ */
+
+/*!
+ *	Micro-benchmarks of the hot kernels of MUSIC on synthetic inputs.
+ *
+ *	Every kernel is run in isolation on fields of configurable size, for a
+ *	list of thread counts, and timed over several repetitions after a warm-up
+ *	run. All files (the generated parameter file, kernel caches and the output
+ *	of the output plug-ins) go to a private work directory below --tmpdir,
+ *	which should be on a tmpfs so that the output plug-ins measure the write
+ *	path rather than the disk. The timings are written as JSON, and can be
+ *	compared against those of an earlier run with --compare.
+ *
+ *	usage: MUSIC_bench [--levelmin L] [--levels N] [--threads 1,2,4]
+ *	                   [--repeat R] [--tmpdir /dev/shm] [--json file]
+ *	                   [--only substring] [--compare file] [--tolerance 0.1] [--keep]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <algorithm>
+
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+#include "general.hh"
+#include "log.hh"
+#include "config_file.hh"
+#include "mem_alloc.hh"
+#include "mesh.hh"
+#include "random.hh"
+#include "densities.hh"
+#include "convolution_kernel.hh"
+#include "transfer_function.hh"
+#include "cosmology.hh"
+#include "poisson.hh"
+#include "region_generator.hh"
+#include "output.hh"
+
+//... globals that are otherwise defined by the driver
+region_generator_plugin *the_region_generator;
+RNG_plugin *the_random_number_generator;
+
+namespace{
+
+//! command line settings of a benchmark run
+struct bench_options
+{
+	unsigned levelmin;				//!< level of the base grid
+	unsigned nlevels;				//!< number of refinement levels on top of the base grid
+	unsigned nrepeat;				//!< number of timed repetitions
+	std::vector<int> threads;		//!< thread counts to run at
+	std::string tmpdir;				//!< directory in which the work directory is created
+	std::string jsonfile;			//!< file the results are written to
+	std::string only;				//!< only run benchmarks whose name contains this
+	std::string comparefile;		//!< results of an earlier run to compare with
+	double tolerance;				//!< relative slow-down above which a benchmark counts as regressed
+	bool keep;						//!< keep the work directory
+};
+
+//! the synthetic problem shared by all benchmarks
+struct bench_context
+{
+	config_file *pcf;						//!< the generated configuration
+	transfer_function_plugin *ptf;			//!< the transfer function
+	refinement_hierarchy *prh;				//!< the refinement structure
+	grid_hierarchy *punigrid;				//!< noise on the base grid only
+	grid_hierarchy *pzoom;					//!< noise on all levels, with refinement masks
+};
+
+//! a benchmark, returns the time of a single repetition or a negative value if it does not apply
+typedef double (*bench_kernel)( bench_context& ctx, const std::string& arg, size_t& ncells );
+
+//! an entry in the list of benchmarks
+struct bench_entry
+{
+	std::string name;		//!< name of the benchmark
+	bench_kernel run;		//!< the benchmark
+	std::string arg;		//!< argument passed to the benchmark, e.g. a plug-in name
+};
+
+//! timings of a benchmark at a given thread count
+struct bench_result
+{
+	std::string name;
+	int nthreads;
+	size_t ncells;
+	double tmin, tmean, tmax;
+};
+
+/*******************************************************************************************/
+
+//! deterministic pseudo random number in [-0.5,0.5) for a given index, safe to call from any thread
+inline double cell_noise( size_t i )
+{
+	unsigned long long z = (unsigned long long)i + 0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	z = z ^ (z >> 31);
+	return (double)(z >> 11) * (1.0/9007199254740992.0) - 0.5;
+}
+
+//! fill all levels from levelmin up with zero mean noise
+void fill_noise( grid_hierarchy& gh, double amplitude )
+{
+	for( unsigned ilevel=gh.levelmin(); ilevel<=gh.levelmax(); ++ilevel )
+	{
+		MeshvarBnd<real_t>& g = *gh.get_grid(ilevel);
+		int nx = g.size(0), ny = g.size(1), nz = g.size(2);
+		double sum = 0.0;
+
+		#pragma omp parallel for reduction(+:sum)
+		for( int ix=0; ix<nx; ++ix )
+			for( int iy=0; iy<ny; ++iy )
+				for( int iz=0; iz<nz; ++iz )
+				{
+					double v = amplitude*cell_noise( (((size_t)ilevel*nx+ix)*ny+iy)*nz+iz );
+					g(ix,iy,iz) = v;
+					sum += v;
+				}
+
+		sum /= (double)nx*(double)ny*(double)nz;
+
+		#pragma omp parallel for
+		for( int ix=0; ix<nx; ++ix )
+			for( int iy=0; iy<ny; ++iy )
+				for( int iz=0; iz<nz; ++iz )
+					g(ix,iy,iz) -= sum;
+	}
+}
+
+//! fill a density grid with noise
+template< typename grid >
+void fill_grid_noise( grid& g, size_t seed )
+{
+	int nx = g.size(0), ny = g.size(1), nz = g.size(2);
+
+	#pragma omp parallel for
+	for( int ix=0; ix<nx; ++ix )
+		for( int iy=0; iy<ny; ++iy )
+			for( int iz=0; iz<nz; ++iz )
+				g(ix,iy,iz) = cell_noise( ((seed*nx+ix)*ny+iy)*nz+iz );
+}
+
+//! the number of cells on all levels from levelmin up
+size_t hierarchy_cells( const grid_hierarchy& gh )
+{
+	size_t n = 0;
+	for( unsigned ilevel=gh.levelmin(); ilevel<=gh.levelmax(); ++ilevel )
+		n += gh.size(ilevel,0)*gh.size(ilevel,1)*gh.size(ilevel,2);
+	return n;
+}
+
+//! build a hierarchy on the refinement structure, levels up to lmax
+void create_hierarchy( const refinement_hierarchy& rh, unsigned lmax, grid_hierarchy& gh )
+{
+	gh.create_base_hierarchy( rh.levelmin() );
+	for( unsigned ilevel=rh.levelmin()+1; ilevel<=lmax; ++ilevel )
+		gh.add_patch( rh.offset(ilevel,0), rh.offset(ilevel,1), rh.offset(ilevel,2),
+					  rh.size(ilevel,0), rh.size(ilevel,1), rh.size(ilevel,2) );
+}
+
+//! store the grid structure in the configuration, as the output plug-ins read it from there
+void store_grid_structure( config_file& cf, const refinement_hierarchy& rh )
+{
+	char str1[128], str2[128];
+	for( unsigned i=rh.levelmin(); i<=rh.levelmax(); ++i )
+		for( int j=0; j<3; ++j )
+		{
+			sprintf(str1,"offset(%d,%d)",i,j);
+			sprintf(str2,"%d",rh.offset(i,j));
+			cf.insertValue("setup",str1,str2);
+
+			sprintf(str1,"size(%d,%d)",i,j);
+			sprintf(str2,"%ld",rh.size(i,j));
+			cf.insertValue("setup",str1,str2);
+		}
+}
+
+convolution::kernel_creator *get_kernel_creator( bool kspace )
+{
+#ifdef SINGLE_PRECISION
+	return convolution::get_kernel_map()[ kspace? "tf_kernel_k_float" : "tf_kernel_real_float" ];
+#else
+	return convolution::get_kernel_map()[ kspace? "tf_kernel_k_double" : "tf_kernel_real_double" ];
+#endif
+}
+
+void set_threads( int nthreads )
+{
+	omp_set_num_threads( nthreads );
+
+#if defined(FFTW3) and not defined(SINGLETHREAD_FFTW)
+	#ifdef SINGLE_PRECISION
+	fftwf_plan_with_nthreads( nthreads );
+	#else
+	fftw_plan_with_nthreads( nthreads );
+	#endif
+#endif
+}
+
+/*******************************************************************************************/
+/*** the benchmarks ************************************************************************/
+
+double bench_random_numbers( bench_context& ctx, const std::string&, size_t& ncells )
+{
+	unsigned res = 1<<ctx.prh->levelmin();
+	unsigned cubesize = ctx.pcf->getValueSafe<unsigned>("random","cubesize",DEF_RAN_CUBE_SIZE);
+	ncells = (size_t)res*res*res;
+
+	double t0 = omp_get_wtime();
+	random_numbers<real_t> *prn = new random_numbers<real_t>( res, cubesize, 12345, true );
+	double t1 = omp_get_wtime();
+
+	delete prn;
+	return t1-t0;
+}
+
+double bench_precompute_kernel( bench_context& ctx, const std::string&, size_t& ncells )
+{
+	unsigned lmax = ctx.prh->levelmax();
+	ncells = ctx.prh->size(lmax,0)*ctx.prh->size(lmax,1)*ctx.prh->size(lmax,2);
+
+	double t0 = omp_get_wtime();
+	convolution::kernel *pk = get_kernel_creator(false)->create( *ctx.pcf, ctx.ptf, *ctx.prh, total );
+	double t1 = omp_get_wtime();
+
+	delete pk;
+	return t1-t0;
+}
+
+double bench_convolution( bench_context& ctx, const std::string& arg, size_t& ncells )
+{
+	unsigned n = 1<<ctx.prh->levelmin();
+	ncells = (size_t)n*n*n;
+
+	convolution::kernel *pk = get_kernel_creator( arg=="k" )->create( *ctx.pcf, ctx.ptf, *ctx.prh, total );
+	pk->fetch_kernel( ctx.prh->levelmin(), false );
+
+	DensityGrid<real_t> top( n, n, n );
+	fill_grid_noise( top, 0 );
+
+	double t0 = omp_get_wtime();
+	convolution::perform<real_t>( pk, reinterpret_cast<void*>( top.get_data_ptr() ), false );
+	double t1 = omp_get_wtime();
+
+	delete pk;
+	return t1-t0;
+}
+
+double bench_fft_interpolate( bench_context& ctx, const std::string&, size_t& ncells )
+{
+	const refinement_hierarchy& rh = *ctx.prh;
+	unsigned lmin = rh.levelmin(), n = 1<<lmin;
+
+	if( rh.levelmax() == lmin )
+		return -1.0;
+
+	DensityGrid<real_t> top( n, n, n );
+	PaddedDensitySubGrid<real_t> fine( rh.offset(lmin+1,0), rh.offset(lmin+1,1), rh.offset(lmin+1,2),
+									   rh.size(lmin+1,0), rh.size(lmin+1,1), rh.size(lmin+1,2) );
+	fill_grid_noise( top, 0 );
+	fill_grid_noise( fine, 1 );
+	ncells = (size_t)fine.size(0)*fine.size(1)*fine.size(2);
+
+	double t0 = omp_get_wtime();
+	fft_interpolate( top, fine, true );
+	return omp_get_wtime()-t0;
+}
+
+double bench_refinement_mask( bench_context& ctx, const std::string&, size_t& ncells )
+{
+	if( ctx.prh->levelmax() == ctx.prh->levelmin() )
+		return -1.0;
+
+	grid_hierarchy gh( *ctx.pzoom );
+	ncells = hierarchy_cells( gh );
+
+	double t0 = omp_get_wtime();
+	gh.add_refinement_mask( ctx.prh->get_coord_shift() );
+	return omp_get_wtime()-t0;
+}
+
+double bench_multigrid( bench_context& ctx, const std::string&, size_t& ncells )
+{
+	const grid_hierarchy& f = *ctx.pzoom;
+	grid_hierarchy u( f );
+	u.zero();
+	ncells = hierarchy_cells( f );
+
+	poisson_plugin *pp = get_poisson_plugin_map()["mg_poisson"]->create( *ctx.pcf );
+
+	double t0 = omp_get_wtime();
+	pp->solve( *ctx.pzoom, u );
+	double t1 = omp_get_wtime();
+
+	delete pp;
+	return t1-t0;
+}
+
+double bench_poisson_hybrid( bench_context& ctx, const std::string&, size_t& ncells )
+{
+	const grid_hierarchy& u = *ctx.pzoom;
+	MeshvarBnd<real_t> g( *u.get_grid( u.levelmax() ) );
+	ncells = g.size(0)*g.size(1)*g.size(2);
+
+	double t0 = omp_get_wtime();
+	poisson_hybrid( g, 0, 4, u.levelmin()==u.levelmax(), false );
+	return omp_get_wtime()-t0;
+}
+
+double bench_2LPT_source( bench_context& ctx, const std::string&, size_t& ncells )
+{
+	const grid_hierarchy& u = *ctx.pzoom;
+	grid_hierarchy fnew( u );
+	ncells = hierarchy_cells( u );
+
+	double t0 = omp_get_wtime();
+	compute_2LPT_source( u, fnew, 4 );
+	return omp_get_wtime()-t0;
+}
+
+double bench_2LPT_source_FFT( bench_context& ctx, const std::string&, size_t& ncells )
+{
+	const grid_hierarchy& u = *ctx.punigrid;
+	grid_hierarchy fnew( u );
+	ncells = hierarchy_cells( u );
+
+	double t0 = omp_get_wtime();
+	compute_2LPT_source_FFT( *ctx.pcf, u, fnew );
+	return omp_get_wtime()-t0;
+}
+
+double bench_output( bench_context& ctx, const std::string& arg, size_t& ncells )
+{
+	config_file& cf = *ctx.pcf;
+	const grid_hierarchy& gh = *ctx.pzoom;
+	ncells = hierarchy_cells( gh );
+
+	cf.insertValue("output","format",arg);
+	cf.insertValue("output","filename","output_"+arg);
+
+	double t0 = omp_get_wtime();
+
+	output_plugin *po = get_output_plugin_map()[arg]->create( cf );
+
+	po->write_dm_mass( gh );
+	po->write_dm_density( gh );
+	po->write_dm_potential( gh );
+	for( int icoord=0; icoord<3; ++icoord )
+		po->write_dm_velocity( icoord, gh );
+	for( int icoord=0; icoord<3; ++icoord )
+		po->write_dm_position( icoord, gh );
+	po->finalize();
+
+	delete po;
+
+	return omp_get_wtime()-t0;
+}
+
+std::vector<bench_entry> get_benchmarks( void )
+{
+	std::vector<bench_entry> v;
+	bench_entry e;
+
+	e.name = "random_numbers::fill_cube";					e.run = bench_random_numbers;		e.arg = "";		v.push_back(e);
+	e.name = "kernel_real_cached::precompute_kernel";		e.run = bench_precompute_kernel;	e.arg = "";		v.push_back(e);
+	e.name = "convolution::perform (k-space kernel)";		e.run = bench_convolution;			e.arg = "k";	v.push_back(e);
+	e.name = "convolution::perform (real-space kernel)";	e.run = bench_convolution;			e.arg = "real";	v.push_back(e);
+	e.name = "fft_interpolate";								e.run = bench_fft_interpolate;		e.arg = "";		v.push_back(e);
+	e.name = "add_refinement_mask";							e.run = bench_refinement_mask;		e.arg = "";		v.push_back(e);
+	e.name = "multigrid::solver";							e.run = bench_multigrid;			e.arg = "";		v.push_back(e);
+	e.name = "poisson_hybrid";								e.run = bench_poisson_hybrid;		e.arg = "";		v.push_back(e);
+	e.name = "compute_2LPT_source";							e.run = bench_2LPT_source;			e.arg = "";		v.push_back(e);
+	e.name = "compute_2LPT_source_FFT";						e.run = bench_2LPT_source_FFT;		e.arg = "";		v.push_back(e);
+
+	std::map< std::string, output_plugin_creator *>& m = get_output_plugin_map();
+	for( std::map< std::string, output_plugin_creator *>::iterator it=m.begin(); it!=m.end(); ++it )
+	{
+		e.name = "output " + it->first;
+		e.run = bench_output;
+		e.arg = it->first;
+		v.push_back(e);
+	}
+
+	return v;
+}
+
+/*******************************************************************************************/
+/*** set-up, reporting and comparison ******************************************************/
+
+void write_config( const std::string& fname, const bench_options& opt )
+{
+	std::ofstream ofs( fname.c_str() );
+
+	ofs << "[setup]\n"
+		<< "boxlength = 100\n"
+		<< "zstart = 50\n"
+		<< "levelmin = " << opt.levelmin << "\n"
+		<< "levelmin_TF = " << opt.levelmin << "\n"
+		<< "levelmax = " << opt.levelmin+opt.nlevels << "\n"
+		<< "padding = 8\n"
+		<< "overlap = 4\n"
+		<< "ref_center = 0.5, 0.5, 0.5\n"
+		<< "ref_extent = 0.3, 0.3, 0.3\n"
+		<< "align_top = no\n"
+		<< "baryons = no\n"
+		<< "use_2LPT = no\n"
+		<< "use_LLA = no\n"
+		<< "periodic_TF = yes\n"
+		<< "verbosity = 0\n\n"
+		<< "[cosmology]\n"
+		<< "Omega_m = 0.276\n"
+		<< "Omega_L = 0.724\n"
+		<< "Omega_b = 0.045\n"
+		<< "H0 = 70.3\n"
+		<< "sigma_8 = 0.811\n"
+		<< "nspec = 0.961\n"
+		<< "transfer = eisenstein\n\n"
+		<< "[random]\n"
+		<< "seed[" << opt.levelmin << "] = 12345\n\n"
+		<< "[output]\n"
+		<< "format = generic\n"
+		<< "filename = output\n\n"
+		<< "[poisson]\n"
+		<< "fft_fine = yes\n"
+		<< "accuracy = 1e-5\n"
+		<< "pre_smooth = 3\n"
+		<< "post_smooth = 3\n"
+		<< "smoother = gs\n"
+		<< "laplace_order = 6\n"
+		<< "grad_order = 6\n";
+}
+
+int remove_entry( const char *path, const struct stat *, int, struct FTW * )
+{
+	return remove( path );
+}
+
+bool parse_options( int argc, const char *argv[], bench_options& opt )
+{
+	opt.levelmin = 7;
+	opt.nlevels = 1;
+	opt.nrepeat = 3;
+	opt.tmpdir = "/dev/shm";
+	opt.jsonfile = "music_bench.json";
+	opt.tolerance = 0.1;
+	opt.keep = false;
+
+	for( int i=1; i<argc; ++i )
+	{
+		std::string a( argv[i] );
+		bool hasval = (i+1 < argc);
+
+		if( a == "--keep" )
+			opt.keep = true;
+		else if( !hasval )
+			return false;
+		else if( a == "--levelmin" )
+			opt.levelmin = atoi( argv[++i] );
+		else if( a == "--levels" )
+			opt.nlevels = atoi( argv[++i] );
+		else if( a == "--repeat" )
+			opt.nrepeat = std::max( 1, atoi( argv[++i] ) );
+		else if( a == "--tmpdir" )
+			opt.tmpdir = argv[++i];
+		else if( a == "--json" )
+			opt.jsonfile = argv[++i];
+		else if( a == "--only" )
+			opt.only = argv[++i];
+		else if( a == "--compare" )
+			opt.comparefile = argv[++i];
+		else if( a == "--tolerance" )
+			opt.tolerance = atof( argv[++i] );
+		else if( a == "--threads" )
+		{
+			std::string s( argv[++i] );
+			size_t pos = 0;
+			while( pos < s.size() )
+			{
+				size_t next = s.find( ',', pos );
+				if( next == std::string::npos )
+					next = s.size();
+				int n = atoi( s.substr(pos,next-pos).c_str() );
+				if( n > 0 )
+					opt.threads.push_back( n );
+				pos = next+1;
+			}
+		}
+		else
+			return false;
+	}
+
+	//... default: powers of two up to all available threads
+	if( opt.threads.empty() )
+	{
+		int nmax = omp_get_max_threads();
+		for( int n=1; n<nmax; n*=2 )
+			opt.threads.push_back( n );
+		opt.threads.push_back( nmax );
+	}
+
+	return opt.levelmin > 2 && opt.levelmin < 16;
+}
+
+void write_json( const std::string& fname, const bench_options& opt, const std::vector<bench_result>& results )
+{
+	std::ofstream ofs( fname.c_str() );
+	if( !ofs.good() )
+	{
+		LOGERR("Cannot create/open benchmark file \'%s\'.",fname.c_str());
+		return;
+	}
+
+	char buf[512];
+
+	ofs << "{\n"
+		<< "  \"benchmark\" : \"MUSIC\",\n"
+#ifdef SINGLE_PRECISION
+		<< "  \"precision\" : \"single\",\n"
+#else
+		<< "  \"precision\" : \"double\",\n"
+#endif
+		<< "  \"levelmin\" : " << opt.levelmin << ",\n"
+		<< "  \"levelmax\" : " << opt.levelmin+opt.nlevels << ",\n"
+		<< "  \"repeat\" : " << opt.nrepeat << ",\n"
+		<< "  \"max_threads\" : " << omp_get_num_procs() << ",\n"
+		<< "  \"results\" : [\n";
+
+	for( size_t i=0; i<results.size(); ++i )
+	{
+		const bench_result& r = results[i];
+		sprintf( buf, "    {\"name\":\"%s\",\"threads\":%d,\"cells\":%lu,\"t_min\":%.6e,\"t_mean\":%.6e,\"t_max\":%.6e,\"mcells_per_s\":%.4f}",
+				 r.name.c_str(), r.nthreads, (unsigned long)r.ncells, r.tmin, r.tmean, r.tmax,
+				 (r.tmin>0.0)? 1e-6*(double)r.ncells/r.tmin : 0.0 );
+		ofs << buf << ((i+1<results.size())? ",\n" : "\n");
+	}
+
+	ofs << "  ]\n}\n";
+
+	std::cout << " - Wrote " << results.size() << " benchmark results to \'" << fname << "\'\n";
+}
+
+//! read the minimum times of a file written by write_json, keyed by name and thread count
+bool read_json( const std::string& fname, std::map< std::pair<std::string,int>, double >& tmin )
+{
+	std::ifstream ifs( fname.c_str() );
+	if( !ifs.good() )
+		return false;
+
+	std::string line;
+	while( std::getline( ifs, line ) )
+	{
+		size_t pn = line.find("\"name\":\""), pt = line.find("\"threads\":"), pm = line.find("\"t_min\":");
+		if( pn == std::string::npos || pt == std::string::npos || pm == std::string::npos )
+			continue;
+
+		pn += 8;
+		std::string name = line.substr( pn, line.find( '\"', pn )-pn );
+		int nthreads = atoi( line.c_str()+pt+10 );
+		tmin[ std::make_pair( name, nthreads ) ] = atof( line.c_str()+pm+8 );
+	}
+
+	return true;
+}
+
+//! print the change of every benchmark against an earlier run, returns the number of regressions
+int compare_results( const bench_options& opt, const std::vector<bench_result>& results )
+{
+	std::map< std::pair<std::string,int>, double > tref;
+	if( !read_json( opt.comparefile, tref ) )
+	{
+		LOGERR("Cannot read benchmark file \'%s\' for comparison.",opt.comparefile.c_str());
+		return 0;
+	}
+
+	int nregressed = 0;
+	std::cout << " - Comparison with \'" << opt.comparefile << "\' (t_min):\n";
+
+	for( size_t i=0; i<results.size(); ++i )
+	{
+		const bench_result& r = results[i];
+		std::map< std::pair<std::string,int>, double >::iterator it = tref.find( std::make_pair( r.name, r.nthreads ) );
+		if( it == tref.end() || it->second <= 0.0 )
+			continue;
+
+		double ratio = r.tmin / it->second;
+		bool regressed = ratio > 1.0+opt.tolerance;
+		nregressed += regressed;
+
+		std::cout << "     " << std::setw(44) << std::left << r.name << std::right << std::setw(4) << r.nthreads
+				  << std::setw(12) << std::fixed << std::setprecision(3) << ratio << "x"
+				  << (regressed? "   REGRESSION" : "") << "\n";
+		std::cout.unsetf( std::ios::floatfield );
+	}
+
+	return nregressed;
+}
+
+}
+
+/*******************************************************************************************/
+/*******************************************************************************************/
+/*******************************************************************************************/
+
+int main( int argc, const char *argv[] )
+{
+	bench_options opt;
+
+	if( !parse_options( argc, argv, opt ) )
+	{
+		std::cout << " usage: " << argv[0] << " [--levelmin L] [--levels N] [--threads 1,2,4] [--repeat R]\n"
+				  << "        [--tmpdir /dev/shm] [--json file] [--only substring] [--compare file]\n"
+				  << "        [--tolerance 0.1] [--keep]\n";
+		return 1;
+	}
+
+	//... make paths of the result files absolute, then move to a private work directory
+	char cwd[4096];
+	if( getcwd( cwd, sizeof(cwd) ) == NULL )
+		cwd[0] = '\0';
+	if( opt.jsonfile[0] != '/' )
+		opt.jsonfile = std::string(cwd) + "/" + opt.jsonfile;
+	if( opt.comparefile.size() > 0 && opt.comparefile[0] != '/' )
+		opt.comparefile = std::string(cwd) + "/" + opt.comparefile;
+
+	char workdir[4096];
+	sprintf( workdir, "%s/music_bench.%d", opt.tmpdir.c_str(), (int)getpid() );
+	if( mkdir( workdir, 0755 ) != 0 || chdir( workdir ) != 0 )
+	{
+		std::cerr << " - Error: cannot create work directory \'" << workdir << "\'\n";
+		return 1;
+	}
+
+	write_config( "music_bench.conf", opt );
+	config_file cf( "music_bench.conf" );
+
+	MUSIC::log::setOutput( "music_bench.log" );
+	MUSIC::log::setLevel( MUSIC::log::Warning );
+
+	mem_alloc_init( cf );
+
+#if defined(FFTW3) and not defined(SINGLETHREAD_FFTW)
+	#ifdef SINGLE_PRECISION
+	fftwf_init_threads();
+	#else
+	fftw_init_threads();
+	#endif
+#endif
+
+	//... set up cosmology and normalisation as the driver does
+	transfer_function_plugin *the_transfer_function_plugin = select_transfer_function_plugin( cf );
+
+	cosmology cosmo( cf );
+	CosmoCalc ccalc( cosmo, the_transfer_function_plugin );
+	cosmo.pnorm	= ccalc.ComputePNorm( 2.0*M_PI/cf.getValue<double>("setup","boxlength") );
+	cosmo.dplus	= ccalc.CalcGrowthFactor( cosmo.astart )/ccalc.CalcGrowthFactor( 1.0 );
+	cosmo.vfact = ccalc.CalcVFact( cosmo.astart );
+	if( !the_transfer_function_plugin->tf_has_total0() )
+		cosmo.pnorm *= cosmo.dplus*cosmo.dplus;
+
+	{
+		char tmpstr[128];
+		sprintf(tmpstr,"%.12g",cosmo.pnorm);
+		cf.insertValue("cosmology","pnorm",tmpstr);
+		sprintf(tmpstr,"%.12g",cosmo.dplus);
+		cf.insertValue("cosmology","dplus",tmpstr);
+		sprintf(tmpstr,"%.12g",cosmo.vfact);
+		cf.insertValue("cosmology","vfact",tmpstr);
+	}
+
+	the_region_generator = select_region_generator_plugin( cf );
+
+	refinement_hierarchy rh( cf );
+	store_grid_structure( cf, rh );
+
+	//... synthetic fields
+	grid_hierarchy unigrid( 4 ), zoom( 4 );
+	create_hierarchy( rh, rh.levelmin(), unigrid );
+	create_hierarchy( rh, rh.levelmax(), zoom );
+	fill_noise( unigrid, 1e-3 );
+	fill_noise( zoom, 1e-3 );
+	zoom.add_refinement_mask( rh.get_coord_shift() );
+
+	bench_context ctx;
+	ctx.pcf = &cf;
+	ctx.ptf = the_transfer_function_plugin;
+	ctx.prh = &rh;
+	ctx.punigrid = &unigrid;
+	ctx.pzoom = &zoom;
+
+	std::cout << " - Benchmarking on a " << (1<<rh.levelmin()) << "^3 base grid with " << opt.nlevels
+			  << " refinement level(s), " << opt.nrepeat << " repetition(s)\n"
+			  << " - Work directory is \'" << workdir << "\'\n";
+
+	//... run all benchmarks at all thread counts
+	std::vector<bench_entry> benchmarks = get_benchmarks();
+	std::vector<bench_result> results;
+
+	std::cout << "     " << std::setw(44) << std::left << "benchmark" << std::right << std::setw(4) << "thr"
+			  << std::setw(12) << "min [s]" << std::setw(12) << "mean [s]" << std::setw(12) << "max [s]"
+			  << std::setw(12) << "Mcells/s" << "\n";
+
+	for( size_t it=0; it<opt.threads.size(); ++it )
+	{
+		set_threads( opt.threads[it] );
+
+		for( size_t ib=0; ib<benchmarks.size(); ++ib )
+		{
+			const bench_entry& b = benchmarks[ib];
+			if( opt.only.size() > 0 && b.name.find( opt.only ) == std::string::npos )
+				continue;
+
+			bench_result r;
+			r.name = b.name;
+			r.nthreads = opt.threads[it];
+			r.ncells = 0;
+			r.tmin = 1e30; r.tmean = 0.0; r.tmax = 0.0;
+
+			try
+			{
+				//... warm-up run, e.g. for FFTW plans and first touch of the allocator pool
+				if( b.run( ctx, b.arg, r.ncells ) < 0.0 )
+					continue;
+
+				for( unsigned irep=0; irep<opt.nrepeat; ++irep )
+				{
+					double t = b.run( ctx, b.arg, r.ncells );
+					r.tmin = std::min( r.tmin, t );
+					r.tmax = std::max( r.tmax, t );
+					r.tmean += t/opt.nrepeat;
+				}
+			}
+			catch( std::exception& e )
+			{
+				std::cout << "     " << std::setw(44) << std::left << b.name << std::right << std::setw(4) << r.nthreads
+						  << "   skipped: " << e.what() << "\n";
+				continue;
+			}
+
+			results.push_back( r );
+
+			std::cout << "     " << std::setw(44) << std::left << r.name << std::right << std::setw(4) << r.nthreads
+					  << std::scientific << std::setprecision(3)
+					  << std::setw(12) << r.tmin << std::setw(12) << r.tmean << std::setw(12) << r.tmax
+					  << std::fixed << std::setprecision(2)
+					  << std::setw(12) << 1e-6*(double)r.ncells/r.tmin << std::endl;
+			std::cout.unsetf( std::ios::floatfield );
+		}
+	}
+
+	write_json( opt.jsonfile, opt, results );
+
+	int nregressed = 0;
+	if( opt.comparefile.size() > 0 )
+		nregressed = compare_results( opt, results );
+
+	//... clean up
+	delete the_region_generator;
+	delete the_transfer_function_plugin;
+
+	if( chdir( cwd ) == 0 && !opt.keep )
+		nftw( workdir, remove_entry, 16, FTW_DEPTH | FTW_PHYS );
+
+	return (nregressed > 0)? 2 : 0;
+}
@@ -0,0 +1,666 @@
+/*
+
+ music_scaling.cc - This file is part of MUSIC -
+ a code to generate multi-scale initial conditions
+ for cosmological simulations
+
+ Copyright (C) 2010  Oliver Hahn
+
+ */
+
+/*!
+ *	End-to-end scaling benchmark of the MUSIC binary.
+ *
+ *	Runs MUSIC on a ladder of built-in reference configurations, each at a
+ *	list of thread counts, every run in its own directory. From each run the
+ *	wall time, the wall time of every top level phase (taken from the trace
+ *	written by MUSIC), the peak resident set size and the number of bytes
+ *	written are recorded, and speedup and parallel efficiency are derived.
+ *	The weak scaling series doubles the base grid resolution for every
+ *	eightfold increase of the thread count, so that the work per thread
+ *	stays constant.
+ *
+ *	The results are written as JSON, and a strong/weak scaling report is
+ *	printed and written next to it.
+ *
+ *	With --check-ensemble no scaling runs are done. Instead the second member
+ *	of an ensemble of the baryon configuration is compared against a single
+ *	run with the same seed, which checks that the transfer function kernels
+ *	kept between ensemble members are reused correctly.
+ *
+ *	usage: MUSIC_scaling [--music ./MUSIC] [--levelmin L] [--threads 1,2,4]
+ *	                     [--configs unigrid_1lpt,...] [--workdir dir]
+ *	                     [--json file] [--keep] [--check-ensemble]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <map>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <iterator>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+namespace{
+
+//! command line settings of a scaling run
+struct scaling_options
+{
+	std::string music;				//!< path of the MUSIC binary
+	unsigned levelmin;				//!< base grid level of the reference configurations
+	std::vector<int> threads;		//!< thread counts to run at
+	std::vector<std::string> configs;	//!< reference configurations to run
+	std::string workdir;			//!< directory in which the runs are done
+	std::string jsonfile;			//!< file the results are written to
+	bool keep;						//!< keep the output of the runs
+	bool check_ensemble;			//!< only check an ensemble member against a single run
+};
+
+//! a single run of MUSIC
+struct scaling_run
+{
+	std::string config;				//!< name of the reference configuration
+	int nthreads;					//!< number of OpenMP threads
+	unsigned levelmin, levelmax;	//!< grid levels of the run
+	int status;						//!< exit status of MUSIC
+	double twall;					//!< wall clock time of the run
+	long peak_rss;					//!< peak resident set size in kB
+	size_t nbytes;					//!< bytes of output written
+	std::vector< std::pair<std::string,double> > phases;	//!< wall time of the top level phases, in order
+	double speedup, efficiency;		//!< relative to the smallest thread count of the series
+};
+
+//! files in a run directory that are not output of the run
+const char *harness_files[] = { "music.conf", "music.conf_log.txt", "music.out", "trace.json", NULL };
+
+/*******************************************************************************************/
+/*** reference configurations **************************************************************/
+
+//! write the parameter file of a reference configuration
+/*! @param name the name of the configuration
+ *  @param levelmin the base grid level
+ *  @param levelmax the finest level, set on return
+ *  @return false if the configuration is unknown
+ */
+bool write_reference_config( const std::string& name, unsigned levelmin, unsigned& levelmax, const std::string& fname )
+{
+	bool b2LPT = false, bbaryons = false, bzoom = false;
+
+	if( name == "unigrid_1lpt" || name == "weak_unigrid_1lpt" )
+		;
+	else if( name == "unigrid_2lpt" )
+		b2LPT = true;
+	else if( name == "zoom_ellipsoid" )
+		bzoom = true;
+	else if( name == "baryons_sph" )
+		bbaryons = true;
+	else
+		return false;
+
+	levelmax = bzoom? levelmin+2 : levelmin;
+
+	std::ofstream ofs( fname.c_str() );
+
+	ofs << "[setup]\n"
+		<< "boxlength = 100\n"
+		<< "zstart = 50\n"
+		<< "levelmin = " << levelmin << "\n"
+		<< "levelmin_TF = " << levelmin << "\n"
+		<< "levelmax = " << levelmax << "\n"
+		<< "padding = 8\n"
+		<< "overlap = 4\n"
+		<< "align_top = no\n"
+		<< "baryons = " << (bbaryons? "yes" : "no") << "\n"
+		<< "do_SPH = " << (bbaryons? "yes" : "no") << "\n"
+		<< "use_2LPT = " << (b2LPT? "yes" : "no") << "\n"
+		<< "use_LLA = no\n"
+		<< "periodic_TF = yes\n";
+
+	if( bzoom )
+		ofs << "region = ellipsoid\n"
+			<< "region_ellipsoid_center = 0.5, 0.5, 0.5\n"
+			<< "region_ellipsoid_matrix[0] = 100.0, 0.0, 0.0\n"
+			<< "region_ellipsoid_matrix[1] = 0.0, 204.0, 0.0\n"
+			<< "region_ellipsoid_matrix[2] = 0.0, 0.0, 400.0\n";
+	else
+		ofs << "ref_center = 0.5, 0.5, 0.5\n"
+			<< "ref_extent = 0.2, 0.2, 0.2\n";
+
+	ofs << "\n[cosmology]\n"
+		<< "Omega_m = 0.276\n"
+		<< "Omega_L = 0.724\n"
+		<< "Omega_b = 0.045\n"
+		<< "H0 = 70.3\n"
+		<< "sigma_8 = 0.811\n"
+		<< "nspec = 0.961\n"
+		<< "transfer = eisenstein\n\n"
+		<< "[random]\n";
+
+	for( unsigned ilevel=levelmin; ilevel<=levelmax; ++ilevel )
+		ofs << "seed[" << ilevel << "] = " << 12345+11111*(ilevel-levelmin) << "\n";
+
+	ofs << "\n[output]\n"
+		<< "format = gadget2\n"
+		<< "filename = ics_gadget.dat\n\n"
+		<< "[poisson]\n"
+		<< "fft_fine = yes\n"
+		<< "accuracy = 1e-5\n"
+		<< "pre_smooth = 3\n"
+		<< "post_smooth = 3\n"
+		<< "smoother = gs\n"
+		<< "laplace_order = 6\n"
+		<< "grad_order = 6\n\n"
+		<< "[trace]\n"
+		<< "enabled = yes\n"
+		<< "filename = trace.json\n";
+
+	return ofs.good();
+}
+
+/*******************************************************************************************/
+/*** running MUSIC and collecting the results **********************************************/
+
+double wall_time( void )
+{
+	struct timeval tv;
+	gettimeofday( &tv, NULL );
+	return (double)tv.tv_sec + 1e-6*(double)tv.tv_usec;
+}
+
+size_t output_bytes = 0;
+
+int add_output_bytes( const char *path, const struct stat *sb, int typeflag, struct FTW *ftwbuf )
+{
+	if( typeflag != FTW_F )
+		return 0;
+
+	for( int i=0; harness_files[i]!=NULL; ++i )
+		if( strcmp( path+ftwbuf->base, harness_files[i] ) == 0 )
+			return 0;
+
+	output_bytes += sb->st_size;
+	return 0;
+}
+
+int remove_entry( const char *path, const struct stat *, int, struct FTW * )
+{
+	return remove( path );
+}
+
+//! read the top level phases of the master thread from a trace written by MUSIC
+void read_trace_phases( const std::string& fname, std::vector< std::pair<std::string,double> >& phases )
+{
+	std::ifstream ifs( fname.c_str() );
+	std::string line;
+
+	while( std::getline( ifs, line ) )
+	{
+		size_t pn = line.find("{\"name\":\""), pt = line.find("\"tid\":"),
+			pd = line.find("\"dur\":"), pl = line.find("\"depth\":");
+		if( pn == std::string::npos || pt == std::string::npos || pd == std::string::npos || pl == std::string::npos )
+			continue;
+
+		if( atoi( line.c_str()+pt+6 ) != 0 || atoi( line.c_str()+pl+8 ) != 0 )
+			continue;
+
+		pn += 9;
+		std::string name = line.substr( pn, line.find( '\"', pn )-pn );
+		double dur = 1e-6*atof( line.c_str()+pd+6 );
+
+		size_t i;
+		for( i=0; i<phases.size(); ++i )
+			if( phases[i].first == name )
+				break;
+
+		if( i < phases.size() )
+			phases[i].second += dur;
+		else
+			phases.push_back( std::make_pair( name, dur ) );
+	}
+}
+
+//! run MUSIC on a reference configuration in its own directory
+/*! @param variant if not NULL, appended to the name of the run directory, which is then kept
+ *  @param extra parameter file lines appended to the reference configuration
+ */
+bool run_music( const scaling_options& opt, const std::string& config, unsigned levelmin, int nthreads, scaling_run& r,
+				const char *variant = NULL, const std::string& extra = "" )
+{
+	char rundir[4096];
+	sprintf( rundir, "%s/%s_l%02u_t%03d%s%s", opt.workdir.c_str(), config.c_str(), levelmin, nthreads,
+			 variant? "_" : "", variant? variant : "" );
+	mkdir( rundir, 0755 );
+
+	r.config = config;
+	r.nthreads = nthreads;
+	r.levelmin = levelmin;
+	r.status = -1;
+	r.twall = 0.0;
+	r.peak_rss = 0;
+	r.nbytes = 0;
+	r.speedup = r.efficiency = 0.0;
+
+	if( !write_reference_config( config, levelmin, r.levelmax, std::string(rundir)+"/music.conf" ) )
+	{
+		std::cerr << " - Error: unknown reference configuration \'" << config << "\'\n";
+		return false;
+	}
+
+	if( !extra.empty() )
+	{
+		std::ofstream ofs( (std::string(rundir)+"/music.conf").c_str(), std::ios::app );
+		ofs << "\n" << extra;
+	}
+
+	double t0 = wall_time();
+	pid_t pid = fork();
+
+	if( pid == 0 )
+	{
+		char nthr[32];
+		sprintf( nthr, "%d", nthreads );
+		setenv( "OMP_NUM_THREADS", nthr, 1 );
+
+		int fd;
+		if( chdir( rundir ) != 0 || (fd = open( "music.out", O_WRONLY|O_CREAT|O_TRUNC, 0644 )) < 0 )
+			_exit( 127 );
+		dup2( fd, 1 );
+		dup2( fd, 2 );
+		close( fd );
+
+		execl( opt.music.c_str(), opt.music.c_str(), "music.conf", (char*)NULL );
+		_exit( 127 );
+	}
+	else if( pid < 0 )
+	{
+		std::cerr << " - Error: could not start \'" << opt.music << "\'\n";
+		return false;
+	}
+
+	int status;
+	struct rusage ru;
+	wait4( pid, &status, 0, &ru );
+
+	r.twall = wall_time()-t0;
+	r.status = WIFEXITED(status)? WEXITSTATUS(status) : -1;
+	r.peak_rss = ru.ru_maxrss;
+
+	output_bytes = 0;
+	nftw( rundir, add_output_bytes, 16, FTW_PHYS );
+	r.nbytes = output_bytes;
+
+	read_trace_phases( std::string(rundir)+"/trace.json", r.phases );
+
+	if( !opt.keep && variant == NULL )
+		nftw( rundir, remove_entry, 16, FTW_DEPTH | FTW_PHYS );
+
+	return r.status == 0;
+}
+
+/*******************************************************************************************/
+/*** ensemble regression check *************************************************************/
+
+//! compare two output files word by word
+/*! words that differ are compared as single precision values, to within the
+ *  rounding of summations that may be done in a different order
+ *  @return the number of words that differ beyond that, or -1 if the files cannot be compared
+ */
+long compare_output( const std::string& fname1, const std::string& fname2 )
+{
+	std::ifstream ifs1( fname1.c_str(), std::ios::binary ), ifs2( fname2.c_str(), std::ios::binary );
+	if( !ifs1.good() || !ifs2.good() )
+		return -1;
+
+	std::vector<char> d1( (std::istreambuf_iterator<char>(ifs1)), std::istreambuf_iterator<char>() );
+	std::vector<char> d2( (std::istreambuf_iterator<char>(ifs2)), std::istreambuf_iterator<char>() );
+	if( d1.size() != d2.size() || d1.empty() )
+		return -1;
+
+	long ndiff = 0;
+	for( size_t i=0; i+sizeof(float)<=d1.size(); i+=sizeof(float) )
+	{
+		if( memcmp( &d1[i], &d2[i], sizeof(float) ) == 0 )
+			continue;
+
+		float f1, f2;
+		memcpy( &f1, &d1[i], sizeof(float) );
+		memcpy( &f2, &d2[i], sizeof(float) );
+		if( !(fabs(f1-f2) <= 1e-4*std::max( fabs(f1), fabs(f2) ) + 1e-10) )
+			++ndiff;
+	}
+
+	return ndiff;
+}
+
+//! run the second member of an ensemble with baryons and a single run with its seed, and compare them
+bool check_ensemble( const scaling_options& opt )
+{
+	const std::string config( "baryons_sph" );
+	const long seed1 = 54321, seed2 = 67890;
+	const int nthreads = opt.threads.front();
+	char seedkey[64], extra[256];
+	sprintf( seedkey, "seed[%u]", opt.levelmin );
+
+	std::cout << " - Checking ensemble member " << seed2 << " of " << config << " on " << (1<<opt.levelmin)
+			  << "^3 against a single run ... " << std::flush;
+
+	scaling_run re, rs;
+	sprintf( extra, "[random]\nensemble_seeds = %ld,%ld\n", seed1, seed2 );
+	bool ok = run_music( opt, config, opt.levelmin, nthreads, re, "ensemble", extra );
+
+	sprintf( extra, "[random]\n%s = %ld\n", seedkey, seed2 );
+	ok = run_music( opt, config, opt.levelmin, nthreads, rs, "single", extra ) && ok;
+
+	char dir[4096];
+	sprintf( dir, "%s/%s_l%02u_t%03d_", opt.workdir.c_str(), config.c_str(), opt.levelmin, nthreads );
+	char fname[64];
+	sprintf( fname, "ics_gadget.dat_%ld", seed2 );
+
+	long ndiff = -1;
+	if( ok )
+		ndiff = compare_output( std::string(dir)+"ensemble/"+fname, std::string(dir)+"single/ics_gadget.dat" );
+
+	if( ndiff == 0 )
+		std::cout << "passed\n";
+	else if( ndiff < 0 )
+		std::cout << "failed, the outputs could not be compared\n";
+	else
+		std::cout << "failed, " << ndiff << " values differ\n";
+
+	if( !opt.keep )
+	{
+		nftw( (std::string(dir)+"ensemble").c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS );
+		nftw( (std::string(dir)+"single").c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS );
+		rmdir( opt.workdir.c_str() );
+	}
+
+	return ndiff == 0;
+}
+
+/*******************************************************************************************/
+/*** reporting *****************************************************************************/
+
+std::string json_string( const std::string& s )
+{
+	std::string out( "\"" );
+	for( size_t i=0; i<s.size(); ++i )
+	{
+		if( s[i] == '\"' || s[i] == '\\' )
+			out += '\\';
+		out += s[i];
+	}
+	return out + "\"";
+}
+
+void write_json( const std::string& fname, const std::vector<scaling_run>& runs )
+{
+	std::ofstream ofs( fname.c_str() );
+	if( !ofs.good() )
+	{
+		std::cerr << " - Error: cannot create/open \'" << fname << "\'\n";
+		return;
+	}
+
+	ofs << "{\n  \"benchmark\" : \"MUSIC scaling\",\n"
+		<< "  \"cores\" : " << sysconf( _SC_NPROCESSORS_ONLN ) << ",\n"
+		<< "  \"runs\" : [\n";
+
+	for( size_t i=0; i<runs.size(); ++i )
+	{
+		const scaling_run& r = runs[i];
+		char buf[512];
+		sprintf( buf, "\"threads\":%d,\"levelmin\":%u,\"levelmax\":%u,\"status\":%d,\"wall\":%.4f,"
+				 "\"peak_rss_kb\":%ld,\"bytes_written\":%lu,\"speedup\":%.4f,\"efficiency\":%.4f",
+				 r.nthreads, r.levelmin, r.levelmax, r.status, r.twall, r.peak_rss,
+				 (unsigned long)r.nbytes, r.speedup, r.efficiency );
+
+		ofs << "    {\"config\":" << json_string(r.config) << "," << buf << ",\"phases\":{";
+		for( size_t j=0; j<r.phases.size(); ++j )
+		{
+			sprintf( buf, "%.4f", r.phases[j].second );
+			ofs << ((j>0)? "," : "") << json_string(r.phases[j].first) << ":" << buf;
+		}
+		ofs << "}}" << ((i+1<runs.size())? ",\n" : "\n");
+	}
+
+	ofs << "  ]\n}\n";
+}
+
+//! write the scaling report of all runs of one configuration
+void report_series( std::ostream& os, const std::vector<scaling_run>& runs, const std::string& config )
+{
+	std::vector<const scaling_run*> s;
+	for( size_t i=0; i<runs.size(); ++i )
+		if( runs[i].config == config )
+			s.push_back( &runs[i] );
+
+	if( s.empty() )
+		return;
+
+	bool weak = config.compare( 0, 5, "weak_" ) == 0;
+
+	os << "\n " << config << (weak? "  (weak scaling, efficiency = T1/Tn)" : "  (strong scaling, efficiency = T1/(n Tn))") << "\n"
+	   << "   " << std::setw(8) << "threads" << std::setw(8) << "grid" << std::setw(12) << "wall [s]"
+	   << std::setw(10) << "speedup" << std::setw(8) << "eff." << std::setw(14) << "peak RSS [MB]"
+	   << std::setw(14) << "written [MB]" << "\n";
+
+	for( size_t i=0; i<s.size(); ++i )
+	{
+		os << "   " << std::setw(8) << s[i]->nthreads << std::setw(8) << (1<<s[i]->levelmin) << std::fixed
+		   << std::setprecision(2) << std::setw(12) << s[i]->twall
+		   << std::setw(10) << s[i]->speedup << std::setw(8) << s[i]->efficiency
+		   << std::setw(14) << (double)s[i]->peak_rss/1024.0
+		   << std::setw(14) << (double)s[i]->nbytes/1024.0/1024.0
+		   << ((s[i]->status!=0)? "   FAILED" : "") << "\n";
+		os.unsetf( std::ios::floatfield );
+	}
+
+	//... per phase speedup of the largest thread count against the smallest
+	const scaling_run &r0 = *s.front(), &r1 = *s.back();
+	if( s.size() < 2 || r0.phases.empty() )
+		return;
+
+	os << "   " << std::setw(34) << std::left << "phase" << std::right << std::setw(10) << "T1 [s]"
+	   << std::setw(10) << "Tn [s]" << std::setw(10) << (weak? "eff." : "speedup") << "   (n = " << r1.nthreads << ")\n";
+
+	for( size_t j=0; j<r0.phases.size(); ++j )
+	{
+		double tn = -1.0;
+		for( size_t k=0; k<r1.phases.size(); ++k )
+			if( r1.phases[k].first == r0.phases[j].first )
+				tn = r1.phases[k].second;
+		if( tn <= 0.0 )
+			continue;
+
+		os << "   " << std::setw(34) << std::left << r0.phases[j].first << std::right << std::fixed << std::setprecision(3)
+		   << std::setw(10) << r0.phases[j].second << std::setw(10) << tn
+		   << std::setprecision(2) << std::setw(10) << r0.phases[j].second/tn << "\n";
+		os.unsetf( std::ios::floatfield );
+	}
+}
+
+bool parse_options( int argc, const char *argv[], scaling_options& opt )
+{
+	opt.music = "./MUSIC";
+	opt.levelmin = 7;
+	opt.workdir = "music_scaling";
+	opt.jsonfile = "music_scaling.json";
+	opt.keep = false;
+	opt.check_ensemble = false;
+
+	std::string configs( "unigrid_1lpt,unigrid_2lpt,zoom_ellipsoid,baryons_sph,weak_unigrid_1lpt" );
+
+	for( int i=1; i<argc; ++i )
+	{
+		std::string a( argv[i] );
+
+		if( a == "--keep" )
+			opt.keep = true;
+		else if( a == "--check-ensemble" )
+			opt.check_ensemble = true;
+		else if( i+1 >= argc )
+			return false;
+		else if( a == "--music" )
+			opt.music = argv[++i];
+		else if( a == "--levelmin" )
+			opt.levelmin = atoi( argv[++i] );
+		else if( a == "--workdir" )
+			opt.workdir = argv[++i];
+		else if( a == "--json" )
+			opt.jsonfile = argv[++i];
+		else if( a == "--configs" )
+			configs = argv[++i];
+		else if( a == "--threads" )
+		{
+			std::stringstream ss( argv[++i] );
+			std::string tok;
+			while( std::getline( ss, tok, ',' ) )
+				if( atoi( tok.c_str() ) > 0 )
+					opt.threads.push_back( atoi( tok.c_str() ) );
+		}
+		else
+			return false;
+	}
+
+	std::stringstream ss( configs );
+	std::string tok;
+	while( std::getline( ss, tok, ',' ) )
+		if( tok.size() > 0 )
+			opt.configs.push_back( tok );
+
+	//... default: powers of two up to all cores
+	if( opt.threads.empty() )
+	{
+		int nmax = std::max( 1L, sysconf( _SC_NPROCESSORS_ONLN ) );
+		for( int n=1; n<nmax; n*=2 )
+			opt.threads.push_back( n );
+		opt.threads.push_back( nmax );
+	}
+	std::sort( opt.threads.begin(), opt.threads.end() );
+
+	//... the binary is started from the run directories
+	if( opt.music[0] != '/' || opt.workdir[0] != '/' )
+	{
+		char cwd[4096];
+		if( getcwd( cwd, sizeof(cwd) ) == NULL )
+			return false;
+		if( opt.music[0] != '/' )
+			opt.music = std::string(cwd) + "/" + opt.music;
+		if( opt.workdir[0] != '/' )
+			opt.workdir = std::string(cwd) + "/" + opt.workdir;
+	}
+
+	return opt.levelmin > 2 && opt.levelmin < 16 && access( opt.music.c_str(), X_OK ) == 0;
+}
+
+}
+
+/*******************************************************************************************/
+/*******************************************************************************************/
+/*******************************************************************************************/
+
+int main( int argc, const char *argv[] )
+{
+	scaling_options opt;
+
+	if( !parse_options( argc, argv, opt ) )
+	{
+		std::cout << " usage: " << argv[0] << " [--music ./MUSIC] [--levelmin L] [--threads 1,2,4]\n"
+				  << "        [--configs unigrid_1lpt,unigrid_2lpt,zoom_ellipsoid,baryons_sph,weak_unigrid_1lpt]\n"
+				  << "        [--workdir dir] [--json file] [--keep] [--check-ensemble]\n";
+		return 1;
+	}
+
+	mkdir( opt.workdir.c_str(), 0755 );
+
+	if( opt.check_ensemble )
+		return check_ensemble( opt )? 0 : 1;
+
+	std::vector<scaling_run> runs;
+	int nfailed = 0;
+
+	for( size_t ic=0; ic<opt.configs.size(); ++ic )
+	{
+		const std::string& config = opt.configs[ic];
+		bool weak = config.compare( 0, 5, "weak_" ) == 0;
+		size_t ifirst = runs.size();
+
+		for( size_t it=0; it<opt.threads.size(); ++it )
+		{
+			int nthreads = opt.threads[it];
+			unsigned levelmin = opt.levelmin;
+
+			//... weak scaling: twice the resolution per eightfold thread count
+			if( weak )
+			{
+				int n = 1;
+				while( 8*n <= nthreads )
+				{
+					n *= 8;
+					++levelmin;
+				}
+				if( n != nthreads )
+					continue;
+			}
+
+			std::cout << " - Running " << std::setw(20) << std::left << config << std::right
+					  << " on " << (1<<levelmin) << "^3 with " << std::setw(3) << nthreads << " threads ... " << std::flush;
+
+			scaling_run r;
+			if( !run_music( opt, config, levelmin, nthreads, r ) )
+			{
+				++nfailed;
+				std::cout << "failed (status " << r.status << ")\n";
+			}
+			else
+				std::cout << std::fixed << std::setprecision(2) << r.twall << "s\n";
+			std::cout.unsetf( std::ios::floatfield );
+
+			runs.push_back( r );
+		}
+
+		//... speedup and efficiency against the smallest thread count of the series
+		for( size_t i=ifirst; i<runs.size(); ++i )
+		{
+			const scaling_run& r0 = runs[ifirst];
+			scaling_run& r = runs[i];
+			if( r.twall <= 0.0 )
+				continue;
+
+			r.speedup = r0.twall/r.twall;
+			r.efficiency = weak? r.speedup : r.speedup*(double)r0.nthreads/(double)r.nthreads;
+		}
+	}
+
+	write_json( opt.jsonfile, runs );
+
+	std::string reportfile = opt.jsonfile.substr( 0, opt.jsonfile.rfind(".json") ) + "_report.txt";
+	std::ofstream ofs( reportfile.c_str() );
+
+	for( size_t ic=0; ic<opt.configs.size(); ++ic )
+	{
+		report_series( std::cout, runs, opt.configs[ic] );
+		report_series( ofs, runs, opt.configs[ic] );
+	}
+
+	std::cout << "\n - Wrote " << runs.size() << " runs to \'" << opt.jsonfile << "\' and report to \'" << reportfile << "\'\n";
+
+	if( !opt.keep )
+		rmdir( opt.workdir.c_str() );
+
+	return (nfailed > 0)? 1 : 0;
+}
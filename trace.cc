@@ -0,0 +1,308 @@
+/*
+
+ trace.cc - This file is part of MUSIC -
+ a code to generate multi-scale initial conditions
+ for cosmological simulations
+
+ Copyright (C) 2010  Oliver Hahn
+
+ */
+
+#include <cstdio>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <map>
+#include <algorithm>
+
+#include "omp.h"
+#include "log.hh"
+#include "trace.hh"
+#include "mem_alloc.hh"
+
+bool MUSIC::trace::enabled_ = false;
+double MUSIC::trace::t0_ = 0.0;
+std::vector<MUSIC::trace::event> MUSIC::trace::events_;
+
+//! names of the phases currently open on this thread, outermost first
+static thread_local std::vector<std::string> trace_stack;
+
+//! thread number set by trace::set_thread, -1 to use the OpenMP thread number
+static thread_local int trace_tid = -1;
+
+//! escape a string for use inside a JSON string literal
+static std::string json_escape( const std::string& s )
+{
+	std::string out;
+	for( size_t i=0; i<s.size(); ++i )
+	{
+		if( s[i] == '\"' || s[i] == '\\' )
+			out += '\\';
+		out += s[i];
+	}
+	return out;
+}
+
+void MUSIC::trace::enable( bool on )
+{
+	if( on && !enabled_ )
+		t0_ = omp_get_wtime();
+	enabled_ = on;
+}
+
+void MUSIC::trace::set_thread( int tid )
+{
+	trace_tid = tid;
+}
+
+double MUSIC::trace::now( void )
+{
+	return omp_get_wtime() - t0_;
+}
+
+void MUSIC::trace::record( const event& ev )
+{
+	#pragma omp critical(trace)
+	events_.push_back( ev );
+}
+
+void MUSIC::trace::write_json( const std::string& filename )
+{
+	std::ofstream ofs( filename.c_str() );
+	if( !ofs.good() )
+	{
+		LOGERR("Cannot create/open trace file \'%s\'.",filename.c_str());
+		return;
+	}
+
+	ofs << "{\"traceEvents\":[\n";
+	for( size_t i=0; i<events_.size(); ++i )
+	{
+		const event& ev = events_[i];
+		char buf[256];
+		sprintf( buf, "\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.0f,\"dur\":%.0f",
+				 ev.tid, ev.t_start*1e6, (ev.t_end-ev.t_start)*1e6 );
+
+		ofs << "{\"name\":\"" << json_escape(ev.name) << "\",\"cat\":\"music\"," << buf
+			<< ",\"args\":{\"depth\":" << ev.depth << ",\"bytes_allocated\":" << ev.nbytes;
+		if( ev.args.size() > 0 )
+			ofs << "," << ev.args;
+		ofs << "}}" << ((i+1<events_.size())? ",\n" : "\n");
+	}
+	ofs << "],\"displayTimeUnit\":\"ms\"}\n";
+
+	LOGINFO("Wrote trace of %d phases to \'%s\'.",(int)events_.size(),filename.c_str());
+}
+
+//! accumulated time of all phases with the same path
+struct trace_summary_entry
+{
+	std::string name;
+	int depth;
+	double t_first;
+	double t_total, t_max;
+	size_t ncalls, nbytes;
+};
+
+static bool trace_summary_order( const std::pair< std::vector<double>, trace_summary_entry >& a,
+								 const std::pair< std::vector<double>, trace_summary_entry >& b )
+{
+	return a.first < b.first;
+}
+
+//! accumulate the events by path, in order of their first start
+static std::vector<trace_summary_entry> trace_summarize( const std::vector<MUSIC::trace::event>& events, double& t_run )
+{
+	std::map<std::string,trace_summary_entry> m;
+	t_run = 0.0;
+
+	for( size_t i=0; i<events.size(); ++i )
+	{
+		const MUSIC::trace::event& ev = events[i];
+		double dt = ev.t_end - ev.t_start;
+		std::map<std::string,trace_summary_entry>::iterator it = m.find( ev.path );
+
+		if( it == m.end() )
+		{
+			trace_summary_entry e;
+			e.name = ev.name;
+			e.depth = ev.depth;
+			e.t_first = ev.t_start;
+			e.t_total = e.t_max = dt;
+			e.ncalls = 1;
+			e.nbytes = ev.nbytes;
+			m[ev.path] = e;
+		}
+		else
+		{
+			trace_summary_entry& e = it->second;
+			e.t_first = std::min( e.t_first, ev.t_start );
+			e.t_total += dt;
+			e.t_max = std::max( e.t_max, dt );
+			e.nbytes += ev.nbytes;
+			++e.ncalls;
+		}
+
+		//... the run time is that of the top level phases of the master thread
+		if( ev.depth == 0 && ev.tid == 0 )
+			t_run += dt;
+	}
+
+	//... order as a tree: by the first start of each ancestor, then of the phase itself
+	std::vector< std::pair< std::vector<double>, trace_summary_entry > > v;
+	for( std::map<std::string,trace_summary_entry>::iterator it=m.begin(); it!=m.end(); ++it )
+	{
+		std::vector<double> key;
+		size_t pos = 0;
+		while( (pos = it->first.find( '/', pos )) != std::string::npos )
+		{
+			std::map<std::string,trace_summary_entry>::iterator ip = m.find( it->first.substr(0,pos) );
+			key.push_back( (ip!=m.end())? ip->second.t_first : it->second.t_first );
+			++pos;
+		}
+		key.push_back( it->second.t_first );
+		v.push_back( std::make_pair( key, it->second ) );
+	}
+
+	std::stable_sort( v.begin(), v.end(), trace_summary_order );
+
+	std::vector<trace_summary_entry> out;
+	for( size_t i=0; i<v.size(); ++i )
+		out.push_back( v[i].second );
+
+	return out;
+}
+
+void MUSIC::trace::print_summary( void )
+{
+	double t_run;
+	std::vector<trace_summary_entry> s = trace_summarize( events_, t_run );
+	std::streamsize prec = std::cout.precision();
+
+	std::cout << " - Time spent in traced phases:\n"
+			  << "     " << std::setw(40) << std::left << "phase" << std::right
+			  << std::setw(8) << "calls" << std::setw(12) << "total [s]" << std::setw(8) << "%"
+			  << std::setw(12) << "max [s]" << std::setw(12) << "alloc [MB]" << "\n";
+
+	for( size_t i=0; i<s.size(); ++i )
+	{
+		std::string name = std::string( 2*s[i].depth, ' ' ) + s[i].name;
+		std::cout << "     " << std::setw(40) << std::left << name << std::right
+				  << std::setw(8) << s[i].ncalls << std::fixed
+				  << std::setw(12) << std::setprecision(3) << s[i].t_total
+				  << std::setw(8) << std::setprecision(1) << ((t_run>0.0)? 100.0*s[i].t_total/t_run : 0.0)
+				  << std::setw(12) << std::setprecision(3) << s[i].t_max
+				  << std::setw(12) << std::setprecision(1) << (double)s[i].nbytes/1024.0/1024.0 << "\n";
+		std::cout.unsetf( std::ios::floatfield );
+	}
+	std::cout.precision( prec );
+}
+
+void MUSIC::trace::log_summary( void )
+{
+	double t_run;
+	std::vector<trace_summary_entry> s = trace_summarize( events_, t_run );
+
+	LOGUSER("Time spent in traced phases (%d phases, %.3fs):", (int)events_.size(), t_run );
+	for( size_t i=0; i<s.size(); ++i )
+	{
+		std::string name = std::string( 2*s[i].depth, ' ' ) + s[i].name;
+		LOGUSER("  %-40s %6ld calls %12.3fs %6.1f%% max %10.3fs %10.1f MB", name.c_str(), (long)s[i].ncalls,
+				s[i].t_total, (t_run>0.0)? 100.0*s[i].t_total/t_run : 0.0, s[i].t_max, (double)s[i].nbytes/1024.0/1024.0 );
+	}
+}
+
+/*******************************************************************************************/
+
+MUSIC::trace_scope::trace_scope( const char* fmt, ... )
+: active_( false ), nbytes0_( 0 )
+{
+	if( !trace::enabled() )
+		return;
+
+	va_list argptr;
+	va_start( argptr, fmt );
+	start( fmt, argptr );
+	va_end( argptr );
+}
+
+MUSIC::trace_scope::~trace_scope()
+{
+	close();
+}
+
+void MUSIC::trace_scope::next( const char* fmt, ... )
+{
+	close();
+
+	if( !trace::enabled() )
+		return;
+
+	va_list argptr;
+	va_start( argptr, fmt );
+	start( fmt, argptr );
+	va_end( argptr );
+}
+
+void MUSIC::trace_scope::start( const char* fmt, va_list argptr )
+{
+	char name[256];
+	vsnprintf( name, sizeof(name), fmt, argptr );
+
+	ev_.name = name;
+	ev_.args.clear();
+	ev_.path.clear();
+	for( size_t i=0; i<trace_stack.size(); ++i )
+		ev_.path += trace_stack[i] + "/";
+	ev_.path += ev_.name;
+	ev_.depth = (int)trace_stack.size();
+	ev_.tid = (trace_tid >= 0)? trace_tid : omp_get_thread_num();
+	trace_stack.push_back( ev_.name );
+
+	nbytes0_ = mem_alloc_get_stats().total_bytes;
+	active_ = true;
+	ev_.t_start = trace::now();
+}
+
+void MUSIC::trace_scope::close( void )
+{
+	if( !active_ )
+		return;
+
+	ev_.t_end = trace::now();
+	ev_.nbytes = mem_alloc_get_stats().total_bytes - nbytes0_;
+	trace_stack.pop_back();
+	active_ = false;
+
+	trace::record( ev_ );
+}
+
+void MUSIC::trace_scope::arg( const char* key, long val )
+{
+	if( !active_ )
+		return;
+
+	char buf[128];
+	sprintf( buf, "%s\"%s\":%ld", ev_.args.size()? "," : "", key, val );
+	ev_.args += buf;
+}
+
+void MUSIC::trace_scope::arg( const char* key, const std::string& val )
+{
+	if( !active_ )
+		return;
+
+	if( ev_.args.size() )
+		ev_.args += ",";
+	ev_.args += "\"" + json_escape(key) + "\":\"" + json_escape(val) + "\"";
+}
+
+void MUSIC::trace_scope::fft( size_t nx, size_t ny, size_t nz )
+{
+	if( !active_ )
+		return;
+
+	char buf[128];
+	sprintf( buf, "%lux%lux%lu", (unsigned long)nx, (unsigned long)ny, (unsigned long)nz );
+	arg( "fft", std::string(buf) );
+}
@@ -0,0 +1,161 @@
+/*
+
+ trace.hh - This file is part of MUSIC -
+ a code to generate multi-scale initial conditions
+ for cosmological simulations
+
+ Copyright (C) 2010  Oliver Hahn
+
+ */
+
+#ifndef __TRACE_HH
+#define __TRACE_HH
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdarg>
+
+/*!
+ *	\brief	Hierarchical tracing of the phases of a run.
+ *
+ *	Phases are opened and closed by trace_scope objects and recorded with
+ *	microsecond timestamps, the OpenMP thread they ran on, their nesting
+ *	depth, the bytes of field memory allocated while they were open, and
+ *	optional arguments such as FFT sizes. At the end of a run the phases
+ *	can be written as Chrome trace-event JSON (chrome://tracing, Perfetto)
+ *	and summarised as a table. When tracing is disabled, scopes cost a
+ *	single branch.
+ *
+ *	The driver enables tracing with
+ *
+ *	[trace]
+ *	enabled  = yes                        (default no)
+ *	filename = <parameter file>_trace.json
+ */
+namespace MUSIC
+{
+
+class trace
+{
+public:
+
+	/*!
+	 *	\brief	A single recorded phase.
+	 */
+	struct event
+	{
+		std::string name;		//!< name of the phase
+		std::string path;		//!< names of all enclosing phases and this one, separated by '/'
+		std::string args;		//!< additional arguments, as members of a JSON object
+		double t_start;			//!< start time in seconds since tracing was enabled
+		double t_end;			//!< end time in seconds since tracing was enabled
+		int tid;				//!< OpenMP thread number
+		int depth;				//!< nesting depth, 0 for top level phases
+		size_t nbytes;			//!< field memory allocated while the phase was open
+	};
+
+	/*!
+	 *	\brief	Switch tracing on or off, switching it on resets the clock.
+	 */
+	static void enable( bool on );
+
+	/*!
+	 *	\brief	Whether phases are currently recorded.
+	 */
+	static bool enabled( void ) { return enabled_; }
+
+	/*!
+	 *	\brief	Seconds since tracing was enabled.
+	 */
+	static double now( void );
+
+	/*!
+	 *	\brief	Label the phases of the calling thread with a fixed thread number.
+	 *
+	 *	Threads not started by OpenMP all report thread number 0, so threads
+	 *	such as the output workers set their own to keep their phases apart.
+	 */
+	static void set_thread( int tid );
+
+	/*!
+	 *	\brief	Get the list of all recorded phases in order of completion.
+	 */
+	static const std::vector<event>& events( void ) { return events_; }
+
+	/*!
+	 *	\brief	Write all phases as Chrome trace-event JSON.
+	 */
+	static void write_json( const std::string& filename );
+
+	/*!
+	 *	\brief	Print a table of the accumulated time of every phase to stdout.
+	 */
+	static void print_summary( void );
+
+	/*!
+	 *	\brief	Write the table of the accumulated time of every phase to the log.
+	 */
+	static void log_summary( void );
+
+private:
+	friend class trace_scope;
+
+	static void record( const event& ev );
+
+	static bool enabled_;
+	static double t0_;
+	static std::vector<event> events_;
+};
+
+/*!
+ *	\brief	Records a phase from construction to destruction.
+ *
+ *	The phase name is given printf-style and is only formatted when tracing is
+ *	enabled. A scope can be moved on to the next sequential phase by next().
+ */
+class trace_scope
+{
+public:
+	explicit trace_scope( const char* fmt, ... );
+	~trace_scope();
+
+	/*!
+	 *	\brief	Close the current phase and open a new one at the same depth.
+	 */
+	void next( const char* fmt, ... );
+
+	/*!
+	 *	\brief	Close the current phase before the scope ends.
+	 */
+	void close( void );
+
+	/*!
+	 *	\brief	Attach an integer argument to the phase.
+	 */
+	void arg( const char* key, long val );
+
+	/*!
+	 *	\brief	Attach a string argument to the phase.
+	 */
+	void arg( const char* key, const std::string& val );
+
+	/*!
+	 *	\brief	Attach the size of the FFT performed in the phase.
+	 */
+	void fft( size_t nx, size_t ny, size_t nz );
+
+private:
+	void start( const char* fmt, va_list argptr );
+
+	bool active_;
+	trace::event ev_;
+	size_t nbytes0_;
+
+	trace_scope( const trace_scope& );
+	trace_scope& operator=( const trace_scope& );
+};
+
+}
+
+#endif //__TRACE_HH
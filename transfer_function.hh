@@ -137,18 +137,15 @@ transfer_function_plugin *select_transfer_function_plugin( config_file& cf );
 class TransferFunction_k
 {
 public:
-	static transfer_function *ptf_;
-	static real_t nspec_;
+	transfer_function *ptf_;
+	real_t nspec_;
 	double pnorm_, sqrtpnorm_;
-	static tf_type type_;
+	tf_type type_;
 	
 	TransferFunction_k( tf_type type, transfer_function *tf, real_t nspec, real_t pnorm )
-	: pnorm_(pnorm)
+	: ptf_(tf), nspec_(nspec), pnorm_(pnorm), type_(type)
 	{
-		ptf_ = tf;
-		nspec_ = nspec;
 		sqrtpnorm_ = sqrt( pnorm_ );
-		type_ = type;
 
 		std::string fname("input_powerspec.txt");
 		if( type == cdm || type == total )
@@ -227,8 +224,8 @@ public:
 	double Tr0_;
 	real_t Tmin_, Tmax_, Tscale_;
 	real_t rneg_, rneg2_, kny_;
-	static transfer_function *ptf_;
-	static real_t nspec_;
+	transfer_function *ptf_;
+	real_t nspec_;
 	
 protected:
 	
@@ -486,7 +483,14 @@ protected:
 	}
 	std::vector<real_t> m_xtable,m_ytable,m_dytable;
 	double m_xmin, m_xmax, m_dx, m_rdx;
-	static tf_type type_;
+	tf_type type_;
+	
+	//! parameters of the k-space integration of T(r=0), passed through GSL
+	struct k_integrand
+	{
+		double a[6];
+		const TransferFunction_real *tf;
+	};
 	
 	
 public:
@@ -523,12 +527,14 @@ public:
 			double kmax = nfull*M_PI/boxlength;
 
 			//... integrate 0..kmax
-			double a[6];
+			k_integrand p;
+			double *a = p.a;
+			p.tf = this;
 			a[3] = 0.1*kmin;
 			a[4] = kmax;
 			  
 			ff.function = &call_x;
-			ff.params = reinterpret_cast<void*> (a);
+			ff.params = reinterpret_cast<void*> (&p);
 			double res, err, res2, err2;
 			
 			gsl_integration_qags( &ff, a[3], a[4], 0.0, GSL_INTEGRATION_ERR, 1000, ws, &res, &err );
@@ -606,11 +612,12 @@ public:
 	
 	static double call_wrapper( double k, void *arg )
 	{
-		double *a = (double*)arg;
+		k_integrand *p = (k_integrand*)arg;
+		double *a = p->a;
 
-		double T = ptf_->compute( k, type_ );
+		double T = p->tf->ptf_->compute( k, p->tf->type_ );
 		
-		return 4.0*M_PI*a[0]*T*pow(k,0.5*nspec_)*k*k;
+		return 4.0*M_PI*a[0]*T*pow(k,0.5*p->tf->nspec_)*k*k;
 	}
 	
 	
@@ -619,14 +626,14 @@ public:
 	{
 		gsl_integration_workspace * wx = gsl_integration_workspace_alloc (1000);
 		
-		double *a = (double*)arg;
+		double *a = ((k_integrand*)arg)->a;
 		double kmin = a[3], kmax = a[4];
 		
 		a[0] = kx;
 		
 		gsl_function FX;
 		FX.function = &call_y;
-		FX.params = reinterpret_cast<void*> (a);
+		FX.params = arg;
 		
 		double resx, errx;
 		gsl_integration_qags( &FX, kmin, kmax, 0.0, GSL_INTEGRATION_ERR, 1000, wx, &resx, &errx );
@@ -640,14 +647,14 @@ public:
 	{
 		gsl_integration_workspace * wy = gsl_integration_workspace_alloc (1000);
 		
-		double *a = (double*)arg;
+		double *a = ((k_integrand*)arg)->a;
 		double kmin = a[3], kmax = a[4];
 		
 		a[1] = ky;
 		
 		gsl_function FY;
 		FY.function = &call_z;
-		FY.params = reinterpret_cast<void*> (a);
+		FY.params = arg;
 		
 		double resy, erry;
 		gsl_integration_qags( &FY, kmin, kmax, 0.0, GSL_INTEGRATION_ERR, 1000, wy, &resy, &erry );
@@ -659,13 +666,13 @@ public:
 	
 	static double call_z( double kz, void *arg )
 	{
-		double *a = (double*)arg;
-		double kx = a[0], ky = a[1];
+		k_integrand *p = (k_integrand*)arg;
+		double kx = p->a[0], ky = p->a[1];
 		
 		double kk = sqrt(kx*kx+ky*ky+kz*kz);
-		double T = ptf_->compute( kk, type_ );
+		double T = p->tf->ptf_->compute( kk, p->tf->type_ );
 		
-		return pow(kk,0.5*nspec_)*T;
+		return pow(kk,0.5*p->tf->nspec_)*T;
 		
 	}
 	